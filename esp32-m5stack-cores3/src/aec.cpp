@@ -0,0 +1,159 @@
+#include <math.h>
+#include <string.h>
+
+#include <esp_timer.h>
+
+#include "main.h"
+
+#define AEC_STEP 0.3f
+#define AEC_REGULARIZATION (AEC_FILTER_LENGTH * 1e-6f)
+#define AEC_MIN_ENERGY (AEC_FILTER_LENGTH * 1e-7f)
+
+// Double-talk is declared once the filter has converged and the residual
+// gets louder than the converged ERLE says it should be, by a margin. A
+// Geigel detector on the raw reference doesn't work here: the speaker path
+// has more than unity gain. Comparing against the echo estimate alone only
+// caught a near end louder than the echo, and the filter diverged on the
+// onset first; this catches one down to about 6dB below the echo.
+#define AEC_CONVERGED_ERLE_DB 6.0f
+#define AEC_DOUBLE_TALK_MARGIN_DB 6.0f
+#define AEC_DOUBLE_TALK_MAX_ERLE_DB 12.0f  // Higher and mic noise trips it
+// Spans the dips between syllables, where adapting on what is left of the
+// near end detunes the filter
+#define AEC_DOUBLE_TALK_HANGOVER_MS 100
+#define AEC_DOUBLE_TALK_HANGOVER \
+  (AEC_DOUBLE_TALK_HANGOVER_MS * AEC_SAMPLE_RATE / 1000)
+#define AEC_POWER_SMOOTHING (1.0f / 64.0f)
+#define AEC_FAR_PEAK_DECAY 0.9995f
+#define AEC_FAR_ACTIVE_PEAK 0.003f
+
+#define AEC_RESIDUAL_SUPPRESSION 0.25f  // -12dB
+#define AEC_SUPPRESSION_SMOOTHING 0.01f
+#define AEC_ERLE_SMOOTHING 0.1f
+
+void aec_init(aec_t *aec) {
+  memset(aec, 0, sizeof(aec_t));
+  aec->suppression = 1.0f;
+}
+
+static float aec_window_energy(const float *window) {
+  float energy = 0.0f;
+  for (int k = 0; k < AEC_FILTER_LENGTH; k++) {
+    energy += window[k] * window[k];
+  }
+  return energy;
+}
+
+void aec_process(aec_t *aec, int16_t *mic, const int16_t *reference,
+                 size_t samples) {
+  int64_t start_us = esp_timer_get_time();
+
+  // Recomputed once per frame so the running sum cannot drift
+  aec->window_energy = aec_window_energy(
+      &aec->history[aec->position + AEC_REFERENCE_DELAY_SAMPLES]);
+
+  int double_talk_hangover = aec->double_talk_hangover;
+  float expected_erle_db =
+      fminf(aec->stats.erle_db, AEC_DOUBLE_TALK_MAX_ERLE_DB);
+  float double_talk_ratio =
+      powf(10.0f, (AEC_DOUBLE_TALK_MARGIN_DB - expected_erle_db) / 10.0f);
+  float frame_mic_energy = 0.0f;
+  float frame_error_energy = 0.0f;
+
+  for (size_t i = 0; i < samples; i++) {
+    float x = reference != NULL ? reference[i] / 32768.0f : 0.0f;
+    float d = mic[i] / 32768.0f;
+
+    // Newest sample lives at the lowest index so history[p + j] is x(n - j)
+    int p = aec->position - 1;
+    if (p < 0) {
+      p += AEC_HISTORY_LENGTH;
+    }
+    float leaving = aec->history[p];
+    aec->history[p] = x;
+    aec->history[p + AEC_HISTORY_LENGTH] = x;
+    aec->position = p;
+
+    const float *window = &aec->history[p + AEC_REFERENCE_DELAY_SAMPLES];
+    float entering = window[0];
+    aec->window_energy += entering * entering - leaving * leaving;
+    if (aec->window_energy < 0.0f) {
+      aec->window_energy = 0.0f;
+    }
+
+    aec->far_peak = fmaxf(fabsf(entering), aec->far_peak * AEC_FAR_PEAK_DECAY);
+
+    float e = d;
+    if (aec->window_energy > AEC_MIN_ENERGY) {
+      float y = 0.0f;
+      for (int k = 0; k < AEC_FILTER_LENGTH; k++) {
+        y += aec->weights[k] * window[k];
+      }
+      e = d - y;
+
+      aec->echo_power += (y * y - aec->echo_power) * AEC_POWER_SMOOTHING;
+      aec->error_power += (e * e - aec->error_power) * AEC_POWER_SMOOTHING;
+
+      if (aec->stats.erle_db > AEC_CONVERGED_ERLE_DB &&
+          aec->error_power > double_talk_ratio * aec->echo_power) {
+        double_talk_hangover = AEC_DOUBLE_TALK_HANGOVER;
+      } else if (double_talk_hangover > 0) {
+        double_talk_hangover--;
+      }
+
+      if (double_talk_hangover == 0) {
+        float g = AEC_STEP * e / (aec->window_energy + AEC_REGULARIZATION);
+        for (int k = 0; k < AEC_FILTER_LENGTH; k++) {
+          aec->weights[k] += g * window[k];
+        }
+      }
+    } else {
+      double_talk_hangover = 0;
+    }
+
+    frame_mic_energy += d * d;
+    frame_error_energy += e * e;
+
+    bool far_only =
+        aec->far_peak > AEC_FAR_ACTIVE_PEAK && double_talk_hangover == 0;
+    float target = far_only ? AEC_RESIDUAL_SUPPRESSION : 1.0f;
+    aec->suppression += (target - aec->suppression) * AEC_SUPPRESSION_SMOOTHING;
+
+    float out = e * aec->suppression * 32768.0f;
+    if (out > 32767.0f) {
+      out = 32767.0f;
+    } else if (out < -32768.0f) {
+      out = -32768.0f;
+    }
+    mic[i] = (int16_t)out;
+  }
+
+  aec->double_talk_hangover = double_talk_hangover;
+  aec->stats.double_talk = double_talk_hangover > 0;
+  if (aec->far_peak > AEC_FAR_ACTIVE_PEAK && !aec->stats.double_talk &&
+      frame_error_energy > 0.0f) {
+    float erle = 10.0f * log10f(frame_mic_energy / frame_error_energy);
+    aec->stats.erle_db += (erle - aec->stats.erle_db) * AEC_ERLE_SMOOTHING;
+  }
+
+  uint32_t elapsed_us = (uint32_t)(esp_timer_get_time() - start_us);
+  aec->stats.frames++;
+  aec->stats.last_frame_us = elapsed_us;
+  if (elapsed_us > aec->stats.max_frame_us) {
+    aec->stats.max_frame_us = elapsed_us;
+  }
+}
+
+const int16_t *aec_reference_acquire(pcm_ring_t *ring, int64_t mic_us) {
+  pcm_frame_meta_t meta;
+  const int16_t *reference;
+  while ((reference = pcm_ring_acquire_read(ring, &meta)) != NULL &&
+         meta.origin_us < mic_us - AEC_REFERENCE_ALIGN_US) {
+    // Played before this block was captured
+    pcm_ring_release_read(ring);
+  }
+  if (reference == NULL || meta.origin_us > mic_us + AEC_REFERENCE_ALIGN_US) {
+    return NULL;
+  }
+  return reference;
+}
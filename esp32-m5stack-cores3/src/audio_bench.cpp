@@ -0,0 +1,433 @@
+#include <esp_timer.h>
+#include <math.h>
+#include <opus.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+// `src.elf --bench`: CPU cost of the audio path for every codec rate at the
+// one frame duration libpeer can send, per second of audio. Mirrors the
+// encoder settings in media.cpp and runs device rate -> resample -> encode
+// -> decode -> resample back on a synthetic voice-like signal. A second
+// table checks that packets of every Opus duration (2.5 to 120ms) report
+// and decode the right number of samples, and what decoding them costs.
+// The last ones are the playback gain kernel and PCM ring throughput.
+#define BENCH_SECONDS 20
+#define BENCH_BITRATE 30000
+#define BENCH_COMPLEXITY 0
+// IPv4 + UDP + RTP + SRTP auth tag
+#define BENCH_PACKET_OVERHEAD (20 + 8 + 12 + 10)
+
+static const uint32_t bench_rates[] = {8000, 16000, 24000, 48000};
+// Packet durations in tenths of a millisecond; above 60ms packets are built
+// from 20ms frames with the repacketizer
+static const uint32_t bench_packet_durations[] = {25,  50,  100, 200, 400,
+                                                  600, 800, 1000, 1200};
+#define BENCH_MAX_PACKET_MS 120
+#define BENCH_GAIN 10  // As media.cpp applies it
+#define BENCH_GAIN_FRAMES 200000
+#define BENCH_RING_FRAMES 200000
+#define BENCH_RING_CAPACITY 8
+#define BENCH_RING_TASK_STACK_SIZE 4096
+#define BENCH_RING_TASK_PRIORITY 5
+
+typedef struct {
+  double resample_s;
+  double encode_s;
+  double decode_s;
+  uint64_t payload_bytes;
+  uint32_t packets;
+} bench_result_t;
+
+static double bench_cpu_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Gliding 100-250Hz harmonic series under a syllable-rate envelope, plus a
+// little noise so DTX never kicks in
+void audio_bench_signal(int16_t *samples, size_t count, uint32_t rate) {
+  uint32_t noise = 12345;
+  double phase = 0.0;
+  for (size_t i = 0; i < count; i++) {
+    double t = (double)i / rate;
+    double pitch = 175.0 + 75.0 * sin(2.0 * M_PI * 0.7 * t);
+    phase += 2.0 * M_PI * pitch / rate;
+    double voice = 0.0;
+    for (int harmonic = 1; harmonic <= 12; harmonic++) {
+      voice += sin(harmonic * phase) / harmonic;
+    }
+    double envelope = 0.55 + 0.45 * sin(2.0 * M_PI * 4.0 * t);
+    noise = noise * 1664525u + 1013904223u;
+    double hiss = ((int32_t)(noise >> 16) - 32768) / 32768.0 * 0.02;
+    samples[i] = (int16_t)(9000.0 * (voice * envelope * 0.5 + hiss));
+  }
+}
+
+static bool bench_run(uint32_t device_rate, uint32_t codec_rate,
+                      uint32_t frame_ms, const int16_t *input,
+                      bench_result_t *result) {
+  size_t device_samples = audio_frame_samples(device_rate, frame_ms);
+  size_t codec_samples = audio_frame_samples(codec_rate, frame_ms);
+  bool resampling = device_rate != codec_rate;
+
+  int error = 0;
+  OpusEncoder *encoder =
+      opus_encoder_create(codec_rate, 1, OPUS_APPLICATION_VOIP, &error);
+  OpusDecoder *decoder = opus_decoder_create(codec_rate, 1, &error);
+  if (encoder == NULL || decoder == NULL) {
+    opus_encoder_destroy(encoder);
+    opus_decoder_destroy(decoder);
+    return false;
+  }
+  opus_encoder_ctl(encoder, OPUS_SET_BITRATE(BENCH_BITRATE));
+  opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(BENCH_COMPLEXITY));
+  opus_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+  opus_encoder_ctl(encoder, OPUS_SET_DTX(1));
+
+  resampler_t down, up;
+  if (resampling &&
+      (!resampler_init(&down, device_rate, codec_rate, device_samples) ||
+       !resampler_init(&up, codec_rate, device_rate, codec_samples))) {
+    opus_encoder_destroy(encoder);
+    opus_decoder_destroy(decoder);
+    return false;
+  }
+
+  int16_t *codec_pcm = (int16_t *)malloc(codec_samples * sizeof(int16_t));
+  int16_t *decoded = (int16_t *)malloc(codec_samples * sizeof(int16_t));
+  int16_t *output = (int16_t *)malloc(device_samples * sizeof(int16_t));
+  uint8_t packet[1276];
+
+  memset(result, 0, sizeof(bench_result_t));
+  size_t frames = BENCH_SECONDS * 1000 / frame_ms;
+  for (size_t frame = 0; frame < frames; frame++) {
+    const int16_t *pcm = input + frame * device_samples;
+
+    double start = bench_cpu_seconds();
+    if (resampling) {
+      resampler_process(&down, pcm, device_samples, codec_pcm);
+    } else {
+      memcpy(codec_pcm, pcm, codec_samples * sizeof(int16_t));
+    }
+    double resampled = bench_cpu_seconds();
+    int size = opus_encode(encoder, codec_pcm, codec_samples, packet,
+                           sizeof(packet));
+    double encoded = bench_cpu_seconds();
+    if (size > 0) {
+      opus_decode(decoder, packet, size, decoded, codec_samples, 0);
+      result->payload_bytes += size;
+      result->packets++;
+    }
+    double decoded_at = bench_cpu_seconds();
+    if (resampling) {
+      resampler_process(&up, decoded, codec_samples, output);
+    }
+    double end = bench_cpu_seconds();
+
+    result->resample_s += (resampled - start) + (end - decoded_at);
+    result->encode_s += encoded - resampled;
+    result->decode_s += decoded_at - encoded;
+  }
+
+  free(codec_pcm);
+  free(decoded);
+  free(output);
+  if (resampling) {
+    resampler_free(&down);
+    resampler_free(&up);
+  }
+  opus_encoder_destroy(encoder);
+  opus_decoder_destroy(decoder);
+  return true;
+}
+
+// Samples in `duration` tenths of a millisecond
+static int bench_duration_samples(uint32_t rate, uint32_t duration) {
+  return (int)((uint64_t)rate * duration / 10000);
+}
+
+// Encodes `input` into packets of `duration` tenths of a millisecond
+static int bench_encode_packet(OpusEncoder *encoder, OpusRepacketizer *rp,
+                               uint32_t rate, uint32_t duration,
+                               const int16_t *input, uint8_t *packet,
+                               size_t capacity) {
+  if (duration <= 600) {
+    return opus_encode(encoder, input, bench_duration_samples(rate, duration),
+                       packet, capacity);
+  }
+
+  uint8_t frames[6][400];
+  size_t frame_samples = audio_frame_samples(rate, 20);
+  opus_repacketizer_init(rp);
+  for (uint32_t i = 0; i < duration / 200; i++) {
+    int size = opus_encode(encoder, input + i * frame_samples, frame_samples,
+                           frames[i], sizeof(frames[i]));
+    if (size <= 0 || opus_repacketizer_cat(rp, frames[i], size) != OPUS_OK) {
+      return -1;
+    }
+  }
+  return opus_repacketizer_out(rp, packet, capacity);
+}
+
+static void bench_packet_durations_table(uint32_t rate, const int16_t *input,
+                                         size_t count) {
+  printf("\nCodec rate %uHz, decode CPU ms per second of audio\n",
+         (unsigned)rate);
+  printf("%8s %8s %8s %8s\n", "packet", "samples", "check", "decode");
+
+  size_t max_samples = audio_frame_samples(rate, BENCH_MAX_PACKET_MS);
+  int16_t *decoded = (int16_t *)malloc(max_samples * sizeof(int16_t));
+  OpusRepacketizer *rp = opus_repacketizer_create();
+  uint8_t packet[1276 * 3];
+
+  for (uint32_t duration : bench_packet_durations) {
+    int error = 0;
+    OpusEncoder *encoder =
+        opus_encoder_create(rate, 1, OPUS_APPLICATION_VOIP, &error);
+    OpusDecoder *decoder = opus_decoder_create(rate, 1, &error);
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(BENCH_BITRATE));
+    opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(BENCH_COMPLEXITY));
+
+    int expected = bench_duration_samples(rate, duration);
+    bool ok = true;
+    double decode_s = 0.0;
+    size_t packets = count / expected;
+    for (size_t i = 0; i < packets; i++) {
+      int size = bench_encode_packet(encoder, rp, rate, duration,
+                                     input + i * expected, packet,
+                                     sizeof(packet));
+      if (size <= 0 ||
+          opus_packet_get_nb_samples(packet, size, rate) != expected) {
+        ok = false;
+        break;
+      }
+      // Into a worst-case buffer, as media.cpp does for odd durations
+      double start = bench_cpu_seconds();
+      int samples = opus_decode(decoder, packet, size, decoded, max_samples, 0);
+      decode_s += bench_cpu_seconds() - start;
+      if (samples != expected) {
+        ok = false;
+        break;
+      }
+    }
+
+    double seconds = (double)packets * expected / rate;
+    printf("%6u.%ums %8d %8s %8.2f\n", (unsigned)(duration / 10),
+           (unsigned)(duration % 10), expected, ok ? "ok" : "FAIL",
+           seconds > 0 ? decode_s * 1000.0 / seconds : 0.0);
+    opus_encoder_destroy(encoder);
+    opus_decoder_destroy(decoder);
+  }
+
+  opus_repacketizer_destroy(rp);
+  free(decoded);
+}
+
+// The float multiply-and-clamp and activity check playback used before
+// audio_gain_meter(), as two passes over the frame
+bool audio_bench_float_gain(int16_t *samples, size_t count, float gain) {
+  bool active = false;
+  for (size_t i = 0; i < count; i++) {
+    if (samples[i] != -1 && samples[i] != 0 && samples[i] != 1) {
+      active = true;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    float scaled = (float)samples[i] * gain;
+    if (scaled > 32767.0f) {
+      scaled = 32767.0f;
+    }
+    if (scaled < -32768.0f) {
+      scaled = -32768.0f;
+    }
+    samples[i] = (int16_t)scaled;
+  }
+  return active;
+}
+
+// Playback gain on frames of the signal, the old float path against the
+// fused kernel, each with the copy into the frame it works in place on
+static void bench_gain_table(uint32_t rate, const int16_t *input,
+                             size_t count) {
+  size_t frame_samples = audio_frame_samples(rate, AUDIO_FRAME_MS);
+  size_t frames = count / frame_samples;
+  int16_t *frame = (int16_t *)malloc(frame_samples * sizeof(int16_t));
+  if (frame == NULL || frames == 0) {
+    free(frame);
+    return;
+  }
+
+  printf("\nPlayback gain x%d, %u frames of %ums at %uHz\n", BENCH_GAIN,
+         (unsigned)BENCH_GAIN_FRAMES,
+         (unsigned)AUDIO_FRAME_MS, (unsigned)rate);
+  printf("%12s %12s %10s\n", "kernel", "frames/s", "ns/frame");
+
+  uint32_t float_active = 0, fused_active = 0;
+  double start = bench_cpu_seconds();
+  for (uint32_t i = 0; i < BENCH_GAIN_FRAMES; i++) {
+    memcpy(frame, input + (i % frames) * frame_samples,
+           frame_samples * sizeof(int16_t));
+    float_active += audio_bench_float_gain(frame, frame_samples, BENCH_GAIN);
+  }
+  double float_s = bench_cpu_seconds() - start;
+
+  start = bench_cpu_seconds();
+  for (uint32_t i = 0; i < BENCH_GAIN_FRAMES; i++) {
+    memcpy(frame, input + (i % frames) * frame_samples,
+           frame_samples * sizeof(int16_t));
+    audio_level_t level;
+    audio_gain_meter(frame, frame_samples, AUDIO_GAIN_Q8(BENCH_GAIN), &level);
+    fused_active += level.active;
+  }
+  double fused_s = bench_cpu_seconds() - start;
+
+  printf("%12s %12.0f %10.1f\n", "float", BENCH_GAIN_FRAMES / float_s,
+         float_s * 1e9 / BENCH_GAIN_FRAMES);
+  printf("%12s %12.0f %10.1f\n", "q8 + meter", BENCH_GAIN_FRAMES / fused_s,
+         fused_s * 1e9 / BENCH_GAIN_FRAMES);
+  printf("Active frames: %u float, %u q8\n", (unsigned)float_active,
+         (unsigned)fused_active);
+  free(frame);
+}
+
+// Producer half of the cross-task PCM ring run
+typedef struct {
+  pcm_ring_t *ring;
+  const int16_t *input;
+  std::atomic<bool> done;
+} bench_ring_producer_t;
+
+static void bench_ring_producer(void *user_data) {
+  bench_ring_producer_t *producer = (bench_ring_producer_t *)user_data;
+  pcm_ring_t *ring = producer->ring;
+  for (uint32_t frame = 0; frame < BENCH_RING_FRAMES; frame++) {
+    int16_t *samples;
+    while ((samples = pcm_ring_acquire_write(ring)) == NULL) {
+      sched_yield();
+    }
+    memcpy(samples, producer->input, ring->frame_samples * sizeof(int16_t));
+    pcm_ring_commit_write(ring, 0);
+  }
+  producer->done.store(true);
+  vTaskDelete(NULL);
+}
+
+// Frames through the PCM ring with a copy in and out, as capture and
+// playback use it: on one task back to back, then between two tasks
+static void bench_pcm_ring_table(uint32_t rate, const int16_t *input) {
+  static pcm_ring_t ring;
+  size_t frame_samples = audio_frame_samples(rate, AUDIO_FRAME_MS);
+  int16_t *output = (int16_t *)malloc(frame_samples * sizeof(int16_t));
+  if (output == NULL || !pipecat_init_memory() ||
+      !pcm_ring_init(&ring, BENCH_RING_CAPACITY, frame_samples,
+                     MEMORY_INTERNAL)) {
+    free(output);
+    return;
+  }
+
+  printf("\nPCM ring, %u frames of %ums at %uHz, %u slots\n",
+         (unsigned)BENCH_RING_FRAMES, (unsigned)AUDIO_FRAME_MS,
+         (unsigned)rate, (unsigned)BENCH_RING_CAPACITY);
+  printf("%12s %12s %10s\n", "mode", "frames/s", "ns/frame");
+
+  double start = bench_cpu_seconds();
+  for (uint32_t frame = 0; frame < BENCH_RING_FRAMES; frame++) {
+    memcpy(pcm_ring_acquire_write(&ring), input,
+           frame_samples * sizeof(int16_t));
+    pcm_ring_commit_write(&ring, 0);
+    memcpy(output, pcm_ring_acquire_read(&ring, NULL),
+           frame_samples * sizeof(int16_t));
+    pcm_ring_release_read(&ring);
+  }
+  double elapsed = bench_cpu_seconds() - start;
+  printf("%12s %12.0f %10.1f\n", "one task", BENCH_RING_FRAMES / elapsed,
+         elapsed * 1e9 / BENCH_RING_FRAMES);
+
+  // Wall clock, both tasks count
+  static bench_ring_producer_t producer;
+  producer.ring = &ring;
+  producer.input = input;
+  producer.done.store(false);
+  int64_t start_us = esp_timer_get_time();
+  xTaskCreate(bench_ring_producer, "bench_ring", BENCH_RING_TASK_STACK_SIZE,
+              &producer, BENCH_RING_TASK_PRIORITY, NULL);
+  uint32_t received = 0;
+  while (received < BENCH_RING_FRAMES) {
+    const int16_t *samples = pcm_ring_acquire_read(&ring, NULL);
+    if (samples == NULL) {
+      sched_yield();
+      continue;
+    }
+    memcpy(output, samples, frame_samples * sizeof(int16_t));
+    pcm_ring_release_read(&ring);
+    received++;
+  }
+  while (!producer.done.load()) {
+    vTaskDelay(1);
+  }
+  double elapsed_s = (esp_timer_get_time() - start_us) / 1e6;
+  printf("%12s %12.0f %10.1f\n", "two tasks", BENCH_RING_FRAMES / elapsed_s,
+         elapsed_s * 1e9 / BENCH_RING_FRAMES);
+  free(output);
+}
+
+int pipecat_audio_benchmark() {
+  uint32_t device_rate = pipecat_audio_config.device_rate;
+  size_t count = (size_t)device_rate * BENCH_SECONDS;
+  int16_t *input = (int16_t *)malloc(count * sizeof(int16_t));
+  if (input == NULL) {
+    return 1;
+  }
+  audio_bench_signal(input, count, device_rate);
+
+  printf("Device rate %uHz, %ds of audio per run, CPU ms per second of audio\n",
+         (unsigned)device_rate, BENCH_SECONDS);
+  printf("%7s %6s %9s %8s %8s %8s %9s %9s\n", "codec", "frame", "resample",
+         "encode", "decode", "total", "pkt/s", "kbit/s");
+
+  uint32_t frame_ms = LIBPEER_AUDIO_LATENCY_MS;
+  for (uint32_t rate : bench_rates) {
+    bench_result_t result;
+    if (!bench_run(device_rate, rate, frame_ms, input, &result)) {
+      printf("%6uk %4ums   failed\n", (unsigned)(rate / 1000),
+             (unsigned)frame_ms);
+      continue;
+    }
+    double scale = 1000.0 / BENCH_SECONDS;
+    double packets_per_s = (double)result.packets / BENCH_SECONDS;
+    double kbps = (result.payload_bytes +
+                   (double)result.packets * BENCH_PACKET_OVERHEAD) *
+                  8.0 / 1000.0 / BENCH_SECONDS;
+    printf("%6uk %4ums %9.2f %8.2f %8.2f %8.2f %9.1f %9.1f\n",
+           (unsigned)(rate / 1000), (unsigned)frame_ms,
+           result.resample_s * scale, result.encode_s * scale,
+           result.decode_s * scale,
+           (result.resample_s + result.encode_s + result.decode_s) * scale,
+           packets_per_s, kbps);
+  }
+
+  // Same signal, reused at the codec rate
+  uint32_t codec_rate = pipecat_audio_config.codec_rate;
+  size_t codec_count = (size_t)codec_rate * BENCH_SECONDS;
+  int16_t *codec_input = (int16_t *)malloc(codec_count * sizeof(int16_t));
+  if (codec_input != NULL) {
+    audio_bench_signal(codec_input, codec_count, codec_rate);
+    bench_packet_durations_table(codec_rate, codec_input, codec_count);
+    free(codec_input);
+  }
+
+  bench_gain_table(device_rate, input, count);
+  bench_pcm_ring_table(device_rate, input);
+
+  free(input);
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <esp_log.h>
+
+#include "bsp/esp-bsp.h"
+#include "main.h"
+
+#define BITS_PER_SAMPLE 16
+#define SPEAKER_VOLUME 100
+#define MICROPHONE_GAIN 42.0
+
+static esp_codec_dev_handle_t mic_codec_dev;
+static esp_codec_dev_handle_t spk_codec_dev;
+
+// There is one board, so the context is unused
+static esp_err_t bsp_audio_init(void *context, uint32_t sample_rate) {
+  esp_codec_dev_sample_info_t fs = {
+      .bits_per_sample = BITS_PER_SAMPLE,
+      .channel = 1,
+      .channel_mask = 0,
+      .sample_rate = (int)sample_rate,
+      .mclk_multiple = 0,
+  };
+
+  esp_err_t ret = bsp_board_init();
+  if (ret != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "BSP board init failed: %s", esp_err_to_name(ret));
+    return ret;
+  }
+
+  spk_codec_dev = bsp_audio_codec_speaker_init();
+  if (spk_codec_dev == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to initialize speaker codec");
+    return ESP_FAIL;
+  }
+
+  ret = esp_codec_dev_open(spk_codec_dev, &fs);
+  if (ret != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Failed to open speaker codec: %s",
+             esp_err_to_name(ret));
+    return ret;
+  }
+
+  ret = esp_codec_dev_set_out_vol(spk_codec_dev, SPEAKER_VOLUME);
+  if (ret != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Failed to set speaker volume: %s",
+             esp_err_to_name(ret));
+  }
+
+  mic_codec_dev = bsp_audio_codec_microphone_init();
+  if (mic_codec_dev == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to initialize microphone codec");
+    return ESP_FAIL;
+  }
+
+  ret = esp_codec_dev_set_in_gain(mic_codec_dev, MICROPHONE_GAIN);
+  if (ret != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Failed to set microphone gain: %s",
+             esp_err_to_name(ret));
+  }
+
+  ret = esp_codec_dev_open(mic_codec_dev, &fs);
+  if (ret != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Failed to open microphone codec: %s",
+             esp_err_to_name(ret));
+    return ret;
+  }
+
+  return ESP_OK;
+}
+
+static esp_err_t bsp_audio_read(void *context, int16_t *samples,
+                                size_t count) {
+  return esp_codec_dev_read(mic_codec_dev, samples, count * sizeof(int16_t));
+}
+
+static esp_err_t bsp_audio_write(void *context, const int16_t *samples,
+                                 size_t count) {
+  return esp_codec_dev_write(spk_codec_dev, (void *)samples,
+                             count * sizeof(int16_t));
+}
+
+audio_device_t pipecat_audio_device = {
+    .init = bsp_audio_init,
+    .read = bsp_audio_read,
+    .write = bsp_audio_write,
+};
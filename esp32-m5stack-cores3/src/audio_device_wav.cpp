@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <esp_log.h>
+
+#include "main.h"
+
+// Linux stand-in for the board codecs:
+//
+//   PIPECAT_MIC_WAV      16-bit mono WAV played into the microphone, silence
+//                        once it runs out (or when unset)
+//   PIPECAT_SPEAKER_WAV  where speaker output is written, discarded if unset
+//   PIPECAT_AUDIO_PACING "realtime" (default) blocks like the I2S DMA would,
+//                        "fast" runs as fast as the pipeline allows
+//
+// That is the NULL context. audio_device_wav_create() makes further ones
+// with explicit paths, e.g. one per load generator session.
+
+#define WAV_HEADER_SIZE 44
+
+typedef struct {
+  const char *mic_path;
+  const char *speaker_path;
+  bool realtime;
+  bool loop;
+
+  FILE *mic_file;
+  long mic_data_offset;  // Where `loop` rewinds to
+  FILE *speaker_file;
+  uint32_t speaker_bytes;
+  uint32_t sample_rate;
+  struct timespec next_read;
+  struct timespec next_write;
+} wav_device_t;
+
+static wav_device_t default_device;
+
+static wav_device_t *wav_device(void *context) {
+  return context != NULL ? (wav_device_t *)context : &default_device;
+}
+
+void *audio_device_wav_create(const char *mic_path, const char *speaker_path,
+                              bool realtime, bool loop) {
+  wav_device_t *device = (wav_device_t *)calloc(1, sizeof(wav_device_t));
+  if (device == NULL) {
+    return NULL;
+  }
+  device->mic_path = mic_path;
+  device->speaker_path = speaker_path;
+  device->realtime = realtime;
+  device->loop = loop;
+  return device;
+}
+
+void audio_device_wav_destroy(void *context) {
+  wav_device_t *device = (wav_device_t *)context;
+  if (device->mic_file != NULL) {
+    fclose(device->mic_file);
+  }
+  // The header is rewritten on every write, so it's already complete
+  if (device->speaker_file != NULL) {
+    fclose(device->speaker_file);
+  }
+  free(device);
+}
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  put_le16(p, v & 0xffff);
+  put_le16(p + 2, v >> 16);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t get_le16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+// Leaves the file positioned at the start of the samples, `data_size` (if
+// not NULL) says how many bytes of them there are
+static bool wav_open_input(FILE *file, uint32_t sample_rate,
+                           uint32_t *data_size) {
+  uint8_t riff[12];
+  if (fread(riff, 1, sizeof(riff), file) != sizeof(riff) ||
+      memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+
+  bool format_ok = false;
+  uint8_t chunk[8];
+  while (fread(chunk, 1, sizeof(chunk), file) == sizeof(chunk)) {
+    uint32_t size = get_le32(chunk + 4);
+    if (memcmp(chunk, "fmt ", 4) == 0) {
+      uint8_t fmt[16];
+      if (size < sizeof(fmt) ||
+          fread(fmt, 1, sizeof(fmt), file) != sizeof(fmt)) {
+        return false;
+      }
+      format_ok = get_le16(fmt) == 1 && get_le16(fmt + 2) == 1 &&
+                  get_le32(fmt + 4) == sample_rate && get_le16(fmt + 14) == 16;
+      size -= sizeof(fmt);
+    } else if (memcmp(chunk, "data", 4) == 0) {
+      if (data_size != NULL) {
+        *data_size = size;
+      }
+      return format_ok;
+    }
+    if (fseek(file, size + (size & 1), SEEK_CUR) != 0) {
+      return false;
+    }
+  }
+  return false;
+}
+
+int16_t *audio_wav_read_file(const char *path, uint32_t sample_rate,
+                             size_t *count) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  int16_t *samples = NULL;
+  uint32_t data_size = 0;
+  if (wav_open_input(file, sample_rate, &data_size)) {
+    size_t max_count = data_size / sizeof(int16_t);
+    samples = (int16_t *)malloc((max_count + 1) * sizeof(int16_t));
+    if (samples != NULL) {
+      // Short if the writer was killed before fixing up the header
+      *count = fread(samples, sizeof(int16_t), max_count, file);
+    }
+  }
+  fclose(file);
+  return samples;
+}
+
+static void wav_write_header(FILE *file, uint32_t sample_rate,
+                             uint32_t data_bytes) {
+  uint8_t header[WAV_HEADER_SIZE];
+  memcpy(header, "RIFF", 4);
+  put_le32(header + 4, 36 + data_bytes);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_le32(header + 16, 16);
+  put_le16(header + 20, 1);  // PCM
+  put_le16(header + 22, 1);  // Mono
+  put_le32(header + 24, sample_rate);
+  put_le32(header + 28, sample_rate * sizeof(int16_t));
+  put_le16(header + 32, sizeof(int16_t));
+  put_le16(header + 34, 16);
+  memcpy(header + 36, "data", 4);
+  put_le32(header + 40, data_bytes);
+
+  fseek(file, 0, SEEK_SET);
+  fwrite(header, 1, sizeof(header), file);
+  fseek(file, 0, SEEK_END);
+}
+
+// Sleeps until `deadline`, then moves it one frame on, like a DMA clock
+static void pace(wav_device_t *device, struct timespec *deadline,
+                 size_t count) {
+  if (!device->realtime) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (deadline->tv_sec == 0 && deadline->tv_nsec == 0) {
+    *deadline = now;
+  }
+
+  uint64_t frame_ns = (uint64_t)count * 1000000000ull / device->sample_rate;
+  deadline->tv_nsec += frame_ns % 1000000000ull;
+  deadline->tv_sec += frame_ns / 1000000000ull + deadline->tv_nsec / 1000000000;
+  deadline->tv_nsec %= 1000000000;
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) ==
+         EINTR) {
+  }
+}
+
+static esp_err_t wav_audio_init(void *context, uint32_t sample_rate) {
+  wav_device_t *device = wav_device(context);
+  device->sample_rate = sample_rate;
+
+  if (context == NULL) {
+    const char *pacing = getenv("PIPECAT_AUDIO_PACING");
+    device->realtime = pacing == NULL || strcmp(pacing, "fast") != 0;
+    device->mic_path = getenv("PIPECAT_MIC_WAV");
+    device->speaker_path = getenv("PIPECAT_SPEAKER_WAV");
+  }
+
+  const char *mic_path = device->mic_path;
+  if (mic_path != NULL) {
+    device->mic_file = fopen(mic_path, "rb");
+    if (device->mic_file == NULL ||
+        !wav_open_input(device->mic_file, sample_rate, NULL)) {
+      ESP_LOGE(LOG_TAG, "%s is not a 16-bit mono %uHz WAV file", mic_path,
+               (unsigned)sample_rate);
+      if (device->mic_file != NULL) {
+        fclose(device->mic_file);
+        device->mic_file = NULL;
+      }
+      return ESP_ERR_INVALID_ARG;
+    }
+    device->mic_data_offset = ftell(device->mic_file);
+  }
+
+  const char *speaker_path = device->speaker_path;
+  if (speaker_path != NULL) {
+    device->speaker_file = fopen(speaker_path, "wb");
+    if (device->speaker_file == NULL) {
+      ESP_LOGE(LOG_TAG, "Unable to create %s", speaker_path);
+      return ESP_FAIL;
+    }
+    wav_write_header(device->speaker_file, sample_rate, 0);
+  }
+
+  ESP_LOGI(LOG_TAG, "WAV audio device: mic %s%s, speaker %s, %s pacing",
+           mic_path ? mic_path : "silence",
+           mic_path && device->loop ? " (looped)" : "",
+           speaker_path ? speaker_path : "null",
+           device->realtime ? "realtime" : "fast");
+  return ESP_OK;
+}
+
+static esp_err_t wav_audio_read(void *context, int16_t *samples,
+                                size_t count) {
+  wav_device_t *device = wav_device(context);
+  size_t read = 0;
+  if (device->mic_file != NULL) {
+    read = fread(samples, sizeof(int16_t), count, device->mic_file);
+    if (read < count && device->loop &&
+        fseek(device->mic_file, device->mic_data_offset, SEEK_SET) == 0) {
+      read += fread(samples + read, sizeof(int16_t), count - read,
+                    device->mic_file);
+    }
+  }
+  memset(samples + read, 0, (count - read) * sizeof(int16_t));
+
+  pace(device, &device->next_read, count);
+  return ESP_OK;
+}
+
+static esp_err_t wav_audio_write(void *context, const int16_t *samples,
+                                 size_t count) {
+  wav_device_t *device = wav_device(context);
+  if (device->speaker_file != NULL) {
+    if (fwrite(samples, sizeof(int16_t), count, device->speaker_file) !=
+        count) {
+      return ESP_FAIL;
+    }
+    // Keep the header valid so the file is usable even if we're killed
+    device->speaker_bytes += count * sizeof(int16_t);
+    wav_write_header(device->speaker_file, device->sample_rate,
+                     device->speaker_bytes);
+  }
+
+  pace(device, &device->next_write, count);
+  return ESP_OK;
+}
+
+audio_device_t pipecat_audio_device = {
+    .init = wav_audio_init,
+    .read = wav_audio_read,
+    .write = wav_audio_write,
+};
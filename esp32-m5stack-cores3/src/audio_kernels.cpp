@@ -0,0 +1,38 @@
+#include <math.h>
+
+#include "main.h"
+
+// Written without branches in the loop body: on Xtensa the clamp becomes
+// CLAMPS and the peak MAX, and host compilers vectorize the whole loop.
+void audio_gain_meter(int16_t *samples, size_t count, int32_t gain_q8,
+                      audio_level_t *level) {
+  uint32_t active = 0;
+  int32_t peak = 0;
+  uint64_t sum_squares = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    int32_t in = samples[i];
+    active |= (uint32_t)(in + 1) > 2u;
+
+    int32_t out = (in * gain_q8) >> 8;
+    out = out < -32768 ? -32768 : out;
+    out = out > 32767 ? 32767 : out;
+    samples[i] = (int16_t)out;
+
+    int32_t magnitude = out < 0 ? -out : out;
+    peak = magnitude > peak ? magnitude : peak;
+    sum_squares += (uint32_t)(out * out);
+  }
+
+  level->active = active != 0;
+  level->peak = peak;
+  level->sum_squares = sum_squares;
+  level->samples = count;
+}
+
+uint32_t audio_level_rms(const audio_level_t *level) {
+  if (level->samples == 0) {
+    return 0;
+  }
+  return (uint32_t)sqrtf((float)level->sum_squares / level->samples);
+}
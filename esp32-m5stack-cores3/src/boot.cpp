@@ -0,0 +1,221 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+// One event group bit per phase, then one per helper worker that has
+// exited. Event groups keep the top 8 bits for themselves.
+#define BOOT_WORKER_EXITED(worker) (1u << (BOOT_MAX_PHASES + (worker)))
+static_assert(BOOT_MAX_PHASES + BOOT_WORKERS <= 24,
+              "Boot phases and workers don't fit in an event group");
+
+static const char *boot_milestone_names[BOOT_MILESTONE_COUNT] = {
+    "connected",
+    "first_audio",
+};
+
+typedef struct {
+  int64_t started_us;
+  int64_t finished_us;
+  uint8_t worker;
+} boot_record_t;
+
+static const boot_phase_t *boot_phases = NULL;
+static int boot_phase_count = 0;
+static EventGroupHandle_t boot_events = NULL;
+static std::atomic<uint32_t> boot_claimed(0);
+static boot_record_t boot_records[BOOT_MAX_PHASES];
+static uint32_t boot_worker_stack_used[BOOT_WORKERS];
+
+static std::atomic<int64_t> boot_finished_us(0);
+static std::atomic<int64_t> boot_milestones_us[BOOT_MILESTONE_COUNT];
+
+static uint32_t boot_all_bits() { return (1u << boot_phase_count) - 1; }
+
+// Claims the first unclaimed phase whose prerequisites are done, -1 if none
+static int boot_claim(uint32_t done) {
+  for (int phase = 0; phase < boot_phase_count; phase++) {
+    uint32_t bit = 1u << phase;
+    if ((boot_phases[phase].depends & ~done) != 0) {
+      continue;
+    }
+    if ((boot_claimed.fetch_or(bit, std::memory_order_relaxed) & bit) == 0) {
+      return phase;
+    }
+  }
+  return -1;
+}
+
+static void boot_work(uint8_t worker) {
+  uint32_t all = boot_all_bits();
+  while ((boot_claimed.load(std::memory_order_relaxed) & all) != all) {
+    uint32_t done = xEventGroupGetBits(boot_events) & all;
+    int phase = boot_claim(done);
+    if (phase < 0) {
+      // Everything left waits on a phase another worker is running
+      xEventGroupWaitBits(boot_events, all & ~done, pdFALSE, pdFALSE,
+                          portMAX_DELAY);
+      continue;
+    }
+
+    boot_record_t *record = &boot_records[phase];
+    record->worker = worker;
+    record->started_us = esp_timer_get_time();
+    boot_phases[phase].run();
+    record->finished_us = esp_timer_get_time();
+    xEventGroupSetBits(boot_events, 1u << phase);
+  }
+}
+
+static void boot_worker_task(void *user_data) {
+  uint8_t worker = (uint8_t)(uintptr_t)user_data;
+  boot_work(worker);
+#ifndef LINUX_BUILD
+  boot_worker_stack_used[worker] =
+      BOOT_WORKER_STACK_SIZE - uxTaskGetStackHighWaterMark(NULL);
+#endif
+  xEventGroupSetBits(boot_events, BOOT_WORKER_EXITED(worker));
+  vTaskDelete(NULL);
+}
+
+// When the last prerequisite of `phase` finished, or boot start
+static int64_t boot_ready_us(int phase, int64_t started_us) {
+  int64_t ready_us = started_us;
+  for (int i = 0; i < phase; i++) {
+    if ((boot_phases[phase].depends & BOOT_AFTER(i)) &&
+        boot_records[i].finished_us > ready_us) {
+      ready_us = boot_records[i].finished_us;
+    }
+  }
+  return ready_us;
+}
+
+// Walks back from the phase that finished last through whichever
+// prerequisite held each phase up
+static void boot_log_critical_path() {
+  int path[BOOT_MAX_PHASES];
+  int length = 0;
+
+  int phase = 0;
+  for (int i = 1; i < boot_phase_count; i++) {
+    if (boot_records[i].finished_us > boot_records[phase].finished_us) {
+      phase = i;
+    }
+  }
+  while (phase >= 0) {
+    path[length++] = phase;
+    int previous = -1;
+    for (int i = 0; i < phase; i++) {
+      if ((boot_phases[phase].depends & BOOT_AFTER(i)) &&
+          (previous < 0 ||
+           boot_records[i].finished_us > boot_records[previous].finished_us)) {
+        previous = i;
+      }
+    }
+    phase = previous;
+  }
+
+  char line[256];
+  size_t offset = 0;
+  for (int i = length - 1; i >= 0 && offset < sizeof(line); i--) {
+    offset += snprintf(line + offset, sizeof(line) - offset, "%s%s",
+                       i == length - 1 ? "" : " > ",
+                       boot_phases[path[i]].name);
+  }
+  ESP_LOGI(LOG_TAG, "Boot critical path: %s", line);
+}
+
+static void boot_log_report(int64_t started_us, int64_t finished_us) {
+  ESP_LOGI(LOG_TAG, "Boot took %lldms (%lldms since power on)",
+           (long long)((finished_us - started_us) / 1000),
+           (long long)(finished_us / 1000));
+  for (int phase = 0; phase < boot_phase_count; phase++) {
+    const boot_record_t *record = &boot_records[phase];
+    int64_t ready_us = boot_ready_us(phase, started_us);
+    ESP_LOGI(LOG_TAG,
+             "  %-16s ready %5lldms, ran %5lldms to %5lldms (%lldms), "
+             "worker %u",
+             boot_phases[phase].name,
+             (long long)((ready_us - started_us) / 1000),
+             (long long)((record->started_us - started_us) / 1000),
+             (long long)((record->finished_us - started_us) / 1000),
+             (long long)((record->finished_us - record->started_us) / 1000),
+             (unsigned)record->worker);
+  }
+  boot_log_critical_path();
+#ifndef LINUX_BUILD
+  for (int worker = 1; worker < BOOT_WORKERS; worker++) {
+    ESP_LOGI(LOG_TAG, "Boot worker %d used %u of %u stack bytes", worker,
+             (unsigned)boot_worker_stack_used[worker],
+             (unsigned)BOOT_WORKER_STACK_SIZE);
+  }
+#endif
+}
+
+void pipecat_boot_run(const boot_phase_t *phases, int count) {
+  if (count <= 0 || count > BOOT_MAX_PHASES) {
+    ESP_LOGE(LOG_TAG, "Boot needs 1 to %d phases, got %d", BOOT_MAX_PHASES,
+             count);
+    return;
+  }
+  for (int phase = 0; phase < count; phase++) {
+    if (phases[phase].depends >> phase) {
+      // Could never become ready
+      ESP_LOGE(LOG_TAG, "Boot phase %s depends on a later phase",
+               phases[phase].name);
+      return;
+    }
+  }
+
+  boot_phases = phases;
+  boot_phase_count = count;
+  boot_claimed.store(0, std::memory_order_relaxed);
+  memset(boot_records, 0, sizeof(boot_records));
+  boot_events = xEventGroupCreate();
+
+  int64_t started_us = esp_timer_get_time();
+  uint32_t wait_bits = boot_all_bits();
+  for (int worker = 1; worker < BOOT_WORKERS; worker++) {
+    if (xTaskCreate(boot_worker_task, "boot", BOOT_WORKER_STACK_SIZE,
+                    (void *)(uintptr_t)worker, BOOT_WORKER_PRIORITY,
+                    NULL) == pdPASS) {
+      wait_bits |= BOOT_WORKER_EXITED(worker);
+    }
+  }
+  boot_work(0);
+
+  // Helpers may still be running the last phases
+  xEventGroupWaitBits(boot_events, wait_bits, pdFALSE, pdTRUE, portMAX_DELAY);
+  vEventGroupDelete(boot_events);
+  boot_events = NULL;
+  int64_t finished_us = esp_timer_get_time();
+  boot_finished_us.store(finished_us, std::memory_order_relaxed);
+  boot_log_report(started_us, finished_us);
+}
+
+void pipecat_boot_milestone(boot_milestone_t milestone) {
+  int64_t expected = 0;
+  if (boot_milestones_us[milestone].load(std::memory_order_relaxed) != 0) {
+    return;
+  }
+  int64_t now_us = esp_timer_get_time();
+  if (boot_milestones_us[milestone].compare_exchange_strong(
+          expected, now_us, std::memory_order_relaxed)) {
+    ESP_LOGI(LOG_TAG, "Boot milestone %s at %lldms since power on",
+             boot_milestone_names[milestone], (long long)(now_us / 1000));
+  }
+}
+
+void pipecat_boot_stats(boot_stats_t *stats) {
+  stats->boot_us = boot_finished_us.load(std::memory_order_relaxed);
+  for (int milestone = 0; milestone < BOOT_MILESTONE_COUNT; milestone++) {
+    stats->milestone_us[milestone] =
+        boot_milestones_us[milestone].load(std::memory_order_relaxed);
+  }
+}
@@ -0,0 +1,66 @@
+#include <esp_log.h>
+
+#include "main.h"
+
+void capture_clock_init(capture_clock_t *clock, uint32_t period_us) {
+  clock->period_us = period_us;
+  clock->start_us = 0;
+  clock->frames = 0;
+  clock->drift_us = 0;
+  clock->max_drift_us = 0;
+  clock->late = 0;
+  clock->missed = 0;
+  clock->resyncs = 0;
+}
+
+// Puts the frame just read exactly on its slot
+static void capture_clock_resync(capture_clock_t *clock, int64_t read_end_us) {
+  clock->start_us = read_end_us - (int64_t)clock->frames * clock->period_us;
+  clock->drift_us = 0;
+  clock->resyncs++;
+}
+
+uint32_t capture_clock_tick(capture_clock_t *clock, int64_t read_start_us,
+                            int64_t read_end_us) {
+  if (clock->frames == 0 && clock->start_us == 0) {
+    clock->start_us = read_end_us;
+    clock->frames = 1;
+    return 0;
+  }
+
+  int64_t period_us = clock->period_us;
+  int64_t drift_us =
+      read_end_us - (clock->start_us + (int64_t)clock->frames * period_us);
+
+  uint32_t lost = 0;
+  bool blocked = read_end_us - read_start_us >= period_us / 2;
+  if (blocked && drift_us >= period_us) {
+    lost = drift_us / period_us;
+    if (lost > CAPTURE_MAX_FILLER_FRAMES) {
+      ESP_LOGW(LOG_TAG, "Capture stalled for %lldms, resyncing",
+               (long long)(drift_us / 1000));
+      clock->missed += lost;
+      capture_clock_resync(clock, read_end_us);
+      clock->frames++;
+      return 0;
+    }
+    clock->missed += lost;
+    clock->frames += lost;
+    drift_us -= lost * period_us;
+  } else if (drift_us <= -period_us) {
+    // Capture clock ahead of the timeline, nothing to fill
+    capture_clock_resync(clock, read_end_us);
+    clock->frames++;
+    return 0;
+  }
+
+  clock->frames++;
+  clock->drift_us = (int32_t)drift_us;
+  if (drift_us > clock->max_drift_us) {
+    clock->max_drift_us = (int32_t)drift_us;
+  }
+  if (drift_us > CAPTURE_LATE_THRESHOLD_MS * 1000LL) {
+    clock->late++;
+  }
+  return lost;
+}
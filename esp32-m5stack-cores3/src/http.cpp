@@ -1,16 +1,79 @@
 #include <cJSON.h>
 #include <esp_http_client.h>
 #include <esp_log.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifndef LINUX_BUILD
+#include <esp_heap_caps.h>
+#endif
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 #include "main.h"
 
 #ifndef MIN
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
+static void *http_realloc(void *ptr, size_t size) {
+#ifndef LINUX_BUILD
+  return heap_caps_realloc(ptr, size, MALLOC_CAP_SPIRAM);
+#else
+  return realloc(ptr, size);
+#endif
+}
+
+void http_buffer_free(http_buffer_t *buffer) {
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->capacity = 0;
+  buffer->overflow = false;
+}
+
+static void http_buffer_clear(http_buffer_t *buffer) {
+  buffer->len = 0;
+  buffer->overflow = false;
+  if (buffer->data != NULL) {
+    buffer->data[0] = '\0';
+  }
+}
+
+static bool http_buffer_append(http_buffer_t *buffer, const char *data,
+                               size_t len) {
+  size_t needed = buffer->len + len + 1;
+  if (needed > HTTP_MAX_RESPONSE_SIZE) {
+    buffer->overflow = true;
+    return false;
+  }
+
+  if (needed > buffer->capacity) {
+    size_t capacity =
+        buffer->capacity > 0 ? buffer->capacity : HTTP_INITIAL_RESPONSE_SIZE;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    capacity = MIN(capacity, (size_t)HTTP_MAX_RESPONSE_SIZE);
+
+    char *data = (char *)http_realloc(buffer->data, capacity);
+    if (data == NULL) {
+      buffer->overflow = true;
+      return false;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->data + buffer->len, data, len);
+  buffer->len += len;
+  buffer->data[buffer->len] = '\0';
+  return true;
+}
+
 static esp_err_t http_event_handler(esp_http_client_event_t *evt) {
-  static int output_len;
+  http_buffer_t *response = (http_buffer_t *)evt->user_data;
   switch (evt->event_id) {
     case HTTP_EVENT_REDIRECT:
       ESP_LOGD(LOG_TAG, "HTTP_EVENT_REDIRECT");
@@ -23,6 +86,8 @@ static esp_err_t http_event_handler(esp_http_client_event_t *evt) {
       break;
     case HTTP_EVENT_ON_CONNECTED:
       ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_CONNECTED");
+      // A redirect or retry starts a new body
+      http_buffer_clear(response);
       break;
     case HTTP_EVENT_HEADER_SENT:
       ESP_LOGD(LOG_TAG, "HTTP_EVENT_HEADER_SENT");
@@ -31,115 +96,173 @@ static esp_err_t http_event_handler(esp_http_client_event_t *evt) {
       ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s",
                evt->header_key, evt->header_value);
       break;
-    case HTTP_EVENT_ON_DATA: {
+    case HTTP_EVENT_ON_DATA:
+      // esp_http_client has already removed any chunked framing
       ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-      if (esp_http_client_is_chunked_response(evt->client)) {
-        ESP_LOGE(LOG_TAG, "Chunked HTTP response not supported");
-#ifndef LINUX_BUILD
-        esp_restart();
-#endif
+      if (!response->overflow) {
+        http_buffer_append(response, (const char *)evt->data, evt->data_len);
       }
-
-      if (output_len == 0 && evt->user_data) {
-        memset(evt->user_data, 0, MAX_HTTP_OUTPUT_BUFFER);
-      }
-
-      // If user_data buffer is configured, copy the response into the buffer
-      int copy_len = 0;
-      if (evt->user_data) {
-        // The last byte in evt->user_data is kept for the NULL character in
-        // case of out-of-bound access.
-        copy_len = MIN(evt->data_len, (MAX_HTTP_OUTPUT_BUFFER - output_len));
-        if (copy_len) {
-          memcpy(((char *)evt->user_data) + output_len, evt->data, copy_len);
-        }
-      }
-      output_len += copy_len;
-
       break;
-    }
     case HTTP_EVENT_ON_FINISH:
       ESP_LOGD(LOG_TAG, "HTTP_EVENT_ON_FINISH");
-      output_len = 0;
       break;
     case HTTP_EVENT_DISCONNECTED:
       ESP_LOGI(LOG_TAG, "HTTP_EVENT_DISCONNECTED");
-      output_len = 0;
       break;
   }
   return ESP_OK;
 }
 
-void pipecat_http_request(char *offer, char *answer) {
-  esp_http_client_config_t config;
-  memset(&config, 0, sizeof(esp_http_client_config_t));
+// {"sdp": offer, "type": "offer"}, NULL on allocation failure
+static char *http_offer_body(const char *offer) {
+  // Worst case every character is escaped as \u00XX
+  size_t size = strlen(offer) * 6 + 64;
+  char *body = (char *)http_realloc(NULL, size);
+  if (body == NULL) {
+    return NULL;
+  }
 
-  config.url = PIPECAT_SMALLWEBRTC_URL;
-  config.event_handler = http_event_handler;
-  config.timeout_ms = HTTP_TIMEOUT_MS;
-  config.user_data = answer;
+  json_writer_t w;
+  json_writer_init(&w, body, size);
+  json_writer_object_begin(&w);
+  json_writer_key(&w, "sdp");
+  json_writer_string(&w, offer);
+  json_writer_key(&w, "type");
+  json_writer_string(&w, "offer");
+  json_writer_object_end(&w);
+  if (json_writer_finish(&w) == 0) {
+    free(body);
+    return NULL;
+  }
+  return body;
+}
 
-  ESP_LOGI(LOG_TAG, "Connecting to %s", config.url);
+static bool http_should_retry(esp_err_t err, int status_code) {
+  return err != ESP_OK || status_code == 429 || status_code >= 500;
+}
 
-  cJSON *j_offer = cJSON_CreateObject();
-  if (j_offer == NULL) {
-    ESP_LOGE(LOG_TAG, "Unable to create JSON offer");
-    return;
+// Replaces the JSON response in `answer` with its `sdp` field
+static esp_err_t http_extract_answer(http_buffer_t *answer) {
+  cJSON *j_response = cJSON_Parse(answer->data);
+  if (j_response == NULL) {
+    ESP_LOGE(LOG_TAG, "Error parsing HTTP response");
+    return ESP_ERR_INVALID_RESPONSE;
   }
-  if (cJSON_AddStringToObject(j_offer, "sdp", offer) == NULL) {
-    cJSON_Delete(j_offer);
-    ESP_LOGE(LOG_TAG, "Unable to create JSON offer");
-    return;
+
+  cJSON *j_answer = cJSON_GetObjectItem(j_response, "sdp");
+  if (!cJSON_IsString(j_answer)) {
+    ESP_LOGE(LOG_TAG, "Unable to find `sdp` field in response");
+    cJSON_Delete(j_response);
+    return ESP_ERR_INVALID_RESPONSE;
   }
-  if (cJSON_AddStringToObject(j_offer, "type", "offer") == NULL) {
-    cJSON_Delete(j_offer);
-    ESP_LOGE(LOG_TAG, "Unable to create JSON offer");
-    return;
+
+  // The SDP is shorter than the response that contains it
+  size_t len = strlen(j_answer->valuestring);
+  memcpy(answer->data, j_answer->valuestring, len + 1);
+  answer->len = len;
+  cJSON_Delete(j_response);
+
+  ESP_LOGD(LOG_TAG, "ANSWER\n%s", answer->data);
+  return ESP_OK;
+}
+
+static bool http_cancelled(http_cancel_t cancelled, void *ctx) {
+  return cancelled != NULL && cancelled(ctx);
+}
+
+// Waits out a backoff in slices, false if cancelled meanwhile
+static bool http_backoff(uint32_t backoff_ms, http_cancel_t cancelled,
+                         void *ctx) {
+  while (backoff_ms > 0) {
+    if (http_cancelled(cancelled, ctx)) {
+      return false;
+    }
+    uint32_t slice_ms = MIN(backoff_ms, (uint32_t)HTTP_CANCEL_POLL_MS);
+    vTaskDelay(pdMS_TO_TICKS(slice_ms));
+    backoff_ms -= slice_ms;
   }
+  return !http_cancelled(cancelled, ctx);
+}
+
+esp_err_t pipecat_http_request(const char *url, const char *offer,
+                               http_buffer_t *answer, http_cancel_t cancelled,
+                               void *cancel_ctx) {
+  memset(answer, 0, sizeof(http_buffer_t));
 
   ESP_LOGD(LOG_TAG, "OFFER\n%s", offer);
 
-  char *j_offer_str = cJSON_Print(j_offer);
+  char *body = http_offer_body(offer);
+  if (body == NULL) {
+    ESP_LOGE(LOG_TAG, "Unable to create JSON offer");
+    return ESP_ERR_NO_MEM;
+  }
 
-  cJSON_Delete(j_offer);
+  esp_http_client_config_t config;
+  memset(&config, 0, sizeof(esp_http_client_config_t));
 
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_http_client_set_method(client, HTTP_METHOD_POST);
-  esp_http_client_set_header(client, "Content-Type", "application/json");
-  esp_http_client_set_post_field(client, j_offer_str, strlen(j_offer_str));
+  config.url = url;
+  config.event_handler = http_event_handler;
+  config.timeout_ms = HTTP_TIMEOUT_MS;
+  config.user_data = answer;
 
-  esp_err_t err = esp_http_client_perform(client);
-  int status_code = esp_http_client_get_status_code(client);
-  if (err != ESP_OK || status_code != 200) {
-    ESP_LOGE(LOG_TAG, "Error perform http request %s (status %d)",
-             esp_err_to_name(err), status_code);
-#ifndef LINUX_BUILD
-    esp_restart();
-#endif
-  }
+  ESP_LOGI(LOG_TAG, "Connecting to %s", config.url);
 
-  cJSON *j_response = cJSON_Parse((const char *)answer);
-  if (j_response == NULL) {
-    ESP_LOGE(LOG_TAG, "Error parsing HTTP response");
-#ifndef LINUX_BUILD
-    esp_restart();
-#endif
-  }
+  esp_err_t err = ESP_FAIL;
+  int status_code = 0;
+  uint32_t backoff_ms = HTTP_INITIAL_BACKOFF_MS;
+  for (int attempt = 1; attempt <= HTTP_MAX_ATTEMPTS; attempt++) {
+    if (attempt > 1) {
+      ESP_LOGW(LOG_TAG, "Retrying HTTP request in %lums (attempt %d/%d)",
+               (unsigned long)backoff_ms, attempt, HTTP_MAX_ATTEMPTS);
+      if (!http_backoff(backoff_ms, cancelled, cancel_ctx)) {
+        err = ESP_ERR_INVALID_STATE;
+        break;
+      }
+      backoff_ms = MIN(backoff_ms * 2, (uint32_t)HTTP_MAX_BACKOFF_MS);
+    } else if (http_cancelled(cancelled, cancel_ctx)) {
+      err = ESP_ERR_INVALID_STATE;
+      break;
+    }
 
-  cJSON *j_answer = cJSON_GetObjectItem(j_response, "sdp");
-  if (j_answer == NULL) {
-    ESP_LOGE(LOG_TAG, "Unable to find `sdp` field in response");
-#ifndef LINUX_BUILD
-    esp_restart();
-#endif
-  }
+    http_buffer_clear(answer);
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+      err = ESP_ERR_NO_MEM;
+      continue;
+    }
+    esp_http_client_set_method(client, HTTP_METHOD_POST);
+    esp_http_client_set_header(client, "Content-Type", "application/json");
+    esp_http_client_set_post_field(client, body, strlen(body));
 
-  memset(answer, 0, MAX_HTTP_OUTPUT_BUFFER + 1);
-  memcpy(answer, j_answer->valuestring, strlen(j_answer->valuestring));
+    err = esp_http_client_perform(client);
+    status_code = esp_http_client_get_status_code(client);
+    esp_http_client_cleanup(client);
 
-  ESP_LOGD(LOG_TAG, "ANSWER\n%s", answer);
+    if (err == ESP_OK && status_code == 200) {
+      if (answer->overflow || answer->data == NULL) {
+        ESP_LOGE(LOG_TAG, "HTTP response empty or larger than %d bytes",
+                 HTTP_MAX_RESPONSE_SIZE);
+        err = ESP_ERR_INVALID_SIZE;
+        break;
+      }
+      err = http_extract_answer(answer);
+      break;
+    }
 
-  cJSON_Delete(j_response);
+    ESP_LOGE(LOG_TAG, "Error perform http request %s (status %d)",
+             esp_err_to_name(err), status_code);
+    bool retry = http_should_retry(err, status_code);
+    if (err == ESP_OK) {
+      err = ESP_ERR_INVALID_RESPONSE;
+    }
+    if (!retry) {
+      break;
+    }
+  }
 
-  esp_http_client_cleanup(client);
+  free(body);
+  if (err != ESP_OK) {
+    http_buffer_free(answer);
+  }
+  return err;
 }
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+
+#define JITTER_BUFFER_MASK (JITTER_BUFFER_SLOTS - 1)
+#define JITTER_BUFFER_FRAME_US (JITTER_BUFFER_FRAME_MS * 1000)
+
+static_assert((JITTER_BUFFER_SLOTS & JITTER_BUFFER_MASK) == 0,
+              "JITTER_BUFFER_SLOTS must be a power of two");
+static_assert(JITTER_BUFFER_MAX_DELAY_MS / JITTER_BUFFER_FRAME_MS <
+                  JITTER_BUFFER_SLOTS,
+              "JITTER_BUFFER_SLOTS too small for JITTER_BUFFER_MAX_DELAY_MS");
+
+static void jitter_buffer_update_target(jitter_buffer_t *jb) {
+  int64_t target_us = JITTER_BUFFER_FRAME_US + JITTER_BUFFER_JITTER_MULTIPLIER *
+                                                   (jb->jitter_us_q4 >> 4);
+  if (target_us < JITTER_BUFFER_MIN_DELAY_MS * 1000) {
+    target_us = JITTER_BUFFER_MIN_DELAY_MS * 1000;
+  }
+  if (target_us > JITTER_BUFFER_MAX_DELAY_MS * 1000) {
+    target_us = JITTER_BUFFER_MAX_DELAY_MS * 1000;
+  }
+  jb->target_frames =
+      (target_us + JITTER_BUFFER_FRAME_US - 1) / JITTER_BUFFER_FRAME_US;
+}
+
+// RFC 3550 section 6.4.1: J += (|D| - J) / 16, kept in microseconds.
+static void jitter_buffer_update_jitter(jitter_buffer_t *jb, uint32_t timestamp,
+                                        int64_t arrival_us) {
+  int64_t arrival_delta = arrival_us - jb->last_arrival_us;
+  int64_t timestamp_delta = (int32_t)(timestamp - jb->last_timestamp);
+  int64_t d = arrival_delta -
+              timestamp_delta * 1000000 / JITTER_BUFFER_RTP_CLOCK_RATE;
+  if (d < 0) {
+    d = -d;
+  }
+  jb->jitter_us_q4 += d - ((jb->jitter_us_q4 + 8) >> 4);
+
+  jb->last_arrival_us = arrival_us;
+  jb->last_timestamp = timestamp;
+}
+
+bool jitter_buffer_init(jitter_buffer_t *jb, memory_region_t region) {
+  memset(jb, 0, sizeof(jitter_buffer_t));
+
+  jb->storage = (uint8_t *)pipecat_memory_alloc(
+      region, JITTER_BUFFER_STORAGE_SIZE, "jitter_buffer");
+  if (jb->storage == NULL) {
+    return false;
+  }
+
+  for (int i = 0; i < JITTER_BUFFER_SLOTS; i++) {
+    jb->slots[i].data = jb->storage + i * JITTER_BUFFER_MAX_PACKET_SIZE;
+  }
+
+  jitter_buffer_reset(jb);
+  return true;
+}
+
+void jitter_buffer_reset(jitter_buffer_t *jb) {
+  for (int i = 0; i < JITTER_BUFFER_SLOTS; i++) {
+    jb->slots[i].used = false;
+  }
+  jb->started = false;
+  jb->jitter_us_q4 = 0;
+  jitter_buffer_update_target(jb);
+}
+
+void jitter_buffer_push(jitter_buffer_t *jb, uint16_t seq, uint32_t timestamp,
+                        const uint8_t *data, size_t size, int64_t arrival_us) {
+  if (size == 0 || size > JITTER_BUFFER_MAX_PACKET_SIZE) {
+    return;
+  }
+
+  if (jb->started) {
+    int16_t ahead = (int16_t)(seq - jb->next_seq);
+    if (ahead < 0 && ahead > -JITTER_BUFFER_SLOTS * 4) {
+      // Already played out (or concealed), too late to be useful
+      jb->stats.late++;
+      return;
+    }
+    if (ahead < 0 || ahead >= JITTER_BUFFER_SLOTS) {
+      // Sender restarted or we lost a long burst, start over
+      pipecat_tlog(TLOG_JITTER_BUFFER_RESET, seq, jb->next_seq);
+      jb->stats.resets++;
+      jitter_buffer_reset(jb);
+    }
+  }
+
+  if (!jb->started) {
+    jb->started = true;
+    jb->next_seq = seq;
+    jb->newest_seq = seq;
+    jb->last_arrival_us = arrival_us;
+    jb->last_timestamp = timestamp;
+  } else {
+    jitter_buffer_update_jitter(jb, timestamp, arrival_us);
+    if ((int16_t)(seq - jb->newest_seq) > 0) {
+      jb->newest_seq = seq;
+    }
+  }
+
+  jitter_buffer_slot_t *slot = &jb->slots[seq & JITTER_BUFFER_MASK];
+  if (slot->used && slot->seq == seq) {
+    jb->stats.duplicate++;
+    return;
+  }
+
+  slot->used = true;
+  slot->seq = seq;
+  slot->timestamp = timestamp;
+  slot->size = size;
+  slot->arrival_us = arrival_us;
+  memcpy(slot->data, data, size);
+
+  jb->stats.received++;
+  jitter_buffer_update_target(jb);
+}
+
+bool jitter_buffer_pop(jitter_buffer_t *jb, bool drain,
+                       jitter_buffer_frame_t *frame) {
+  if (!jb->started) {
+    return false;
+  }
+
+  int depth = (int16_t)(jb->newest_seq - jb->next_seq) + 1;
+  if (depth <= 0 || (!drain && depth <= (int)jb->target_frames)) {
+    return false;
+  }
+
+  uint16_t seq = jb->next_seq++;
+  jitter_buffer_slot_t *slot = &jb->slots[seq & JITTER_BUFFER_MASK];
+  jitter_buffer_slot_t *next = &jb->slots[(seq + 1) & JITTER_BUFFER_MASK];
+
+  frame->seq = seq;
+  if (slot->used && slot->seq == seq) {
+    slot->used = false;
+    frame->kind = JITTER_BUFFER_FRAME_PACKET;
+    frame->data = slot->data;
+    frame->size = slot->size;
+    frame->arrival_us = slot->arrival_us;
+    jb->stats.played++;
+  } else if (next->used && next->seq == (uint16_t)(seq + 1)) {
+    frame->kind = JITTER_BUFFER_FRAME_FEC;
+    frame->data = next->data;
+    frame->size = next->size;
+    frame->arrival_us = next->arrival_us;
+    jb->stats.fec++;
+  } else {
+    frame->kind = JITTER_BUFFER_FRAME_PLC;
+    frame->data = NULL;
+    frame->size = 0;
+    frame->arrival_us = 0;
+    jb->stats.plc++;
+  }
+
+  return true;
+}
+
+uint32_t jitter_buffer_jitter_ms(const jitter_buffer_t *jb) {
+  return (uint32_t)((jb->jitter_us_q4 >> 4) / 1000);
+}
+
+// RFC 3550 section 5.1
+bool rtp_parse(const uint8_t *packet, size_t size, rtp_packet_t *rtp) {
+  if (size < RTP_HEADER_SIZE || (packet[0] >> 6) != 2) {
+    return false;
+  }
+
+  size_t header = RTP_HEADER_SIZE + 4 * (packet[0] & 0x0f);
+  if ((packet[0] & 0x10) != 0) {
+    // Extension: 16-bit profile, 16-bit length in words, then the words
+    if (header + 4 > size) {
+      return false;
+    }
+    header += 4 + 4 * ((packet[header + 2] << 8) | packet[header + 3]);
+  }
+  if (header > size) {
+    return false;
+  }
+
+  size_t padding = 0;
+  if ((packet[0] & 0x20) != 0) {
+    // The last byte counts the padding, itself included
+    padding = packet[size - 1];
+    if (padding == 0 || padding > size - header) {
+      return false;
+    }
+  }
+
+  rtp->seq = (packet[2] << 8) | packet[3];
+  rtp->timestamp = ((uint32_t)packet[4] << 24) | (packet[5] << 16) |
+                   (packet[6] << 8) | packet[7];
+  rtp->payload = packet + header;
+  rtp->size = size - header - padding;
+  return true;
+}
@@ -0,0 +1,175 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+
+void json_writer_init(json_writer_t *w, char *buffer, size_t size) {
+  w->buffer = buffer;
+  w->size = size;
+  w->len = 0;
+  w->depth = 0;
+  w->needs_comma = 0;
+  w->after_key = false;
+  w->overflow = size == 0;
+  if (!w->overflow) {
+    buffer[0] = '\0';
+  }
+}
+
+static void json_writer_append(json_writer_t *w, const char *bytes,
+                               size_t count) {
+  if (w->overflow) {
+    return;
+  }
+  // Always leave room for the terminator
+  if (count >= w->size - w->len) {
+    w->overflow = true;
+    return;
+  }
+  memcpy(w->buffer + w->len, bytes, count);
+  w->len += count;
+  w->buffer[w->len] = '\0';
+}
+
+static void json_writer_char(json_writer_t *w, char c) {
+  json_writer_append(w, &c, 1);
+}
+
+// Separates values within the current object or array
+static void json_writer_value(json_writer_t *w) {
+  if (w->after_key) {
+    w->after_key = false;
+    return;
+  }
+  uint32_t bit = 1u << w->depth;
+  if (w->needs_comma & bit) {
+    json_writer_char(w, ',');
+  }
+  w->needs_comma |= bit;
+}
+
+static void json_writer_open(json_writer_t *w, char c) {
+  json_writer_value(w);
+  json_writer_char(w, c);
+  if (w->depth + 1 >= JSON_WRITER_MAX_DEPTH) {
+    w->overflow = true;
+    return;
+  }
+  w->depth++;
+  w->needs_comma &= ~(1u << w->depth);
+}
+
+static void json_writer_close(json_writer_t *w, char c) {
+  if (w->depth > 0) {
+    w->depth--;
+  }
+  json_writer_char(w, c);
+}
+
+void json_writer_object_begin(json_writer_t *w) { json_writer_open(w, '{'); }
+
+void json_writer_object_end(json_writer_t *w) { json_writer_close(w, '}'); }
+
+void json_writer_array_begin(json_writer_t *w) { json_writer_open(w, '['); }
+
+void json_writer_array_end(json_writer_t *w) { json_writer_close(w, ']'); }
+
+static void json_writer_escaped(json_writer_t *w, const char *s) {
+  json_writer_char(w, '"');
+  const char *run = s;
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    json_writer_append(w, run, s - run);
+    run = s + 1;
+
+    char escape[7];
+    switch (c) {
+      case '"':
+        json_writer_append(w, "\\\"", 2);
+        break;
+      case '\\':
+        json_writer_append(w, "\\\\", 2);
+        break;
+      case '\n':
+        json_writer_append(w, "\\n", 2);
+        break;
+      case '\r':
+        json_writer_append(w, "\\r", 2);
+        break;
+      case '\t':
+        json_writer_append(w, "\\t", 2);
+        break;
+      default:
+        snprintf(escape, sizeof(escape), "\\u%04x", c);
+        json_writer_append(w, escape, 6);
+        break;
+    }
+  }
+  json_writer_append(w, run, s - run);
+  json_writer_char(w, '"');
+}
+
+void json_writer_key(json_writer_t *w, const char *key) {
+  json_writer_value(w);
+  json_writer_escaped(w, key);
+  json_writer_char(w, ':');
+  w->after_key = true;
+}
+
+void json_writer_string(json_writer_t *w, const char *value) {
+  json_writer_value(w);
+  json_writer_escaped(w, value);
+}
+
+void json_writer_int(json_writer_t *w, int64_t value) {
+  char number[24];
+  int len = snprintf(number, sizeof(number), "%" PRId64, value);
+  json_writer_value(w);
+  json_writer_append(w, number, len);
+}
+
+void json_writer_uint(json_writer_t *w, uint64_t value) {
+  char number[24];
+  int len = snprintf(number, sizeof(number), "%" PRIu64, value);
+  json_writer_value(w);
+  json_writer_append(w, number, len);
+}
+
+void json_writer_float(json_writer_t *w, double value) {
+  json_writer_value(w);
+  if (!isfinite(value)) {
+    // JSON has no NaN or infinity
+    json_writer_append(w, "null", 4);
+    return;
+  }
+  char number[32];
+  int len = snprintf(number, sizeof(number), "%.6g", value);
+  json_writer_append(w, number, len);
+}
+
+void json_writer_bool(json_writer_t *w, bool value) {
+  json_writer_value(w);
+  json_writer_append(w, value ? "true" : "false", value ? 4 : 5);
+}
+
+void json_writer_null(json_writer_t *w) {
+  json_writer_value(w);
+  json_writer_append(w, "null", 4);
+}
+
+void json_writer_raw(json_writer_t *w, const char *json) {
+  json_writer_value(w);
+  json_writer_append(w, json, strlen(json));
+}
+
+size_t json_writer_finish(json_writer_t *w) {
+  if (w->overflow || w->depth != 0) {
+    return 0;
+  }
+  return w->len;
+}
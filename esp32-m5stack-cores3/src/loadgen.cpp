@@ -0,0 +1,123 @@
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <peer.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+#define LOADGEN_LOG_TAG "loadgen"
+
+// Each simulated device runs its own WebRTC loop, like app_main() does
+static void loadgen_loop_task(void *user_data) {
+  pipecat_session_t *session = (pipecat_session_t *)user_data;
+  while (1) {
+    pipecat_webrtc_loop(session);
+    pipecat_webrtc_wait(session);
+  }
+}
+
+static bool loadgen_start_session(pipecat_session_t *session, uint32_t index,
+                                  const char *url, const char *mic_path) {
+  pipecat_session_config_t config = {
+      .index = index,
+      .url = url,
+      .device = &pipecat_audio_device,
+      .device_context = audio_device_wav_create(mic_path, NULL, true, true),
+  };
+  if (config.device_context == NULL ||
+      !pipecat_session_create(session, &config)) {
+    return false;
+  }
+
+  pipecat_init_audio_capture(session);
+  pipecat_init_audio_decoder(session);
+  pipecat_init_audio_encoder(session);
+  pipecat_init_webrtc(session);
+
+  TaskHandle_t task = NULL;
+  xTaskCreate(loadgen_loop_task, "loadgen_loop", LOADGEN_LOOP_TASK_STACK_SIZE,
+              session, LOADGEN_LOOP_TASK_PRIORITY, &task);
+  pipecat_memory_track_task(task, "loadgen_loop",
+                            LOADGEN_LOOP_TASK_STACK_SIZE);
+  return task != NULL;
+}
+
+static void loadgen_report(pipecat_session_t *sessions, uint32_t count) {
+  uint32_t states[PIPECAT_SESSION_CONNECTED + 1] = {0};
+  uint64_t sent = 0, underruns = 0, decode_errors = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    pipecat_session_t *session = &sessions[i];
+    if (session->webrtc == NULL) {
+      continue;
+    }
+    audio_capture_stats_t capture;
+    audio_playback_stats_t playback;
+    pipecat_audio_capture_stats(session, &capture);
+    pipecat_audio_playback_stats(session, &playback);
+    states[pipecat_webrtc_state(session)]++;
+    sent += capture.sent;
+    underruns += playback.underruns;
+    decode_errors += playback.decode_errors;
+  }
+
+  ESP_LOGI(LOADGEN_LOG_TAG,
+           "%lu sessions: %lu idle, %lu connecting, %lu connected | "
+           "%llu packets sent, %llu underruns, %llu decode errors",
+           (unsigned long)count,
+           (unsigned long)states[PIPECAT_SESSION_IDLE],
+           (unsigned long)states[PIPECAT_SESSION_CONNECTING],
+           (unsigned long)states[PIPECAT_SESSION_CONNECTED],
+           (unsigned long long)sent, (unsigned long long)underruns,
+           (unsigned long long)decode_errors);
+}
+
+int pipecat_load_generator(uint32_t count, uint32_t ramp_ms) {
+  pipecat_session_t *sessions =
+      (pipecat_session_t *)calloc(count, sizeof(pipecat_session_t));
+  if (sessions == NULL || !pipecat_init_memory(count)) {
+    return 1;
+  }
+
+  ESP_ERROR_CHECK(esp_event_loop_create_default());
+  peer_init();
+  pipecat_init_rtvi_callbacks();
+
+  // $PIPECAT_SMALLWEBRTC_URL at run time points a prebuilt binary elsewhere
+  const char *url = getenv("PIPECAT_SMALLWEBRTC_URL");
+  if (url == NULL) {
+    url = PIPECAT_SMALLWEBRTC_URL;
+  }
+  const char *mic_path = getenv("PIPECAT_MIC_WAV");
+
+  ESP_LOGI(LOADGEN_LOG_TAG, "Starting %lu sessions %lums apart against %s",
+           (unsigned long)count, (unsigned long)ramp_ms, url);
+
+  uint32_t started = 0;
+  int64_t last_report_us = esp_timer_get_time();
+  while (1) {
+    if (started < count) {
+      if (!loadgen_start_session(&sessions[started], started, url,
+                                 mic_path)) {
+        ESP_LOGE(LOADGEN_LOG_TAG, "Stopping the ramp at %lu sessions",
+                 (unsigned long)started);
+        count = started;
+        continue;
+      }
+      started++;
+      vTaskDelay(pdMS_TO_TICKS(ramp_ms));
+    } else {
+      vTaskDelay(pdMS_TO_TICKS(LOADGEN_REPORT_INTERVAL_MS));
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    if (now_us - last_report_us >= LOADGEN_REPORT_INTERVAL_MS * 1000LL) {
+      last_report_us = now_us;
+      loadgen_report(sessions, started);
+      pipecat_trace_dump();
+    }
+  }
+}
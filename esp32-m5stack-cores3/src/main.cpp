@@ -4,10 +4,36 @@
 #include <esp_log.h>
 #include <peer.h>
 
+// The device, or the Linux stand-in, as a single client
+static const pipecat_session_config_t default_session_config = {
+    .index = 0,
+    .url = PIPECAT_SMALLWEBRTC_URL,
+    .device = &pipecat_audio_device,
+    .device_context = NULL,
+};
+
 #ifndef LINUX_BUILD
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "nvs_flash.h"
 
-extern "C" void app_main(void) {
+// Boot phases, each after the ones it names in `depends`
+enum {
+  PHASE_NVS,
+  PHASE_WARM_CACHE,
+  PHASE_EVENT_LOOP,
+  PHASE_BOARD,
+  PHASE_PEER,
+  PHASE_WIFI,
+  PHASE_AUDIO_CAPTURE,
+  PHASE_AUDIO_DECODER,
+  PHASE_AUDIO_ENCODER,
+  PHASE_RTVI_CALLBACKS,
+  PHASE_WEBRTC,
+  PHASE_WIFI_CONNECTED,
+};
+
+static void boot_nvs() {
   esp_err_t ret = nvs_flash_init();
   if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
       ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -15,7 +41,13 @@ extern "C" void app_main(void) {
     ret = nvs_flash_init();
   }
   ESP_ERROR_CHECK(ret);
+}
+
+static void boot_event_loop() {
+  ESP_ERROR_CHECK(esp_event_loop_create_default());
+}
 
+static void boot_board() {
   // Configure M5Stack BEFORE calling M5.begin()
   auto cfg = M5.config();
   
@@ -23,7 +55,7 @@ extern "C" void app_main(void) {
   cfg.speaker_config.pin_bck = GPIO_NUM_7;
   cfg.speaker_config.pin_ws = GPIO_NUM_5;
   cfg.speaker_config.pin_data_out = GPIO_NUM_6;
-  cfg.speaker_config.sample_rate = 16000;
+  cfg.speaker_config.sample_rate = pipecat_audio_config.device_rate;
   cfg.speaker_config.stereo = false;
   cfg.speaker_config.buzzer = false;
   cfg.speaker_config.use_dac = false;
@@ -31,7 +63,7 @@ extern "C" void app_main(void) {
   cfg.microphone_config.pin_bck = GPIO_NUM_4;
   cfg.microphone_config.pin_ws = GPIO_NUM_5;
   cfg.microphone_config.pin_data_in = GPIO_NUM_6;
-  cfg.microphone_config.sample_rate = 16000;
+  cfg.microphone_config.sample_rate = pipecat_audio_config.device_rate;
   cfg.microphone_config.stereo = false;
   
   M5.begin(cfg);
@@ -40,45 +72,174 @@ extern "C" void app_main(void) {
   M5.Display.setTextSize(1.5);
   M5.Display.fillScreen(BLACK);
   M5.Display.println("Pipecat ESP32 client initialized\n");
+}
+
+static void boot_peer() { peer_init(); }
 
+// Nothing but Wi-Fi needs NVS or the event loop, and only the first session
+// needs an IP address, so the codecs and the board come up during
+// association
+static const boot_phase_t boot_phases[] = {
+    {"nvs", boot_nvs, 0},
+    {"warm_cache", pipecat_init_warm_cache, BOOT_AFTER(PHASE_NVS)},
+    {"event_loop", boot_event_loop, 0},
+    {"board", boot_board, 0},
+    {"peer", boot_peer, 0},
+    {"wifi", pipecat_init_wifi,
+     BOOT_AFTER(PHASE_WARM_CACHE) | BOOT_AFTER(PHASE_EVENT_LOOP)},
+    {"audio_capture", pipecat_init_audio_capture, BOOT_AFTER(PHASE_BOARD)},
+    // The playback task writes to the device opened by capture
+    {"audio_decoder", pipecat_init_audio_decoder,
+     BOOT_AFTER(PHASE_AUDIO_CAPTURE)},
+    {"audio_encoder", pipecat_init_audio_encoder, 0},
+    {"rtvi_callbacks", pipecat_init_rtvi_callbacks, 0},
+    {"webrtc", pipecat_init_webrtc,
+     BOOT_AFTER(PHASE_EVENT_LOOP) | BOOT_AFTER(PHASE_PEER) |
+         BOOT_AFTER(PHASE_AUDIO_DECODER) | BOOT_AFTER(PHASE_AUDIO_ENCODER) |
+         BOOT_AFTER(PHASE_RTVI_CALLBACKS)},
+    {"wifi_connected", pipecat_wifi_wait_connected, BOOT_AFTER(PHASE_WIFI)},
+};
+
+extern "C" void app_main(void) {
   ESP_LOGI("MAIN", "Starting initialization sequence...");
 
-  ESP_ERROR_CHECK(esp_event_loop_create_default());
-  peer_init();
-  
-  // Initialize audio components in correct order
-  ESP_LOGI("MAIN", "Initializing audio capture...");
-  pipecat_init_audio_capture();
-  
-  ESP_LOGI("MAIN", "Initializing audio decoder...");
-  pipecat_init_audio_decoder();
-  
-  ESP_LOGI("MAIN", "Initializing audio encoder...");
-  pipecat_init_audio_encoder();
-  
-  ESP_LOGI("MAIN", "Initializing WiFi...");
-  pipecat_init_wifi();
-  
-  ESP_LOGI("MAIN", "Initializing WebRTC...");
-  pipecat_init_webrtc();
-  
+  pipecat_init_tlog();
+  pipecat_memory_track_task(xTaskGetCurrentTaskHandle(), "main",
+                            CONFIG_ESP_MAIN_TASK_STACK_SIZE);
+  if (!pipecat_init_memory() ||
+      !pipecat_session_create(&pipecat_session, &default_session_config)) {
+    return;
+  }
+#ifdef RECORD_PATH
+  pipecat_record_start(RECORD_PATH);
+#endif
+
+  pipecat_boot_run(boot_phases, sizeof(boot_phases) / sizeof(boot_phases[0]));
+
   ESP_LOGI("MAIN", "Initialization complete, starting main loop...");
+  pipecat_memory_dump();
 
   while (1) {
     pipecat_webrtc_loop();
-    vTaskDelay(pdMS_TO_TICKS(TICK_INTERVAL));
+    pipecat_webrtc_wait();
   }
 }
 #else
-int main(void) {
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+static volatile sig_atomic_t trace_dump_requested = 0;
+
+// `kill -USR1 <pid>` dumps the latency trace and memory use on the console
+static void on_sigusr1(int sig) { trace_dump_requested = 1; }
+
+static void config_from_env(const char *name, uint32_t *value) {
+  const char *env = getenv(name);
+  if (env != NULL) {
+    *value = strtoul(env, NULL, 10);
+  }
+}
+
+static void config_from_arg(int argc, char **argv, const char *name,
+                            uint32_t *value) {
+  for (int i = 1; i + 1 < argc; i++) {
+    if (strcmp(argv[i], name) == 0) {
+      *value = strtoul(argv[i + 1], NULL, 10);
+    }
+  }
+}
+
+enum {
+  PHASE_WARM_CACHE,
+  PHASE_EVENT_LOOP,
+  PHASE_PEER,
+  PHASE_AUDIO_CAPTURE,
+  PHASE_AUDIO_DECODER,
+  PHASE_AUDIO_ENCODER,
+  PHASE_RTVI_CALLBACKS,
+  PHASE_WEBRTC,
+};
+
+static void boot_event_loop() {
   ESP_ERROR_CHECK(esp_event_loop_create_default());
-  peer_init();
-  pipecat_init_audio_encoder();
-  pipecat_webrtc();
+}
+
+static void boot_peer() { peer_init(); }
+
+static const boot_phase_t boot_phases[] = {
+    {"warm_cache", pipecat_init_warm_cache, 0},
+    {"event_loop", boot_event_loop, 0},
+    {"peer", boot_peer, 0},
+    {"audio_capture", pipecat_init_audio_capture, 0},
+    {"audio_decoder", pipecat_init_audio_decoder,
+     BOOT_AFTER(PHASE_AUDIO_CAPTURE)},
+    {"audio_encoder", pipecat_init_audio_encoder, 0},
+    {"rtvi_callbacks", pipecat_init_rtvi_callbacks, 0},
+    {"webrtc", pipecat_init_webrtc,
+     BOOT_AFTER(PHASE_EVENT_LOOP) | BOOT_AFTER(PHASE_PEER) |
+         BOOT_AFTER(PHASE_AUDIO_DECODER) | BOOT_AFTER(PHASE_AUDIO_ENCODER) |
+         BOOT_AFTER(PHASE_RTVI_CALLBACKS)},
+};
+
+int main(int argc, char **argv) {
+  config_from_env("PIPECAT_DEVICE_RATE", &pipecat_audio_config.device_rate);
+  config_from_env("PIPECAT_CODEC_RATE", &pipecat_audio_config.codec_rate);
+
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    return pipecat_audio_benchmark();
+  }
+#ifdef PIPECAT_HOST_TESTS
+  if (argc > 1 && strcmp(argv[1], "--test") == 0) {
+    return pipecat_run_tests(argc > 2 ? argv[2] : NULL);
+  }
+#endif
+  if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+    return pipecat_replay(argv[2],
+                          argc > 3 && strcmp(argv[3], "--fast") == 0);
+  }
+  if (argc > 1 && strcmp(argv[1], "--standin") == 0) {
+    return pipecat_standin_server(
+        argc > 2 ? strtoul(argv[2], NULL, 10) : STANDIN_DEFAULT_PORT);
+  }
+
+  signal(SIGUSR1, on_sigusr1);
+
+  pipecat_init_tlog();
+
+  // `--sessions N [--ramp-ms MS]` runs the load generator instead
+  uint32_t sessions = 0;
+  uint32_t ramp_ms = LOADGEN_RAMP_MS;
+  config_from_arg(argc, argv, "--sessions", &sessions);
+  config_from_arg(argc, argv, "--ramp-ms", &ramp_ms);
+  if (sessions > 0) {
+    return pipecat_load_generator(sessions, ramp_ms);
+  }
+
+  // Like the load generator's, e.g. to point a build at `--standin`
+  pipecat_session_config_t config = default_session_config;
+  const char *url = getenv("PIPECAT_SMALLWEBRTC_URL");
+  if (url != NULL) {
+    config.url = url;
+  }
+  if (!pipecat_init_memory() ||
+      !pipecat_session_create(&pipecat_session, &config)) {
+    return 1;
+  }
+  const char *record_path = getenv("PIPECAT_RECORD");
+  if (record_path != NULL && !pipecat_record_start(record_path)) {
+    return 1;
+  }
+  pipecat_boot_run(boot_phases, sizeof(boot_phases) / sizeof(boot_phases[0]));
 
   while (1) {
     pipecat_webrtc_loop();
-    vTaskDelay(pdMS_TO_TICKS(TICK_INTERVAL));
+    if (trace_dump_requested) {
+      trace_dump_requested = 0;
+      pipecat_trace_dump();
+      pipecat_memory_dump();
+    }
+    pipecat_webrtc_wait();
   }
 }
 #endif
\ No newline at end of file
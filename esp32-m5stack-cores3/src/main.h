@@ -1,50 +1,1271 @@
+#include <esp_err.h>
 #include <peer.h>
-#include <peer.h>
 
+#include <atomic>
+
+#ifndef LINUX_BUILD
 // Add BSP support
 #ifdef CONFIG_BSP_BOARD_M5STACK_CORE_S3
 #include "bsp/esp-bsp.h"
-#else
-#include <M5Unified.h>
 #endif
 
-
-#ifndef LINUX_BUILD
 #include <M5Unified.h>
 #endif
 
 #define LOG_TAG "pipecat"
-#define MAX_HTTP_OUTPUT_BUFFER 4096
 #define HTTP_TIMEOUT_MS 10000
 #define TICK_INTERVAL 15
 
+// See Session below
+typedef struct pipecat_session pipecat_session_t;
+
 // Wifi
+//
+// pipecat_init_wifi() starts association and returns,
+// pipecat_wifi_wait_connected() blocks until there is an IP address.
 extern void pipecat_init_wifi();
+extern void pipecat_wifi_wait_connected();
+
+// Warm-start cache
+//
+// Small blobs that make the next boot faster, kept in NVS on the device and
+// in one file per key under $PIPECAT_CACHE_DIR (default .pipecat_cache) on
+// Linux. Each entry records the format version, a tag derived from whatever
+// the value depends on (e.g. the SSID) and the boot it was written in. A
+// version or tag mismatch, or an entry written more than `max_boots` boots
+// ago, reads as a miss. Callers invalidate entries that turned out wrong.
+// Keys are at most 15 characters (NVS).
+#define WARM_CACHE_VERSION 1
+#define WARM_CACHE_NAMESPACE "pipecat"
+#define WARM_CACHE_MAX_SIZE 512
+#define WARM_CACHE_DIR ".pipecat_cache"
+
+// Increments the boot counter, needs NVS on the device
+extern void pipecat_init_warm_cache();
+extern bool warm_cache_load(const char *key, uint32_t tag, uint32_t max_boots,
+                            void *value, size_t size);
+extern void warm_cache_store(const char *key, uint32_t tag, const void *value,
+                             size_t size);
+extern void warm_cache_invalidate(const char *key);
+extern uint32_t warm_cache_tag(const char *text);
+
+// Last AP that gave us an address, for a connect without the full scan
+#define WIFI_CACHE_KEY "wifi_ap"
+#define WIFI_CACHE_MAX_BOOTS 100
+
+// Boot
+//
+// Init phases run as soon as the phases they depend on have finished, on
+// the calling task plus BOOT_WORKERS - 1 helper tasks, so codec and board
+// setup overlap the Wi-Fi association wait. A phase may only depend on
+// phases listed before it. Every boot logs when each phase became ready,
+// started and finished, and the critical path through them. Milestones
+// after boot (connected, first bot audio) are logged the first time they
+// happen.
+#define BOOT_MAX_PHASES 16
+#define BOOT_WORKERS 2
+#define BOOT_WORKER_STACK_SIZE 16384
+#define BOOT_WORKER_PRIORITY 5
+
+#define BOOT_AFTER(phase) (1u << (phase))
+
+typedef struct {
+  const char *name;
+  void (*run)();
+  uint32_t depends;  // BOOT_AFTER() of each prerequisite
+} boot_phase_t;
+
+typedef enum {
+  BOOT_MILESTONE_CONNECTED,    // First PeerConnection reached CONNECTED
+  BOOT_MILESTONE_FIRST_AUDIO,  // First bot audio written to the speaker
+  BOOT_MILESTONE_COUNT,
+} boot_milestone_t;
+
+typedef struct {
+  int64_t boot_us;  // Since power on, 0 until boot has finished
+  int64_t milestone_us[BOOT_MILESTONE_COUNT];  // 0 until reached
+} boot_stats_t;
+
+// Returns once every phase has run
+extern void pipecat_boot_run(const boot_phase_t *phases, int count);
+extern void pipecat_boot_milestone(boot_milestone_t milestone);
+extern void pipecat_boot_stats(boot_stats_t *stats);
+
+// Audio configuration
+//
+// Set pipecat_audio_config before the pipecat_init_audio_*() calls; every
+// buffer is sized from it. The board codecs run at `device_rate`, Opus at
+// `codec_rate`, and a resampler converts between the two when they differ.
+// libpeer stamps each outgoing packet with a fixed AUDIO_LATENCY worth of
+// RTP time, so `frame_ms` is always the 20ms LIBPEER_AUDIO_LATENCY_MS;
+// 10, 40 and 60ms frames would need libpeer to stamp each packet's own
+// duration. The echo canceller is tuned at AEC_SAMPLE_RATE, so that is the
+// only device rate; the codec rate is free.
+#define AUDIO_DEVICE_SAMPLE_RATE 16000
+#define AUDIO_CODEC_SAMPLE_RATE 16000
+#define AUDIO_FRAME_MS 20
+#define AUDIO_MAX_SAMPLE_RATE 48000
+#define AUDIO_BLOCK_MS 10  // Divides every frame duration
+#define LIBPEER_AUDIO_LATENCY_MS 20
+
+typedef struct {
+  uint32_t device_rate;  // AEC_SAMPLE_RATE
+  uint32_t codec_rate;   // 8, 16, 24 or 48kHz
+  uint32_t frame_ms;     // LIBPEER_AUDIO_LATENCY_MS uplink frames
+} audio_config_t;
+
+extern audio_config_t pipecat_audio_config;
+extern bool audio_config_valid(const audio_config_t *config);
+
+static inline size_t audio_frame_samples(uint32_t rate, uint32_t ms) {
+  return rate / 1000 * ms;
+}
+
+// Resampler
+//
+// Polyphase windowed-sinc FIR with Q15 taps for the rational ratios between
+// the supported rates (at most 6:1). The filter spans RESAMPLER_TAPS samples
+// of the lower rate, so a phase has RESAMPLER_TAPS taps when upsampling and
+// proportionally more when decimating. Streams across calls, keeping the
+// last taps - 1 input samples as history.
+#define RESAMPLER_TAPS 16
+#define RESAMPLER_MAX_RATIO 6
+#define RESAMPLER_MAX_TAPS (RESAMPLER_TAPS * RESAMPLER_MAX_RATIO)
+
+typedef struct {
+  uint32_t up;        // L
+  uint32_t down;      // M
+  uint32_t phase_taps;
+  uint32_t position;  // Of the next output, in upsampled samples
+  int16_t taps[RESAMPLER_MAX_TAPS];  // phase_taps per phase, `up` phases
+  int16_t *work;  // History followed by the current input
+  size_t max_input;
+} resampler_t;
+
+extern bool resampler_init(resampler_t *resampler, uint32_t from_rate,
+                           uint32_t to_rate, size_t max_input);
+extern void resampler_free(resampler_t *resampler);
+extern void resampler_reset(resampler_t *resampler);
+// Returns the number of samples written, count * L / M for whole frames
+extern size_t resampler_process(resampler_t *resampler, const int16_t *input,
+                                size_t count, int16_t *output);
+
+#ifdef LINUX_BUILD
+// `--bench`: CPU per second of audio for each codec rate and frame duration
+extern int pipecat_audio_benchmark();
+// Synthetic voice-like signal (gliding harmonics, syllable envelope, a
+// little noise) for the benchmark and the stand-in server's TTS
+extern void audio_bench_signal(int16_t *samples, size_t count, uint32_t rate);
+// The float gain playback used before audio_gain_meter(), as a reference;
+// returns whether the input was active
+extern bool audio_bench_float_gain(int16_t *samples, size_t count, float gain);
+#endif
 
 // WebRTC / Media
+//
+// Without a session these set up the default one, pipecat_session.
 extern void pipecat_init_audio_capture();
 extern void pipecat_init_audio_decoder();
 extern void pipecat_init_audio_encoder();
-extern void pipecat_send_audio(PeerConnection *peer_connection);
-extern void pipecat_audio_decode(uint8_t *data, size_t size);
+extern void pipecat_init_audio_capture(pipecat_session_t *session);
+extern void pipecat_init_audio_decoder(pipecat_session_t *session);
+extern void pipecat_init_audio_encoder(pipecat_session_t *session);
+extern void pipecat_send_audio(pipecat_session_t *session,
+                               PeerConnection *peer_connection);
+// `now_us` is the arrival (or tick) time the jitter buffer sees: the
+// WebRTC loop passes esp_timer_get_time(), replay the recorded clock
+extern void pipecat_audio_receive(pipecat_session_t *session, uint16_t seq,
+                                  uint32_t timestamp, const uint8_t *data,
+                                  size_t size, int64_t now_us);
+extern void pipecat_audio_playout_tick(pipecat_session_t *session,
+                                       int64_t now_us);
+// Drops buffered downlink audio and decoder state between connections
+extern void pipecat_audio_reset_downlink(pipecat_session_t *session);
+
+// Audio device
+//
+// Where PCM comes from and goes to: audio_device_bsp.cpp drives the board
+// codecs, audio_device_wav.cpp (linux) reads the microphone from a WAV file
+// and writes the speaker to a WAV file or nowhere. Every call gets the
+// session's device context; NULL is the board, or on Linux the WAV device
+// configured from the environment.
+typedef struct {
+  esp_err_t (*init)(void *context, uint32_t sample_rate);
+  // Blocks until a full frame has been captured
+  esp_err_t (*read)(void *context, int16_t *samples, size_t count);
+  esp_err_t (*write)(void *context, const int16_t *samples, size_t count);
+} audio_device_t;
+
+extern audio_device_t pipecat_audio_device;
+
+#ifdef LINUX_BUILD
+// A context for pipecat_audio_device with its own files and clocks. A NULL
+// path reads silence or discards the speaker; `loop` rewinds the microphone
+// file instead of running out.
+extern void *audio_device_wav_create(const char *mic_path,
+                                     const char *speaker_path, bool realtime,
+                                     bool loop);
+// Closes the files, the speaker WAV stays valid
+extern void audio_device_wav_destroy(void *context);
+// Every sample of a 16-bit mono WAV file at `sample_rate`, malloc'ed, NULL
+// if the file can't be read or has another format
+extern int16_t *audio_wav_read_file(const char *path, uint32_t sample_rate,
+                                    size_t *count);
+#endif
+
+// Memory plan
+//
+// Every long-lived buffer comes out of one of two arenas allocated at boot.
+// Each is a single block that is never freed. Modules report what they will
+// need through their *_memory_plan() functions, pipecat_init_memory() sizes
+// the arenas from that, and the init functions then carve their buffers in
+// the same region. Buffers touched every frame go in internal RAM, large or
+// rarely touched ones in PSRAM. On Linux both arenas come from malloc().
+//
+// Tasks register their stacks so the diagnostics can report each high-water
+// mark next to the heap minimum-free watermarks. Only the first
+// MEMORY_MAX_BLOCKS blocks and MEMORY_MAX_TASKS tasks are listed (most
+// sessions' are alike); the rest are counted, with a warning the first time.
+//
+// The plans are per session, the arenas hold as many as the process runs.
+#define MEMORY_ALIGNMENT 16
+#define MEMORY_MAX_BLOCKS 24
+#define MEMORY_MAX_TASKS 8
+
+typedef enum {
+  MEMORY_INTERNAL,
+  MEMORY_PSRAM,
+  MEMORY_REGION_COUNT,
+} memory_region_t;
+
+typedef struct {
+  size_t size[MEMORY_REGION_COUNT];
+} memory_plan_t;
+
+typedef struct {
+  const char *name;
+  uint32_t stack_size;      // Bytes
+  uint32_t stack_min_free;  // Bytes never touched so far
+} memory_task_stats_t;
+
+typedef struct {
+  size_t arena_size[MEMORY_REGION_COUNT];
+  size_t arena_used[MEMORY_REGION_COUNT];
+  size_t heap_free[MEMORY_REGION_COUNT];
+  size_t heap_min_free[MEMORY_REGION_COUNT];
+  size_t heap_largest_block[MEMORY_REGION_COUNT];
+  uint32_t task_count;
+  memory_task_stats_t tasks[MEMORY_MAX_TASKS];
+  uint32_t untracked_tasks;   // Registered past MEMORY_MAX_TASKS
+  uint32_t untracked_blocks;  // Carved past MEMORY_MAX_BLOCKS
+} memory_diagnostics_t;
+
+extern void memory_plan_add(memory_plan_t *plan, memory_region_t region,
+                            size_t size);
+// After pipecat_audio_config is final and before any other pipecat_init_*()
+extern bool pipecat_init_memory(uint32_t sessions = 1);
+// Zeroed and MEMORY_ALIGNMENT aligned, NULL if it wasn't planned for
+extern void *pipecat_memory_alloc(memory_region_t region, size_t size,
+                                  const char *name);
+extern void pipecat_memory_track_task(void *task, const char *name,
+                                      uint32_t stack_size);
+extern void pipecat_memory_diagnostics(memory_diagnostics_t *diagnostics);
+extern void pipecat_memory_dump();
+
+extern void pipecat_audio_memory_plan(memory_plan_t *plan);
+extern void pipecat_webrtc_memory_plan(memory_plan_t *plan);
+extern void pipecat_rtvi_memory_plan(memory_plan_t *plan);
+extern void pipecat_signalling_memory_plan(memory_plan_t *plan);
+
+// Jitter buffer
+//
+// Orders incoming Opus packets by RTP sequence number and holds them for an
+// adaptive delay derived from the RFC 3550 inter-arrival jitter estimate.
+// Frames are popped in order; a missing frame is reported as FEC (recover it
+// from the in-band FEC of the following packet) or PLC (nothing to recover
+// from) so the caller can conceal it with the decoder.
+#define JITTER_BUFFER_SLOTS 16  // Must be a power of two
+#define JITTER_BUFFER_MAX_PACKET_SIZE 1276
+#define JITTER_BUFFER_STORAGE_SIZE \
+  (JITTER_BUFFER_SLOTS * JITTER_BUFFER_MAX_PACKET_SIZE)
+#define JITTER_BUFFER_RTP_CLOCK_RATE 48000  // Opus RTP clock (RFC 7587)
+#define JITTER_BUFFER_FRAME_MS 20
+#define JITTER_BUFFER_MIN_DELAY_MS 40
+#define JITTER_BUFFER_MAX_DELAY_MS 120
+#define JITTER_BUFFER_JITTER_MULTIPLIER 3
+
+typedef enum {
+  JITTER_BUFFER_FRAME_PACKET,
+  JITTER_BUFFER_FRAME_FEC,
+  JITTER_BUFFER_FRAME_PLC,
+} jitter_buffer_frame_kind_t;
+
+typedef struct {
+  jitter_buffer_frame_kind_t kind;
+  uint16_t seq;
+  // PACKET: the packet itself. FEC: the packet following the missing one.
+  // PLC: NULL. Valid until the next push.
+  const uint8_t *data;
+  size_t size;
+  int64_t arrival_us;  // When `data` arrived, 0 for PLC
+} jitter_buffer_frame_t;
+
+typedef struct {
+  uint32_t received;
+  uint32_t played;
+  uint32_t fec;
+  uint32_t plc;
+  uint32_t late;
+  uint32_t duplicate;
+  uint32_t resets;
+} jitter_buffer_stats_t;
+
+typedef struct {
+  bool used;
+  uint16_t seq;
+  uint32_t timestamp;
+  uint16_t size;
+  uint8_t *data;
+  int64_t arrival_us;
+} jitter_buffer_slot_t;
+
+typedef struct {
+  jitter_buffer_slot_t slots[JITTER_BUFFER_SLOTS];
+  uint8_t *storage;
+  bool started;
+  uint16_t next_seq;
+  uint16_t newest_seq;
+  int64_t last_arrival_us;
+  uint32_t last_timestamp;
+  int64_t jitter_us_q4;  // Jitter estimate in microseconds, Q4
+  uint32_t target_frames;
+  jitter_buffer_stats_t stats;
+} jitter_buffer_t;
+
+extern bool jitter_buffer_init(jitter_buffer_t *jb, memory_region_t region);
+extern void jitter_buffer_reset(jitter_buffer_t *jb);
+extern void jitter_buffer_push(jitter_buffer_t *jb, uint16_t seq,
+                               uint32_t timestamp, const uint8_t *data,
+                               size_t size, int64_t arrival_us);
+extern bool jitter_buffer_pop(jitter_buffer_t *jb, bool drain,
+                              jitter_buffer_frame_t *frame);
+extern uint32_t jitter_buffer_jitter_ms(const jitter_buffer_t *jb);
+
+// libpeer's RTP decoder hands onaudiotrack whatever follows the fixed RTP
+// header, which is still in the receive buffer right in front of it.
+// rtp_parse() reads that header back and skips the CSRC list, header
+// extension and padding libpeer leaves in, so `payload` is the Opus packet
+// alone.
+#define RTP_HEADER_SIZE 12
+
+typedef struct {
+  uint16_t seq;
+  uint32_t timestamp;
+  const uint8_t *payload;
+  size_t size;
+} rtp_packet_t;
+
+// `packet` starts at the fixed header. False if it isn't RTP version 2 or
+// the CSRC list, extension or padding run past `size`.
+extern bool rtp_parse(const uint8_t *packet, size_t size, rtp_packet_t *rtp);
+
+// PCM ring
+//
+// Lock-free single-producer/single-consumer ring of fixed-size PCM frames.
+// The producer fills a frame in place between acquire_write and
+// commit_write, the consumer drains it between acquire_read and
+// release_read. Neither side ever blocks. Each frame carries the time its
+// audio entered the pipeline and the time it was queued, for tracing.
+typedef struct {
+  int64_t origin_us;
+  int64_t queued_us;
+} pcm_frame_meta_t;
+
+typedef struct {
+  int16_t *frames;
+  pcm_frame_meta_t *meta;
+  size_t frame_samples;
+  uint32_t capacity;  // Must be a power of two
+  std::atomic<uint32_t> head;  // Only written by the producer
+  std::atomic<uint32_t> tail;  // Only written by the consumer
+  std::atomic<uint32_t> overruns;
+  std::atomic<uint32_t> underruns;
+} pcm_ring_t;
+
+// Frames and metadata share one block of pcm_ring_storage_size() bytes
+extern size_t pcm_ring_storage_size(uint32_t capacity, size_t frame_samples);
+extern bool pcm_ring_init(pcm_ring_t *ring, uint32_t capacity,
+                          size_t frame_samples, memory_region_t region);
+extern int16_t *pcm_ring_acquire_write(pcm_ring_t *ring);
+// origin_us of 0 means the audio originates at commit time
+extern void pcm_ring_commit_write(pcm_ring_t *ring, int64_t origin_us);
+extern const int16_t *pcm_ring_acquire_read(pcm_ring_t *ring,
+                                            pcm_frame_meta_t *meta);
+extern void pcm_ring_release_read(pcm_ring_t *ring);
+extern uint32_t pcm_ring_count(pcm_ring_t *ring);
+
+// Audio kernels
+//
+// audio_gain_meter() applies a saturating Q8 gain in place and, in the same
+// pass, reports whether the input had any activity (a sample outside
+// {-1, 0, 1}) plus the peak and energy of the output. Compared with a
+// float multiply-and-clamp, results are bit-exact for integer gains and
+// within 1 LSB for other multiples of 1/256 (shift rounds towards -inf).
+#define AUDIO_GAIN_Q8(gain) ((int32_t)((gain) * 256))
+
+typedef struct {
+  bool active;
+  int32_t peak;
+  uint64_t sum_squares;
+  size_t samples;
+} audio_level_t;
+
+extern void audio_gain_meter(int16_t *samples, size_t count, int32_t gain_q8,
+                             audio_level_t *level);
+extern uint32_t audio_level_rms(const audio_level_t *level);
+
+typedef struct {
+  uint32_t underruns;
+  uint32_t overruns;
+  uint32_t buffered_frames;
+  int32_t output_peak;
+  uint32_t output_rms;
+  uint32_t decode_errors;  // Invalid packets and failed decodes
+  uint32_t decoded_samples;  // At the codec rate, concealment included
+  // Jitter buffer frames played from their own packet, and concealed with
+  // FEC or PLC for a packet that never came
+  uint32_t played;
+  uint32_t lost;
+} audio_playback_stats_t;
+
+extern void pipecat_audio_playback_stats(pipecat_session_t *session,
+                                         audio_playback_stats_t *stats);
+
+// Voice activity detection
+//
+// Energy detector against an adaptive noise floor, with a hangover so word
+// endings and the pause the server's end-of-turn detection waits for are
+// still encoded. Outside speech only one keepalive frame every
+// VAD_KEEPALIVE_MS is encoded, the periods in between carry 3-byte filler
+// packets (see Capture scheduler). That saves encoder CPU and uplink bytes,
+// but not packets: the packet rate is one per capture period either way.
+#define VAD_HANGOVER_MS 1000
+#define VAD_KEEPALIVE_MS 400
+#define VAD_THRESHOLD_DB 9.0f
+#define VAD_MIN_SPEECH_DB -55.0f  // dBFS, below this is never speech
+
+typedef struct {
+  float noise_floor_db;
+  int hangover_frames;
+  int silent_frames;
+  int hangover_limit;      // VAD_HANGOVER_MS in frames
+  int keepalive_interval;  // VAD_KEEPALIVE_MS in frames
+  bool speech;
+} vad_t;
+
+extern void vad_init(vad_t *vad, uint32_t frame_ms);
+// Returns true if the frame should be encoded, false for a filler packet
+extern bool vad_process(vad_t *vad, const int16_t *samples, size_t count);
+
+typedef struct {
+  uint32_t frames;
+  uint32_t encoded;
+  uint32_t sent;
+  uint32_t dtx;      // Encoded, Opus DTX sent a tiny keepalive instead
+  uint32_t fillers;  // Silence packets for unencoded or missed periods
+} audio_capture_stats_t;
+
+extern void pipecat_audio_capture_stats(pipecat_session_t *session,
+                                        audio_capture_stats_t *stats);
+
+// Capture scheduler
+//
+// The microphone read blocks on the I2S DMA (or the monotonic clock of the
+// Linux WAV device), so that clock paces the uplink: one read, one packet.
+// libpeer advances the RTP timestamp by one frame per packet, so every
+// capture period has to produce a packet or the RTP clock falls behind real
+// time. Silence and DTX periods are no exception, so neither the VAD nor DTX
+// lowers the packet rate; that would take libpeer stamping each packet with
+// the time elapsed since the last one. capture_clock_t places each read on
+// the nominal timeline and reports the periods that were lost, for the
+// caller to fill.
+//
+// A read that returns late but didn't block was served from DMA backlog and
+// lost nothing. Only a read that had to wait and still lands a whole period
+// or more past its slot means the DMA overran. Anything beyond
+// CAPTURE_MAX_FILLER_FRAMES (or a read a whole period early) resyncs the
+// timeline instead.
+#define CAPTURE_LATE_THRESHOLD_MS 5
+#define CAPTURE_MAX_FILLER_FRAMES 5
+
+typedef struct {
+  uint32_t period_us;
+  int64_t start_us;   // Slot of frame 0, moved on resync
+  uint64_t frames;    // Periods on the timeline, read or filled
+  int32_t drift_us;   // Last read against its slot, positive is late
+  int32_t max_drift_us;
+  uint32_t late;      // Reads more than CAPTURE_LATE_THRESHOLD_MS late
+  uint32_t missed;    // Periods lost to DMA overruns
+  uint32_t resyncs;
+} capture_clock_t;
+
+extern void capture_clock_init(capture_clock_t *clock, uint32_t period_us);
+// Call right after each read; returns how many periods before it were lost
+extern uint32_t capture_clock_tick(capture_clock_t *clock,
+                                   int64_t read_start_us, int64_t read_end_us);
+extern const capture_clock_t *pipecat_audio_capture_clock(
+    pipecat_session_t *session);
+
+// Opus encoder controller
+//
+// Adjusts bitrate, complexity, in-band FEC and the expected packet loss hint
+// once per interval from observed loss and measured encode time. Loss drives
+// bitrate and FEC, encode time against OPUS_CONTROLLER_ENCODE_BUDGET_US
+// drives complexity. Every decision is kept in the controller for metrics.
+// libpeer doesn't surface RTCP receiver reports, so the client feeds it the
+// downlink loss its jitter buffer sees in place of uplink loss, and no RTT.
+#define OPUS_CONTROLLER_INTERVAL_MS 1000
+#define OPUS_CONTROLLER_MIN_BITRATE 12000
+#define OPUS_CONTROLLER_MAX_BITRATE 48000
+#define OPUS_CONTROLLER_FEC_MIN_BITRATE 20000
+#define OPUS_CONTROLLER_MAX_COMPLEXITY 5
+#define OPUS_CONTROLLER_ENCODE_BUDGET_US 4000
+
+typedef struct {
+  int32_t bitrate;
+  int32_t complexity;
+  bool inband_fec;
+  int32_t packet_loss_perc;
+} opus_encoder_settings_t;
+
+typedef struct {
+  float loss_percent;
+  uint32_t rtt_ms;  // 0 if unknown
+  uint32_t encode_us;  // Average encode time per frame
+} opus_controller_input_t;
+
+typedef struct {
+  opus_encoder_settings_t settings;
+  opus_controller_input_t last_input;
+  float loss_ewma;
+  int good_intervals;
+  uint32_t decisions;
+  uint32_t changes;
+} opus_controller_t;
+
+extern void opus_controller_init(opus_controller_t *ctl,
+                                 const opus_encoder_settings_t *initial);
+// Returns true if ctl->settings changed and should be applied
+extern bool opus_controller_update(opus_controller_t *ctl,
+                                   const opus_controller_input_t *input);
+
+extern const opus_controller_t *pipecat_audio_encoder_controller(
+    pipecat_session_t *session);
+
+// Acoustic echo canceller
+//
+// Normalized LMS filter that models the speaker-to-microphone path from the
+// PCM actually written to the speaker, and subtracts the estimated echo
+// from the microphone signal. Adaptation freezes during double-talk and a
+// light residual suppressor attenuates what the linear filter leaves behind
+// while only the far end is active.
+#define AEC_SAMPLE_RATE 16000      // Tuned at this rate only
+#define AEC_FILTER_MS 16           // Echo tail
+#define AEC_REFERENCE_DELAY_MS 10  // Bulk I2S in/out latency
+#define AEC_FILTER_LENGTH (AEC_FILTER_MS * AEC_SAMPLE_RATE / 1000)
+#define AEC_REFERENCE_DELAY_SAMPLES \
+  (AEC_REFERENCE_DELAY_MS * AEC_SAMPLE_RATE / 1000)
+#define AEC_HISTORY_LENGTH (AEC_FILTER_LENGTH + AEC_REFERENCE_DELAY_SAMPLES)
+
+typedef struct {
+  float erle_db;  // Smoothed echo return loss enhancement
+  bool double_talk;
+  uint32_t frames;
+  uint32_t last_frame_us;
+  uint32_t max_frame_us;
+} aec_stats_t;
+
+typedef struct {
+  float weights[AEC_FILTER_LENGTH];
+  // Reference history, stored twice so any window is contiguous
+  float history[2 * AEC_HISTORY_LENGTH];
+  int position;
+  float window_energy;
+  float far_peak;
+  float echo_power;
+  float error_power;
+  int double_talk_hangover;
+  float suppression;
+  aec_stats_t stats;
+} aec_t;
+
+extern void aec_init(aec_t *aec);
+extern void aec_process(aec_t *aec, int16_t *mic, const int16_t *reference,
+                        size_t samples);
+
+// Reference blocks are stamped with when they were handed to the speaker,
+// microphone blocks with when they were captured; the filter's delay and
+// tail cover the I2S latency between the two. Pairs the microphone block
+// starting at `mic_us` with the reference block of that time: older blocks
+// are dropped, and NULL (silence) is returned while the oldest is still
+// ahead. A block returned is released with pcm_ring_release_read().
+#define AEC_REFERENCE_ALIGN_US (AUDIO_BLOCK_MS * 1000 / 2)
+
+extern const int16_t *aec_reference_acquire(pcm_ring_t *ring, int64_t mic_us);
+
+// Latency tracing
+//
+// Fixed-bucket histograms of how long each audio stage takes, recorded from
+// esp_timer_get_time() stamps taken along the frame's path. Recording is a
+// handful of relaxed atomic adds and never allocates, so it stays on in
+// production builds. Dumped on the console and, when the server sends a
+// `server-message` of type TRACE_RTVI_MESSAGE_TYPE, over the rtvi-ai channel.
+#define TRACE_BUCKETS 12
+#define TRACE_JSON_BUFFER_SIZE 3072
+#define TRACE_RTVI_MESSAGE_TYPE "pipecat-esp32-trace"
+// Also dump to the console periodically, 0 to only dump on demand
+#define TRACE_DUMP_INTERVAL_MS 0
+
+typedef enum {
+  TRACE_MIC_READ,         // Microphone read call
+  TRACE_ENCODE,           // opus_encode()
+  TRACE_SEND,             // peer_connection_send_audio()
+  TRACE_UPLINK,           // End of capture to packet handed to libpeer
+  TRACE_RX_WAIT,          // Previous poll to packet handled (upper bound)
+  TRACE_RTP_INTERARRIVAL, // Between consecutive RTP packets
+  TRACE_JITTER_BUFFER,    // Packet arrival to decode
+  TRACE_DECODE,           // opus_decode() plus gain and metering
+  TRACE_PLAYBACK_QUEUE,   // Decoded to picked up by the playback task
+  TRACE_SPEAKER_WRITE,    // Speaker write call
+  TRACE_DOWNLINK,         // Packet arrival to speaker write done
+  TRACE_STAGE_COUNT,
+} trace_stage_t;
+
+extern void pipecat_trace_record(trace_stage_t stage, int64_t start_us,
+                                 int64_t end_us);
+extern void pipecat_trace_reset();
+// Writes the histograms as compact JSON, returns the length (0 if `len` is
+// too small)
+extern size_t pipecat_trace_to_json(char *buffer, size_t len);
+extern void pipecat_trace_dump();
+
+// Tokenized log
+//
+// Hot-path log lines (one per packet or per frame) are written as a format
+// ID plus up to TLOG_MAX_ARGS integer arguments into a per-core ring of
+// TLOG_RING_SIZE slots. Writers reserve a slot with a CAS and publish it
+// with a per-slot sequence number, so tasks preempting each other on the
+// same core never lock or block. A full ring counts the record as dropped.
+// A low priority task drains the rings every TLOG_DRAIN_INTERVAL_MS and
+// formats records up to TLOG_TEXT_LEVEL through ESP_LOG. With
+// TLOG_OUTPUT_BINARY it prints every record as a `TLOG:<hex>` line
+// instead, for tools/tlog_decode.py to format on the host.
+#define TLOG_RING_SIZE 64  // Power of two
+#define TLOG_MAX_ARGS 3
+#define TLOG_DRAIN_INTERVAL_MS 50
+#define TLOG_TASK_STACK_SIZE 4096
+#define TLOG_TASK_PRIORITY 1
+#define TLOG_TEXT_LEVEL ESP_LOG_INFO
+#ifndef TLOG_OUTPUT_BINARY
+#define TLOG_OUTPUT_BINARY 0
+#endif
+#ifndef LINUX_BUILD
+#define TLOG_CORES portNUM_PROCESSORS
+#else
+#define TLOG_CORES 1
+#endif
+
+// X(id, level, format), arguments are printed as long. Only append, the IDs
+// are what ends up in binary captures. tools/tlog_decode.py reads this list.
+#define TLOG_FORMATS(X)                                                      \
+  X(TLOG_DROPPED, ESP_LOG_WARN, "Dropped %ld log records on core %ld")       \
+  X(TLOG_DECODE, ESP_LOG_DEBUG, "Decode %ld bytes (kind %ld)")               \
+  X(TLOG_DECODED, ESP_LOG_DEBUG, "Decoded %ld samples")                      \
+  X(TLOG_DECODE_FAILED, ESP_LOG_WARN, "Decode failed: %ld")                  \
+  X(TLOG_INVALID_PACKET, ESP_LOG_WARN,                                       \
+    "Invalid Opus packet (%ld bytes, %ld samples)")                          \
+  X(TLOG_SPEAKER_WRITE_FAILED, ESP_LOG_WARN, "Speaker write failed: 0x%lx")  \
+  X(TLOG_MIC_READ_FAILED, ESP_LOG_WARN, "Microphone read failed: 0x%lx")     \
+  X(TLOG_ENCODE_FAILED, ESP_LOG_WARN, "Opus encode failed: %ld")             \
+  X(TLOG_JITTER_BUFFER_RESET, ESP_LOG_WARN,                                  \
+    "Jitter buffer reset (seq %lu, expected %lu)")                           \
+  X(TLOG_INVALID_RTP, ESP_LOG_WARN, "Invalid RTP packet (%ld bytes)")
+
+typedef enum {
+#define TLOG_ENUM_ENTRY(id, level, format) id,
+  TLOG_FORMATS(TLOG_ENUM_ENTRY)
+#undef TLOG_ENUM_ENTRY
+  TLOG_ID_COUNT,
+} tlog_id_t;
+
+// Little endian on the wire, 20 bytes
+typedef struct __attribute__((packed)) {
+  uint32_t timestamp_us;  // Low 32 bits of esp_timer_get_time()
+  uint16_t id;
+  uint8_t core;
+  uint8_t reserved;
+  int32_t args[TLOG_MAX_ARGS];
+} tlog_record_t;
+
+typedef struct {
+  uint32_t drained;
+  uint32_t dropped;
+} tlog_stats_t;
+
+// Starts the drain task, records written before then wait in the rings
+extern void pipecat_init_tlog();
+extern void pipecat_tlog(tlog_id_t id, int32_t arg0 = 0, int32_t arg1 = 0,
+                         int32_t arg2 = 0);
+extern tlog_stats_t pipecat_tlog_stats();
+
+// Session record
+//
+// Captures what a client received and sent, to reproduce field problems
+// with `--replay`. The recording hooks append records to a byte ring of
+// RECORD_RING_SIZE under a mutex held only for the copy. A low priority
+// task writes the ring to the file every RECORD_FLUSH_INTERVAL_MS. When
+// the ring is full, records are dropped and a RECORD_DROPPED record says
+// how many, across all sessions. Until pipecat_record_start() succeeds,
+// every hook returns straight away. On Linux `PIPECAT_RECORD=<file>` turns
+// it on. The device records to RECORD_PATH when that is defined, which
+// must be on a mounted filesystem (SD card, SPIFFS).
+//
+// The file is a record_file_header_t followed by records, each a
+// record_header_t and `length` payload bytes, all little endian.
+#define RECORD_RING_SIZE (64 * 1024)  // Power of two
+#define RECORD_FLUSH_INTERVAL_MS 100
+#define RECORD_TASK_STACK_SIZE 4096
+#define RECORD_TASK_PRIORITY 1
+#define RECORD_VERSION 2
+#define RECORD_SESSION_NONE UINT32_MAX  // Not one session's, RECORD_DROPPED
+
+typedef enum {
+  RECORD_AUDIO_RX,  // uint16 RTP seq, uint32 RTP timestamp, Opus packet
+  RECORD_DATA_RX,   // Data channel message
+  RECORD_AUDIO_TX,  // Everything sent as audio: Opus, DTX and fillers
+  RECORD_DATA_TX,   // Data channel message
+  RECORD_RESET,     // Connection closed, downlink state dropped
+  RECORD_DROPPED,   // uint32 records lost to a full ring
+} record_kind_t;
+
+typedef struct __attribute__((packed)) {
+  char magic[4];  // "PCRC"
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t codec_rate;
+  uint32_t frame_ms;
+} record_file_header_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t delta_us;  // Since the previous record
+  uint32_t session;   // pipecat_session_config_t.index
+  uint16_t length;
+  uint8_t kind;
+  uint8_t reserved;
+} record_header_t;
+
+extern bool pipecat_record_start(const char *path);
+extern void pipecat_record(pipecat_session_t *session, record_kind_t kind,
+                           const void *data, size_t len);
+extern void pipecat_record_audio_rx(pipecat_session_t *session, uint16_t seq,
+                                    uint32_t timestamp, const uint8_t *data,
+                                    size_t len);
+
+#ifdef LINUX_BUILD
+// `--replay FILE [--fast]` feeds a recording's downlink back through the
+// jitter buffer, decode, playback (to $PIPECAT_SPEAKER_WAV) and RTVI
+// dispatch of the default session, on the recorded clock. Real time by
+// default; `fast` runs as fast as playback drains, on the same clock, so
+// both play the same frames. Only session 0 of a recording is replayed.
+#define REPLAY_FAST_MAX_BUFFERED_FRAMES 4
+
+extern int pipecat_replay(const char *path, bool fast);
+#endif
+
+// JSON writer
+//
+// Writes compact JSON straight into a caller-provided buffer without
+// allocating. Separators are handled by the writer. Once the buffer is
+// full every call is a no-op, and json_writer_finish() reports the
+// overflow.
+#define JSON_WRITER_MAX_DEPTH 16
+
+typedef struct {
+  char *buffer;
+  size_t size;
+  size_t len;
+  int depth;
+  uint32_t needs_comma;  // One bit per nesting level
+  bool after_key;
+  bool overflow;
+} json_writer_t;
+
+extern void json_writer_init(json_writer_t *w, char *buffer, size_t size);
+extern void json_writer_object_begin(json_writer_t *w);
+extern void json_writer_object_end(json_writer_t *w);
+extern void json_writer_array_begin(json_writer_t *w);
+extern void json_writer_array_end(json_writer_t *w);
+extern void json_writer_key(json_writer_t *w, const char *key);
+extern void json_writer_string(json_writer_t *w, const char *value);
+extern void json_writer_int(json_writer_t *w, int64_t value);
+extern void json_writer_uint(json_writer_t *w, uint64_t value);
+extern void json_writer_float(json_writer_t *w, double value);
+extern void json_writer_bool(json_writer_t *w, bool value);
+extern void json_writer_null(json_writer_t *w);
+// Appends an already serialized value
+extern void json_writer_raw(json_writer_t *w, const char *json);
+// Returns the length written (NUL terminated), 0 on overflow or if an
+// object or array was left open
+extern size_t json_writer_finish(json_writer_t *w);
 
 // WebRTC / Signalling
+//
+// pipecat_http_request() POSTs the offer and returns the answer SDP in a
+// buffer that grows (in PSRAM on device) as the response streams in, plain
+// or chunked. Transport errors, 5xx and 429 are retried with exponential
+// backoff, anything else is returned to the caller. The caller's cancel
+// callback is checked before each attempt and every HTTP_CANCEL_POLL_MS of
+// backoff; an attempt already under way runs to at most HTTP_TIMEOUT_MS.
+#define HTTP_INITIAL_RESPONSE_SIZE 4096
+#define HTTP_MAX_RESPONSE_SIZE (64 * 1024)
+#define HTTP_MAX_ATTEMPTS 4
+#define HTTP_INITIAL_BACKOFF_MS 500
+#define HTTP_MAX_BACKOFF_MS 4000
+#define HTTP_CANCEL_POLL_MS 50
+
+// True once the request is no longer wanted
+typedef bool (*http_cancel_t)(void *ctx);
+
+typedef struct {
+  char *data;  // NUL terminated
+  size_t len;
+  size_t capacity;
+  bool overflow;  // Response exceeded HTTP_MAX_RESPONSE_SIZE
+} http_buffer_t;
+
+extern void http_buffer_free(http_buffer_t *buffer);
+
+// A dropped connection tears down and recreates only the PeerConnection;
+// codecs, audio devices, tasks and buffers stay up. Attempts back off
+// exponentially, and a session that doesn't reach CONNECTED in time is
+// abandoned.
+#define RECONNECT_INITIAL_BACKOFF_MS 250
+#define RECONNECT_MAX_BACKOFF_MS 8000
+#define RECONNECT_CONNECT_TIMEOUT_MS 15000
+
+typedef enum {
+  PIPECAT_SESSION_IDLE,        // No PeerConnection, waiting to retry
+  PIPECAT_SESSION_CONNECTING,  // Gathering, signalling, ICE and DTLS
+  PIPECAT_SESSION_CONNECTED,
+} pipecat_session_state_t;
+
+// libpeer doesn't expose its sockets, but peer_connection_loop() waits on
+// them for about a millisecond. pipecat_webrtc_wait() keeps polling through
+// the window where the next 20ms RTP frame is due and while packets keep
+// coming. Otherwise it sleeps until the next deadline, at most
+// TICK_INTERVAL. Outbound work (RTVI sends, signalling results) wakes it
+// early with pipecat_webrtc_wake().
+#define LOOP_RX_EARLY_MS 2     // Start polling this long before a frame is due
+#define LOOP_RX_WINDOW_MS 4    // and keep at it this long after
+#define LOOP_RX_ACTIVE_MS 500  // Cadence assumed this long after a packet
+#define LOOP_CONNECTING_POLL_MS 1
+
+typedef struct {
+  uint32_t iterations;
+  uint32_t sleeps;
+  uint32_t notified;  // Sleeps cut short by pipecat_webrtc_wake()
+  uint32_t packets;   // RTP and data channel messages handled
+  // Summed over those packets: the previous poll to handling the packet,
+  // the most it can have waited in the socket (TRACE_RX_WAIT)
+  uint64_t rx_wait_us;
+} webrtc_loop_stats_t;
+
 extern void pipecat_init_webrtc();
 extern void pipecat_webrtc_loop();
-extern void pipecat_http_request(char *offer, char *answer);
+extern void pipecat_webrtc_wait();
+extern void pipecat_webrtc_wake();
+// Each session's loop and wait run on one task of their own
+extern void pipecat_init_webrtc(pipecat_session_t *session);
+extern void pipecat_webrtc_loop(pipecat_session_t *session);
+extern void pipecat_webrtc_wait(pipecat_session_t *session);
+extern void pipecat_webrtc_wake(pipecat_session_t *session);
+extern pipecat_session_state_t pipecat_webrtc_state(pipecat_session_t *session);
+extern void pipecat_webrtc_loop_stats(pipecat_session_t *session,
+                                      webrtc_loop_stats_t *stats);
+// On ESP_OK `answer` holds the SDP, release it with http_buffer_free().
+// ESP_ERR_INVALID_STATE once `cancelled` (may be NULL) returns true.
+extern esp_err_t pipecat_http_request(const char *url, const char *offer,
+                                      http_buffer_t *answer,
+                                      http_cancel_t cancelled,
+                                      void *cancel_ctx);
+
+// The offer/answer exchange runs on its own task so the WebRTC loop keeps
+// servicing ICE and DTLS meanwhile. pipecat_signalling_start() copies the
+// offer and returns at once; the loop picks the answer up with
+// pipecat_signalling_poll() and applies it on its own thread.
+// pipecat_signalling_cancel() drops the exchange for a connection that is
+// being torn down: a queued request is skipped and a running one stops
+// before its next attempt, so the next connection isn't kept waiting. On
+// Linux, PIPECAT_SIGNALLING_INLINE set runs the exchange inside the
+// onicecandidate callback instead, blocking the loop the way it used to,
+// to measure against.
+#define SIGNALLING_TASK_STACK_SIZE 8192
+#define SIGNALLING_TASK_PRIORITY 5
 
-// RTVI
 typedef struct {
-  void (*on_bot_started_speaking)();
-  void (*on_bot_stopped_speaking)();
-  void (*on_bot_tts_text)(const char *text);
-} rtvi_callbacks_t;
+  uint32_t connection;  // As passed to pipecat_signalling_start()
+  esp_err_t err;
+  http_buffer_t answer;  // Release with http_buffer_free()
+  int64_t elapsed_us;
+} signalling_result_t;
+
+extern void pipecat_init_signalling(pipecat_session_t *session);
+extern bool pipecat_signalling_start(pipecat_session_t *session,
+                                     const char *offer, uint32_t connection);
+extern bool pipecat_signalling_poll(pipecat_session_t *session,
+                                    signalling_result_t *result);
+extern void pipecat_signalling_cancel(pipecat_session_t *session);
+
+// RTVI parser
+//
+// Single-pass parser that pulls `type`, `id` and the `data` fields we use
+// out of an incoming RTVI message into a fixed-size struct, without building
+// a DOM or allocating. Strings that don't fit are truncated on a UTF-8
+// boundary; malformed or truncated JSON is rejected. Messages are parsed
+// straight into one of RTVI_MESSAGE_SLOTS preallocated slots.
+#define RTVI_MESSAGE_SLOTS 8
+#define RTVI_MAX_TYPE_LEN 32
+#define RTVI_MAX_ID_LEN 64
+#define RTVI_MAX_TEXT_LEN 512
+#define RTVI_MAX_DATA_LEN 512
+#define RTVI_MAX_DEPTH 16
+
+// Every RTVI server event we know about. Adding one here is all it takes
+// for subscribers to receive it.
+#define RTVI_EVENTS(X)                                  \
+  X(BOT_READY, "bot-ready")                             \
+  X(ERROR, "error")                                     \
+  X(ERROR_RESPONSE, "error-response")                   \
+  X(SERVER_MESSAGE, "server-message")                   \
+  X(SERVER_RESPONSE, "server-response")                 \
+  X(USER_STARTED_SPEAKING, "user-started-speaking")     \
+  X(USER_STOPPED_SPEAKING, "user-stopped-speaking")     \
+  X(BOT_STARTED_SPEAKING, "bot-started-speaking")       \
+  X(BOT_STOPPED_SPEAKING, "bot-stopped-speaking")       \
+  X(BOT_INTERRUPTED, "bot-interrupted")                 \
+  X(USER_TRANSCRIPTION, "user-transcription")           \
+  X(BOT_TRANSCRIPTION, "bot-transcription")             \
+  X(USER_LLM_TEXT, "user-llm-text")                     \
+  X(BOT_LLM_STARTED, "bot-llm-started")                 \
+  X(BOT_LLM_STOPPED, "bot-llm-stopped")                 \
+  X(BOT_LLM_TEXT, "bot-llm-text")                       \
+  X(BOT_LLM_SEARCH_RESPONSE, "bot-llm-search-response") \
+  X(LLM_FUNCTION_CALL, "llm-function-call")             \
+  X(BOT_TTS_STARTED, "bot-tts-started")                 \
+  X(BOT_TTS_STOPPED, "bot-tts-stopped")                 \
+  X(BOT_TTS_TEXT, "bot-tts-text")                       \
+  X(METRICS, "metrics")
+
+#define RTVI_EVENT_ENUM(name, type) RTVI_EVENT_##name,
+typedef enum {
+  RTVI_EVENTS(RTVI_EVENT_ENUM)
+  RTVI_EVENT_COUNT,
+  RTVI_EVENT_UNKNOWN = RTVI_EVENT_COUNT,
+} rtvi_event_t;
+#undef RTVI_EVENT_ENUM
+
+typedef struct {
+  rtvi_event_t event;
+  char type[RTVI_MAX_TYPE_LEN];
+  char id[RTVI_MAX_ID_LEN];
+  // From `data`
+  char text[RTVI_MAX_TEXT_LEN];
+  bool has_text;
+  char data_type[RTVI_MAX_TYPE_LEN];  // data.type, as used by server-message
+  bool final;
+  bool reset;  // data.reset, as in the trace request
+  // Raw JSON of `data`, empty if it didn't fit
+  char data[RTVI_MAX_DATA_LEN];
+  size_t data_len;
+  bool truncated;  // Some field didn't fit
+} rtvi_message_t;
+
+typedef struct {
+  uint32_t parsed;
+  uint32_t invalid;
+  uint32_t truncated;
+  uint32_t dropped;  // No free slot
+} rtvi_parser_stats_t;
+
+extern bool rtvi_parse_message(const char *json, size_t len,
+                               rtvi_message_t *msg);
+extern void pipecat_rtvi_parser_stats(pipecat_session_t *session,
+                                      rtvi_parser_stats_t *stats);
+
+// RTVI dispatcher
+//
+// Message types resolve to an rtvi_event_t through a table built at compile
+// time from the 64-bit FNV-1a hash of each name (a static_assert rejects
+// collisions), so dispatch is a hash, a probe and a single strcmp() that
+// confirms the match against a type that only shares the hash. Each event
+// has room for RTVI_MAX_SUBSCRIBERS handlers, all run on the RTVI task in
+// subscription order. Subscriptions are process-wide, the handler is told
+// which session the message came from.
+#define RTVI_MAX_SUBSCRIBERS 4
+
+typedef void (*rtvi_handler_t)(pipecat_session_t *session,
+                               const rtvi_message_t *msg, void *user_data);
+
+extern rtvi_event_t rtvi_event_lookup(const char *type);
+extern const char *rtvi_event_name(rtvi_event_t event);
+// Subscribe before pipecat_init_rtvi(). Subscribing the same handler and
+// user_data twice is a no-op.
+extern bool pipecat_rtvi_subscribe(rtvi_event_t event, rtvi_handler_t handler,
+                                   void *user_data);
+extern void rtvi_dispatch(pipecat_session_t *session,
+                          const rtvi_message_t *msg);
 
-extern rtvi_callbacks_t pipecat_rtvi_callbacks;
+// RTVI
+extern void pipecat_init_rtvi_callbacks();
+extern void pipecat_init_rtvi(pipecat_session_t *session);
+// Messages only go out between attach and detach. Both drop anything still
+// queued: detach for the old connection, attach whatever a sender queued
+// for the old connection while it was being detached. Detach once the
+// publisher has finished its frame, so it can't queue after the drain.
+extern void pipecat_rtvi_attach(pipecat_session_t *session,
+                                PeerConnection *peer_connection);
+extern void pipecat_rtvi_detach(pipecat_session_t *session);
+extern void pipecat_rtvi_handle_message(pipecat_session_t *session,
+                                        const char *msg, size_t len);
+
+// RTVI outbound
+//
+// The sender serializes each message with json_writer straight into one of
+// RTVI_SEND_SLOTS preallocated buffers and queues it. pipecat_rtvi_flush(),
+// run from the WebRTC loop, hands queued messages to the data channel.
+// Sending never blocks. With every slot in use the message is dropped and
+// counted. A message sent with a coalesce key replaces an unsent one with
+// the same key. The slots are the only backpressure: libpeer queues into
+// SCTP without reporting how much is buffered, so a sender that outruns the
+// link fills the slots and then drops. A data channel that refuses a
+// message (not open yet, or a failed send) has it retried on the next
+// flush, and nothing queued behind it goes out before it.
+#define RTVI_SEND_SLOTS 6
+#define RTVI_SEND_BUFFER_SIZE (TRACE_JSON_BUFFER_SIZE + 512)
+#define RTVI_METRICS_INTERVAL_MS 5000
+#define RTVI_METRICS_MESSAGE_TYPE "pipecat-esp32-metrics"
+#define RTVI_USER_STARTED_SPEAKING_MESSAGE_TYPE "user-started-speaking"
+#define RTVI_USER_STOPPED_SPEAKING_MESSAGE_TYPE "user-stopped-speaking"
+
+typedef enum {
+  RTVI_COALESCE_NONE = -1,
+  RTVI_COALESCE_METRICS,
+  RTVI_COALESCE_COUNT,
+} rtvi_coalesce_t;
+
+// Writes the value of `data`
+typedef void (*rtvi_data_writer_t)(json_writer_t *w, const void *ctx);
+
+typedef struct {
+  uint32_t queued;
+  uint32_t sent;
+  uint32_t coalesced;  // Replaced before they were sent
+  uint32_t dropped;    // No free slot
+  uint32_t overflow;   // Didn't fit in RTVI_SEND_BUFFER_SIZE
+  uint32_t retries;    // Refused by the data channel
+  uint32_t bytes;
+  uint32_t queued_bytes;  // Serialized, whether sent yet or not
+} rtvi_send_stats_t;
 
-extern void pipecat_init_rtvi(PeerConnection *peer_connection, rtvi_callbacks_t *callbacks);
+// write_data may be NULL for messages without `data`. Without a session
+// these send on the default one.
+extern bool pipecat_rtvi_send(const char *type, rtvi_data_writer_t write_data,
+                              const void *ctx, rtvi_coalesce_t coalesce);
+extern bool pipecat_rtvi_send(pipecat_session_t *session, const char *type,
+                              rtvi_data_writer_t write_data, const void *ctx,
+                              rtvi_coalesce_t coalesce);
+// A `client-message` with data {"t": t, "d": ...}
+extern bool pipecat_rtvi_send_client_message(const char *t,
+                                             rtvi_data_writer_t write_data,
+                                             const void *ctx,
+                                             rtvi_coalesce_t coalesce);
+extern bool pipecat_rtvi_send_client_message(pipecat_session_t *session,
+                                             const char *t,
+                                             rtvi_data_writer_t write_data,
+                                             const void *ctx,
+                                             rtvi_coalesce_t coalesce);
 extern void pipecat_rtvi_send_client_ready();
-extern void pipecat_rtvi_handle_message(const char* msg);
+extern void pipecat_rtvi_send_client_ready(pipecat_session_t *session);
+extern void pipecat_rtvi_send_user_speaking(pipecat_session_t *session,
+                                            bool speaking);
+extern void pipecat_rtvi_send_client_metrics(pipecat_session_t *session);
+extern void pipecat_rtvi_flush(pipecat_session_t *session);
+extern void pipecat_rtvi_send_stats(pipecat_session_t *session,
+                                    rtvi_send_stats_t *stats);
+
+// Session
+//
+// Everything one conversation owns: its PeerConnection and reconnect state,
+// the codecs and audio buffers, the RTVI queues and the signalling task.
+// Each module keeps its part in a private struct carved from the arenas by
+// pipecat_session_create(). The device runs the default pipecat_session,
+// which the session-less entry points above wrap. Trace histograms, the
+// tokenized log, boot milestones, RTVI subscriptions and the audio
+// configuration are shared by every session in the process.
+typedef struct audio_state audio_state_t;
+typedef struct webrtc_state webrtc_state_t;
+typedef struct rtvi_state rtvi_state_t;
+typedef struct signalling_state signalling_state_t;
+
+typedef struct {
+  uint32_t index;   // In logs, 0 for the default session
+  const char *url;  // Signalling endpoint
+  const audio_device_t *device;
+  void *device_context;
+} pipecat_session_config_t;
+
+struct pipecat_session {
+  pipecat_session_config_t config;
+  audio_state_t *audio;
+  webrtc_state_t *webrtc;
+  rtvi_state_t *rtvi;
+  signalling_state_t *signalling;
+};
+
+extern pipecat_session_t pipecat_session;
+
+// After pipecat_init_memory(), before any pipecat_init_*() for the session
+extern bool pipecat_session_create(pipecat_session_t *session,
+                                   const pipecat_session_config_t *config);
+extern bool pipecat_audio_session_create(pipecat_session_t *session);
+extern bool pipecat_webrtc_session_create(pipecat_session_t *session);
+extern bool pipecat_rtvi_session_create(pipecat_session_t *session);
+extern bool pipecat_signalling_session_create(pipecat_session_t *session);
+
+#ifdef LINUX_BUILD
+// Load generator
+//
+// `--sessions N` runs N simulated devices against the bot from one
+// process, started LOADGEN_RAMP_MS apart so signalling isn't hit all at
+// once. Each has its own loop task and a WAV device that loops
+// $PIPECAT_MIC_WAV (or sends silence) and discards the speaker. A summary
+// of connection states and audio counters across all sessions is logged
+// every LOADGEN_REPORT_INTERVAL_MS.
+#define LOADGEN_RAMP_MS 200
+#define LOADGEN_REPORT_INTERVAL_MS 5000
+#define LOADGEN_LOOP_TASK_STACK_SIZE 16384
+#define LOADGEN_LOOP_TASK_PRIORITY 5
+
+extern int pipecat_load_generator(uint32_t sessions, uint32_t ramp_ms);
+
+// Stand-in server
+//
+// `--standin [PORT]` answers POST /api/offer like a Pipecat SmallWebRTC
+// bot, on the same libpeer stack, with no STT, LLM or TTS behind it. After
+// `client-ready` each connection gets `bot-ready`, then scripted turns:
+// `bot-tts-started`, `bot-started-speaking`, one `bot-tts-text` per word
+// spread over the turn's audio, `bot-stopped-speaking` and
+// `bot-tts-stopped`, then STANDIN_TURN_GAP_MS of silence. The turn audio
+// is encoded once at startup, so every run sends the same packets.
+//
+//   PIPECAT_STANDIN_TTS_WAV     turn audio at the codec rate, a synthetic
+//                               voice of STANDIN_TURN_MS if unset
+//   PIPECAT_STANDIN_ECHO        1 sends the uplink back instead of the TTS
+//   PIPECAT_STANDIN_RECORD_DIR  decodes each connection's uplink into
+//                               uplink-<n>.wav there
+//   PIPECAT_STANDIN_LOSS        downlink packet loss, percent
+//   PIPECAT_STANDIN_JITTER_MS   extra downlink delay, uniform in [0, ms]
+//   PIPECAT_STANDIN_KBPS        downlink bandwidth cap, 0 for none
+//   PIPECAT_STANDIN_SEED        for the loss and jitter draws
+//
+// Impairments apply to downlink audio only; the data channel is reliable
+// and ordered anyway. With any of them set, each connection's media runs
+// through a UDP relay in the stand-in, which both SDPs are rewritten to
+// use with one IPv4 candidate each, and loss, jitter and the cap act on
+// the SRTP datagrams libpeer has already numbered. The client's jitter
+// buffer sees the gaps and reordering a real network would leave. Counters
+// across connections are logged every STANDIN_REPORT_INTERVAL_MS.
+//
+// POST /api/echo answers with the offer's own SDP and no WebRTC behind it,
+// for exercising the signalling client alone. Both endpoints take HTTP
+// faults in the query string:
+//
+//   status=<code>  answer with this status and no body instead
+//   times=<n>      apply these faults only to the first n requests with
+//                  exactly this query (add any other parameter to start a
+//                  fresh count)
+//   delay_ms=<ms>  wait this long before answering
+//   chunked=1      send the body with chunked transfer encoding
+//   pad=<bytes>    add a "pad" member of this many bytes to the body, up
+//                  to STANDIN_MAX_PAD
+//   close=1        close the connection without answering
+//
+// pipecat_standin_start() runs the server on its own tasks, e.g. inside the
+// host tests, and returns the port it listens on (a free one for port 0),
+// 0 on failure. pipecat_standin_stop() closes every connection and waits
+// for its tasks to end.
+#define STANDIN_DEFAULT_PORT 7860
+#define STANDIN_MAX_PEERS 64
+#define STANDIN_TURN_MS 4000
+#define STANDIN_TURN_GAP_MS 2000
+#define STANDIN_MAX_TURN_MS 60000  // Longer TTS files are cut
+#define STANDIN_ANSWER_TIMEOUT_MS 5000
+#define STANDIN_REPORT_INTERVAL_MS 5000
+#define STANDIN_POLL_MS 1
+#define STANDIN_MAX_PAD (1024 * 1024)
+
+extern int pipecat_standin_server(uint16_t port);
+extern uint16_t pipecat_standin_start(uint16_t port);
+extern void pipecat_standin_stop();
+
+// Host tests
+//
+// Built only into a Linux build with PIPECAT_HOST_TESTS set, since test.cpp
+// replaces the C allocator to count allocations. `--test [NAME]` runs every
+// test whose name starts with NAME, all of them without, and exits non-zero
+// if a check failed; ctest runs it as host_tests. Each module's tests live
+// in test_<module>.cpp and are listed in test.cpp. A failed check logs the
+// expression and the test carries on, so one run reports every failure.
+// Measurements (rates, CPU, ERLE) are printed next to the result. The
+// arenas are sized for TEST_MAX_SESSIONS sessions, which the tests share.
+#define TEST_MAX_SESSIONS 8
+
+#define TEST_CHECK(expr) test_check((expr), #expr, __FILE__, __LINE__)
+#define TEST_CHECK_EQ(actual, expected)                                  \
+  test_check_eq((int64_t)(actual), (int64_t)(expected), #actual, __FILE__, \
+                __LINE__)
+
+extern bool test_check(bool ok, const char *expr, const char *file, int line);
+extern bool test_check_eq(int64_t actual, int64_t expected, const char *expr,
+                          const char *file, int line);
+extern int pipecat_run_tests(const char *filter);
+// A new session from the arenas, NULL once TEST_MAX_SESSIONS are taken
+extern pipecat_session_t *test_session_create(const audio_device_t *device,
+                                              void *device_context);
+// Heap allocations this thread has made so far
+extern uint64_t test_allocations();
+// Heap blocks this thread has allocated and not yet freed
+extern int64_t test_live_allocations();
+
+extern void test_jitter_buffer();
+extern void test_rtp_parse();
+extern void test_pcm_ring();
+extern void test_aec();
+extern void test_audio_gain_meter();
+extern void test_capture_vad();
+extern void test_encoder_loss();
+extern void test_audio_config();
+extern void test_audio_receive();
+extern void test_opus_controller();
+extern void test_rtvi_parser();
+extern void test_rtvi_send();
+extern void test_warm_cache();
+extern void test_standin();
+extern void test_http();
+extern void test_signalling();
+extern void test_webrtc();
+extern void test_record();
+#endif
 
 // Screen
 extern void pipecat_init_screen();
@@ -1,223 +1,739 @@
-#include "bsp/esp-bsp.h"
 #include <atomic>
+#include <new>
 #include <opus.h>
 #include <peer.h>
+#include <string.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "main.h"
 
 // Exact settings from working code
-#define GAIN 10.0f  // Same as working code
-
-#define CHANNELS 1
-#define SAMPLE_RATE (16000)
-#define BITS_PER_SAMPLE 16
-
-#define PCM_BUFFER_SIZE 640  // Same as working code
+#define GAIN AUDIO_GAIN_Q8(10)  // Same as working code
 
 #define OPUS_BUFFER_SIZE 1276
+#define OPUS_MAX_PACKET_MS 120
 #define OPUS_ENCODER_BITRATE 30000
 #define OPUS_ENCODER_COMPLEXITY 0
 
+
+#define PLAYBACK_RING_FRAMES 8
+#define PLAYBACK_TASK_STACK_SIZE 4096
+#define PLAYBACK_TASK_PRIORITY 8
+#define PLAYBACK_TASK_CORE 1
+// A frame arriving sooner than this after the ring ran dry means playback
+// starved mid-utterance rather than the bot simply finishing a sentence.
+#define PLAYBACK_UNDERRUN_GAP_MS 200
+
+// The reference is queued in AUDIO_BLOCK_MS blocks stamped with the time
+// they were played, so speaker and microphone frames don't have to be the
+// same length and a backlog (e.g. capture started late) is skipped by time.
+#define AEC_REFERENCE_RING_BLOCKS 16
+
+// Where each buffer lives, see pipecat_audio_memory_plan(). Everything
+// touched on every frame sits in internal RAM. The Opus states are large
+// and were already in PSRAM with malloc(). The decode buffer only sees
+// packets that aren't exactly one frame.
+#define FRAME_BUFFER_REGION MEMORY_INTERNAL
+#define JITTER_BUFFER_REGION MEMORY_INTERNAL
+#define PCM_RING_REGION MEMORY_INTERNAL
+#define OPUS_STATE_REGION MEMORY_PSRAM
+#define DECODE_BUFFER_REGION MEMORY_PSRAM
+#define AUDIO_STATE_REGION MEMORY_INTERNAL
+
 static const char *TAG = "pipecat_audio";
 
-// Same codec configuration as working code
-esp_codec_dev_sample_info_t fs = {
-    .bits_per_sample = BITS_PER_SAMPLE,
-    .channel = CHANNELS,
-    .channel_mask = 0,
-    .sample_rate = SAMPLE_RATE,
-    .mclk_multiple = 0,
+audio_config_t pipecat_audio_config = {
+    .device_rate = AUDIO_DEVICE_SAMPLE_RATE,
+    .codec_rate = AUDIO_CODEC_SAMPLE_RATE,
+    .frame_ms = AUDIO_FRAME_MS,
 };
 
-esp_codec_dev_handle_t mic_codec_dev;
-esp_codec_dev_handle_t spk_codec_dev;
+// Frame sizes in samples, from pipecat_audio_config, the same for every
+// session
+static size_t capture_samples = 0;   // Uplink frame at the device rate
+static size_t encode_samples = 0;    // Uplink frame at the codec rate
+static size_t playback_samples = 0;  // Downlink frame at the device rate
+static size_t decode_samples = 0;    // Downlink frame at the codec rate
+static size_t block_samples = 0;     // AEC reference block
+static size_t decoder_max_samples = 0;  // Worst-case packet
+static bool resampling = false;
 
-OpusDecoder *opus_decoder = NULL;
-opus_int16 *decoder_buffer = NULL;
+// Duration of `samples` at the device rate
+static int64_t audio_samples_us(size_t samples) {
+    return (int64_t)samples * 1000000 / pipecat_audio_config.device_rate;
+}
 
-OpusEncoder *opus_encoder = NULL;
-uint8_t *encoder_output_buffer = NULL;
-uint8_t *read_buffer = NULL;
+struct audio_state {
+    resampler_t capture_resampler;   // Device to codec rate
+    resampler_t playback_resampler;  // Codec to device rate
+    opus_int16 *encode_buffer;
 
-std::atomic<bool> is_playing = false;
+    OpusDecoder *opus_decoder;
+    opus_int16 *decoder_buffer;
 
-// Exact play state detection from working code
-void set_is_playing(int16_t *in_buf) {
-    bool any_set = false;
-    for (size_t i = 0; i < (PCM_BUFFER_SIZE / 2); i++) {
-        if (in_buf[i] != -1 && in_buf[i] != 0 && in_buf[i] != 1) {
-            any_set = true;
-        }
+    OpusEncoder *opus_encoder;
+    uint8_t *encoder_output_buffer;
+    uint8_t *read_buffer;
+
+    // Decoded audio waiting to fill a whole playback frame, at the codec
+    // rate. decoder_buffer holds a worst-case packet plus the remainder of
+    // the previous one.
+    size_t decoded_pending;
+    int last_packet_samples;
+    opus_int16 *resampler_scratch;
+    uint32_t decode_errors;
+    uint32_t decoded_samples;
+
+    jitter_buffer_t jitter_buffer;
+    int64_t last_receive_us;  // Also the last RTP arrival for tracing
+    // The jitter buffer belongs to the WebRTC loop task. After each push or
+    // pop it publishes the frames it concealed (FEC or PLC) in the high
+    // half and the ones it played in the low half, so the publisher reads
+    // both in one load.
+    std::atomic<uint64_t> downlink_frames;
+
+    pcm_ring_t playback_ring;
+    TaskHandle_t playback_task_handle;
+    std::atomic<int32_t> output_peak;
+    std::atomic<uint32_t> output_rms;
+
+    aec_t aec;
+    pcm_ring_t aec_reference_ring;
+
+    vad_t vad;
+    bool user_speaking;
+    audio_capture_stats_t capture_stats;
+    capture_clock_t capture_clock;
+
+    opus_controller_t opus_controller;
+    uint32_t encode_us_total;
+    uint32_t encode_us_average;
+    uint32_t encoded_in_interval;
+    uint64_t last_downlink_frames;
+};
+
+// Decodes to one frame of silence and keeps the RTP clock moving for
+// periods we don't encode: a single 20ms CELT fullband frame
+static_assert(LIBPEER_AUDIO_LATENCY_MS == 20, "The filler is one 20ms frame");
+static const uint8_t opus_silence_frame[] = {0xf8, 0xff, 0xfe};
+
+// libpeer's RTP clock fixes the frame length and the AEC's tuning the
+// device rate, see audio_config_t
+bool audio_config_valid(const audio_config_t *config) {
+    uint32_t rate = config->codec_rate;
+    return config->device_rate == AEC_SAMPLE_RATE &&
+           (rate == 8000 || rate == 16000 || rate == 24000 || rate == 48000) &&
+           config->frame_ms == LIBPEER_AUDIO_LATENCY_MS;
+}
+
+static bool audio_sizes_init() {
+    const audio_config_t *config = &pipecat_audio_config;
+    if (!audio_config_valid(config)) {
+        ESP_LOGE(TAG, "Unsupported audio config: %uHz device, %uHz codec, %ums frames",
+                 (unsigned)config->device_rate, (unsigned)config->codec_rate,
+                 (unsigned)config->frame_ms);
+        return false;
+    }
+    if (capture_samples != 0) {
+        return true;
     }
-    is_playing = any_set;
+
+    capture_samples = audio_frame_samples(config->device_rate, config->frame_ms);
+    encode_samples = audio_frame_samples(config->codec_rate, config->frame_ms);
+    playback_samples = audio_frame_samples(config->device_rate, JITTER_BUFFER_FRAME_MS);
+    decode_samples = audio_frame_samples(config->codec_rate, JITTER_BUFFER_FRAME_MS);
+    block_samples = audio_frame_samples(config->device_rate, AUDIO_BLOCK_MS);
+    decoder_max_samples = audio_frame_samples(config->codec_rate, OPUS_MAX_PACKET_MS);
+    resampling = config->device_rate != config->codec_rate;
+
+    ESP_LOGI(TAG, "Audio: %uHz device, %uHz codec, %ums frames",
+             (unsigned)config->device_rate, (unsigned)config->codec_rate,
+             (unsigned)config->frame_ms);
+    return true;
 }
 
-// Exact gain application from working code
-void apply_gain(int16_t *samples) {
-    for (size_t i = 0; i < (PCM_BUFFER_SIZE / 2); i++) {
-        float scaled = (float)samples[i] * GAIN;
+void pipecat_audio_memory_plan(memory_plan_t *plan) {
+    if (!audio_sizes_init()) {
+        return;
+    }
+
+    // Capture and encode
+    memory_plan_add(plan, FRAME_BUFFER_REGION, capture_samples * sizeof(int16_t));
+    memory_plan_add(plan, FRAME_BUFFER_REGION, OPUS_BUFFER_SIZE);
+    memory_plan_add(plan, OPUS_STATE_REGION, opus_encoder_get_size(1));
+    memory_plan_add(plan, PCM_RING_REGION,
+                    pcm_ring_storage_size(AEC_REFERENCE_RING_BLOCKS, block_samples));
 
-        // Clamp to 16-bit range
-        if (scaled > 32767.0f)
-            scaled = 32767.0f;
-        if (scaled < -32768.0f)
-            scaled = -32768.0f;
+    // Decode and playback
+    memory_plan_add(plan, OPUS_STATE_REGION, opus_decoder_get_size(1));
+    memory_plan_add(plan, DECODE_BUFFER_REGION,
+                    (decoder_max_samples + decode_samples) * sizeof(opus_int16));
+    memory_plan_add(plan, JITTER_BUFFER_REGION, JITTER_BUFFER_STORAGE_SIZE);
+    memory_plan_add(plan, PCM_RING_REGION,
+                    pcm_ring_storage_size(PLAYBACK_RING_FRAMES, playback_samples));
 
-        samples[i] = (int16_t)scaled;
+    if (resampling) {
+        memory_plan_add(plan, FRAME_BUFFER_REGION, encode_samples * sizeof(opus_int16));
+        memory_plan_add(plan, DECODE_BUFFER_REGION, playback_samples * sizeof(opus_int16));
     }
+
+    memory_plan_add(plan, AUDIO_STATE_REGION, sizeof(audio_state_t));
 }
 
-// ---------------------- BSP Audio Initialization ----------------------
-void pipecat_init_audio_capture() {
+bool pipecat_audio_session_create(pipecat_session_t *session) {
+    void *state = pipecat_memory_alloc(AUDIO_STATE_REGION, sizeof(audio_state_t),
+                                       "audio_state");
+    if (state == NULL) {
+        return false;
+    }
+    session->audio = new (state) audio_state_t();
+    return true;
+}
+
+// ---------------------- Audio Initialization ----------------------
+void pipecat_init_audio_capture(pipecat_session_t *session) {
     ESP_LOGI(TAG, ">>> BSP AUDIO INIT <<<");
-    
-    // Initialize BSP board first
-    esp_err_t ret = bsp_board_init();
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "BSP board init failed: %s", esp_err_to_name(ret));
+
+    audio_state_t *audio = session->audio;
+    if (!audio_sizes_init()) {
         return;
     }
-    
-    // Speaker - exact same as working code
-    spk_codec_dev = bsp_audio_codec_speaker_init();
-    if (spk_codec_dev == NULL) {
-        ESP_LOGE(TAG, "Failed to initialize speaker codec");
+
+    aec_init(&audio->aec);
+    capture_clock_init(&audio->capture_clock, pipecat_audio_config.frame_ms * 1000);
+    if (!pcm_ring_init(&audio->aec_reference_ring, AEC_REFERENCE_RING_BLOCKS,
+                       block_samples, PCM_RING_REGION)) {
         return;
     }
     
-    ret = esp_codec_dev_open(spk_codec_dev, &fs);
+    esp_err_t ret = session->config.device->init(session->config.device_context,
+                                                 pipecat_audio_config.device_rate);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to open speaker codec: %s", esp_err_to_name(ret));
+        ESP_LOGE(TAG, "Audio device init failed: %s", esp_err_to_name(ret));
         return;
     }
     
-    ret = esp_codec_dev_set_out_vol(spk_codec_dev, 100);  // Same volume as working code
-    if (ret != ESP_OK) {
-        ESP_LOGW(TAG, "Failed to set speaker volume: %s", esp_err_to_name(ret));
+    ESP_LOGI(TAG, ">>> BSP AUDIO INIT COMPLETE <<<");
+}
+
+// Consumer side of the playback ring. The blocking I2S write lives here so a
+// slow speaker never stalls peer_connection_loop().
+static void pipecat_playback_task(void *user_data) {
+    pipecat_session_t *session = (pipecat_session_t *)user_data;
+    audio_state_t *audio = session->audio;
+    bool starved = false;
+    int64_t starved_at_us = 0;
+
+    while (1) {
+        pcm_frame_meta_t meta;
+        const int16_t *frame = pcm_ring_acquire_read(&audio->playback_ring, &meta);
+        if (frame == NULL) {
+            if (!starved) {
+                starved = true;
+                starved_at_us = esp_timer_get_time();
+            }
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(JITTER_BUFFER_FRAME_MS));
+            continue;
+        }
+
+        if (starved) {
+            starved = false;
+            if (esp_timer_get_time() - starved_at_us < PLAYBACK_UNDERRUN_GAP_MS * 1000) {
+                audio->playback_ring.underruns.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        int64_t write_start_us = esp_timer_get_time();
+        pipecat_trace_record(TRACE_PLAYBACK_QUEUE, meta.queued_us, write_start_us);
+
+        esp_err_t ret = session->config.device->write(session->config.device_context,
+                                                      frame, playback_samples);
+        int64_t write_end_us = esp_timer_get_time();
+        pipecat_trace_record(TRACE_SPEAKER_WRITE, write_start_us, write_end_us);
+        pipecat_trace_record(TRACE_DOWNLINK, meta.origin_us, write_end_us);
+
+        if (ret != ESP_OK) {
+            pipecat_tlog(TLOG_SPEAKER_WRITE_FAILED, ret);
+        } else {
+            pipecat_boot_milestone(BOOT_MILESTONE_FIRST_AUDIO);
+
+            // What actually went out of the speaker is the echo reference
+            for (size_t offset = 0; offset < playback_samples; offset += block_samples) {
+                int16_t *reference = pcm_ring_acquire_write(&audio->aec_reference_ring);
+                if (reference == NULL) {
+                    break;
+                }
+                memcpy(reference, frame + offset, block_samples * sizeof(int16_t));
+                pcm_ring_commit_write(&audio->aec_reference_ring,
+                                      write_end_us + audio_samples_us(offset));
+            }
+        }
+        pcm_ring_release_read(&audio->playback_ring);
     }
+}
 
-    // Microphone - exact same as working code
-    mic_codec_dev = bsp_audio_codec_microphone_init();
-    if (mic_codec_dev == NULL) {
-        ESP_LOGE(TAG, "Failed to initialize microphone codec");
+void pipecat_audio_playback_stats(pipecat_session_t *session,
+                                  audio_playback_stats_t *stats) {
+    audio_state_t *audio = session->audio;
+    stats->underruns = audio->playback_ring.underruns.load(std::memory_order_relaxed);
+    stats->overruns = audio->playback_ring.overruns.load(std::memory_order_relaxed);
+    stats->buffered_frames = pcm_ring_count(&audio->playback_ring);
+    stats->output_peak = audio->output_peak;
+    stats->output_rms = audio->output_rms;
+    stats->decode_errors = audio->decode_errors;
+    stats->decoded_samples = audio->decoded_samples;
+    uint64_t frames = audio->downlink_frames.load(std::memory_order_relaxed);
+    stats->played = (uint32_t)frames;
+    stats->lost = (uint32_t)(frames >> 32);
+}
+
+void pipecat_init_audio_decoder(pipecat_session_t *session) {
+    ESP_LOGI(TAG, ">>> BSP OPUS DECODER INIT <<<");
+    audio_state_t *audio = session->audio;
+    if (audio->opus_decoder != NULL || !audio_sizes_init()) {
         return;
     }
-    
-    ret = esp_codec_dev_set_in_gain(mic_codec_dev, 42.0);  // Same gain as working code
-    if (ret != ESP_OK) {
-        ESP_LOGW(TAG, "Failed to set microphone gain: %s", esp_err_to_name(ret));
-    }
-    
-    ret = esp_codec_dev_open(mic_codec_dev, &fs);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to open microphone codec: %s", esp_err_to_name(ret));
+
+    // Decoder - exact same as working code, in state allocated once
+    OpusDecoder *decoder = (OpusDecoder *)pipecat_memory_alloc(
+        OPUS_STATE_REGION, opus_decoder_get_size(1), "opus_decoder");
+    if (decoder == NULL) {
         return;
     }
-    
-    ESP_LOGI(TAG, ">>> BSP AUDIO INIT COMPLETE <<<");
-}
-
-void pipecat_init_audio_decoder() {
-    ESP_LOGI(TAG, ">>> BSP OPUS DECODER INIT <<<");
-    
-    // Decoder - exact same as working code
-    int opus_error = 0;
-    opus_decoder = opus_decoder_create(SAMPLE_RATE, 1, &opus_error);
+    int opus_error = opus_decoder_init(decoder, pipecat_audio_config.codec_rate, 1);
     if (opus_error != OPUS_OK) {
         ESP_LOGE(TAG, "Failed to create OPUS decoder: %d", opus_error);
         return;
     }
-    
-    decoder_buffer = (opus_int16 *)malloc(PCM_BUFFER_SIZE);  // Same allocation as working code
-    if (!decoder_buffer) {
-        ESP_LOGE(TAG, "Failed to allocate decoder buffer");
+    audio->opus_decoder = decoder;
+
+    audio->decoder_buffer = (opus_int16 *)pipecat_memory_alloc(
+        DECODE_BUFFER_REGION, (decoder_max_samples + decode_samples) * sizeof(opus_int16),
+        "decoder_buffer");
+    if (!audio->decoder_buffer) {
+        return;
+    }
+    audio->last_packet_samples = decode_samples;
+
+    if (resampling) {
+        audio->resampler_scratch = (opus_int16 *)pipecat_memory_alloc(
+            DECODE_BUFFER_REGION, playback_samples * sizeof(opus_int16),
+            "resampler_scratch");
+        if (audio->resampler_scratch == NULL ||
+            !resampler_init(&audio->playback_resampler, pipecat_audio_config.codec_rate,
+                            pipecat_audio_config.device_rate, decode_samples)) {
+            ESP_LOGE(TAG, "Failed to set up playback resampling");
+            return;
+        }
+    }
+
+    if (!jitter_buffer_init(&audio->jitter_buffer, JITTER_BUFFER_REGION)) {
+        return;
+    }
+
+    if (!pcm_ring_init(&audio->playback_ring, PLAYBACK_RING_FRAMES, playback_samples,
+                       PCM_RING_REGION)) {
         return;
     }
+
+    xTaskCreatePinnedToCore(pipecat_playback_task, "audio_playback",
+                            PLAYBACK_TASK_STACK_SIZE, session, PLAYBACK_TASK_PRIORITY,
+                            &audio->playback_task_handle, PLAYBACK_TASK_CORE);
+    pipecat_memory_track_task(audio->playback_task_handle, "audio_playback",
+                              PLAYBACK_TASK_STACK_SIZE);
     
     ESP_LOGI(TAG, ">>> BSP OPUS DECODER READY <<<");
 }
 
-void pipecat_init_audio_encoder() {
+static void apply_encoder_settings(audio_state_t *audio,
+                                   const opus_encoder_settings_t *settings) {
+    OpusEncoder *encoder = audio->opus_encoder;
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(settings->bitrate));
+    opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(settings->complexity));
+    opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(settings->inband_fec));
+    opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(settings->packet_loss_perc));
+}
+
+// On the loop task, after anything that changes the jitter buffer's stats
+static void publish_downlink_frames(audio_state_t *audio) {
+    const jitter_buffer_stats_t *stats = &audio->jitter_buffer.stats;
+    uint32_t lost = stats->fec + stats->plc;
+    audio->downlink_frames.store((uint64_t)lost << 32 | stats->played,
+                                 std::memory_order_relaxed);
+}
+
+// libpeer doesn't surface RTCP receiver reports, so there is no uplink loss
+// to adapt to. Loss on the downlink, as the jitter buffer saw it, stands in
+// for it on the assumption that both directions share the bottleneck. The
+// controller gets no RTT either.
+static float downlink_loss_percent(audio_state_t *audio) {
+    uint64_t now = audio->downlink_frames.load(std::memory_order_relaxed);
+    uint64_t last = audio->last_downlink_frames;
+    audio->last_downlink_frames = now;
+    uint32_t lost = (uint32_t)(now >> 32) - (uint32_t)(last >> 32);
+    uint32_t played = (uint32_t)now - (uint32_t)last;
+    uint32_t total = lost + played;
+    return total > 0 ? 100.0f * lost / total : 0.0f;
+}
+
+static void update_encoder_controller(audio_state_t *audio) {
+    if (audio->encoded_in_interval > 0) {
+        audio->encode_us_average = audio->encode_us_total / audio->encoded_in_interval;
+    }
+    audio->encode_us_total = 0;
+    audio->encoded_in_interval = 0;
+
+    opus_controller_input_t input = {
+        .loss_percent = downlink_loss_percent(audio),
+        .rtt_ms = 0,
+        .encode_us = audio->encode_us_average,
+    };
+    if (opus_controller_update(&audio->opus_controller, &input)) {
+        apply_encoder_settings(audio, &audio->opus_controller.settings);
+    }
+}
+
+void pipecat_init_audio_encoder(pipecat_session_t *session) {
     ESP_LOGI(TAG, ">>> BSP OPUS ENCODER INIT <<<");
-    
-    // Encoder - exact same as working code
-    int opus_error = 0;
-    opus_encoder = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, &opus_error);
+    audio_state_t *audio = session->audio;
+    if (audio->opus_encoder != NULL || !audio_sizes_init()) {
+        return;
+    }
+
+    // Encoder - exact same as working code, in state allocated once
+    OpusEncoder *encoder = (OpusEncoder *)pipecat_memory_alloc(
+        OPUS_STATE_REGION, opus_encoder_get_size(1), "opus_encoder");
+    if (encoder == NULL) {
+        return;
+    }
+    int opus_error = opus_encoder_init(encoder, pipecat_audio_config.codec_rate, 1,
+                                       OPUS_APPLICATION_VOIP);
     if (opus_error != OPUS_OK) {
         ESP_LOGE(TAG, "Failed to create OPUS encoder: %d", opus_error);
         return;
     }
+    audio->opus_encoder = encoder;
     
-    // Same encoder configuration as working code
-    opus_encoder_ctl(opus_encoder, OPUS_SET_BITRATE(OPUS_ENCODER_BITRATE));
-    opus_encoder_ctl(opus_encoder, OPUS_SET_COMPLEXITY(OPUS_ENCODER_COMPLEXITY));
-    opus_encoder_ctl(opus_encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
-
-    // Same buffer allocation as working code
-    read_buffer = (uint8_t *)heap_caps_malloc(PCM_BUFFER_SIZE, MALLOC_CAP_DEFAULT);
-    encoder_output_buffer = (uint8_t *)malloc(OPUS_BUFFER_SIZE);
-    
-    if (!read_buffer || !encoder_output_buffer) {
-        ESP_LOGE(TAG, "Failed to allocate encoder buffers");
+    // Same encoder configuration as working code, the controller takes it
+    // from there
+    opus_encoder_settings_t settings = {
+        .bitrate = OPUS_ENCODER_BITRATE,
+        .complexity = OPUS_ENCODER_COMPLEXITY,
+        .inband_fec = false,
+        .packet_loss_perc = 0,
+    };
+    opus_controller_init(&audio->opus_controller, &settings);
+    apply_encoder_settings(audio, &settings);
+    opus_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+    opus_encoder_ctl(encoder, OPUS_SET_DTX(1));
+
+    vad_init(&audio->vad, pipecat_audio_config.frame_ms);
+
+    audio->read_buffer = (uint8_t *)pipecat_memory_alloc(
+        FRAME_BUFFER_REGION, capture_samples * sizeof(int16_t), "read_buffer");
+    audio->encoder_output_buffer = (uint8_t *)pipecat_memory_alloc(
+        FRAME_BUFFER_REGION, OPUS_BUFFER_SIZE, "encoder_output_buffer");
+    if (!audio->read_buffer || !audio->encoder_output_buffer) {
         return;
     }
+
+    if (resampling) {
+        audio->encode_buffer = (opus_int16 *)pipecat_memory_alloc(
+            FRAME_BUFFER_REGION, encode_samples * sizeof(opus_int16), "encode_buffer");
+        if (audio->encode_buffer == NULL ||
+            !resampler_init(&audio->capture_resampler, pipecat_audio_config.device_rate,
+                            pipecat_audio_config.codec_rate, capture_samples)) {
+            ESP_LOGE(TAG, "Failed to set up capture resampling");
+            return;
+        }
+    }
     
     ESP_LOGI(TAG, ">>> BSP OPUS ENCODER READY <<<");
 }
 
-// ---------------------- BSP Audio Play (exact copy of working code) ----------------------
-void pipecat_audio_decode(uint8_t *data, size_t size) {
-    ESP_LOGI(TAG, ">>> BSP DECODE: %d bytes <<<", size);
-    
-    // Exact same decode logic as working code
-    auto decoded_size = opus_decode(opus_decoder, data, size, decoder_buffer, PCM_BUFFER_SIZE, 0);
+// ---------------------- BSP Audio Play ----------------------
+// Gain, metering and hand-off of one playback frame already in the ring
+static void pipecat_audio_commit_frame(audio_state_t *audio, opus_int16 *frame,
+                                       int64_t origin_us) {
+    // Gain and output metering in a single pass
+    audio_level_t level;
+    audio_gain_meter(frame, playback_samples, GAIN, &level);
+    audio->output_peak = level.peak;
+    audio->output_rms = audio_level_rms(&level);
+
+    // Concealed frames have no packet behind them and start here
+    pcm_ring_commit_write(&audio->playback_ring, origin_us);
+    xTaskNotifyGive(audio->playback_task_handle);
+}
+
+// Moves whole playback frames out of decoder_buffer into the ring,
+// resampling on the way, and keeps any remainder for the next packet
+static void pipecat_audio_drain_decoded(audio_state_t *audio, int64_t origin_us) {
+    size_t offset = 0;
+    while (audio->decoded_pending - offset >= decode_samples) {
+        opus_int16 *output = pcm_ring_acquire_write(&audio->playback_ring);
+        // With the speaker a whole ring behind the frame is dropped
+        if (output != NULL) {
+            if (resampling) {
+                resampler_process(&audio->playback_resampler,
+                                  audio->decoder_buffer + offset, decode_samples,
+                                  output);
+            } else {
+                memcpy(output, audio->decoder_buffer + offset,
+                       decode_samples * sizeof(opus_int16));
+            }
+            pipecat_audio_commit_frame(audio, output, origin_us);
+        } else if (resampling) {
+            // Keep the filter history in step with what's decoded
+            resampler_process(&audio->playback_resampler,
+                              audio->decoder_buffer + offset, decode_samples,
+                              audio->resampler_scratch);
+        }
+        offset += decode_samples;
+    }
+
+    audio->decoded_pending -= offset;
+    memmove(audio->decoder_buffer, audio->decoder_buffer + offset,
+            audio->decoded_pending * sizeof(opus_int16));
+}
+
+static void pipecat_audio_decode(audio_state_t *audio,
+                                 const jitter_buffer_frame_t *frame) {
+    int decoded_size;
+
+    int64_t decode_start_us = esp_timer_get_time();
+    pipecat_trace_record(TRACE_JITTER_BUFFER, frame->arrival_us, decode_start_us);
+
+    // Packets can carry anything from 2.5 to 120ms. Sized from the packet
+    // itself; losses are concealed with the duration of the last good one.
+    int packet_samples = frame->kind == JITTER_BUFFER_FRAME_PACKET
+                             ? opus_packet_get_nb_samples(frame->data, frame->size,
+                                                          pipecat_audio_config.codec_rate)
+                             : audio->last_packet_samples;
+    if (packet_samples <= 0 || (size_t)packet_samples > decoder_max_samples) {
+        pipecat_tlog(TLOG_INVALID_PACKET, frame->size, packet_samples);
+        audio->decode_errors++;
+        return;
+    }
+
+    // The common case, one playback frame per packet and nothing carried
+    // over, decodes straight into the ring
+    opus_int16 *output = NULL;
+    if (!resampling && audio->decoded_pending == 0 &&
+        (size_t)packet_samples == decode_samples) {
+        output = pcm_ring_acquire_write(&audio->playback_ring);
+    }
+    opus_int16 *pcm =
+        output != NULL ? output : audio->decoder_buffer + audio->decoded_pending;
+
+    pipecat_tlog(TLOG_DECODE, frame->size, frame->kind);
+    switch (frame->kind) {
+        case JITTER_BUFFER_FRAME_PACKET:
+            decoded_size = opus_decode(audio->opus_decoder, frame->data, frame->size,
+                                       pcm, packet_samples, 0);
+            break;
+        case JITTER_BUFFER_FRAME_FEC:
+            // Recover the missing frame from the next packet's in-band FEC
+            decoded_size = opus_decode(audio->opus_decoder, frame->data, frame->size,
+                                       pcm, packet_samples, 1);
+            break;
+        default:
+            decoded_size = opus_decode(audio->opus_decoder, NULL, 0, pcm,
+                                       packet_samples, 0);
+            break;
+    }
 
     if (decoded_size <= 0) {
-        ESP_LOGW(TAG, ">>> BSP DECODE FAILED: %d <<<", decoded_size);
+        pipecat_tlog(TLOG_DECODE_FAILED, decoded_size);
+        audio->decode_errors++;
         return;
     }
-    
-    ESP_LOGI(TAG, ">>> BSP DECODED: %d samples <<<", decoded_size);
 
-    // Exact same play state detection as working code
-    set_is_playing(decoder_buffer);
-    
-    // Exact same gain application as working code
-    apply_gain((int16_t *)decoder_buffer);
-    
-    // Use BSP codec instead of M5Stack
-    esp_err_t ret = esp_codec_dev_write(spk_codec_dev, decoder_buffer, PCM_BUFFER_SIZE);
-    if (ret != ESP_OK) {
-        ESP_LOGW(TAG, ">>> BSP SPEAKER WRITE FAILED: %s <<<", esp_err_to_name(ret));
+    pipecat_tlog(TLOG_DECODED, decoded_size);
+    audio->decoded_samples += decoded_size;
+    if (frame->kind == JITTER_BUFFER_FRAME_PACKET) {
+        audio->last_packet_samples = decoded_size;
+    }
+
+    if (output != NULL) {
+        pipecat_audio_commit_frame(audio, output, frame->arrival_us);
     } else {
-        ESP_LOGI(TAG, ">>> BSP PLAYING SUCCESS <<<");
+        audio->decoded_pending += decoded_size;
+        pipecat_audio_drain_decoded(audio, frame->arrival_us);
+    }
+
+    pipecat_trace_record(TRACE_DECODE, decode_start_us, esp_timer_get_time());
+}
+
+void pipecat_audio_receive(pipecat_session_t *session, uint16_t seq,
+                           uint32_t timestamp, const uint8_t *data, size_t size,
+                           int64_t now_us) {
+    audio_state_t *audio = session->audio;
+    pipecat_trace_record(TRACE_RTP_INTERARRIVAL, audio->last_receive_us, now_us);
+    audio->last_receive_us = now_us;
+    jitter_buffer_push(&audio->jitter_buffer, seq, timestamp, data, size, now_us);
+
+    jitter_buffer_frame_t frame;
+    while (jitter_buffer_pop(&audio->jitter_buffer, false, &frame)) {
+        pipecat_audio_decode(audio, &frame);
     }
+    publish_downlink_frames(audio);
+}
+
+// Play out whatever is still buffered once packets stop arriving (e.g. at the
+// end of a bot utterance), otherwise the tail would wait for the next one.
+void pipecat_audio_playout_tick(pipecat_session_t *session, int64_t now_us) {
+    audio_state_t *audio = session->audio;
+    if (!audio->jitter_buffer.started) {
+        return;
+    }
+
+    int64_t idle_us = now_us - audio->last_receive_us;
+    if (idle_us < (int64_t)audio->jitter_buffer.target_frames * JITTER_BUFFER_FRAME_MS * 1000) {
+        return;
+    }
+
+    jitter_buffer_frame_t frame;
+    while (jitter_buffer_pop(&audio->jitter_buffer, true, &frame)) {
+        pipecat_audio_decode(audio, &frame);
+    }
+    publish_downlink_frames(audio);
+}
+
+void pipecat_audio_reset_downlink(pipecat_session_t *session) {
+    // A new connection restarts RTP sequence numbers and the remote encoder
+    audio_state_t *audio = session->audio;
+    jitter_buffer_reset(&audio->jitter_buffer);
+    opus_decoder_ctl(audio->opus_decoder, OPUS_RESET_STATE);
+    audio->decoded_pending = 0;
+    audio->last_packet_samples = decode_samples;
+    if (resampling) {
+        resampler_reset(&audio->playback_resampler);
+    }
+}
+
+// Every packet the uplink sends goes through here, so the recording has
+// all of them
+static void pipecat_send_packet(pipecat_session_t *session,
+                                PeerConnection *peer_connection,
+                                const uint8_t *data, size_t size) {
+    peer_connection_send_audio(peer_connection, data, size);
+    pipecat_record(session, RECORD_AUDIO_TX, data, size);
+}
+
+static void pipecat_send_filler(pipecat_session_t *session,
+                                PeerConnection *peer_connection) {
+    pipecat_send_packet(session, peer_connection, opus_silence_frame,
+                        sizeof(opus_silence_frame));
+    session->audio->capture_stats.fillers++;
 }
 
 // ---------------------- BSP Audio Send (exact copy of working code) ----------------------
-void pipecat_send_audio(PeerConnection *peer_connection) {
-    if (is_playing) {
-        // Send silence when playing - exact same as working code
-        memset(read_buffer, 0, PCM_BUFFER_SIZE);
-    } else {
-        // Record from microphone using BSP codec
-        esp_err_t ret = esp_codec_dev_read(mic_codec_dev, read_buffer, PCM_BUFFER_SIZE);
-        if (ret != ESP_OK) {
-            ESP_LOGW(TAG, "Microphone read failed: %s", esp_err_to_name(ret));
-            memset(read_buffer, 0, PCM_BUFFER_SIZE);  // Use silence on error
+// One call per capture period: the read blocks until the device clock has a
+// frame, and exactly one packet goes out for it.
+void pipecat_send_audio(pipecat_session_t *session, PeerConnection *peer_connection) {
+    audio_state_t *audio = session->audio;
+
+    // Record from microphone
+    int64_t read_start_us = esp_timer_get_time();
+    int16_t *pcm = (int16_t *)audio->read_buffer;
+    esp_err_t ret = session->config.device->read(session->config.device_context,
+                                                 pcm, capture_samples);
+    int64_t captured_us = esp_timer_get_time();
+    pipecat_trace_record(TRACE_MIC_READ, read_start_us, captured_us);
+    if (ret != ESP_OK) {
+        pipecat_tlog(TLOG_MIC_READ_FAILED, ret);
+        memset(pcm, 0, capture_samples * sizeof(int16_t));  // Use silence on error
+    }
+
+    // Periods the DMA dropped still get their slot on the RTP clock
+    uint32_t lost = capture_clock_tick(&audio->capture_clock, read_start_us, captured_us);
+    for (uint32_t i = 0; i < lost; i++) {
+        pipecat_send_filler(session, peer_connection);
+    }
+
+    // Cancel the bot's own voice so the uplink can stay open while it talks,
+    // each block against what the speaker played as it was captured
+    int64_t frame_start_us = captured_us - audio_samples_us(capture_samples);
+    for (size_t offset = 0; offset < capture_samples; offset += block_samples) {
+        const int16_t *reference = aec_reference_acquire(
+            &audio->aec_reference_ring, frame_start_us + audio_samples_us(offset));
+        aec_process(&audio->aec, pcm + offset, reference, block_samples);
+        if (reference != NULL) {
+            pcm_ring_release_read(&audio->aec_reference_ring);
         }
     }
 
-    // Exact same encoding as working code
-    auto encoded_size = opus_encode(opus_encoder, 
-                                  (const opus_int16 *)read_buffer,
-                                  PCM_BUFFER_SIZE / sizeof(uint16_t),  // Same calculation
-                                  encoder_output_buffer, 
+    // Every frame, so the filter history stays continuous across skipped
+    // encodes
+    const opus_int16 *codec_pcm = pcm;
+    if (resampling) {
+        resampler_process(&audio->capture_resampler, pcm, capture_samples,
+                          audio->encode_buffer);
+        codec_pcm = audio->encode_buffer;
+    }
+
+    uint32_t controller_frames = OPUS_CONTROLLER_INTERVAL_MS / pipecat_audio_config.frame_ms;
+    if (++audio->capture_stats.frames % controller_frames == 0) {
+        update_encoder_controller(audio);
+    }
+
+    // Silence past the hangover is only encoded for keepalive frames. That
+    // saves the encode, not the packet: every period still sends one.
+    bool send = vad_process(&audio->vad, pcm, capture_samples);
+
+    bool speaking = audio->vad.speech || audio->vad.hangover_frames > 0;
+    if (speaking != audio->user_speaking) {
+        audio->user_speaking = speaking;
+        pipecat_rtvi_send_user_speaking(session, speaking);
+    }
+
+    if (!send) {
+        pipecat_send_filler(session, peer_connection);
+        return;
+    }
+
+    // Exact same encoding as working code, at the codec rate
+    int64_t encode_start_us = esp_timer_get_time();
+    auto encoded_size = opus_encode(audio->opus_encoder, 
+                                  codec_pcm,
+                                  encode_samples,
+                                  audio->encoder_output_buffer, 
                                   OPUS_BUFFER_SIZE);
-    
-    if (encoded_size > 0) {
-        peer_connection_send_audio(peer_connection, encoder_output_buffer, encoded_size);
+    int64_t encode_end_us = esp_timer_get_time();
+    pipecat_trace_record(TRACE_ENCODE, encode_start_us, encode_end_us);
+    audio->encode_us_total += (uint32_t)(encode_end_us - encode_start_us);
+    audio->encoded_in_interval++;
+    audio->capture_stats.encoded++;
+
+    // With DTX on, 1-2 byte packets mean "nothing worth sending", but they
+    // still hold the frame's place on the RTP clock
+    if (encoded_size > 2) {
+        pipecat_send_packet(session, peer_connection,
+                            audio->encoder_output_buffer, encoded_size);
+        int64_t sent_us = esp_timer_get_time();
+        pipecat_trace_record(TRACE_SEND, encode_end_us, sent_us);
+        pipecat_trace_record(TRACE_UPLINK, captured_us, sent_us);
+        audio->capture_stats.sent++;
+    } else if (encoded_size > 0) {
+        pipecat_send_packet(session, peer_connection,
+                            audio->encoder_output_buffer, encoded_size);
+        audio->capture_stats.dtx++;
     } else {
-        ESP_LOGW(TAG, "OPUS encode failed: %d", encoded_size);
+        pipecat_tlog(TLOG_ENCODE_FAILED, encoded_size);
+        pipecat_send_filler(session, peer_connection);
     }
-}
\ No newline at end of file
+}
+
+const opus_controller_t *pipecat_audio_encoder_controller(pipecat_session_t *session) {
+    return &session->audio->opus_controller;
+}
+
+const capture_clock_t *pipecat_audio_capture_clock(pipecat_session_t *session) {
+    return &session->audio->capture_clock;
+}
+
+void pipecat_audio_capture_stats(pipecat_session_t *session,
+                                 audio_capture_stats_t *stats) {
+    *stats = session->audio->capture_stats;
+}
@@ -0,0 +1,203 @@
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef LINUX_BUILD
+#include <esp_heap_caps.h>
+#endif
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+static const char *memory_region_names[MEMORY_REGION_COUNT] = {"internal",
+                                                                "psram"};
+
+// Boot phases run in parallel, so carving is lock-free
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  std::atomic<size_t> used;
+} memory_arena_t;
+
+typedef struct {
+  const char *name;
+  memory_region_t region;
+  size_t size;
+} memory_block_t;
+
+typedef struct {
+  TaskHandle_t task;
+  const char *name;
+  uint32_t stack_size;
+} memory_task_t;
+
+static memory_arena_t memory_arenas[MEMORY_REGION_COUNT];
+// What was carved where, for pipecat_memory_dump()
+static memory_block_t memory_blocks[MEMORY_MAX_BLOCKS];
+static std::atomic<uint32_t> memory_block_count(0);
+static memory_task_t memory_tasks[MEMORY_MAX_TASKS];
+static std::atomic<uint32_t> memory_task_count(0);
+
+static size_t memory_align(size_t size) {
+  return (size + MEMORY_ALIGNMENT - 1) & ~(size_t)(MEMORY_ALIGNMENT - 1);
+}
+
+#ifndef LINUX_BUILD
+static uint32_t memory_caps(memory_region_t region) {
+  return region == MEMORY_INTERNAL ? MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT
+                                   : MALLOC_CAP_SPIRAM;
+}
+#endif
+
+void memory_plan_add(memory_plan_t *plan, memory_region_t region,
+                     size_t size) {
+  plan->size[region] += memory_align(size);
+}
+
+bool pipecat_init_memory(uint32_t sessions) {
+  memory_plan_t plan;
+  memset(&plan, 0, sizeof(plan));
+  pipecat_audio_memory_plan(&plan);
+  pipecat_webrtc_memory_plan(&plan);
+
+  for (int region = 0; region < MEMORY_REGION_COUNT; region++) {
+    memory_arena_t *arena = &memory_arenas[region];
+    plan.size[region] *= sessions;
+    if (arena->base != NULL || plan.size[region] == 0) {
+      continue;
+    }
+#ifndef LINUX_BUILD
+    arena->base = (uint8_t *)heap_caps_aligned_alloc(
+        MEMORY_ALIGNMENT, plan.size[region],
+        memory_caps((memory_region_t)region));
+#else
+    arena->base = (uint8_t *)aligned_alloc(MEMORY_ALIGNMENT, plan.size[region]);
+#endif
+    if (arena->base == NULL) {
+      ESP_LOGE(LOG_TAG, "Failed to allocate %u byte %s arena",
+               (unsigned)plan.size[region], memory_region_names[region]);
+      return false;
+    }
+    arena->size = plan.size[region];
+    ESP_LOGI(LOG_TAG, "Memory arena: %u bytes %s", (unsigned)arena->size,
+             memory_region_names[region]);
+  }
+  return true;
+}
+
+void *pipecat_memory_alloc(memory_region_t region, size_t size,
+                           const char *name) {
+  memory_arena_t *arena = &memory_arenas[region];
+  size_t aligned = memory_align(size);
+  size_t used = arena->used.load(std::memory_order_relaxed);
+  do {
+    if (arena->base == NULL || arena->size - used < aligned) {
+      ESP_LOGE(LOG_TAG, "%s (%u bytes) is not in the %s memory plan", name,
+               (unsigned)size, memory_region_names[region]);
+      return NULL;
+    }
+  } while (!arena->used.compare_exchange_weak(used, used + aligned,
+                                              std::memory_order_relaxed));
+
+  void *block = arena->base + used;
+  memset(block, 0, size);
+
+  uint32_t index = memory_block_count.fetch_add(1, std::memory_order_relaxed);
+  if (index < MEMORY_MAX_BLOCKS) {
+    memory_blocks[index] = {name, region, size};
+  } else if (index == MEMORY_MAX_BLOCKS) {
+    ESP_LOGW(LOG_TAG, "More than %d memory blocks, %s and later aren't listed",
+             MEMORY_MAX_BLOCKS, name);
+  }
+  return block;
+}
+
+void pipecat_memory_track_task(void *task, const char *name,
+                               uint32_t stack_size) {
+  if (task == NULL) {
+    return;
+  }
+  uint32_t index = memory_task_count.fetch_add(1, std::memory_order_relaxed);
+  if (index < MEMORY_MAX_TASKS) {
+    memory_tasks[index] = {(TaskHandle_t)task, name, stack_size};
+  } else if (index == MEMORY_MAX_TASKS) {
+    ESP_LOGW(LOG_TAG, "More than %d tasks, %s and later aren't listed",
+             MEMORY_MAX_TASKS, name);
+  }
+}
+
+void pipecat_memory_diagnostics(memory_diagnostics_t *diagnostics) {
+  memset(diagnostics, 0, sizeof(memory_diagnostics_t));
+
+  for (int region = 0; region < MEMORY_REGION_COUNT; region++) {
+    diagnostics->arena_size[region] = memory_arenas[region].size;
+    diagnostics->arena_used[region] =
+        memory_arenas[region].used.load(std::memory_order_relaxed);
+#ifndef LINUX_BUILD
+    uint32_t caps = memory_caps((memory_region_t)region);
+    diagnostics->heap_free[region] = heap_caps_get_free_size(caps);
+    diagnostics->heap_min_free[region] = heap_caps_get_minimum_free_size(caps);
+    diagnostics->heap_largest_block[region] =
+        heap_caps_get_largest_free_block(caps);
+#endif
+  }
+
+  uint32_t task_count = memory_task_count.load(std::memory_order_relaxed);
+  uint32_t block_count = memory_block_count.load(std::memory_order_relaxed);
+  diagnostics->untracked_tasks =
+      task_count > MEMORY_MAX_TASKS ? task_count - MEMORY_MAX_TASKS : 0;
+  diagnostics->untracked_blocks =
+      block_count > MEMORY_MAX_BLOCKS ? block_count - MEMORY_MAX_BLOCKS : 0;
+
+  // Host threads have host-managed stacks, nothing to measure on Linux
+#ifndef LINUX_BUILD
+  task_count = task_count < MEMORY_MAX_TASKS ? task_count : MEMORY_MAX_TASKS;
+  for (uint32_t i = 0; i < task_count; i++) {
+    memory_task_stats_t *stats = &diagnostics->tasks[i];
+    stats->name = memory_tasks[i].name;
+    stats->stack_size = memory_tasks[i].stack_size;
+    // In bytes on ESP-IDF
+    stats->stack_min_free = uxTaskGetStackHighWaterMark(memory_tasks[i].task);
+  }
+  diagnostics->task_count = task_count;
+#endif
+}
+
+void pipecat_memory_dump() {
+  memory_diagnostics_t diagnostics;
+  pipecat_memory_diagnostics(&diagnostics);
+
+  for (int region = 0; region < MEMORY_REGION_COUNT; region++) {
+    ESP_LOGI(LOG_TAG,
+             "Memory %s: arena %u/%u bytes, heap %u free, %u min free, "
+             "%u largest block",
+             memory_region_names[region],
+             (unsigned)diagnostics.arena_used[region],
+             (unsigned)diagnostics.arena_size[region],
+             (unsigned)diagnostics.heap_free[region],
+             (unsigned)diagnostics.heap_min_free[region],
+             (unsigned)diagnostics.heap_largest_block[region]);
+  }
+  uint32_t block_count = memory_block_count.load(std::memory_order_relaxed);
+  for (uint32_t i = 0; i < block_count && i < MEMORY_MAX_BLOCKS; i++) {
+    ESP_LOGI(LOG_TAG, "  %-22s %6u bytes %s", memory_blocks[i].name,
+             (unsigned)memory_blocks[i].size,
+             memory_region_names[memory_blocks[i].region]);
+  }
+  if (diagnostics.untracked_blocks > 0) {
+    ESP_LOGI(LOG_TAG, "  and %u more blocks",
+             (unsigned)diagnostics.untracked_blocks);
+  }
+  for (uint32_t i = 0; i < diagnostics.task_count; i++) {
+    const memory_task_stats_t *task = &diagnostics.tasks[i];
+    ESP_LOGI(LOG_TAG, "Stack %-16s %6u of %6u bytes used", task->name,
+             (unsigned)(task->stack_size - task->stack_min_free),
+             (unsigned)task->stack_size);
+  }
+  if (diagnostics.untracked_tasks > 0) {
+    ESP_LOGI(LOG_TAG, "  and %u more tasks",
+             (unsigned)diagnostics.untracked_tasks);
+  }
+}
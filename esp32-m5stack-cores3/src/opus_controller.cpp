@@ -0,0 +1,101 @@
+#include <esp_log.h>
+
+#include "main.h"
+
+#define OPUS_CONTROLLER_LOSS_SMOOTHING 0.3f
+#define OPUS_CONTROLLER_FEC_ON_LOSS 2.0f
+#define OPUS_CONTROLLER_FEC_OFF_LOSS 1.0f
+#define OPUS_CONTROLLER_HIGH_LOSS 10.0f
+#define OPUS_CONTROLLER_MAX_LOSS_PERC 30
+// The loss hint only moves in steps this size, or back to 0, so a smoothed
+// loss wandering around one value doesn't reapply the settings every interval
+#define OPUS_CONTROLLER_LOSS_PERC_STEP 2
+
+// Only probe upwards after a few clean intervals in a row
+#define OPUS_CONTROLLER_GOOD_INTERVALS 5
+#define OPUS_CONTROLLER_BITRATE_DOWN 0.85f
+#define OPUS_CONTROLLER_BITRATE_UP 1.1f
+
+static int32_t clamp(int32_t value, int32_t min, int32_t max) {
+  return value < min ? min : (value > max ? max : value);
+}
+
+void opus_controller_init(opus_controller_t *ctl,
+                          const opus_encoder_settings_t *initial) {
+  ctl->settings = *initial;
+  ctl->last_input = {};
+  ctl->loss_ewma = 0.0f;
+  ctl->good_intervals = 0;
+  ctl->decisions = 0;
+  ctl->changes = 0;
+}
+
+bool opus_controller_update(opus_controller_t *ctl,
+                            const opus_controller_input_t *input) {
+  opus_encoder_settings_t next = ctl->settings;
+
+  ctl->loss_ewma +=
+      (input->loss_percent - ctl->loss_ewma) * OPUS_CONTROLLER_LOSS_SMOOTHING;
+  float loss = ctl->loss_ewma;
+
+  // Tell the encoder what to expect so FEC is sized for it
+  int32_t loss_perc =
+      clamp((int32_t)(loss + 0.5f), 0, OPUS_CONTROLLER_MAX_LOSS_PERC);
+  int32_t loss_perc_delta = loss_perc - next.packet_loss_perc;
+  if (loss_perc == 0 || loss_perc_delta >= OPUS_CONTROLLER_LOSS_PERC_STEP ||
+      loss_perc_delta <= -OPUS_CONTROLLER_LOSS_PERC_STEP) {
+    next.packet_loss_perc = loss_perc;
+  }
+
+  if (loss >= OPUS_CONTROLLER_FEC_ON_LOSS) {
+    next.inband_fec = true;
+  } else if (loss < OPUS_CONTROLLER_FEC_OFF_LOSS) {
+    next.inband_fec = false;
+  }
+
+  if (loss >= OPUS_CONTROLLER_HIGH_LOSS) {
+    next.bitrate = (int32_t)(next.bitrate * OPUS_CONTROLLER_BITRATE_DOWN);
+    ctl->good_intervals = 0;
+  } else if (loss < OPUS_CONTROLLER_FEC_OFF_LOSS) {
+    if (++ctl->good_intervals >= OPUS_CONTROLLER_GOOD_INTERVALS) {
+      next.bitrate = (int32_t)(next.bitrate * OPUS_CONTROLLER_BITRATE_UP);
+      ctl->good_intervals = 0;
+    }
+  } else {
+    ctl->good_intervals = 0;
+  }
+
+  // LBRR frames are only produced with enough bitrate to carry them
+  int32_t min_bitrate = next.inband_fec ? OPUS_CONTROLLER_FEC_MIN_BITRATE
+                                        : OPUS_CONTROLLER_MIN_BITRATE;
+  next.bitrate =
+      clamp(next.bitrate, min_bitrate, OPUS_CONTROLLER_MAX_BITRATE);
+
+  if (input->encode_us > OPUS_CONTROLLER_ENCODE_BUDGET_US * 8 / 10) {
+    next.complexity--;
+  } else if (input->encode_us < OPUS_CONTROLLER_ENCODE_BUDGET_US * 4 / 10 &&
+             ctl->good_intervals > 0) {
+    next.complexity++;
+  }
+  next.complexity = clamp(next.complexity, 0, OPUS_CONTROLLER_MAX_COMPLEXITY);
+
+  ctl->last_input = *input;
+  ctl->decisions++;
+
+  bool changed = next.bitrate != ctl->settings.bitrate ||
+                 next.complexity != ctl->settings.complexity ||
+                 next.inband_fec != ctl->settings.inband_fec ||
+                 next.packet_loss_perc != ctl->settings.packet_loss_perc;
+  if (changed) {
+    ctl->changes++;
+    ESP_LOGI(LOG_TAG,
+             "Opus controller: loss %.1f%% rtt %ums encode %uus -> bitrate "
+             "%d complexity %d fec %d loss_perc %d",
+             loss, (unsigned)input->rtt_ms, (unsigned)input->encode_us,
+             (int)next.bitrate, (int)next.complexity, next.inband_fec,
+             (int)next.packet_loss_perc);
+  }
+
+  ctl->settings = next;
+  return changed;
+}
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "main.h"
+
+size_t pcm_ring_storage_size(uint32_t capacity, size_t frame_samples) {
+  return capacity * sizeof(pcm_frame_meta_t) +
+         capacity * frame_samples * sizeof(int16_t);
+}
+
+bool pcm_ring_init(pcm_ring_t *ring, uint32_t capacity, size_t frame_samples,
+                   memory_region_t region) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+    ESP_LOGE(LOG_TAG, "PCM ring capacity must be a power of two");
+    return false;
+  }
+
+  // Metadata first, it has the stricter alignment
+  uint8_t *storage = (uint8_t *)pipecat_memory_alloc(
+      region, pcm_ring_storage_size(capacity, frame_samples), "pcm_ring");
+  if (storage == NULL) {
+    return false;
+  }
+  ring->meta = (pcm_frame_meta_t *)storage;
+  ring->frames = (int16_t *)(storage + capacity * sizeof(pcm_frame_meta_t));
+
+  ring->frame_samples = frame_samples;
+  ring->capacity = capacity;
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->tail.store(0, std::memory_order_relaxed);
+  ring->overruns.store(0, std::memory_order_relaxed);
+  ring->underruns.store(0, std::memory_order_relaxed);
+  return true;
+}
+
+// Returns the frame to fill, or NULL (and counts an overrun) when the
+// consumer has fallen a whole ring behind.
+int16_t *pcm_ring_acquire_write(pcm_ring_t *ring) {
+  uint32_t head = ring->head.load(std::memory_order_relaxed);
+  uint32_t tail = ring->tail.load(std::memory_order_acquire);
+  if (head - tail == ring->capacity) {
+    ring->overruns.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+  }
+  return ring->frames + (head & (ring->capacity - 1)) * ring->frame_samples;
+}
+
+void pcm_ring_commit_write(pcm_ring_t *ring, int64_t origin_us) {
+  uint32_t head = ring->head.load(std::memory_order_relaxed);
+  pcm_frame_meta_t *meta = &ring->meta[head & (ring->capacity - 1)];
+  meta->queued_us = esp_timer_get_time();
+  meta->origin_us = origin_us != 0 ? origin_us : meta->queued_us;
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+const int16_t *pcm_ring_acquire_read(pcm_ring_t *ring, pcm_frame_meta_t *meta) {
+  uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint32_t head = ring->head.load(std::memory_order_acquire);
+  if (head == tail) {
+    return NULL;
+  }
+  uint32_t index = tail & (ring->capacity - 1);
+  if (meta != NULL) {
+    *meta = ring->meta[index];
+  }
+  return ring->frames + index * ring->frame_samples;
+}
+
+void pcm_ring_release_read(pcm_ring_t *ring) {
+  uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+uint32_t pcm_ring_count(pcm_ring_t *ring) {
+  return ring->head.load(std::memory_order_acquire) -
+         ring->tail.load(std::memory_order_acquire);
+}
@@ -0,0 +1,174 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef LINUX_BUILD
+#include <esp_heap_caps.h>
+#endif
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+static_assert((RECORD_RING_SIZE & (RECORD_RING_SIZE - 1)) == 0,
+              "RECORD_RING_SIZE must be a power of two");
+static_assert(sizeof(record_file_header_t) == 16,
+              "record_file_header_t is a file format");
+static_assert(sizeof(record_header_t) == 12,
+              "record_header_t is a file format");
+
+// head and tail count bytes since the start and only ever grow. Writers
+// fill [head, tail + RECORD_RING_SIZE) under the mutex, the flush task
+// alone drains [tail, head).
+static uint8_t *record_ring = NULL;
+static std::atomic<bool> record_started(false);
+static std::atomic<uint32_t> record_head(0);
+static std::atomic<uint32_t> record_tail(0);
+static SemaphoreHandle_t record_mutex;
+static FILE *record_file;
+static int64_t record_last_us;  // Under the mutex
+static uint32_t record_dropped;  // Under the mutex, not yet reported
+
+static void record_copy(uint32_t position, const void *data, size_t len) {
+  uint32_t index = position & (RECORD_RING_SIZE - 1);
+  size_t first = MIN(len, (size_t)(RECORD_RING_SIZE - index));
+  memcpy(record_ring + index, data, first);
+  memcpy(record_ring, (const uint8_t *)data + first, len - first);
+}
+
+// Copies a header and up to two payload parts, or counts the record as
+// dropped. Runs under the mutex.
+static bool record_append(uint32_t session, record_kind_t kind,
+                          const void *prefix, size_t prefix_len,
+                          const void *data, size_t len, int64_t now_us) {
+  size_t payload = prefix_len + len;
+  uint32_t head = record_head.load(std::memory_order_relaxed);
+  uint32_t used = head - record_tail.load(std::memory_order_acquire);
+  if (payload > UINT16_MAX ||
+      used + sizeof(record_header_t) + payload > RECORD_RING_SIZE) {
+    return false;
+  }
+
+  record_header_t header = {
+      .delta_us = (uint32_t)(now_us - record_last_us),
+      .session = session,
+      .length = (uint16_t)payload,
+      .kind = (uint8_t)kind,
+      .reserved = 0,
+  };
+  record_last_us = now_us;
+  record_copy(head, &header, sizeof(header));
+  head += sizeof(header);
+  if (prefix_len > 0) {
+    record_copy(head, prefix, prefix_len);
+    head += prefix_len;
+  }
+  if (len > 0) {
+    record_copy(head, data, len);
+    head += len;
+  }
+  record_head.store(head, std::memory_order_release);
+  return true;
+}
+
+static void record_write(pipecat_session_t *session, record_kind_t kind,
+                         const void *prefix, size_t prefix_len,
+                         const void *data, size_t len) {
+  if (!record_started.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  xSemaphoreTake(record_mutex, portMAX_DELAY);
+  int64_t now_us = esp_timer_get_time();
+  // Lost records can be any session's, so the count is nobody's
+  if (record_dropped > 0 &&
+      record_append(RECORD_SESSION_NONE, RECORD_DROPPED, &record_dropped,
+                    sizeof(record_dropped), NULL, 0, now_us)) {
+    record_dropped = 0;
+  }
+  if (record_dropped > 0 ||
+      !record_append(session->config.index, kind, prefix, prefix_len, data,
+                     len, now_us)) {
+    record_dropped++;
+  }
+  xSemaphoreGive(record_mutex);
+}
+
+void pipecat_record(pipecat_session_t *session, record_kind_t kind,
+                    const void *data, size_t len) {
+  record_write(session, kind, NULL, 0, data, len);
+}
+
+void pipecat_record_audio_rx(pipecat_session_t *session, uint16_t seq,
+                             uint32_t timestamp, const uint8_t *data,
+                             size_t len) {
+  uint8_t prefix[6];
+  memcpy(prefix, &seq, sizeof(seq));
+  memcpy(prefix + 2, &timestamp, sizeof(timestamp));
+  record_write(session, RECORD_AUDIO_RX, prefix, sizeof(prefix), data, len);
+}
+
+static void pipecat_record_task(void *user_data) {
+  while (1) {
+    vTaskDelay(pdMS_TO_TICKS(RECORD_FLUSH_INTERVAL_MS));
+
+    uint32_t tail = record_tail.load(std::memory_order_relaxed);
+    uint32_t head = record_head.load(std::memory_order_acquire);
+    if (head == tail) {
+      continue;
+    }
+    uint32_t index = tail & (RECORD_RING_SIZE - 1);
+    size_t len = head - tail;
+    size_t first = MIN(len, (size_t)(RECORD_RING_SIZE - index));
+    fwrite(record_ring + index, 1, first, record_file);
+    fwrite(record_ring, 1, len - first, record_file);
+    fflush(record_file);
+    record_tail.store(head, std::memory_order_release);
+  }
+}
+
+bool pipecat_record_start(const char *path) {
+  if (record_started) {
+    return true;
+  }
+
+#ifndef LINUX_BUILD
+  record_ring = (uint8_t *)heap_caps_malloc(RECORD_RING_SIZE,
+                                            MALLOC_CAP_SPIRAM);
+#else
+  record_ring = (uint8_t *)malloc(RECORD_RING_SIZE);
+#endif
+  record_mutex = xSemaphoreCreateMutex();
+  record_file = fopen(path, "wb");
+  if (record_ring == NULL || record_mutex == NULL || record_file == NULL) {
+    ESP_LOGE(LOG_TAG, "Unable to record to %s", path);
+    return false;
+  }
+
+  record_file_header_t header = {
+      .magic = {'P', 'C', 'R', 'C'},
+      .version = RECORD_VERSION,
+      .reserved = 0,
+      .codec_rate = pipecat_audio_config.codec_rate,
+      .frame_ms = pipecat_audio_config.frame_ms,
+  };
+  fwrite(&header, 1, sizeof(header), record_file);
+  record_last_us = esp_timer_get_time();
+
+  TaskHandle_t task = NULL;
+  xTaskCreate(pipecat_record_task, "record", RECORD_TASK_STACK_SIZE, NULL,
+              RECORD_TASK_PRIORITY, &task);
+  pipecat_memory_track_task(task, "record", RECORD_TASK_STACK_SIZE);
+  record_started.store(true, std::memory_order_release);
+
+  ESP_LOGI(LOG_TAG, "Recording to %s", path);
+  return true;
+}
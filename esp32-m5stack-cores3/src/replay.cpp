@@ -0,0 +1,219 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+// `src.elf --replay FILE [--fast]`, see "Session record" in main.h. The
+// recording's clock drives the jitter buffer: every record and every
+// playout tick in between is handed the time it happened at (plus a fixed
+// offset), whether or not we actually wait for it.
+#define REPLAY_LOG_TAG "replay"
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#define REPLAY_KIND_COUNT (RECORD_DROPPED + 1)
+
+static const char *replay_kind_names[REPLAY_KIND_COUNT] = {
+    "audio rx", "data rx", "audio tx", "data tx", "reset", "dropped",
+};
+
+// Sleeps until `clock_us` in real time, or in fast mode until playback has
+// room, so neither mode overruns the playback ring
+static void replay_wait(pipecat_session_t *session, int64_t clock_us,
+                        bool fast) {
+  if (!fast) {
+    int64_t wait_us = clock_us - esp_timer_get_time();
+    if (wait_us > 0) {
+      vTaskDelay(pdMS_TO_TICKS((wait_us + 999) / 1000));
+    }
+    return;
+  }
+
+  audio_playback_stats_t playback;
+  pipecat_audio_playback_stats(session, &playback);
+  while (playback.buffered_frames >= REPLAY_FAST_MAX_BUFFERED_FRAMES) {
+    vTaskDelay(1);
+    pipecat_audio_playback_stats(session, &playback);
+  }
+}
+
+static bool replay_read_header(FILE *file, const char *path) {
+  record_file_header_t header;
+  if (fread(&header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header.magic, "PCRC", 4) != 0) {
+    ESP_LOGE(REPLAY_LOG_TAG, "%s is not a session recording", path);
+    return false;
+  }
+  if (header.version != RECORD_VERSION) {
+    ESP_LOGE(REPLAY_LOG_TAG, "%s is version %u, expected %u", path,
+             (unsigned)header.version, (unsigned)RECORD_VERSION);
+    return false;
+  }
+
+  // Decode at the rates the client was using, which this build must
+  // support too: a frame_ms of 0 would never advance the playout clock
+  audio_config_t config = pipecat_audio_config;
+  config.codec_rate = header.codec_rate;
+  config.frame_ms = header.frame_ms;
+  if (!audio_config_valid(&config)) {
+    ESP_LOGE(REPLAY_LOG_TAG, "%s: unsupported %lu Hz, %lu ms frames", path,
+             (unsigned long)header.codec_rate, (unsigned long)header.frame_ms);
+    return false;
+  }
+  pipecat_audio_config = config;
+  ESP_LOGI(REPLAY_LOG_TAG, "%s: %lu Hz, %lu ms frames", path,
+           (unsigned long)header.codec_rate, (unsigned long)header.frame_ms);
+  return true;
+}
+
+int pipecat_replay(const char *path, bool fast) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    ESP_LOGE(REPLAY_LOG_TAG, "Unable to open %s", path);
+    return 1;
+  }
+  if (!replay_read_header(file, path)) {
+    fclose(file);
+    return 1;
+  }
+
+  pipecat_init_tlog();
+  pipecat_session_config_t config = {
+      .index = 0,
+      .url = NULL,
+      .device = &pipecat_audio_device,
+      .device_context = audio_device_wav_create(
+          NULL, getenv("PIPECAT_SPEAKER_WAV"), !fast, false),
+  };
+  pipecat_session_t *session = &pipecat_session;
+  if (config.device_context == NULL || !pipecat_init_memory() ||
+      !pipecat_session_create(session, &config)) {
+    fclose(file);
+    return 1;
+  }
+  pipecat_init_rtvi_callbacks();
+  pipecat_init_audio_capture(session);
+  pipecat_init_audio_decoder(session);
+  pipecat_init_rtvi(session);
+
+  uint32_t counts[REPLAY_KIND_COUNT] = {0};
+  uint32_t dropped = 0;
+  uint8_t *payload = (uint8_t *)malloc(UINT16_MAX + 1);
+  if (payload == NULL) {
+    fclose(file);
+    return 1;
+  }
+
+  int64_t tick_us = pipecat_audio_config.frame_ms * 1000LL;
+  int64_t started_us = esp_timer_get_time();
+  int64_t clock_us = started_us;  // The recording's time, shifted to now
+  int64_t next_tick_us = clock_us + tick_us;
+  record_header_t header;
+  while (fread(&header, 1, sizeof(header), file) == sizeof(header)) {
+    if (fread(payload, 1, header.length, file) != header.length) {
+      ESP_LOGW(REPLAY_LOG_TAG, "Recording ends mid-record");
+      break;
+    }
+    // Keeps RTVI messages printable and the parser within bounds
+    payload[header.length] = '\0';
+
+    clock_us += header.delta_us;
+    while (next_tick_us <= clock_us) {
+      replay_wait(session, next_tick_us, fast);
+      pipecat_audio_playout_tick(session, next_tick_us);
+      next_tick_us += tick_us;
+    }
+    if (header.kind < REPLAY_KIND_COUNT) {
+      counts[header.kind]++;
+    }
+    if (header.kind == RECORD_DROPPED) {
+      // Not one session's, some of them may have been session 0's
+      uint32_t lost = 0;
+      memcpy(&lost, payload, MIN(sizeof(lost), (size_t)header.length));
+      dropped += lost;
+      ESP_LOGW(REPLAY_LOG_TAG, "The recorder dropped %lu records here",
+               (unsigned long)lost);
+      continue;
+    }
+    if (header.session != 0) {
+      continue;
+    }
+
+    replay_wait(session, clock_us, fast);
+    switch (header.kind) {
+      case RECORD_AUDIO_RX: {
+        if (header.length < 6) {
+          break;
+        }
+        uint16_t seq;
+        uint32_t timestamp;
+        memcpy(&seq, payload, sizeof(seq));
+        memcpy(&timestamp, payload + 2, sizeof(timestamp));
+        pipecat_audio_receive(session, seq, timestamp, payload + 6,
+                              header.length - 6, clock_us);
+        break;
+      }
+      case RECORD_DATA_RX:
+        pipecat_rtvi_handle_message(session, (const char *)payload,
+                                    header.length);
+        if (fast) {
+          // Let the RTVI task keep up rather than run out of slots
+          vTaskDelay(1);
+        }
+        break;
+      case RECORD_RESET:
+        pipecat_audio_reset_downlink(session);
+        break;
+      default:
+        // What the client sent, counted only
+        break;
+    }
+  }
+  fclose(file);
+  free(payload);
+
+  // Play out the tail, the jitter buffer holds at most its maximum delay
+  for (int i = 0; i <= JITTER_BUFFER_MAX_DELAY_MS / JITTER_BUFFER_FRAME_MS;
+       i++) {
+    replay_wait(session, next_tick_us, fast);
+    pipecat_audio_playout_tick(session, next_tick_us);
+    next_tick_us += tick_us;
+  }
+  audio_playback_stats_t playback;
+  do {
+    vTaskDelay(pdMS_TO_TICKS(JITTER_BUFFER_FRAME_MS));
+    pipecat_audio_playback_stats(session, &playback);
+  } while (playback.buffered_frames > 0);
+
+  int64_t recorded_us = clock_us - started_us;
+  int64_t elapsed_us = esp_timer_get_time() - started_us;
+  rtvi_parser_stats_t parser;
+  pipecat_rtvi_parser_stats(session, &parser);
+  for (int kind = 0; kind < REPLAY_KIND_COUNT; kind++) {
+    ESP_LOGI(REPLAY_LOG_TAG, "%-9s %lu records", replay_kind_names[kind],
+             (unsigned long)counts[kind]);
+  }
+  ESP_LOGI(REPLAY_LOG_TAG,
+           "%.1fs recorded in %.1fs (%.1fx), %lu records lost when "
+           "recording",
+           recorded_us / 1e6, elapsed_us / 1e6,
+           elapsed_us > 0 ? (double)recorded_us / elapsed_us : 0.0,
+           (unsigned long)dropped);
+  ESP_LOGI(REPLAY_LOG_TAG,
+           "Playback: %lu underruns, %lu overruns, %lu decode errors | "
+           "RTVI: %lu parsed, %lu invalid, %lu dropped",
+           (unsigned long)playback.underruns, (unsigned long)playback.overruns,
+           (unsigned long)playback.decode_errors,
+           (unsigned long)parser.parsed, (unsigned long)parser.invalid,
+           (unsigned long)parser.dropped);
+  pipecat_trace_dump();
+  return 0;
+}
@@ -0,0 +1,135 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_log.h>
+
+#include "main.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Fraction of the narrower Nyquist band kept, the rest is transition
+#define RESAMPLER_PASSBAND 0.9
+
+static uint32_t resampler_gcd(uint32_t a, uint32_t b) {
+  while (b != 0) {
+    uint32_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Blackman-windowed sinc at the upsampled rate, split into `up` phases, each
+// normalized to unity DC gain
+static void resampler_design(resampler_t *resampler) {
+  uint32_t up = resampler->up;
+  uint32_t phase_taps = resampler->phase_taps;
+  int length = up * phase_taps;
+  double cutoff =
+      RESAMPLER_PASSBAND * 0.5 / (up > resampler->down ? up : resampler->down);
+  double center = (length - 1) / 2.0;
+
+  for (uint32_t phase = 0; phase < up; phase++) {
+    double taps[RESAMPLER_MAX_TAPS];
+    double sum = 0.0;
+    for (uint32_t k = 0; k < phase_taps; k++) {
+      int n = phase + k * up;
+      double x = n - center;
+      double sinc = x == 0.0 ? 2.0 * cutoff
+                             : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+      double window = 0.42 - 0.5 * cos(2.0 * M_PI * n / (length - 1)) +
+                      0.08 * cos(4.0 * M_PI * n / (length - 1));
+      taps[k] = sinc * window;
+      sum += taps[k];
+    }
+    int16_t *out = &resampler->taps[phase * phase_taps];
+    for (uint32_t k = 0; k < phase_taps; k++) {
+      long q15 = lround(taps[k] / sum * 32768.0);
+      out[k] = (int16_t)(q15 > INT16_MAX ? INT16_MAX
+                                         : (q15 < INT16_MIN ? INT16_MIN : q15));
+    }
+  }
+}
+
+bool resampler_init(resampler_t *resampler, uint32_t from_rate,
+                    uint32_t to_rate, size_t max_input) {
+  uint32_t gcd = resampler_gcd(from_rate, to_rate);
+  resampler->up = to_rate / gcd;
+  resampler->down = from_rate / gcd;
+  if (resampler->up > RESAMPLER_MAX_RATIO ||
+      resampler->down > RESAMPLER_MAX_RATIO) {
+    ESP_LOGE(LOG_TAG, "Unsupported resampling ratio %u:%u",
+             (unsigned)from_rate, (unsigned)to_rate);
+    return false;
+  }
+  // Taps are spent at the lower of the two rates
+  resampler->phase_taps =
+      resampler->down > resampler->up
+          ? (RESAMPLER_TAPS * resampler->down + resampler->up - 1) /
+                resampler->up
+          : RESAMPLER_TAPS;
+
+  resampler->max_input = max_input;
+  resampler->work = (int16_t *)calloc(resampler->phase_taps - 1 + max_input,
+                                      sizeof(int16_t));
+  if (resampler->work == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate resampler");
+    return false;
+  }
+
+  resampler_design(resampler);
+  resampler_reset(resampler);
+  return true;
+}
+
+void resampler_free(resampler_t *resampler) {
+  free(resampler->work);
+  resampler->work = NULL;
+}
+
+void resampler_reset(resampler_t *resampler) {
+  resampler->position = 0;
+  memset(resampler->work, 0, (resampler->phase_taps - 1) * sizeof(int16_t));
+}
+
+size_t resampler_process(resampler_t *resampler, const int16_t *input,
+                         size_t count, int16_t *output) {
+  if (count > resampler->max_input) {
+    count = resampler->max_input;
+  }
+
+  // work[history + i] is input[i], anything before it is history
+  size_t history = resampler->phase_taps - 1;
+  int16_t *work = resampler->work;
+  memcpy(work + history, input, count * sizeof(int16_t));
+
+  uint32_t up = resampler->up;
+  uint32_t down = resampler->down;
+  uint32_t phase_taps = resampler->phase_taps;
+  uint64_t end = (uint64_t)count * up;
+  uint64_t position = resampler->position;
+  size_t produced = 0;
+
+  while (position < end) {
+    const int16_t *taps = &resampler->taps[(position % up) * phase_taps];
+    const int16_t *x = work + history + position / up;
+
+    // Each phase sums to 1.0 with little overshoot, so 32 bits are plenty
+    int32_t acc = 1 << 14;
+    for (uint32_t k = 0; k < phase_taps; k++) {
+      acc += (int32_t)taps[k] * x[-(int32_t)k];
+    }
+    acc >>= 15;
+    output[produced++] =
+        (int16_t)(acc > INT16_MAX ? INT16_MAX
+                                  : (acc < INT16_MIN ? INT16_MIN : acc));
+    position += down;
+  }
+  resampler->position = (uint32_t)(position - end);
+
+  memmove(work, work + count, history * sizeof(int16_t));
+  return produced;
+}
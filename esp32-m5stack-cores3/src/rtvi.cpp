@@ -1,143 +1,546 @@
-#include <cJSON.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <new>
+
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
 
 #include "main.h"
 
-#define MAX_TYPE_LEN 32
-#define MAX_ID_LEN 64
+struct rtvi_state {
+  // Set between pipecat_rtvi_attach() and pipecat_rtvi_detach(), only
+  // dereferenced on the WebRTC loop
+  std::atomic<PeerConnection *> peer_connection;
+
+  // Incoming messages are parsed straight into a preallocated slot. Slot
+  // indices move from free_queue to ready_queue (network thread) and back
+  // (rtvi_task), so nothing is allocated per message.
+  rtvi_message_t *slots;
+  QueueHandle_t free_queue;
+  QueueHandle_t ready_queue;
+  rtvi_parser_stats_t parser_stats;
+
+  // Outgoing messages take the same route in the other direction:
+  // serialized into a free buffer by the sender, queued (or parked in
+  // send_pending under their coalesce key) and sent by
+  // pipecat_rtvi_flush().
+  char *send_buffers;
+  size_t send_lengths[RTVI_SEND_SLOTS];
+  QueueHandle_t send_free_queue;
+  QueueHandle_t send_queue;
+  std::atomic<int> send_pending[RTVI_COALESCE_COUNT];
+  int send_retry;  // Only touched by pipecat_rtvi_flush(), -1 for none
+  std::atomic<uint32_t> id;
 
-static int rtvi_id = 0;
-static QueueHandle_t rtvi_queue;
-static PeerConnection *peer_connection = NULL;
-static rtvi_callbacks_t *rtvi_callbacks = NULL;
+  struct {
+    std::atomic<uint32_t> queued;
+    std::atomic<uint32_t> sent;
+    std::atomic<uint32_t> coalesced;
+    std::atomic<uint32_t> dropped;
+    std::atomic<uint32_t> overflow;
+    std::atomic<uint32_t> retries;
+    std::atomic<uint32_t> bytes;
+    std::atomic<uint32_t> queued_bytes;
+  } send_stats;
+
+  // Only touched from rtvi_task
+  char trace_json[TRACE_JSON_BUFFER_SIZE];
+};
 
 typedef struct {
-  cJSON *msg;
-} rtvi_msg_t;
+  const char *t;
+  rtvi_data_writer_t write_data;
+  const void *ctx;
+} rtvi_client_message_t;
 
-// Simple hashing function so we can fake pattern matching and switch on strings
-// as a constexpr so it gets evaluated in compile time for static strings
-static constexpr unsigned int hash(const char *s, int off = 0) {
-  return !s[off] ? 5381 : (hash(s, off + 1) * 33) ^ s[off];
-}
+#define RTVI_TASK_STACK_SIZE 4096
+#define RTVI_TASK_PRIORITY 2
+#define RTVI_TASK_CORE 1
 
-static rtvi_msg_t *create_rtvi_message(const char *type) {
-  cJSON *j_msg = cJSON_CreateObject();
+// Only touched when a message comes or goes, fine in PSRAM
+#define RTVI_MEMORY_REGION MEMORY_PSRAM
 
-  if (j_msg == NULL) {
-    ESP_LOGE(LOG_TAG, "Unable to create RTVI message");
-    return NULL;
+static void rtvi_write_client_message(json_writer_t *w, const void *ctx) {
+  const rtvi_client_message_t *msg = (const rtvi_client_message_t *)ctx;
+  json_writer_object_begin(w);
+  json_writer_key(w, "t");
+  json_writer_string(w, msg->t);
+  if (msg->write_data != NULL) {
+    json_writer_key(w, "d");
+    msg->write_data(w, msg->ctx);
   }
-  if (cJSON_AddStringToObject(j_msg, "label", "rtvi-ai") == NULL) {
-    cJSON_Delete(j_msg);
-    ESP_LOGE(LOG_TAG, "Unable to create RTVI message");
-    return NULL;
+  json_writer_object_end(w);
+}
+
+static void rtvi_write_raw(json_writer_t *w, const void *ctx) {
+  json_writer_raw(w, (const char *)ctx);
+}
+
+// Answers a `server-message` asking for the latency trace with a
+// `client-message` carrying the histograms, and logs them on the console too.
+static void rtvi_send_trace(pipecat_session_t *session, bool reset) {
+  char *trace_json = session->rtvi->trace_json;
+  pipecat_trace_dump();
+  if (pipecat_trace_to_json(trace_json, TRACE_JSON_BUFFER_SIZE) == 0) {
+    ESP_LOGE(LOG_TAG, "Latency trace does not fit in %d bytes",
+             TRACE_JSON_BUFFER_SIZE);
+    return;
   }
-  if (cJSON_AddStringToObject(j_msg, "type", type) == NULL) {
-    cJSON_Delete(j_msg);
-    ESP_LOGE(LOG_TAG, "Unable to create RTVI message");
-    return NULL;
+  if (reset) {
+    pipecat_trace_reset();
   }
 
-  char id[MAX_ID_LEN];
-  sprintf(id, "%d", rtvi_id++);
-  if (cJSON_AddStringToObject(j_msg, "id", id) == NULL) {
-    cJSON_Delete(j_msg);
-    ESP_LOGE(LOG_TAG, "Unable to create RTVI message");
-    return NULL;
+  pipecat_rtvi_send_client_message(session, TRACE_RTVI_MESSAGE_TYPE,
+                                   rtvi_write_raw, trace_json,
+                                   RTVI_COALESCE_NONE);
+}
+
+// {"type": "pipecat-esp32-trace", "reset": true} in `data`
+static void rtvi_on_server_message(pipecat_session_t *session,
+                                   const rtvi_message_t *msg,
+                                   void *user_data) {
+  if (strcmp(msg->data_type, TRACE_RTVI_MESSAGE_TYPE) == 0) {
+    rtvi_send_trace(session, msg->reset);
   }
+}
+
+static void rtvi_task(void *user_data) {
+  pipecat_session_t *session = (pipecat_session_t *)user_data;
+  rtvi_state_t *rtvi = session->rtvi;
+  uint8_t slot;
 
-  rtvi_msg_t *msg = (rtvi_msg_t *)malloc(sizeof(rtvi_msg_t));
-  msg->msg = j_msg;
+  while (1) {
+    if (xQueueReceive(rtvi->ready_queue, &slot, portMAX_DELAY)) {
+      rtvi_dispatch(session, &rtvi->slots[slot]);
+      xQueueSend(rtvi->free_queue, &slot, 0);
+    }
+  }
+}
 
-  return msg;
+void pipecat_rtvi_memory_plan(memory_plan_t *plan) {
+  memory_plan_add(plan, RTVI_MEMORY_REGION, sizeof(rtvi_state_t));
+  memory_plan_add(plan, RTVI_MEMORY_REGION,
+                  RTVI_MESSAGE_SLOTS * sizeof(rtvi_message_t));
+  memory_plan_add(plan, RTVI_MEMORY_REGION,
+                  RTVI_SEND_SLOTS * RTVI_SEND_BUFFER_SIZE);
 }
 
-static void destroy_rtvi_message(rtvi_msg_t *msg) {
-  cJSON_Delete(msg->msg);
-  free(msg);
+bool pipecat_rtvi_session_create(pipecat_session_t *session) {
+  void *state = pipecat_memory_alloc(RTVI_MEMORY_REGION, sizeof(rtvi_state_t),
+                                     "rtvi_state");
+  if (state == NULL) {
+    return false;
+  }
+  rtvi_state_t *rtvi = new (state) rtvi_state_t();
+  rtvi->send_retry = -1;
+  for (int key = 0; key < RTVI_COALESCE_COUNT; key++) {
+    rtvi->send_pending[key] = -1;
+  }
+  session->rtvi = rtvi;
+  return true;
 }
 
-static char *rtvi_message_to_string(rtvi_msg_t *msg) {
-  if (msg == NULL || msg->msg == NULL) {
-    return NULL;
+void pipecat_init_rtvi(pipecat_session_t *session) {
+  rtvi_state_t *rtvi = session->rtvi;
+  if (rtvi->slots != NULL) {
+    return;
   }
 
-  char *msg_str = cJSON_Print(msg->msg);
+  pipecat_rtvi_subscribe(RTVI_EVENT_SERVER_MESSAGE, rtvi_on_server_message,
+                         NULL);
 
-  return msg_str;
+  rtvi->slots = (rtvi_message_t *)pipecat_memory_alloc(
+      RTVI_MEMORY_REGION, RTVI_MESSAGE_SLOTS * sizeof(rtvi_message_t),
+      "rtvi_slots");
+  if (rtvi->slots == NULL) {
+    return;
+  }
+
+  char *send_buffers = (char *)pipecat_memory_alloc(
+      RTVI_MEMORY_REGION, RTVI_SEND_SLOTS * RTVI_SEND_BUFFER_SIZE,
+      "rtvi_send_buffers");
+  if (send_buffers == NULL) {
+    return;
+  }
+
+  rtvi->send_free_queue = xQueueCreate(RTVI_SEND_SLOTS, sizeof(uint8_t));
+  rtvi->send_queue = xQueueCreate(RTVI_SEND_SLOTS, sizeof(uint8_t));
+  for (uint8_t slot = 0; slot < RTVI_SEND_SLOTS; slot++) {
+    xQueueSend(rtvi->send_free_queue, &slot, 0);
+  }
+  // Senders check this, so only once the queues exist
+  rtvi->send_buffers = send_buffers;
+
+  rtvi->free_queue = xQueueCreate(RTVI_MESSAGE_SLOTS, sizeof(uint8_t));
+  rtvi->ready_queue = xQueueCreate(RTVI_MESSAGE_SLOTS, sizeof(uint8_t));
+  for (uint8_t slot = 0; slot < RTVI_MESSAGE_SLOTS; slot++) {
+    xQueueSend(rtvi->free_queue, &slot, 0);
+  }
+
+  TaskHandle_t rtvi_task_handle = NULL;
+  xTaskCreatePinnedToCore(rtvi_task, "RTVI Task", RTVI_TASK_STACK_SIZE,
+                          session, RTVI_TASK_PRIORITY, &rtvi_task_handle,
+                          RTVI_TASK_CORE);
+  pipecat_memory_track_task(rtvi_task_handle, "RTVI Task",
+                            RTVI_TASK_STACK_SIZE);
 }
 
-static void rtvi_handle_message(const rtvi_msg_t *msg) {
-  cJSON *j_type = cJSON_GetObjectItem(msg->msg, "type");
-  if (j_type == NULL) {
-    ESP_LOGE(LOG_TAG, "Unable to find `type` field in RTVI message");
+static void rtvi_release_send_slot(rtvi_state_t *rtvi, int slot) {
+  uint8_t released = slot;
+  rtvi->send_stats.dropped++;
+  xQueueSend(rtvi->send_free_queue, &released, 0);
+}
+
+// Gives back every slot still queued, parked or awaiting a retry, counted
+// as dropped. Runs on the WebRTC loop, like pipecat_rtvi_flush().
+static void rtvi_drop_queued(rtvi_state_t *rtvi) {
+  if (rtvi->send_buffers == NULL) {
     return;
   }
 
-  switch (hash(j_type->valuestring)) {
-    case hash("bot-started-speaking"):
-      rtvi_callbacks->on_bot_started_speaking();
-      break;
-    case hash("bot-stopped-speaking"):
-      rtvi_callbacks->on_bot_stopped_speaking();
-      break;
-    case hash("bot-tts-text"): {
-      cJSON *j_data = cJSON_GetObjectItem(msg->msg, "data");
-      cJSON *j_text = cJSON_GetObjectItem(j_data, "text");
-      rtvi_callbacks->on_bot_tts_text(j_text->valuestring);
-      break;
+  if (rtvi->send_retry >= 0) {
+    rtvi_release_send_slot(rtvi, rtvi->send_retry);
+    rtvi->send_retry = -1;
+  }
+  uint8_t slot;
+  while (xQueueReceive(rtvi->send_queue, &slot, 0)) {
+    rtvi_release_send_slot(rtvi, slot);
+  }
+  for (int key = 0; key < RTVI_COALESCE_COUNT; key++) {
+    int pending = rtvi->send_pending[key].exchange(-1);
+    if (pending >= 0) {
+      rtvi_release_send_slot(rtvi, pending);
     }
-    default:
-      break;
   }
 }
 
-static void rtvi_task(void *pvParameter) {
-  rtvi_msg_t msg;
+// A sender that saw the old connection just before detach may have queued
+// after the drain, so the new connection starts from an empty queue too
+void pipecat_rtvi_attach(pipecat_session_t *session,
+                         PeerConnection *connection) {
+  rtvi_state_t *rtvi = session->rtvi;
+  rtvi_drop_queued(rtvi);
+  rtvi->peer_connection = connection;
+}
+
+void pipecat_rtvi_detach(pipecat_session_t *session) {
+  rtvi_state_t *rtvi = session->rtvi;
+  rtvi->peer_connection = nullptr;
+  rtvi_drop_queued(rtvi);
+}
 
-  while (1) {
-    if (xQueueReceive(rtvi_queue, &msg, portMAX_DELAY)) {
-      rtvi_handle_message(&msg);
-      cJSON_Delete(msg.msg);
-    }
+bool pipecat_rtvi_send(pipecat_session_t *session, const char *type,
+                       rtvi_data_writer_t write_data, const void *ctx,
+                       rtvi_coalesce_t coalesce) {
+  rtvi_state_t *rtvi = session->rtvi;
+  uint8_t slot;
+  if (rtvi->send_buffers == NULL || rtvi->peer_connection == nullptr ||
+      !xQueueReceive(rtvi->send_free_queue, &slot, 0)) {
+    rtvi->send_stats.dropped++;
+    return false;
+  }
+
+  char id[16];
+  snprintf(id, sizeof(id), "%lu", (unsigned long)rtvi->id++);
+
+  json_writer_t w;
+  json_writer_init(&w, rtvi->send_buffers + slot * RTVI_SEND_BUFFER_SIZE,
+                   RTVI_SEND_BUFFER_SIZE);
+  json_writer_object_begin(&w);
+  json_writer_key(&w, "label");
+  json_writer_string(&w, "rtvi-ai");
+  json_writer_key(&w, "type");
+  json_writer_string(&w, type);
+  json_writer_key(&w, "id");
+  json_writer_string(&w, id);
+  if (write_data != NULL) {
+    json_writer_key(&w, "data");
+    write_data(&w, ctx);
+  }
+  json_writer_object_end(&w);
+
+  size_t len = json_writer_finish(&w);
+  if (len == 0) {
+    ESP_LOGE(LOG_TAG, "RTVI %s message does not fit in %d bytes", type,
+             RTVI_SEND_BUFFER_SIZE);
+    rtvi->send_stats.overflow++;
+    xQueueSend(rtvi->send_free_queue, &slot, 0);
+    return false;
+  }
+  rtvi->send_lengths[slot] = len;
+  rtvi->send_stats.queued++;
+  rtvi->send_stats.queued_bytes += len;
+
+  if (coalesce == RTVI_COALESCE_NONE) {
+    xQueueSend(rtvi->send_queue, &slot, 0);
+    pipecat_webrtc_wake(session);
+    return true;
   }
+
+  // Whatever was still parked under this key is stale now
+  int previous = rtvi->send_pending[coalesce].exchange(slot);
+  if (previous >= 0) {
+    uint8_t stale = previous;
+    rtvi->send_stats.coalesced++;
+    xQueueSend(rtvi->send_free_queue, &stale, 0);
+  }
+  pipecat_webrtc_wake(session);
+  return true;
 }
 
-void pipecat_init_rtvi(PeerConnection *connection,
-                       rtvi_callbacks_t *callbacks) {
-  peer_connection = connection;
-  rtvi_callbacks = callbacks;
+bool pipecat_rtvi_send_client_message(pipecat_session_t *session,
+                                      const char *t,
+                                      rtvi_data_writer_t write_data,
+                                      const void *ctx,
+                                      rtvi_coalesce_t coalesce) {
+  rtvi_client_message_t msg = {.t = t, .write_data = write_data, .ctx = ctx};
+  return pipecat_rtvi_send(session, "client-message",
+                           rtvi_write_client_message, &msg, coalesce);
+}
+
+void pipecat_rtvi_send_client_ready(pipecat_session_t *session) {
+  pipecat_rtvi_send(session, "client-ready", NULL, NULL, RTVI_COALESCE_NONE);
+}
 
-  rtvi_queue = xQueueCreate(10, sizeof(rtvi_msg_t));
-  xTaskCreatePinnedToCore(rtvi_task, "RTVI Task", 4096, NULL, 2, NULL, 1);
+void pipecat_rtvi_send_user_speaking(pipecat_session_t *session,
+                                     bool speaking) {
+  pipecat_rtvi_send_client_message(
+      session,
+      speaking ? RTVI_USER_STARTED_SPEAKING_MESSAGE_TYPE
+               : RTVI_USER_STOPPED_SPEAKING_MESSAGE_TYPE,
+      NULL, NULL, RTVI_COALESCE_NONE);
 }
 
-void pipecat_rtvi_send_client_ready() {
-  rtvi_msg_t *msg = create_rtvi_message("client-ready");
+static void rtvi_write_client_metrics(json_writer_t *w, const void *ctx) {
+  pipecat_session_t *session = (pipecat_session_t *)ctx;
+  const rtvi_parser_stats_t *parser = &session->rtvi->parser_stats;
+  audio_playback_stats_t playback;
+  audio_capture_stats_t capture;
+  rtvi_send_stats_t send;
+  webrtc_loop_stats_t loop;
+  pipecat_audio_playback_stats(session, &playback);
+  pipecat_audio_capture_stats(session, &capture);
+  pipecat_rtvi_send_stats(session, &send);
+  pipecat_webrtc_loop_stats(session, &loop);
+  const capture_clock_t *clock = pipecat_audio_capture_clock(session);
+  const opus_encoder_settings_t *encoder =
+      &pipecat_audio_encoder_controller(session)->settings;
 
-  char *msg_str = rtvi_message_to_string(msg);
+  json_writer_object_begin(w);
+  json_writer_key(w, "uptime_ms");
+  json_writer_int(w, esp_timer_get_time() / 1000);
 
-  peer_connection_datachannel_send(peer_connection, msg_str, strlen(msg_str));
+  json_writer_key(w, "playback");
+  json_writer_object_begin(w);
+  json_writer_key(w, "underruns");
+  json_writer_uint(w, playback.underruns);
+  json_writer_key(w, "overruns");
+  json_writer_uint(w, playback.overruns);
+  json_writer_key(w, "decode_errors");
+  json_writer_uint(w, playback.decode_errors);
+  json_writer_key(w, "buffered");
+  json_writer_uint(w, playback.buffered_frames);
+  json_writer_key(w, "rms");
+  json_writer_uint(w, playback.output_rms);
+  json_writer_object_end(w);
 
-  cJSON_free(msg_str);
+  json_writer_key(w, "capture");
+  json_writer_object_begin(w);
+  json_writer_key(w, "frames");
+  json_writer_uint(w, capture.frames);
+  json_writer_key(w, "sent");
+  json_writer_uint(w, capture.sent);
+  json_writer_key(w, "dtx");
+  json_writer_uint(w, capture.dtx);
+  json_writer_key(w, "fillers");
+  json_writer_uint(w, capture.fillers);
+  json_writer_key(w, "late");
+  json_writer_uint(w, clock->late);
+  json_writer_key(w, "missed");
+  json_writer_uint(w, clock->missed);
+  json_writer_key(w, "drift_us");
+  json_writer_int(w, clock->drift_us);
+  json_writer_key(w, "max_drift_us");
+  json_writer_int(w, clock->max_drift_us);
+  json_writer_object_end(w);
 
-  destroy_rtvi_message(msg);
+  json_writer_key(w, "encoder");
+  json_writer_object_begin(w);
+  json_writer_key(w, "bitrate");
+  json_writer_int(w, encoder->bitrate);
+  json_writer_key(w, "complexity");
+  json_writer_int(w, encoder->complexity);
+  json_writer_key(w, "fec");
+  json_writer_bool(w, encoder->inband_fec);
+  json_writer_object_end(w);
+
+  json_writer_key(w, "loop");
+  json_writer_object_begin(w);
+  json_writer_key(w, "iterations");
+  json_writer_uint(w, loop.iterations);
+  json_writer_key(w, "sleeps");
+  json_writer_uint(w, loop.sleeps);
+  json_writer_key(w, "notified");
+  json_writer_uint(w, loop.notified);
+  json_writer_key(w, "packets");
+  json_writer_uint(w, loop.packets);
+  json_writer_object_end(w);
+
+  boot_stats_t boot;
+  pipecat_boot_stats(&boot);
+  json_writer_key(w, "boot");
+  json_writer_object_begin(w);
+  json_writer_key(w, "boot_ms");
+  json_writer_int(w, boot.boot_us / 1000);
+  json_writer_key(w, "connected_ms");
+  json_writer_int(w, boot.milestone_us[BOOT_MILESTONE_CONNECTED] / 1000);
+  json_writer_key(w, "first_audio_ms");
+  json_writer_int(w, boot.milestone_us[BOOT_MILESTONE_FIRST_AUDIO] / 1000);
+  json_writer_object_end(w);
+
+  memory_diagnostics_t memory;
+  pipecat_memory_diagnostics(&memory);
+  json_writer_key(w, "memory");
+  json_writer_object_begin(w);
+  json_writer_key(w, "internal_min_free");
+  json_writer_uint(w, memory.heap_min_free[MEMORY_INTERNAL]);
+  json_writer_key(w, "psram_min_free");
+  json_writer_uint(w, memory.heap_min_free[MEMORY_PSRAM]);
+  json_writer_key(w, "stack_min_free");
+  json_writer_object_begin(w);
+  for (uint32_t i = 0; i < memory.task_count; i++) {
+    json_writer_key(w, memory.tasks[i].name);
+    json_writer_uint(w, memory.tasks[i].stack_min_free);
+  }
+  json_writer_object_end(w);
+  json_writer_object_end(w);
+
+  tlog_stats_t tlog = pipecat_tlog_stats();
+  json_writer_key(w, "log");
+  json_writer_object_begin(w);
+  json_writer_key(w, "records");
+  json_writer_uint(w, tlog.drained);
+  json_writer_key(w, "dropped");
+  json_writer_uint(w, tlog.dropped);
+  json_writer_object_end(w);
+
+  json_writer_key(w, "rtvi");
+  json_writer_object_begin(w);
+  json_writer_key(w, "received");
+  json_writer_uint(w, parser->parsed);
+  json_writer_key(w, "invalid");
+  json_writer_uint(w, parser->invalid);
+  json_writer_key(w, "sent");
+  json_writer_uint(w, send.sent);
+  json_writer_key(w, "coalesced");
+  json_writer_uint(w, send.coalesced);
+  json_writer_key(w, "dropped");
+  json_writer_uint(w, send.dropped + parser->dropped);
+  json_writer_key(w, "retries");
+  json_writer_uint(w, send.retries);
+  json_writer_object_end(w);
+
+  json_writer_object_end(w);
 }
 
-void pipecat_rtvi_handle_message(const char *msg) {
-  cJSON *j_msg = cJSON_Parse(msg);
-  if (j_msg == NULL) {
+void pipecat_rtvi_send_client_metrics(pipecat_session_t *session) {
+  pipecat_rtvi_send_client_message(session, RTVI_METRICS_MESSAGE_TYPE,
+                                   rtvi_write_client_metrics, session,
+                                   RTVI_COALESCE_METRICS);
+}
+
+static int rtvi_next_to_send(rtvi_state_t *rtvi) {
+  if (rtvi->send_retry >= 0) {
+    return rtvi->send_retry;
+  }
+  uint8_t slot;
+  if (xQueueReceive(rtvi->send_queue, &slot, 0)) {
+    return slot;
+  }
+  for (int key = 0; key < RTVI_COALESCE_COUNT; key++) {
+    int pending = rtvi->send_pending[key].exchange(-1);
+    if (pending >= 0) {
+      return pending;
+    }
+  }
+  return -1;
+}
+
+// Runs on the WebRTC loop, the only thread that talks to the data channel
+void pipecat_rtvi_flush(pipecat_session_t *session) {
+  rtvi_state_t *rtvi = session->rtvi;
+  PeerConnection *connection = rtvi->peer_connection;
+  if (rtvi->send_buffers == NULL || connection == nullptr) {
+    return;
+  }
+
+  int slot;
+  while ((slot = rtvi_next_to_send(rtvi)) >= 0) {
+    if (peer_connection_datachannel_send(
+            connection, rtvi->send_buffers + slot * RTVI_SEND_BUFFER_SIZE,
+            rtvi->send_lengths[slot]) < 0) {
+      // Not open yet or failed, keep the order and try again later. libpeer
+      // doesn't refuse for congestion, the slots filling up is what does
+      rtvi->send_retry = slot;
+      rtvi->send_stats.retries++;
+      return;
+    }
+
+    pipecat_record(session, RECORD_DATA_TX,
+                   rtvi->send_buffers + slot * RTVI_SEND_BUFFER_SIZE,
+                   rtvi->send_lengths[slot]);
+    rtvi->send_retry = -1;
+    rtvi->send_stats.sent++;
+    rtvi->send_stats.bytes += rtvi->send_lengths[slot];
+    uint8_t sent = slot;
+    xQueueSend(rtvi->send_free_queue, &sent, 0);
+  }
+}
+
+void pipecat_rtvi_send_stats(pipecat_session_t *session,
+                             rtvi_send_stats_t *stats) {
+  rtvi_state_t *rtvi = session->rtvi;
+  stats->queued = rtvi->send_stats.queued;
+  stats->sent = rtvi->send_stats.sent;
+  stats->coalesced = rtvi->send_stats.coalesced;
+  stats->dropped = rtvi->send_stats.dropped;
+  stats->overflow = rtvi->send_stats.overflow;
+  stats->retries = rtvi->send_stats.retries;
+  stats->bytes = rtvi->send_stats.bytes;
+  stats->queued_bytes = rtvi->send_stats.queued_bytes;
+}
+
+// Runs on the network thread, so it never blocks: with every slot busy the
+// message is dropped and counted.
+void pipecat_rtvi_handle_message(pipecat_session_t *session, const char *msg,
+                                 size_t len) {
+  rtvi_state_t *rtvi = session->rtvi;
+  uint8_t slot;
+  if (rtvi->slots == NULL || !xQueueReceive(rtvi->free_queue, &slot, 0)) {
+    rtvi->parser_stats.dropped++;
+    return;
+  }
+
+  if (!rtvi_parse_message(msg, len, &rtvi->slots[slot])) {
     ESP_LOGE(LOG_TAG, "Error parsing RTVI message");
+    rtvi->parser_stats.invalid++;
+    xQueueSend(rtvi->free_queue, &slot, 0);
     return;
   }
 
-  rtvi_msg_t rtvi_msg = {.msg = j_msg};
+  rtvi->parser_stats.parsed++;
+  if (rtvi->slots[slot].truncated) {
+    rtvi->parser_stats.truncated++;
+  }
+  xQueueSend(rtvi->ready_queue, &slot, 0);
+}
 
-  xQueueSend(rtvi_queue, &rtvi_msg, portMAX_DELAY);
+void pipecat_rtvi_parser_stats(pipecat_session_t *session,
+                               rtvi_parser_stats_t *stats) {
+  *stats = session->rtvi->parser_stats;
 }
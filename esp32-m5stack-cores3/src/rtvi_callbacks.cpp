@@ -2,21 +2,31 @@
 
 #include "main.h"
 
-static void on_bot_started_speaking() {
+static void on_bot_started_speaking(pipecat_session_t *session,
+                                    const rtvi_message_t *msg,
+                                    void *user_data) {
   // pipecat_screen_new_log();
 }
 
-static void on_bot_stopped_speaking() {
+static void on_bot_stopped_speaking(pipecat_session_t *session,
+                                    const rtvi_message_t *msg,
+                                    void *user_data) {
   // pipecat_screen_log("\n");
 }
 
-static void on_bot_tts_text(const char *text) {
-  // pipecat_screen_log(text);
+static void on_bot_tts_text(pipecat_session_t *session,
+                            const rtvi_message_t *msg, void *user_data) {
+  if (!msg->has_text) {
+    return;
+  }
+  // pipecat_screen_log(msg->text);
   // pipecat_screen_log(" ");
 }
 
-rtvi_callbacks_t pipecat_rtvi_callbacks = {
-    .on_bot_started_speaking = on_bot_started_speaking,
-    .on_bot_stopped_speaking = on_bot_stopped_speaking,
-    .on_bot_tts_text = on_bot_tts_text,
-};
+void pipecat_init_rtvi_callbacks() {
+  pipecat_rtvi_subscribe(RTVI_EVENT_BOT_STARTED_SPEAKING,
+                         on_bot_started_speaking, NULL);
+  pipecat_rtvi_subscribe(RTVI_EVENT_BOT_STOPPED_SPEAKING,
+                         on_bot_stopped_speaking, NULL);
+  pipecat_rtvi_subscribe(RTVI_EVENT_BOT_TTS_TEXT, on_bot_tts_text, NULL);
+}
@@ -0,0 +1,130 @@
+#include <esp_log.h>
+#include <string.h>
+
+#include "main.h"
+
+// Open addressing, at most half full so probes stay short
+#define RTVI_EVENT_TABLE_SIZE 64
+#define RTVI_EVENT_TABLE_MASK (RTVI_EVENT_TABLE_SIZE - 1)
+
+static_assert(RTVI_EVENT_COUNT * 2 <= RTVI_EVENT_TABLE_SIZE,
+              "RTVI_EVENT_TABLE_SIZE too small for RTVI_EVENTS");
+
+#define RTVI_EVENT_NAME(name, type) type,
+static constexpr const char *rtvi_event_names[RTVI_EVENT_COUNT] = {
+    RTVI_EVENTS(RTVI_EVENT_NAME)};
+#undef RTVI_EVENT_NAME
+
+static constexpr uint64_t rtvi_fnv1a(const char *s) {
+  uint64_t hash = 14695981039346656037ull;
+  while (*s) {
+    hash = (hash ^ (uint8_t)*s++) * 1099511628211ull;
+  }
+  return hash;
+}
+
+static constexpr bool rtvi_event_hashes_unique() {
+  for (int i = 0; i < RTVI_EVENT_COUNT; i++) {
+    if (rtvi_fnv1a(rtvi_event_names[i]) == 0) {
+      return false;  // Reserved for empty table entries
+    }
+    for (int j = i + 1; j < RTVI_EVENT_COUNT; j++) {
+      if (rtvi_fnv1a(rtvi_event_names[i]) == rtvi_fnv1a(rtvi_event_names[j])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Two known names sharing a hash would share a table entry
+static_assert(rtvi_event_hashes_unique(), "RTVI event hash collision");
+
+typedef struct {
+  uint64_t hash;  // 0 marks an empty entry
+  rtvi_event_t event;
+} rtvi_event_entry_t;
+
+typedef struct {
+  rtvi_event_entry_t entries[RTVI_EVENT_TABLE_SIZE];
+} rtvi_event_table_t;
+
+static constexpr rtvi_event_table_t rtvi_build_event_table() {
+  rtvi_event_table_t table = {};
+  for (int i = 0; i < RTVI_EVENT_COUNT; i++) {
+    uint64_t hash = rtvi_fnv1a(rtvi_event_names[i]);
+    size_t index = hash & RTVI_EVENT_TABLE_MASK;
+    while (table.entries[index].hash != 0) {
+      index = (index + 1) & RTVI_EVENT_TABLE_MASK;
+    }
+    table.entries[index].hash = hash;
+    table.entries[index].event = (rtvi_event_t)i;
+  }
+  return table;
+}
+
+static constexpr rtvi_event_table_t rtvi_event_table = rtvi_build_event_table();
+
+typedef struct {
+  rtvi_handler_t handler;
+  void *user_data;
+} rtvi_subscriber_t;
+
+static rtvi_subscriber_t rtvi_subscribers[RTVI_EVENT_COUNT]
+                                         [RTVI_MAX_SUBSCRIBERS];
+static uint8_t rtvi_subscriber_count[RTVI_EVENT_COUNT];
+
+rtvi_event_t rtvi_event_lookup(const char *type) {
+  uint64_t hash = rtvi_fnv1a(type);
+  size_t index = hash & RTVI_EVENT_TABLE_MASK;
+  while (rtvi_event_table.entries[index].hash != 0) {
+    if (rtvi_event_table.entries[index].hash == hash) {
+      // The server picks `type`, and FNV-1a collisions are easy to make
+      rtvi_event_t event = rtvi_event_table.entries[index].event;
+      return strcmp(type, rtvi_event_names[event]) == 0 ? event
+                                                        : RTVI_EVENT_UNKNOWN;
+    }
+    index = (index + 1) & RTVI_EVENT_TABLE_MASK;
+  }
+  return RTVI_EVENT_UNKNOWN;
+}
+
+const char *rtvi_event_name(rtvi_event_t event) {
+  return event < RTVI_EVENT_COUNT ? rtvi_event_names[event] : "unknown";
+}
+
+bool pipecat_rtvi_subscribe(rtvi_event_t event, rtvi_handler_t handler,
+                            void *user_data) {
+  if (event >= RTVI_EVENT_COUNT || handler == NULL) {
+    return false;
+  }
+
+  uint8_t count = rtvi_subscriber_count[event];
+  for (int i = 0; i < count; i++) {
+    if (rtvi_subscribers[event][i].handler == handler &&
+        rtvi_subscribers[event][i].user_data == user_data) {
+      return true;
+    }
+  }
+
+  if (count == RTVI_MAX_SUBSCRIBERS) {
+    ESP_LOGE(LOG_TAG, "Too many subscribers for RTVI event %s",
+             rtvi_event_name(event));
+    return false;
+  }
+  rtvi_subscribers[event][count].handler = handler;
+  rtvi_subscribers[event][count].user_data = user_data;
+  rtvi_subscriber_count[event] = count + 1;
+  return true;
+}
+
+void rtvi_dispatch(pipecat_session_t *session, const rtvi_message_t *msg) {
+  if (msg->event >= RTVI_EVENT_COUNT) {
+    return;
+  }
+
+  const rtvi_subscriber_t *subscribers = rtvi_subscribers[msg->event];
+  for (int i = 0; i < rtvi_subscriber_count[msg->event]; i++) {
+    subscribers[i].handler(session, msg, subscribers[i].user_data);
+  }
+}
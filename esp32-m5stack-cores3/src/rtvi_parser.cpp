@@ -0,0 +1,476 @@
+#include <string.h>
+
+#include "main.h"
+
+#define RTVI_MAX_KEY_LEN 16
+
+typedef struct {
+  const char *json;
+  size_t len;
+  size_t pos;
+  int depth;
+} rtvi_parser_t;
+
+static bool rtvi_skip_value(rtvi_parser_t *p);
+
+static void rtvi_skip_whitespace(rtvi_parser_t *p) {
+  while (p->pos < p->len) {
+    char c = p->json[p->pos];
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+      return;
+    }
+    p->pos++;
+  }
+}
+
+static bool rtvi_expect(rtvi_parser_t *p, char c) {
+  rtvi_skip_whitespace(p);
+  if (p->pos >= p->len || p->json[p->pos] != c) {
+    return false;
+  }
+  p->pos++;
+  return true;
+}
+
+static bool rtvi_peek(rtvi_parser_t *p, char *c) {
+  rtvi_skip_whitespace(p);
+  if (p->pos >= p->len) {
+    return false;
+  }
+  *c = p->json[p->pos];
+  return true;
+}
+
+static int rtvi_hex(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static bool rtvi_read_hex4(rtvi_parser_t *p, uint32_t *value) {
+  if (p->len - p->pos < 4) {
+    return false;
+  }
+  *value = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = rtvi_hex(p->json[p->pos++]);
+    if (digit < 0) {
+      return false;
+    }
+    *value = (*value << 4) | digit;
+  }
+  return true;
+}
+
+typedef struct {
+  char *buffer;  // NULL to only validate
+  size_t size;
+  size_t len;
+  bool truncated;
+} rtvi_string_out_t;
+
+// Appends whole UTF-8 sequences only, so truncation never splits a character
+static void rtvi_out_append(rtvi_string_out_t *out, const char *bytes,
+                            size_t count) {
+  if (out->buffer == NULL || out->truncated) {
+    return;
+  }
+  if (out->len + count >= out->size) {
+    out->truncated = true;
+    return;
+  }
+  memcpy(out->buffer + out->len, bytes, count);
+  out->len += count;
+}
+
+static void rtvi_out_append_codepoint(rtvi_string_out_t *out,
+                                      uint32_t codepoint) {
+  char bytes[4];
+  size_t count;
+  if (codepoint < 0x80) {
+    bytes[0] = codepoint;
+    count = 1;
+  } else if (codepoint < 0x800) {
+    bytes[0] = 0xC0 | (codepoint >> 6);
+    bytes[1] = 0x80 | (codepoint & 0x3F);
+    count = 2;
+  } else if (codepoint < 0x10000) {
+    bytes[0] = 0xE0 | (codepoint >> 12);
+    bytes[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+    bytes[2] = 0x80 | (codepoint & 0x3F);
+    count = 3;
+  } else {
+    bytes[0] = 0xF0 | (codepoint >> 18);
+    bytes[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+    bytes[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+    bytes[3] = 0x80 | (codepoint & 0x3F);
+    count = 4;
+  }
+  rtvi_out_append(out, bytes, count);
+}
+
+static size_t rtvi_utf8_length(unsigned char lead) {
+  if (lead < 0x80) return 1;
+  if ((lead & 0xE0) == 0xC0) return 2;
+  if ((lead & 0xF0) == 0xE0) return 3;
+  if ((lead & 0xF8) == 0xF0) return 4;
+  return 1;  // Stray continuation byte, pass it through
+}
+
+// Parses a string at the current position, unescaping it into `out`
+static bool rtvi_parse_string(rtvi_parser_t *p, rtvi_string_out_t *out) {
+  if (!rtvi_expect(p, '"')) {
+    return false;
+  }
+
+  while (p->pos < p->len) {
+    unsigned char c = p->json[p->pos];
+    if (c == '"') {
+      p->pos++;
+      if (out->buffer != NULL) {
+        out->buffer[out->len] = '\0';
+      }
+      return true;
+    }
+    if (c < 0x20) {
+      return false;
+    }
+
+    if (c != '\\') {
+      size_t count = rtvi_utf8_length(c);
+      if (p->len - p->pos < count) {
+        return false;
+      }
+      rtvi_out_append(out, p->json + p->pos, count);
+      p->pos += count;
+      continue;
+    }
+
+    if (++p->pos >= p->len) {
+      return false;
+    }
+    char escape = p->json[p->pos++];
+    uint32_t codepoint;
+    switch (escape) {
+      case '"': codepoint = '"'; break;
+      case '\\': codepoint = '\\'; break;
+      case '/': codepoint = '/'; break;
+      case 'b': codepoint = '\b'; break;
+      case 'f': codepoint = '\f'; break;
+      case 'n': codepoint = '\n'; break;
+      case 'r': codepoint = '\r'; break;
+      case 't': codepoint = '\t'; break;
+      case 'u':
+        if (!rtvi_read_hex4(p, &codepoint)) {
+          return false;
+        }
+        if (codepoint >= 0xD800 && codepoint < 0xDC00) {
+          uint32_t low;
+          if (p->len - p->pos < 2 || p->json[p->pos] != '\\' ||
+              p->json[p->pos + 1] != 'u') {
+            return false;
+          }
+          p->pos += 2;
+          if (!rtvi_read_hex4(p, &low) || low < 0xDC00 || low >= 0xE000) {
+            return false;
+          }
+          codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+        } else if (codepoint >= 0xDC00 && codepoint < 0xE000) {
+          return false;
+        }
+        break;
+      default:
+        return false;
+    }
+    rtvi_out_append_codepoint(out, codepoint);
+  }
+  return false;
+}
+
+static bool rtvi_parse_string_into(rtvi_parser_t *p, char *buffer,
+                                   size_t size, bool *truncated) {
+  rtvi_string_out_t out = {.buffer = buffer, .size = size, .len = 0,
+                           .truncated = false};
+  if (!rtvi_parse_string(p, &out)) {
+    return false;
+  }
+  *truncated |= out.truncated;
+  return true;
+}
+
+static bool rtvi_is_literal(rtvi_parser_t *p, size_t start, const char *word) {
+  size_t len = strlen(word);
+  return p->pos - start == len && memcmp(p->json + start, word, len) == 0;
+}
+
+static bool rtvi_skip_digits(const char *s, size_t len, size_t *i) {
+  size_t start = *i;
+  while (*i < len && s[*i] >= '0' && s[*i] <= '9') {
+    (*i)++;
+  }
+  return *i > start;
+}
+
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?, all of `len`
+static bool rtvi_is_number(const char *s, size_t len) {
+  size_t i = 0;
+  if (i < len && s[i] == '-') {
+    i++;
+  }
+  if (i < len && s[i] == '0') {
+    i++;
+  } else if (!rtvi_skip_digits(s, len, &i)) {
+    return false;
+  }
+  if (i < len && s[i] == '.') {
+    i++;
+    if (!rtvi_skip_digits(s, len, &i)) {
+      return false;
+    }
+  }
+  if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+    i++;
+    if (i < len && (s[i] == '+' || s[i] == '-')) {
+      i++;
+    }
+    if (!rtvi_skip_digits(s, len, &i)) {
+      return false;
+    }
+  }
+  return i == len;
+}
+
+// Numbers and the true/false/null literals
+static bool rtvi_skip_scalar(rtvi_parser_t *p) {
+  size_t start = p->pos;
+  while (p->pos < p->len) {
+    char c = p->json[p->pos];
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' ||
+          c == '+' || c == '.' || c == 'E')) {
+      break;
+    }
+    p->pos++;
+  }
+  if (p->pos == start || p->pos == p->len) {
+    // Empty, or cut off where a delimiter has to follow
+    return false;
+  }
+  char first = p->json[start];
+  if (first >= 'a' && first <= 'z') {
+    return rtvi_is_literal(p, start, "true") ||
+           rtvi_is_literal(p, start, "false") ||
+           rtvi_is_literal(p, start, "null");
+  }
+  return rtvi_is_number(p->json + start, p->pos - start);
+}
+
+typedef bool (*rtvi_member_fn)(rtvi_parser_t *p, const char *key,
+                               rtvi_message_t *msg);
+
+// Walks an object, handing each member to `member` with the parser
+// positioned on its value. `member` must consume the value.
+static bool rtvi_parse_object(rtvi_parser_t *p, rtvi_member_fn member,
+                              rtvi_message_t *msg) {
+  if (!rtvi_expect(p, '{') || ++p->depth > RTVI_MAX_DEPTH) {
+    return false;
+  }
+
+  char c;
+  if (!rtvi_peek(p, &c)) {
+    return false;
+  }
+  if (c == '}') {
+    p->pos++;
+    p->depth--;
+    return true;
+  }
+
+  while (1) {
+    char key[RTVI_MAX_KEY_LEN];
+    bool key_truncated = false;
+    if (!rtvi_parse_string_into(p, key, sizeof(key), &key_truncated) ||
+        !rtvi_expect(p, ':')) {
+      return false;
+    }
+    // A key we had to truncate is not one we know
+    if (!member(p, key_truncated ? "" : key, msg)) {
+      return false;
+    }
+
+    if (!rtvi_peek(p, &c)) {
+      return false;
+    }
+    p->pos++;
+    if (c == '}') {
+      p->depth--;
+      return true;
+    }
+    if (c != ',') {
+      return false;
+    }
+  }
+}
+
+static bool rtvi_skip_member(rtvi_parser_t *p, const char *key,
+                             rtvi_message_t *msg) {
+  return rtvi_skip_value(p);
+}
+
+static bool rtvi_skip_array(rtvi_parser_t *p) {
+  if (!rtvi_expect(p, '[') || ++p->depth > RTVI_MAX_DEPTH) {
+    return false;
+  }
+
+  char c;
+  if (!rtvi_peek(p, &c)) {
+    return false;
+  }
+  if (c == ']') {
+    p->pos++;
+    p->depth--;
+    return true;
+  }
+
+  while (1) {
+    if (!rtvi_skip_value(p) || !rtvi_peek(p, &c)) {
+      return false;
+    }
+    p->pos++;
+    if (c == ']') {
+      p->depth--;
+      return true;
+    }
+    if (c != ',') {
+      return false;
+    }
+  }
+}
+
+static bool rtvi_skip_value(rtvi_parser_t *p) {
+  char c;
+  if (!rtvi_peek(p, &c)) {
+    return false;
+  }
+  switch (c) {
+    case '{':
+      return rtvi_parse_object(p, rtvi_skip_member, NULL);
+    case '[':
+      return rtvi_skip_array(p);
+    case '"': {
+      rtvi_string_out_t out = {};
+      return rtvi_parse_string(p, &out);
+    }
+    default:
+      return rtvi_skip_scalar(p);
+  }
+}
+
+static bool rtvi_data_member(rtvi_parser_t *p, const char *key,
+                             rtvi_message_t *msg) {
+  char c;
+  if (!rtvi_peek(p, &c)) {
+    return false;
+  }
+
+  if (c == '"' && strcmp(key, "text") == 0) {
+    msg->has_text = true;
+    return rtvi_parse_string_into(p, msg->text, sizeof(msg->text),
+                                  &msg->truncated);
+  }
+  if (c == '"' && strcmp(key, "type") == 0) {
+    return rtvi_parse_string_into(p, msg->data_type, sizeof(msg->data_type),
+                                  &msg->truncated);
+  }
+  if (strcmp(key, "final") == 0 || strcmp(key, "reset") == 0) {
+    size_t start = p->pos;
+    if (!rtvi_skip_value(p)) {
+      return false;
+    }
+    bool *flag = strcmp(key, "final") == 0 ? &msg->final : &msg->reset;
+    *flag = rtvi_is_literal(p, start, "true");
+    return true;
+  }
+  return rtvi_skip_value(p);
+}
+
+static bool rtvi_message_member(rtvi_parser_t *p, const char *key,
+                                rtvi_message_t *msg) {
+  char c;
+  if (!rtvi_peek(p, &c)) {
+    return false;
+  }
+
+  if (c == '"' && strcmp(key, "type") == 0) {
+    return rtvi_parse_string_into(p, msg->type, sizeof(msg->type),
+                                  &msg->truncated);
+  }
+  if (strcmp(key, "id") == 0) {
+    if (c == '"') {
+      return rtvi_parse_string_into(p, msg->id, sizeof(msg->id),
+                                    &msg->truncated);
+    }
+    // Numeric ids are kept as written
+    size_t start = p->pos;
+    if (!rtvi_skip_value(p)) {
+      return false;
+    }
+    size_t len = p->pos - start;
+    if (len >= sizeof(msg->id)) {
+      msg->truncated = true;
+      len = 0;
+    }
+    memcpy(msg->id, p->json + start, len);
+    msg->id[len] = '\0';
+    return true;
+  }
+  if (c == '{' && strcmp(key, "data") == 0) {
+    size_t start = p->pos;
+    if (!rtvi_parse_object(p, rtvi_data_member, msg)) {
+      return false;
+    }
+    size_t len = p->pos - start;
+    if (len < sizeof(msg->data)) {
+      memcpy(msg->data, p->json + start, len);
+      msg->data_len = len;
+    } else {
+      msg->truncated = true;
+      msg->data_len = 0;
+    }
+    msg->data[msg->data_len] = '\0';
+    return true;
+  }
+  return rtvi_skip_value(p);
+}
+
+bool rtvi_parse_message(const char *json, size_t len, rtvi_message_t *msg) {
+  msg->event = RTVI_EVENT_UNKNOWN;
+  msg->type[0] = '\0';
+  msg->id[0] = '\0';
+  msg->text[0] = '\0';
+  msg->has_text = false;
+  msg->data_type[0] = '\0';
+  msg->final = false;
+  msg->reset = false;
+  msg->data[0] = '\0';
+  msg->data_len = 0;
+  msg->truncated = false;
+
+  rtvi_parser_t p = {.json = json, .len = len, .pos = 0, .depth = 0};
+  if (!rtvi_parse_object(&p, rtvi_message_member, msg)) {
+    return false;
+  }
+
+  // Only whitespace (or the terminator the data channel may include) may
+  // follow the message
+  rtvi_skip_whitespace(&p);
+  while (p.pos < p.len && p.json[p.pos] == '\0') {
+    p.pos++;
+  }
+  if (p.pos != p.len || msg->type[0] == '\0') {
+    return false;
+  }
+
+  msg->event = rtvi_event_lookup(msg->type);
+  return true;
+}
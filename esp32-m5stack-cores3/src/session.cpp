@@ -0,0 +1,58 @@
+#include <esp_log.h>
+
+#include "main.h"
+
+pipecat_session_t pipecat_session;
+
+bool pipecat_session_create(pipecat_session_t *session,
+                            const pipecat_session_config_t *config) {
+  session->config = *config;
+  if (!pipecat_audio_session_create(session) ||
+      !pipecat_webrtc_session_create(session) ||
+      !pipecat_rtvi_session_create(session) ||
+      !pipecat_signalling_session_create(session)) {
+    ESP_LOGE(LOG_TAG, "Unable to create session %lu",
+             (unsigned long)config->index);
+    return false;
+  }
+  return true;
+}
+
+// The single-session entry points, on pipecat_session
+
+void pipecat_init_audio_capture() {
+  pipecat_init_audio_capture(&pipecat_session);
+}
+
+void pipecat_init_audio_decoder() {
+  pipecat_init_audio_decoder(&pipecat_session);
+}
+
+void pipecat_init_audio_encoder() {
+  pipecat_init_audio_encoder(&pipecat_session);
+}
+
+void pipecat_init_webrtc() { pipecat_init_webrtc(&pipecat_session); }
+
+void pipecat_webrtc_loop() { pipecat_webrtc_loop(&pipecat_session); }
+
+void pipecat_webrtc_wait() { pipecat_webrtc_wait(&pipecat_session); }
+
+void pipecat_webrtc_wake() { pipecat_webrtc_wake(&pipecat_session); }
+
+bool pipecat_rtvi_send(const char *type, rtvi_data_writer_t write_data,
+                       const void *ctx, rtvi_coalesce_t coalesce) {
+  return pipecat_rtvi_send(&pipecat_session, type, write_data, ctx, coalesce);
+}
+
+bool pipecat_rtvi_send_client_message(const char *t,
+                                      rtvi_data_writer_t write_data,
+                                      const void *ctx,
+                                      rtvi_coalesce_t coalesce) {
+  return pipecat_rtvi_send_client_message(&pipecat_session, t, write_data, ctx,
+                                          coalesce);
+}
+
+void pipecat_rtvi_send_client_ready() {
+  pipecat_rtvi_send_client_ready(&pipecat_session);
+}
@@ -0,0 +1,146 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+#define SIGNALLING_STATE_REGION MEMORY_INTERNAL
+
+// A cancelled exchange can still hold the task for the attempt under way
+static_assert(RECONNECT_CONNECT_TIMEOUT_MS > HTTP_TIMEOUT_MS,
+              "An HTTP attempt must fit in a connection attempt");
+
+typedef struct {
+  char *offer;
+  uint32_t connection;
+} signalling_request_t;
+
+// One exchange at a time: a new offer only comes with a new connection.
+// Results carry their connection so the loop can discard answers for a
+// connection it already tore down, and `current` lets the task stop
+// working on one. 0 while no connection wants an answer.
+struct signalling_state {
+  QueueHandle_t requests;
+  QueueHandle_t results;
+  std::atomic<uint32_t> current;
+};
+
+typedef struct {
+  signalling_state_t *signalling;
+  uint32_t connection;
+} signalling_cancel_ctx_t;
+
+static bool signalling_cancelled(void *ctx) {
+  signalling_cancel_ctx_t *cancel = (signalling_cancel_ctx_t *)ctx;
+  return cancel->signalling->current != cancel->connection;
+}
+
+static void pipecat_signalling_task(void *user_data) {
+  pipecat_session_t *session = (pipecat_session_t *)user_data;
+  signalling_state_t *signalling = session->signalling;
+  signalling_request_t request;
+
+  while (1) {
+    if (!xQueueReceive(signalling->requests, &request, portMAX_DELAY)) {
+      continue;
+    }
+
+    signalling_cancel_ctx_t cancel = {.signalling = signalling,
+                                      .connection = request.connection};
+    if (signalling_cancelled(&cancel)) {
+      ESP_LOGI(LOG_TAG, "Signalling for connection %lu dropped, it's closed",
+               (unsigned long)request.connection);
+      free(request.offer);
+      continue;
+    }
+
+    signalling_result_t result;
+    result.connection = request.connection;
+    int64_t start_us = esp_timer_get_time();
+    result.err =
+        pipecat_http_request(session->config.url, request.offer,
+                             &result.answer, signalling_cancelled, &cancel);
+    result.elapsed_us = esp_timer_get_time() - start_us;
+    free(request.offer);
+
+    ESP_LOGI(LOG_TAG, "Signalling finished in %lldms: %s",
+             (long long)(result.elapsed_us / 1000),
+             esp_err_to_name(result.err));
+    if (signalling_cancelled(&cancel)) {
+      http_buffer_free(&result.answer);
+      continue;
+    }
+    if (!xQueueSend(signalling->results, &result, 0)) {
+      http_buffer_free(&result.answer);
+    }
+    pipecat_webrtc_wake(session);
+  }
+}
+
+void pipecat_signalling_memory_plan(memory_plan_t *plan) {
+  memory_plan_add(plan, SIGNALLING_STATE_REGION, sizeof(signalling_state_t));
+}
+
+bool pipecat_signalling_session_create(pipecat_session_t *session) {
+  void *state = pipecat_memory_alloc(SIGNALLING_STATE_REGION,
+                                     sizeof(signalling_state_t),
+                                     "signalling_state");
+  if (state == NULL) {
+    return false;
+  }
+  session->signalling = new (state) signalling_state_t();
+  return true;
+}
+
+void pipecat_init_signalling(pipecat_session_t *session) {
+  signalling_state_t *signalling = session->signalling;
+  signalling->requests = xQueueCreate(1, sizeof(signalling_request_t));
+  signalling->results = xQueueCreate(1, sizeof(signalling_result_t));
+  TaskHandle_t task = NULL;
+  xTaskCreate(pipecat_signalling_task, "signalling",
+              SIGNALLING_TASK_STACK_SIZE, session, SIGNALLING_TASK_PRIORITY,
+              &task);
+  pipecat_memory_track_task(task, "signalling", SIGNALLING_TASK_STACK_SIZE);
+}
+
+bool pipecat_signalling_start(pipecat_session_t *session, const char *offer,
+                              uint32_t connection) {
+  signalling_request_t request = {.offer = strdup(offer),
+                                  .connection = connection};
+  if (request.offer == NULL) {
+    ESP_LOGE(LOG_TAG, "Unable to copy offer for signalling");
+    return false;
+  }
+
+  // An exchange still under way for an older connection stops at its next
+  // attempt, one that hasn't started yet is replaced
+  signalling_state_t *signalling = session->signalling;
+  signalling->current = connection;
+  signalling_request_t stale;
+  if (xQueueReceive(signalling->requests, &stale, 0)) {
+    free(stale.offer);
+  }
+  if (!xQueueSend(signalling->requests, &request, 0)) {
+    ESP_LOGE(LOG_TAG, "Unable to queue signalling request");
+    free(request.offer);
+    return false;
+  }
+  return true;
+}
+
+void pipecat_signalling_cancel(pipecat_session_t *session) {
+  session->signalling->current = 0;
+}
+
+bool pipecat_signalling_poll(pipecat_session_t *session,
+                             signalling_result_t *result) {
+  QueueHandle_t results = session->signalling->results;
+  return results != NULL && xQueueReceive(results, result, 0);
+}
@@ -0,0 +1,1239 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <opus.h>
+#include <peer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include <cJSON.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+// `src.elf --standin [PORT]`, see "Stand-in server" in main.h. One task
+// accepts HTTP connections and hands each to a task of its own, so a slow
+// client only holds up itself. An offer becomes a peer with its own task
+// that services its libpeer loop, turn script and UDP relay every
+// STANDIN_POLL_MS, and answers the HTTP connection once libpeer has the
+// answer. The peer table is shared under standin_mutex.
+#define STANDIN_LOG_TAG "standin"
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define STANDIN_HTTP_MAX_REQUEST 32768
+#define STANDIN_HTTP_TIMEOUT_MS 2000
+#define STANDIN_HTTP_CHUNK_SIZE 1024
+// How long accept() waits before the accept task looks for
+// pipecat_standin_stop() again
+#define STANDIN_ACCEPT_POLL_MS 100
+// Distinct fault queries counted for `times`
+#define STANDIN_MAX_FAULT_QUERIES 32
+#define STANDIN_MAX_QUERY 128
+#define STANDIN_HTTP_TASK_STACK_SIZE 8192
+#define STANDIN_PEER_TASK_STACK_SIZE 16384
+#define STANDIN_TASK_PRIORITY 5
+#define STANDIN_OPUS_BITRATE 32000
+// Any datagram libpeer sends fits
+#define STANDIN_MAX_PACKET 1500
+// Downlink packets held back by jitter or the bandwidth cap
+#define STANDIN_MAX_IN_FLIGHT 128
+// IPv4 + UDP, counted against the bandwidth cap on top of the datagram
+#define STANDIN_PACKET_OVERHEAD (20 + 8)
+// Stands in for both sides' candidates in the relayed SDP
+#define STANDIN_RELAY_CANDIDATE \
+  "a=candidate:1 1 UDP 2130706431 %s %u typ host\r\n"
+// A turn this far behind restarts its clock rather than bursting
+#define STANDIN_MAX_LATE_MS 100
+
+static const char *standin_words[] = {
+    "This", "is",    "the",   "stand-in", "bot",   "speaking", "from",
+    "a",    "local", "libpeer", "server,", "with",  "scripted", "audio",
+    "and",  "RTVI",  "events", "for",     "soak",  "testing.",
+};
+#define STANDIN_WORD_COUNT (sizeof(standin_words) / sizeof(standin_words[0]))
+
+typedef struct {
+  float loss_percent;
+  uint32_t jitter_ms;
+  uint32_t kbps;
+  uint32_t seed;
+  bool echo;
+  const char *record_dir;
+  bool relay;  // Any impairment set
+} standin_config_t;
+
+// The turn audio, encoded once: packet i is data[offsets[i]..offsets[i+1])
+typedef struct {
+  uint8_t *data;
+  uint32_t *offsets;
+  uint32_t count;
+} standin_script_t;
+
+typedef struct {
+  int64_t due_us;
+  uint16_t len;
+  uint8_t data[STANDIN_MAX_PACKET];
+} standin_packet_t;
+
+typedef struct {
+  uint32_t downlink_sent;     // Handed to libpeer
+  uint32_t downlink_lost;     // RTP dropped by PIPECAT_STANDIN_LOSS
+  uint32_t downlink_overrun;  // No room in the in-flight queue
+  uint32_t uplink_packets;
+  uint64_t uplink_bytes;
+  uint32_t rtvi_sent;
+  uint32_t rtvi_received;
+  uint32_t turns;
+  uint32_t late;  // Turn clock restarts
+} standin_stats_t;
+
+// Faults from the request's query string, see main.h
+typedef struct {
+  int status;
+  uint32_t times;
+  uint32_t delay_ms;
+  bool chunked;
+  uint32_t pad;
+  bool close;
+} standin_http_fault_t;
+
+typedef struct {
+  char query[STANDIN_MAX_QUERY];  // Empty for a free entry
+  uint32_t count;
+} standin_fault_count_t;
+
+typedef struct {
+  bool in_use;  // Claimed and released under standin_mutex
+  PeerConnection *peer_connection;
+  uint32_t index;
+  PeerConnectionState state;
+  bool closing;  // Destroyed after peer_connection_loop() returns
+  int http_fd;   // Waiting for the answer, -1 once answered
+  standin_http_fault_t fault;
+  int64_t created_us;
+  bool connected;
+
+  // Turn script, started by client-ready
+  bool ready;
+  bool speaking;
+  int64_t turn_start_us;
+  int64_t next_frame_us;
+  uint32_t turn_packet;
+  uint32_t next_word;
+  uint32_t rtvi_id;
+
+  // UDP relay between the client and libpeer, -1 without impairments
+  int relay_client_fd;  // Advertised to the client in the answer
+  int relay_peer_fd;    // Advertised to libpeer in the offer
+  uint16_t relay_client_port;
+  uint16_t relay_peer_port;
+  struct sockaddr_in client_addr;  // Where the client's datagrams come from
+  struct sockaddr_in peer_addr;    // libpeer's candidate in the answer
+
+  // Downlink impairment, on RTP leaving the relay
+  uint32_t rng;
+  int64_t link_free_us;
+  standin_packet_t *in_flight;
+  uint32_t in_flight_count;
+
+  // Uplink recording
+  char record_path[256];
+  OpusDecoder *decoder;
+  void *recorder;
+  int16_t *pcm;
+  size_t pcm_samples;  // 120ms, the longest Opus packet
+
+  rtvi_message_t message;  // Too big for the stack
+  standin_stats_t stats;
+} standin_peer_t;
+
+static standin_config_t standin_config;
+static standin_script_t standin_script;
+static standin_peer_t *standin_peers;
+static standin_fault_count_t standin_fault_counts[STANDIN_MAX_FAULT_QUERIES];
+static SemaphoreHandle_t standin_mutex;
+static std::atomic<uint32_t> standin_next_index(0);
+static int64_t standin_frame_us;
+static std::atomic<bool> standin_running(false);
+// Accept, HTTP and peer tasks still running
+static std::atomic<int> standin_tasks(0);
+
+static float standin_env_float(const char *name, float fallback) {
+  const char *env = getenv(name);
+  return env != NULL ? strtof(env, NULL) : fallback;
+}
+
+static uint32_t standin_env_uint(const char *name, uint32_t fallback) {
+  const char *env = getenv(name);
+  return env != NULL ? strtoul(env, NULL, 10) : fallback;
+}
+
+// xorshift32, so a seed reproduces the same loss and jitter pattern
+static uint32_t standin_random(standin_peer_t *peer) {
+  uint32_t x = peer->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  peer->rng = x;
+  return x;
+}
+
+static bool standin_build_script() {
+  uint32_t rate = pipecat_audio_config.codec_rate;
+  size_t frame_samples =
+      audio_frame_samples(rate, pipecat_audio_config.frame_ms);
+  size_t max_samples = (size_t)rate * STANDIN_MAX_TURN_MS / 1000;
+
+  size_t count = 0;
+  int16_t *samples = NULL;
+  const char *path = getenv("PIPECAT_STANDIN_TTS_WAV");
+  if (path != NULL) {
+    samples = audio_wav_read_file(path, rate, &count);
+    if (samples == NULL) {
+      ESP_LOGE(STANDIN_LOG_TAG, "%s is not a 16-bit mono %luHz WAV file",
+               path, (unsigned long)rate);
+      return false;
+    }
+    count = MIN(count, max_samples);
+  } else {
+    count = (size_t)rate * STANDIN_TURN_MS / 1000;
+    samples = (int16_t *)malloc(count * sizeof(int16_t));
+    if (samples == NULL) {
+      return false;
+    }
+    audio_bench_signal(samples, count, rate);
+  }
+
+  // Whole frames only, the tail is dropped
+  uint32_t frames = count / frame_samples;
+  int error = 0;
+  OpusEncoder *encoder =
+      opus_encoder_create(rate, 1, OPUS_APPLICATION_VOIP, &error);
+  standin_script.data = (uint8_t *)malloc((size_t)frames * STANDIN_MAX_PACKET);
+  standin_script.offsets = (uint32_t *)malloc((frames + 1) * sizeof(uint32_t));
+  if (encoder == NULL || standin_script.data == NULL ||
+      standin_script.offsets == NULL || frames == 0) {
+    ESP_LOGE(STANDIN_LOG_TAG, "Unable to encode the turn audio");
+    free(samples);
+    return false;
+  }
+  opus_encoder_ctl(encoder, OPUS_SET_BITRATE(STANDIN_OPUS_BITRATE));
+  opus_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+
+  uint32_t offset = 0;
+  for (uint32_t i = 0; i < frames; i++) {
+    standin_script.offsets[i] = offset;
+    int size = opus_encode(encoder, samples + i * frame_samples,
+                           frame_samples, standin_script.data + offset,
+                           STANDIN_MAX_PACKET);
+    if (size < 0) {
+      ESP_LOGE(STANDIN_LOG_TAG, "Opus encode failed: %s", opus_strerror(size));
+      opus_encoder_destroy(encoder);
+      free(samples);
+      return false;
+    }
+    offset += size;
+  }
+  standin_script.offsets[frames] = offset;
+  standin_script.count = frames;
+
+  opus_encoder_destroy(encoder);
+  free(samples);
+  ESP_LOGI(STANDIN_LOG_TAG, "Turn audio: %s, %lu packets, %lu bytes",
+           path ? path : "synthetic voice", (unsigned long)frames,
+           (unsigned long)offset);
+  return true;
+}
+
+// HTTP
+
+static const char *standin_http_reason(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    default: return "Error";
+  }
+}
+
+static bool standin_send_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Writes the response and closes `fd`. `fault` may be NULL.
+static void standin_http_respond(int fd, int status, const char *body,
+                                 const standin_http_fault_t *fault) {
+  if (fault != NULL && fault->close) {
+    close(fd);
+    return;
+  }
+
+  bool chunked = fault != NULL && fault->chunked;
+  size_t len = body != NULL ? strlen(body) : 0;
+  char header[256];
+  int header_len = snprintf(header, sizeof(header),
+                            "HTTP/1.1 %d %s\r\n"
+                            "Content-Type: application/json\r\n",
+                            status, standin_http_reason(status));
+  header_len += snprintf(header + header_len, sizeof(header) - header_len,
+                         chunked ? "Transfer-Encoding: chunked\r\n"
+                                 : "Content-Length: %zu\r\n",
+                         len);
+  header_len += snprintf(header + header_len, sizeof(header) - header_len,
+                         "Connection: close\r\n\r\n");
+
+  bool ok = standin_send_all(fd, header, header_len);
+  if (chunked) {
+    for (size_t offset = 0; ok && offset < len;
+         offset += STANDIN_HTTP_CHUNK_SIZE) {
+      size_t chunk = MIN(len - offset, (size_t)STANDIN_HTTP_CHUNK_SIZE);
+      char size_line[16];
+      int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk);
+      ok = standin_send_all(fd, size_line, size_len) &&
+           standin_send_all(fd, body + offset, chunk) &&
+           standin_send_all(fd, "\r\n", 2);
+    }
+    if (ok) {
+      standin_send_all(fd, "0\r\n\r\n", 5);
+    }
+  } else if (ok && len > 0) {
+    standin_send_all(fd, body, len);
+  }
+  close(fd);
+}
+
+// {"sdp": sdp, "type": "answer", "pc_id": pc_id}, plus `pad` bytes in a
+// "pad" member. NULL if out of memory.
+static char *standin_http_answer_body(const char *sdp, const char *pc_id,
+                                      uint32_t pad) {
+  size_t size = strlen(sdp) * 6 + pad + 128;
+  char *body = (char *)malloc(size);
+  char *padding = (char *)malloc(pad + 1);
+  if (body == NULL || padding == NULL) {
+    free(body);
+    free(padding);
+    return NULL;
+  }
+  memset(padding, 'x', pad);
+  padding[pad] = '\0';
+
+  json_writer_t w;
+  json_writer_init(&w, body, size);
+  json_writer_object_begin(&w);
+  json_writer_key(&w, "sdp");
+  json_writer_string(&w, sdp);
+  json_writer_key(&w, "type");
+  json_writer_string(&w, "answer");
+  json_writer_key(&w, "pc_id");
+  json_writer_string(&w, pc_id);
+  if (pad > 0) {
+    json_writer_key(&w, "pad");
+    json_writer_string(&w, padding);
+  }
+  json_writer_object_end(&w);
+  free(padding);
+  if (json_writer_finish(&w) == 0) {
+    free(body);
+    return NULL;
+  }
+  return body;
+}
+
+static void standin_http_answer(standin_peer_t *peer, const char *answer) {
+  char pc_id[32];
+  snprintf(pc_id, sizeof(pc_id), "standin-%lu", (unsigned long)peer->index);
+  char *body = standin_http_answer_body(answer, pc_id, peer->fault.pad);
+  standin_http_respond(peer->http_fd, body != NULL ? 200 : 500, body,
+                       &peer->fault);
+  peer->http_fd = -1;
+  free(body);
+}
+
+static bool standin_query_key(const char *param, size_t len, const char *key) {
+  return len == strlen(key) && strncmp(param, key, len) == 0;
+}
+
+static void standin_http_parse_fault(const char *query,
+                                     standin_http_fault_t *fault) {
+  memset(fault, 0, sizeof(standin_http_fault_t));
+  while (query != NULL && *query != '\0') {
+    const char *next = strchr(query, '&');
+    const char *value = strchr(query, '=');
+    if (value != NULL && (next == NULL || value < next)) {
+      size_t len = value - query;
+      uint32_t number = strtoul(value + 1, NULL, 10);
+      if (standin_query_key(query, len, "status")) {
+        fault->status = number;
+      } else if (standin_query_key(query, len, "times")) {
+        fault->times = number;
+      } else if (standin_query_key(query, len, "delay_ms")) {
+        fault->delay_ms = number;
+      } else if (standin_query_key(query, len, "chunked")) {
+        fault->chunked = number != 0;
+      } else if (standin_query_key(query, len, "pad")) {
+        fault->pad = MIN(number, (uint32_t)STANDIN_MAX_PAD);
+      } else if (standin_query_key(query, len, "close")) {
+        fault->close = number != 0;
+      }
+    }
+    query = next != NULL ? next + 1 : NULL;
+  }
+}
+
+// Whether this request gets its faults: every one, or the first `times`
+// with exactly this query
+static bool standin_http_fault_due(const char *query,
+                                   const standin_http_fault_t *fault) {
+  if (fault->times == 0) {
+    return true;
+  }
+
+  bool due = true;
+  xSemaphoreTake(standin_mutex, portMAX_DELAY);
+  standin_fault_count_t *entry = NULL;
+  for (int i = 0; i < STANDIN_MAX_FAULT_QUERIES && entry == NULL; i++) {
+    standin_fault_count_t *candidate = &standin_fault_counts[i];
+    if (candidate->query[0] == '\0' ||
+        strncmp(candidate->query, query, STANDIN_MAX_QUERY - 1) == 0) {
+      entry = candidate;
+    }
+  }
+  if (entry != NULL) {
+    if (entry->query[0] == '\0') {
+      snprintf(entry->query, sizeof(entry->query), "%s", query);
+    }
+    due = entry->count++ < fault->times;
+  } else {
+    ESP_LOGW(STANDIN_LOG_TAG, "More than %d fault queries, `times` ignored",
+             STANDIN_MAX_FAULT_QUERIES);
+  }
+  xSemaphoreGive(standin_mutex);
+  return due;
+}
+
+// Reads a whole request into `buffer`, returns the body or NULL
+static char *standin_http_read(int fd, char *buffer, size_t size,
+                               char *method, char *path) {
+  size_t len = 0;
+  char *body = NULL;
+  size_t content_length = 0;
+  while (len < size - 1) {
+    ssize_t n = recv(fd, buffer + len, size - 1 - len, 0);
+    if (n <= 0) {
+      return NULL;
+    }
+    len += n;
+    buffer[len] = '\0';
+
+    if (body == NULL) {
+      char *end = strstr(buffer, "\r\n\r\n");
+      if (end == NULL) {
+        continue;
+      }
+      body = end + 4;
+      const char *header = strcasestr(buffer, "\r\nContent-Length:");
+      if (header != NULL && header < end) {
+        content_length = strtoul(header + 17, NULL, 10);
+      }
+    }
+    if ((size_t)(buffer + len - body) >= content_length) {
+      body[content_length] = '\0';
+      return sscanf(buffer, "%7s %127s", method, path) == 2 ? body : NULL;
+    }
+  }
+  return NULL;
+}
+
+// RTVI
+
+static void standin_send_rtvi(standin_peer_t *peer, const char *type,
+                              const char *text) {
+  if (!peer->ready) {
+    return;
+  }
+
+  char id[16];
+  snprintf(id, sizeof(id), "%lu", (unsigned long)peer->rtvi_id++);
+
+  char buffer[RTVI_MAX_TEXT_LEN + 256];
+  json_writer_t w;
+  json_writer_init(&w, buffer, sizeof(buffer));
+  json_writer_object_begin(&w);
+  json_writer_key(&w, "label");
+  json_writer_string(&w, "rtvi-ai");
+  json_writer_key(&w, "type");
+  json_writer_string(&w, type);
+  json_writer_key(&w, "id");
+  json_writer_string(&w, id);
+  json_writer_key(&w, "data");
+  json_writer_object_begin(&w);
+  if (text != NULL) {
+    json_writer_key(&w, "text");
+    json_writer_string(&w, text);
+  }
+  json_writer_object_end(&w);
+  json_writer_object_end(&w);
+
+  size_t len = json_writer_finish(&w);
+  if (len > 0 &&
+      peer_connection_datachannel_send(peer->peer_connection, buffer, len) >=
+          0) {
+    peer->stats.rtvi_sent++;
+  }
+}
+
+// Relay
+//
+// libpeer stamps RTP sequence numbers and timestamps as it sends, so loss
+// or delay applied to the Opus payloads before that would reach the client
+// as a gapless stream. With any impairment set, the offer's candidates are
+// swapped for one on the relay's libpeer side and the answer's for one on
+// its client side. Datagrams then pass through untouched, except SRTP from
+// libpeer to the client, which goes through the impairment queue. SRTP
+// leaves the RTP header in the clear, so this is where RTP is told apart,
+// and what the client's jitter buffer sees missing is what was dropped
+// here.
+
+// A non-blocking UDP socket on a free port, -1 on failure
+static int standin_relay_socket(uint16_t *port) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  socklen_t addr_len = sizeof(addr);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+// `sdp` with its candidates replaced by one host candidate at `ip`:`port`,
+// or at the replaced candidate's own address for a NULL `ip`. That is the
+// first UDP IPv4 candidate, its address goes to `original`. NULL if there
+// is none, or out of memory. Release with free().
+static char *standin_relay_sdp(const char *sdp, const char *ip, uint16_t port,
+                               struct sockaddr_in *original) {
+  char *out = (char *)malloc(strlen(sdp) + 128);
+  if (out == NULL) {
+    return NULL;
+  }
+  char *end = out;
+  bool found = false;
+  while (*sdp != '\0') {
+    const char *newline = strchr(sdp, '\n');
+    size_t len = newline != NULL ? newline - sdp + 1 : strlen(sdp);
+    if (strncmp(sdp, "a=candidate:", 12) != 0) {
+      memcpy(end, sdp, len);
+      end += len;
+    } else if (!found) {
+      char line[256];
+      snprintf(line, sizeof(line), "%.*s", (int)len, sdp);
+      char transport[8];
+      char address[64];
+      unsigned int candidate_port = 0;
+      if (sscanf(line, "a=candidate:%*s %*s %7s %*s %63s %u", transport,
+                 address, &candidate_port) == 3 &&
+          strcasecmp(transport, "udp") == 0 &&
+          inet_pton(AF_INET, address, &original->sin_addr) == 1) {
+        original->sin_family = AF_INET;
+        original->sin_port = htons(candidate_port);
+        end += sprintf(end, STANDIN_RELAY_CANDIDATE,
+                       ip != NULL ? ip : address, (unsigned)port);
+        found = true;
+      }
+    }
+    sdp += len;
+  }
+  *end = '\0';
+
+  if (!found) {
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+// RFC 7983 demultiplexing, with RTCP told apart by its RFC 5761 types
+static bool standin_relay_is_rtp(const uint8_t *data, size_t len) {
+  return len >= RTP_HEADER_SIZE && data[0] >= 128 && data[0] <= 191 &&
+         !(data[1] >= 192 && data[1] <= 223);
+}
+
+static void standin_relay_queue(standin_peer_t *peer, const uint8_t *data,
+                                size_t len) {
+  int64_t now_us = esp_timer_get_time();
+  if (standin_config.loss_percent > 0 &&
+      (standin_random(peer) % 10000) <
+          (uint32_t)(standin_config.loss_percent * 100)) {
+    peer->stats.downlink_lost++;
+    return;
+  }
+  if (peer->in_flight_count == STANDIN_MAX_IN_FLIGHT ||
+      len > STANDIN_MAX_PACKET) {
+    peer->stats.downlink_overrun++;
+    return;
+  }
+
+  // The link sends one packet at a time at the capped rate, jitter comes
+  // on top and may reorder packets like a real network
+  int64_t due_us = now_us;
+  if (standin_config.kbps > 0) {
+    int64_t tx_us = (int64_t)(len + STANDIN_PACKET_OVERHEAD) * 8 * 1000 /
+                    standin_config.kbps;
+    peer->link_free_us = MAX(peer->link_free_us, now_us) + tx_us;
+    due_us = peer->link_free_us;
+  }
+  if (standin_config.jitter_ms > 0) {
+    due_us += standin_random(peer) % (standin_config.jitter_ms * 1000 + 1);
+  }
+
+  standin_packet_t *packet = &peer->in_flight[peer->in_flight_count++];
+  packet->due_us = due_us;
+  packet->len = len;
+  memcpy(packet->data, data, len);
+}
+
+static void standin_relay_send(standin_peer_t *peer, const uint8_t *data,
+                               size_t len) {
+  sendto(peer->relay_client_fd, data, len, 0,
+         (struct sockaddr *)&peer->client_addr, sizeof(peer->client_addr));
+}
+
+// Moves whatever is waiting on either side across, then sends the RTP that
+// is due
+static void standin_relay_forward(standin_peer_t *peer) {
+  uint8_t data[STANDIN_MAX_PACKET];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  ssize_t n;
+  while ((n = recvfrom(peer->relay_client_fd, data, sizeof(data), 0,
+                       (struct sockaddr *)&from, &from_len)) >= 0) {
+    // Wherever the client's ICE ends up sending from
+    peer->client_addr = from;
+    from_len = sizeof(from);
+    sendto(peer->relay_peer_fd, data, n, 0,
+           (struct sockaddr *)&peer->peer_addr, sizeof(peer->peer_addr));
+  }
+  while ((n = recv(peer->relay_peer_fd, data, sizeof(data), 0)) >= 0) {
+    if (standin_relay_is_rtp(data, n)) {
+      standin_relay_queue(peer, data, n);
+    } else {
+      standin_relay_send(peer, data, n);
+    }
+  }
+
+  int64_t now_us = esp_timer_get_time();
+  uint32_t i = 0;
+  while (i < peer->in_flight_count) {
+    standin_packet_t *packet = &peer->in_flight[i];
+    if (packet->due_us > now_us) {
+      i++;
+      continue;
+    }
+    standin_relay_send(peer, packet->data, packet->len);
+    // Order doesn't matter, due times do
+    *packet = peer->in_flight[--peer->in_flight_count];
+  }
+}
+
+// Downlink
+
+static void standin_send_audio(standin_peer_t *peer, const uint8_t *data,
+                               size_t len) {
+  peer_connection_send_audio(peer->peer_connection, data, len);
+  peer->stats.downlink_sent++;
+}
+
+static void standin_run_script(standin_peer_t *peer) {
+  int64_t now_us = esp_timer_get_time();
+  if (!peer->ready || now_us < peer->turn_start_us) {
+    return;
+  }
+
+  if (!peer->speaking) {
+    peer->speaking = true;
+    peer->turn_packet = 0;
+    peer->next_word = 0;
+    peer->next_frame_us = peer->turn_start_us;
+    peer->stats.turns++;
+    standin_send_rtvi(peer, "bot-tts-started", NULL);
+    standin_send_rtvi(peer, "bot-started-speaking", NULL);
+  }
+
+  if (now_us - peer->next_frame_us > STANDIN_MAX_LATE_MS * 1000LL) {
+    peer->next_frame_us = now_us;
+    peer->stats.late++;
+  }
+
+  uint32_t count = standin_script.count;
+  while (peer->speaking && now_us >= peer->next_frame_us) {
+    // Words are spread evenly over the turn's audio
+    while (peer->next_word < STANDIN_WORD_COUNT &&
+           peer->turn_packet >=
+               peer->next_word * count / STANDIN_WORD_COUNT) {
+      standin_send_rtvi(peer, "bot-tts-text", standin_words[peer->next_word]);
+      peer->next_word++;
+    }
+
+    if (!standin_config.echo) {
+      uint32_t offset = standin_script.offsets[peer->turn_packet];
+      standin_send_audio(peer, standin_script.data + offset,
+                         standin_script.offsets[peer->turn_packet + 1] -
+                             offset);
+    }
+    peer->turn_packet++;
+    peer->next_frame_us += standin_frame_us;
+
+    if (peer->turn_packet == count) {
+      peer->speaking = false;
+      peer->turn_start_us =
+          peer->next_frame_us + STANDIN_TURN_GAP_MS * 1000LL;
+      standin_send_rtvi(peer, "bot-stopped-speaking", NULL);
+      standin_send_rtvi(peer, "bot-tts-stopped", NULL);
+    }
+  }
+}
+
+// libpeer callbacks, all from inside peer_connection_loop()
+
+static void standin_on_answer(char *sdp, void *user_data) {
+  standin_peer_t *peer = (standin_peer_t *)user_data;
+  if (peer->http_fd < 0) {
+    return;
+  }
+  if (peer->relay_client_fd < 0) {
+    standin_http_answer(peer, sdp);
+    return;
+  }
+
+  // The client reaches the relay wherever it would have reached libpeer
+  char *relayed = standin_relay_sdp(sdp, NULL, peer->relay_client_port,
+                                    &peer->peer_addr);
+  if (relayed == NULL) {
+    ESP_LOGE(STANDIN_LOG_TAG, "[%lu] No IPv4 candidate in the answer",
+             (unsigned long)peer->index);
+    standin_http_respond(peer->http_fd, 500, NULL, &peer->fault);
+    peer->http_fd = -1;
+    peer->closing = true;
+    return;
+  }
+  standin_http_answer(peer, relayed);
+  free(relayed);
+}
+
+static void standin_on_state(PeerConnectionState state, void *user_data) {
+  standin_peer_t *peer = (standin_peer_t *)user_data;
+  ESP_LOGI(STANDIN_LOG_TAG, "[%lu] %s", (unsigned long)peer->index,
+           peer_connection_state_to_string(state));
+  peer->state = state;
+  if (state == PEER_CONNECTION_CONNECTED ||
+      state == PEER_CONNECTION_COMPLETED) {
+    peer->connected = true;
+  } else if (state == PEER_CONNECTION_FAILED ||
+             state == PEER_CONNECTION_DISCONNECTED ||
+             state == PEER_CONNECTION_CLOSED) {
+    peer->closing = true;
+  }
+}
+
+static void standin_on_message(char *msg, size_t len, void *user_data,
+                               uint16_t sid) {
+  standin_peer_t *peer = (standin_peer_t *)user_data;
+  rtvi_message_t &message = peer->message;
+  peer->stats.rtvi_received++;
+  if (!rtvi_parse_message(msg, len, &message)) {
+    return;
+  }
+
+  if (strcmp(message.type, "client-ready") == 0 && !peer->ready) {
+    peer->ready = true;
+    standin_send_rtvi(peer, "bot-ready", NULL);
+    peer->turn_start_us = esp_timer_get_time() + STANDIN_TURN_GAP_MS * 1000LL;
+  }
+}
+
+static void standin_on_audio(uint8_t *data, size_t size, void *user_data) {
+  standin_peer_t *peer = (standin_peer_t *)user_data;
+  peer->stats.uplink_packets++;
+  peer->stats.uplink_bytes += size;
+
+  if (standin_config.echo) {
+    standin_send_audio(peer, data, size);
+  }
+  if (peer->recorder != NULL) {
+    int samples =
+        opus_decode(peer->decoder, data, size, peer->pcm, peer->pcm_samples, 0);
+    if (samples > 0) {
+      pipecat_audio_device.write(peer->recorder, peer->pcm, samples);
+    }
+  }
+}
+
+// Connections
+
+static standin_peer_t *standin_peer_claim() {
+  standin_peer_t *peer = NULL;
+  xSemaphoreTake(standin_mutex, portMAX_DELAY);
+  for (int i = 0; i < STANDIN_MAX_PEERS && peer == NULL; i++) {
+    if (!standin_peers[i].in_use) {
+      peer = &standin_peers[i];
+      memset(peer, 0, sizeof(standin_peer_t));
+      peer->in_use = true;
+      peer->http_fd = -1;
+      peer->relay_client_fd = -1;
+      peer->relay_peer_fd = -1;
+      peer->index = standin_next_index++;
+    }
+  }
+  xSemaphoreGive(standin_mutex);
+  return peer;
+}
+
+static void standin_peer_free(standin_peer_t *peer) {
+  if (peer->http_fd >= 0) {
+    standin_http_respond(peer->http_fd, 500, NULL, NULL);
+  }
+  if (peer->peer_connection != NULL) {
+    peer_connection_destroy(peer->peer_connection);
+  }
+  if (peer->decoder != NULL) {
+    opus_decoder_destroy(peer->decoder);
+  }
+  if (peer->recorder != NULL) {
+    audio_device_wav_destroy(peer->recorder);
+  }
+  free(peer->pcm);
+  free(peer->in_flight);
+  if (peer->relay_client_fd >= 0) {
+    close(peer->relay_client_fd);
+  }
+  if (peer->relay_peer_fd >= 0) {
+    close(peer->relay_peer_fd);
+  }
+
+  xSemaphoreTake(standin_mutex, portMAX_DELAY);
+  memset(peer, 0, sizeof(standin_peer_t));
+  xSemaphoreGive(standin_mutex);
+}
+
+static void standin_peer_log(const standin_peer_t *peer, const char *reason) {
+  const standin_stats_t *s = &peer->stats;
+  ESP_LOGI(STANDIN_LOG_TAG,
+           "[%lu] closed (%s): %lu turns, downlink %lu sent %lu lost %lu "
+           "overrun, uplink %lu packets, RTVI %lu sent %lu received",
+           (unsigned long)peer->index, reason, (unsigned long)s->turns,
+           (unsigned long)s->downlink_sent, (unsigned long)s->downlink_lost,
+           (unsigned long)s->downlink_overrun,
+           (unsigned long)s->uplink_packets, (unsigned long)s->rtvi_sent,
+           (unsigned long)s->rtvi_received);
+}
+
+// On a claimed peer; the HTTP connection is answered from the peer's task
+static bool standin_peer_open(standin_peer_t *peer, const char *offer,
+                              int http_fd, const standin_http_fault_t *fault) {
+  peer->http_fd = http_fd;
+  peer->fault = *fault;
+  peer->created_us = esp_timer_get_time();
+  peer->rng = standin_config.seed + peer->index * 0x9e3779b9u;
+  if (peer->rng == 0) {
+    peer->rng = 1;
+  }
+  if (standin_config.relay) {
+    peer->in_flight = (standin_packet_t *)malloc(STANDIN_MAX_IN_FLIGHT *
+                                                 sizeof(standin_packet_t));
+    peer->relay_client_fd = standin_relay_socket(&peer->relay_client_port);
+    peer->relay_peer_fd = standin_relay_socket(&peer->relay_peer_port);
+    if (peer->in_flight == NULL || peer->relay_client_fd < 0 ||
+        peer->relay_peer_fd < 0) {
+      return false;
+    }
+  }
+
+  if (standin_config.record_dir != NULL) {
+    snprintf(peer->record_path, sizeof(peer->record_path), "%s/uplink-%lu.wav",
+             standin_config.record_dir, (unsigned long)peer->index);
+    uint32_t rate = pipecat_audio_config.codec_rate;
+    int error = 0;
+    peer->decoder = opus_decoder_create(rate, 1, &error);
+    peer->pcm_samples = audio_frame_samples(rate, 120);
+    peer->pcm = (int16_t *)malloc(peer->pcm_samples * sizeof(int16_t));
+    peer->recorder =
+        audio_device_wav_create(NULL, peer->record_path, false, false);
+    if (peer->decoder == NULL || peer->pcm == NULL || peer->recorder == NULL ||
+        pipecat_audio_device.init(peer->recorder, rate) != ESP_OK) {
+      return false;
+    }
+  }
+
+  PeerConfiguration config = {
+      .ice_servers = {},
+      .audio_codec = CODEC_OPUS,
+      .video_codec = CODEC_NONE,
+      .datachannel = DATA_CHANNEL_STRING,
+      .onaudiotrack = standin_on_audio,
+      .onvideotrack = NULL,
+      .on_request_keyframe = NULL,
+      .user_data = peer,
+  };
+  peer->peer_connection = peer_connection_create(&config);
+  if (peer->peer_connection == NULL) {
+    return false;
+  }
+  peer_connection_oniceconnectionstatechange(peer->peer_connection,
+                                             standin_on_state);
+  peer_connection_onicecandidate(peer->peer_connection, standin_on_answer);
+  peer_connection_ondatachannel(peer->peer_connection, standin_on_message,
+                                NULL, NULL);
+
+  // libpeer reaches the relay on this host. Until the client sends through
+  // it, what libpeer sends goes to the client's own candidate.
+  char *relayed = NULL;
+  if (standin_config.relay) {
+    relayed = standin_relay_sdp(offer, "127.0.0.1", peer->relay_peer_port,
+                                &peer->client_addr);
+    if (relayed == NULL) {
+      ESP_LOGE(STANDIN_LOG_TAG, "[%lu] No IPv4 candidate in the offer",
+               (unsigned long)peer->index);
+      return false;
+    }
+    offer = relayed;
+  }
+
+  // libpeer hands the answer to onicecandidate, like the client's offer
+  peer_connection_set_remote_description(peer->peer_connection, offer,
+                                         SDP_TYPE_OFFER);
+  peer_connection_create_answer(peer->peer_connection);
+  free(relayed);
+  return true;
+}
+
+// Why the peer should close, NULL to keep it
+static const char *standin_service(standin_peer_t *peer) {
+  peer_connection_loop(peer->peer_connection);
+
+  int64_t age_us = esp_timer_get_time() - peer->created_us;
+  if (peer->closing) {
+    return peer_connection_state_to_string(peer->state);
+  }
+  if (peer->http_fd >= 0 && age_us > STANDIN_ANSWER_TIMEOUT_MS * 1000LL) {
+    return "answer timeout";
+  }
+  if (!peer->connected && age_us > RECONNECT_CONNECT_TIMEOUT_MS * 1000LL) {
+    return "connect timeout";
+  }
+
+  standin_run_script(peer);
+  if (peer->relay_client_fd >= 0) {
+    standin_relay_forward(peer);
+  }
+  return NULL;
+}
+
+static void standin_peer_task(void *user_data) {
+  standin_peer_t *peer = (standin_peer_t *)user_data;
+  const char *reason = "stopped";
+  while (standin_running) {
+    const char *closed = standin_service(peer);
+    if (closed != NULL) {
+      reason = closed;
+      break;
+    }
+    vTaskDelay(MAX(pdMS_TO_TICKS(STANDIN_POLL_MS), 1));
+  }
+  standin_peer_log(peer, reason);
+  standin_peer_free(peer);
+  standin_tasks--;
+  vTaskDelete(NULL);
+}
+
+static void standin_http_offer(int fd, const char *sdp,
+                               const standin_http_fault_t *fault) {
+  standin_peer_t *peer = standin_peer_claim();
+  if (peer == NULL) {
+    standin_http_respond(fd, 503, NULL, fault);
+    return;
+  }
+
+  if (!standin_peer_open(peer, sdp, fd, fault)) {
+    ESP_LOGE(STANDIN_LOG_TAG, "Unable to create connection");
+    standin_peer_free(peer);
+    return;
+  }
+  ESP_LOGI(STANDIN_LOG_TAG, "[%lu] offer from client",
+           (unsigned long)peer->index);
+
+  standin_tasks++;
+  if (xTaskCreate(standin_peer_task, "Stand-in Peer",
+                  STANDIN_PEER_TASK_STACK_SIZE, peer, STANDIN_TASK_PRIORITY,
+                  NULL) != pdPASS) {
+    standin_tasks--;
+    ESP_LOGE(STANDIN_LOG_TAG, "Unable to start connection task");
+    standin_peer_free(peer);
+  }
+}
+
+// The offer's SDP back as the answer, without WebRTC
+static void standin_http_echo(int fd, const char *sdp,
+                              const standin_http_fault_t *fault) {
+  char pc_id[32];
+  snprintf(pc_id, sizeof(pc_id), "echo-%lu",
+           (unsigned long)standin_next_index++);
+  char *body = standin_http_answer_body(sdp, pc_id, fault->pad);
+  standin_http_respond(fd, body != NULL ? 200 : 500, body, fault);
+  free(body);
+}
+
+static void standin_http_handle(int fd) {
+  char *request = (char *)malloc(STANDIN_HTTP_MAX_REQUEST);
+  char method[8];
+  char path[128];
+  char *body = request != NULL ? standin_http_read(fd, request,
+                                                   STANDIN_HTTP_MAX_REQUEST,
+                                                   method, path)
+                               : NULL;
+  if (body == NULL) {
+    standin_http_respond(fd, 400, NULL, NULL);
+    free(request);
+    return;
+  }
+
+  char *query = strchr(path, '?');
+  if (query != NULL) {
+    *query++ = '\0';
+  }
+  standin_http_fault_t fault;
+  standin_http_parse_fault(query, &fault);
+
+  bool offer = strcmp(path, "/api/offer") == 0;
+  bool echo = strcmp(path, "/api/echo") == 0;
+  if (strcmp(method, "POST") != 0 || (!offer && !echo)) {
+    standin_http_respond(fd, 404, NULL, NULL);
+    free(request);
+    return;
+  }
+
+  if (!standin_http_fault_due(query, &fault)) {
+    memset(&fault, 0, sizeof(fault));
+  }
+  if (fault.delay_ms > 0) {
+    vTaskDelay(pdMS_TO_TICKS(fault.delay_ms));
+  }
+  if (fault.status != 0) {
+    standin_http_respond(fd, fault.status, NULL, &fault);
+    free(request);
+    return;
+  }
+
+  cJSON *j_request = cJSON_Parse(body);
+  cJSON *j_sdp = cJSON_GetObjectItem(j_request, "sdp");
+  if (!cJSON_IsString(j_sdp)) {
+    standin_http_respond(fd, 400, NULL, NULL);
+  } else if (offer) {
+    standin_http_offer(fd, j_sdp->valuestring, &fault);
+  } else {
+    standin_http_echo(fd, j_sdp->valuestring, &fault);
+  }
+  cJSON_Delete(j_request);
+  free(request);
+}
+
+static void standin_http_task(void *user_data) {
+  standin_http_handle((int)(intptr_t)user_data);
+  standin_tasks--;
+  vTaskDelete(NULL);
+}
+
+static void standin_accept_task(void *user_data) {
+  int listen_fd = (int)(intptr_t)user_data;
+  while (standin_running) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      // Timed out, or a failed connection
+      continue;
+    }
+    struct timeval timeout = {.tv_sec = STANDIN_HTTP_TIMEOUT_MS / 1000,
+                              .tv_usec = STANDIN_HTTP_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    standin_tasks++;
+    if (xTaskCreate(standin_http_task, "Stand-in HTTP",
+                    STANDIN_HTTP_TASK_STACK_SIZE, (void *)(intptr_t)fd,
+                    STANDIN_TASK_PRIORITY, NULL) != pdPASS) {
+      standin_tasks--;
+      standin_http_respond(fd, 503, NULL, NULL);
+    }
+  }
+  close(listen_fd);
+  standin_tasks--;
+  vTaskDelete(NULL);
+}
+
+static void standin_report() {
+  standin_stats_t total = {};
+  uint32_t active = 0, connected = 0;
+  xSemaphoreTake(standin_mutex, portMAX_DELAY);
+  for (int i = 0; i < STANDIN_MAX_PEERS; i++) {
+    const standin_peer_t *peer = &standin_peers[i];
+    if (!peer->in_use) {
+      continue;
+    }
+    active++;
+    connected += peer->connected;
+    total.downlink_sent += peer->stats.downlink_sent;
+    total.downlink_lost += peer->stats.downlink_lost;
+    total.downlink_overrun += peer->stats.downlink_overrun;
+    total.uplink_packets += peer->stats.uplink_packets;
+    total.rtvi_sent += peer->stats.rtvi_sent;
+    total.rtvi_received += peer->stats.rtvi_received;
+    total.late += peer->stats.late;
+  }
+  xSemaphoreGive(standin_mutex);
+  ESP_LOGI(STANDIN_LOG_TAG,
+           "%lu connections (%lu connected) | downlink %lu sent %lu lost "
+           "%lu overrun | uplink %lu packets | RTVI %lu sent %lu received | "
+           "%lu late turns",
+           (unsigned long)active, (unsigned long)connected,
+           (unsigned long)total.downlink_sent,
+           (unsigned long)total.downlink_lost,
+           (unsigned long)total.downlink_overrun,
+           (unsigned long)total.uplink_packets,
+           (unsigned long)total.rtvi_sent, (unsigned long)total.rtvi_received,
+           (unsigned long)total.late);
+}
+
+uint16_t pipecat_standin_start(uint16_t port) {
+  if (standin_running) {
+    ESP_LOGE(STANDIN_LOG_TAG, "Already running");
+    return 0;
+  }
+
+  standin_config.loss_percent = standin_env_float("PIPECAT_STANDIN_LOSS", 0);
+  standin_config.jitter_ms = standin_env_uint("PIPECAT_STANDIN_JITTER_MS", 0);
+  standin_config.kbps = standin_env_uint("PIPECAT_STANDIN_KBPS", 0);
+  standin_config.seed = standin_env_uint("PIPECAT_STANDIN_SEED", 1);
+  standin_config.echo = standin_env_uint("PIPECAT_STANDIN_ECHO", 0) != 0;
+  standin_config.record_dir = getenv("PIPECAT_STANDIN_RECORD_DIR");
+  standin_config.relay = standin_config.loss_percent > 0 ||
+                         standin_config.jitter_ms > 0 ||
+                         standin_config.kbps > 0;
+  standin_frame_us = pipecat_audio_config.frame_ms * 1000LL;
+
+  // Kept across restarts, like libpeer's global state
+  if (standin_peers == NULL) {
+    standin_mutex = xSemaphoreCreateMutex();
+    standin_peers =
+        (standin_peer_t *)calloc(STANDIN_MAX_PEERS, sizeof(standin_peer_t));
+    if (standin_mutex == NULL || standin_peers == NULL ||
+        !standin_build_script()) {
+      free(standin_peers);
+      standin_peers = NULL;
+      return 0;
+    }
+    peer_init();
+  }
+  memset(standin_fault_counts, 0, sizeof(standin_fault_counts));
+
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct timeval timeout = {.tv_sec = 0,
+                            .tv_usec = STANDIN_ACCEPT_POLL_MS * 1000};
+  setsockopt(listen_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  socklen_t addr_len = sizeof(addr);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 16) != 0 ||
+      getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+    ESP_LOGE(STANDIN_LOG_TAG, "Unable to listen on port %u: %s",
+             (unsigned)port, strerror(errno));
+    if (listen_fd >= 0) {
+      close(listen_fd);
+    }
+    return 0;
+  }
+  port = ntohs(addr.sin_port);
+
+  standin_running = true;
+  standin_tasks = 1;
+  if (xTaskCreate(standin_accept_task, "Stand-in Accept",
+                  STANDIN_HTTP_TASK_STACK_SIZE, (void *)(intptr_t)listen_fd,
+                  STANDIN_TASK_PRIORITY, NULL) != pdPASS) {
+    standin_running = false;
+    standin_tasks = 0;
+    close(listen_fd);
+    return 0;
+  }
+
+  ESP_LOGI(STANDIN_LOG_TAG,
+           "Listening on http://127.0.0.1:%u/api/offer: %s, loss %.1f%%, "
+           "jitter %lums, %lukbps, seed %lu",
+           (unsigned)port, standin_config.echo ? "echo" : "scripted TTS",
+           standin_config.loss_percent,
+           (unsigned long)standin_config.jitter_ms,
+           (unsigned long)standin_config.kbps,
+           (unsigned long)standin_config.seed);
+  return port;
+}
+
+void pipecat_standin_stop() {
+  if (!standin_running) {
+    return;
+  }
+  standin_running = false;
+  // Peers notice within STANDIN_POLL_MS, the accept task within
+  // STANDIN_ACCEPT_POLL_MS, an HTTP connection once its request is handled
+  while (standin_tasks > 0) {
+    vTaskDelay(MAX(pdMS_TO_TICKS(STANDIN_POLL_MS), 1));
+  }
+  ESP_LOGI(STANDIN_LOG_TAG, "Stopped");
+}
+
+int pipecat_standin_server(uint16_t port) {
+  if (pipecat_standin_start(port) == 0) {
+    return 1;
+  }
+  while (1) {
+    vTaskDelay(pdMS_TO_TICKS(STANDIN_REPORT_INTERVAL_MS));
+    standin_report();
+  }
+}
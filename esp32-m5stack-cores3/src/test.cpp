@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <esp_log.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+
+// `src.elf --test [NAME]`, see "Host tests" in main.h
+#define TEST_LOG_TAG "test"
+
+typedef struct {
+  const char *name;
+  void (*run)();
+} test_case_t;
+
+static void test_allocator();
+
+static const test_case_t test_cases[] = {
+    {"allocator", test_allocator},
+    {"jitter_buffer", test_jitter_buffer},
+    {"rtp_parse", test_rtp_parse},
+    {"pcm_ring", test_pcm_ring},
+    {"aec", test_aec},
+    {"gain_meter", test_audio_gain_meter},
+    {"capture_vad", test_capture_vad},
+    {"encoder_loss", test_encoder_loss},
+    {"audio_config", test_audio_config},
+    {"audio_receive", test_audio_receive},
+    {"opus_controller", test_opus_controller},
+    {"rtvi_parser", test_rtvi_parser},
+    {"rtvi_send", test_rtvi_send},
+    {"warm_cache", test_warm_cache},
+    {"standin", test_standin},
+    {"http", test_http},
+    {"signalling", test_signalling},
+    {"webrtc", test_webrtc},
+    {"record", test_record},
+};
+
+static uint32_t test_checks = 0;
+static uint32_t test_failures = 0;
+
+static pipecat_session_t test_sessions[TEST_MAX_SESSIONS];
+static uint32_t test_sessions_used = 0;
+
+bool test_check(bool ok, const char *expr, const char *file, int line) {
+  test_checks++;
+  if (!ok) {
+    test_failures++;
+    ESP_LOGE(TEST_LOG_TAG, "%s:%d: %s", file, line, expr);
+  }
+  return ok;
+}
+
+bool test_check_eq(int64_t actual, int64_t expected, const char *expr,
+                   const char *file, int line) {
+  test_checks++;
+  if (actual != expected) {
+    test_failures++;
+    ESP_LOGE(TEST_LOG_TAG, "%s:%d: %s is %" PRId64 ", expected %" PRId64,
+             file, line, expr, actual, expected);
+  }
+  return actual == expected;
+}
+
+// glibc's allocator, counted per thread so other tasks don't show up
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+static thread_local uint64_t test_allocation_count = 0;
+static thread_local int64_t test_live_count = 0;
+
+extern "C" void *malloc(size_t size) noexcept {
+  test_allocation_count++;
+  void *ptr = __libc_malloc(size);
+  test_live_count += ptr != NULL;
+  return ptr;
+}
+
+extern "C" void *calloc(size_t count, size_t size) noexcept {
+  test_allocation_count++;
+  void *ptr = __libc_calloc(count, size);
+  test_live_count += ptr != NULL;
+  return ptr;
+}
+
+extern "C" void *realloc(void *ptr, size_t size) noexcept {
+  test_allocation_count++;
+  void *result = __libc_realloc(ptr, size);
+  if (ptr == NULL) {
+    test_live_count += result != NULL;
+  } else if (size == 0) {
+    test_live_count--;
+  }
+  return result;
+}
+
+// The aligned allocators too, everything they return goes to free()
+extern "C" void *aligned_alloc(size_t alignment, size_t size) noexcept {
+  test_allocation_count++;
+  void *ptr = __libc_memalign(alignment, size);
+  test_live_count += ptr != NULL;
+  return ptr;
+}
+
+extern "C" void *memalign(size_t alignment, size_t size) noexcept {
+  return aligned_alloc(alignment, size);
+}
+
+extern "C" int posix_memalign(void **ptr, size_t alignment,
+                              size_t size) noexcept {
+  if (alignment % sizeof(void *) != 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  void *result = aligned_alloc(alignment, size);
+  if (result == NULL) {
+    return ENOMEM;
+  }
+  *ptr = result;
+  return 0;
+}
+
+extern "C" void free(void *ptr) noexcept {
+  test_live_count -= ptr != NULL;
+  __libc_free(ptr);
+}
+
+uint64_t test_allocations() { return test_allocation_count; }
+
+int64_t test_live_allocations() { return test_live_count; }
+
+// Every allocator is counted once and balanced by free(), or the leak
+// checks drift
+static void test_allocator() {
+  uint64_t allocations = test_allocations();
+  int64_t live = test_live_allocations();
+  void *blocks[6];
+  blocks[0] = malloc(16);
+  blocks[1] = calloc(4, 16);
+  blocks[2] = realloc(NULL, 16);
+  blocks[2] = realloc(blocks[2], 4096);
+  blocks[3] = aligned_alloc(64, 256);
+  blocks[4] = NULL;
+  TEST_CHECK_EQ(posix_memalign(&blocks[4], 64, 256), 0);
+  TEST_CHECK_EQ(posix_memalign(&blocks[5], 3, 256), EINVAL);
+  blocks[5] = NULL;
+  TEST_CHECK_EQ((uintptr_t)blocks[3] % 64, 0);
+  TEST_CHECK_EQ((uintptr_t)blocks[4] % 64, 0);
+  TEST_CHECK_EQ(test_allocations() - allocations, 6);
+  TEST_CHECK_EQ(test_live_allocations() - live, 5);
+  for (void *block : blocks) {
+    free(block);
+  }
+  TEST_CHECK_EQ(test_live_allocations(), live);
+}
+
+pipecat_session_t *test_session_create(const audio_device_t *device,
+                                       void *device_context) {
+  if (test_sessions_used == TEST_MAX_SESSIONS) {
+    ESP_LOGE(TEST_LOG_TAG, "All %d test sessions are in use",
+             TEST_MAX_SESSIONS);
+    return NULL;
+  }
+  pipecat_session_t *session = &test_sessions[test_sessions_used];
+  // 0 is the default session's
+  pipecat_session_config_t config = {
+      .index = test_sessions_used + 1,
+      .url = PIPECAT_SMALLWEBRTC_URL,
+      .device = device,
+      .device_context = device_context,
+  };
+  if (!pipecat_session_create(session, &config)) {
+    return NULL;
+  }
+  test_sessions_used++;
+  return session;
+}
+
+int pipecat_run_tests(const char *filter) {
+  if (!pipecat_init_memory(TEST_MAX_SESSIONS)) {
+    return 1;
+  }
+
+  uint32_t run = 0, failed = 0;
+  for (const test_case_t &test : test_cases) {
+    if (filter != NULL && strncmp(test.name, filter, strlen(filter)) != 0) {
+      continue;
+    }
+    printf("%s\n", test.name);
+    uint32_t failures = test_failures;
+    test.run();
+    run++;
+    if (test_failures != failures) {
+      failed++;
+    }
+    printf("%s %s\n", test.name, test_failures == failures ? "ok" : "FAILED");
+  }
+
+  printf("%lu tests, %lu failed, %lu checks\n", (unsigned long)run,
+         (unsigned long)failed, (unsigned long)test_checks);
+  return run == 0 || failed > 0;
+}
@@ -0,0 +1,351 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+
+// The canceller against a synthetic speaker-to-microphone path: a bulk
+// delay inside the reference window plus a short decaying response, mic
+// noise at -60dBFS. Far end only, then double-talk with a second voice,
+// then far end only again. ERLE is microphone over output energy, with
+// and without the residual suppressor, over the last second of each far
+// end phase. With PIPECAT_AEC_REFERENCE_WAV and PIPECAT_AEC_MIC_WAV (16-bit
+// mono at 16kHz) the same figures are printed for a recorded pair.
+#define TEST_AEC_RATE 16000
+#define TEST_AEC_BLOCK (TEST_AEC_RATE / 1000 * AUDIO_BLOCK_MS)
+#define TEST_AEC_PHASE_S 4
+#define TEST_AEC_DOUBLE_TALK_S 2
+#define TEST_AEC_MIN_ERLE_DB 20.0f
+#define TEST_AEC_MIN_NEAR_END_CLARITY_DB 10.0f
+
+typedef struct {
+  uint32_t delay;
+  float gain;
+} test_aec_tap_t;
+
+static const test_aec_tap_t test_aec_path[] = {
+    {AEC_REFERENCE_DELAY_SAMPLES + 24, 0.9f},
+    {AEC_REFERENCE_DELAY_SAMPLES + 31, -0.45f},
+    {AEC_REFERENCE_DELAY_SAMPLES + 64, 0.2f},
+    {AEC_REFERENCE_DELAY_SAMPLES + 150, -0.08f},
+};
+
+typedef struct {
+  double mic_energy;
+  double output_energy;
+  double residual_energy;  // Output with the suppressor divided back out
+  uint32_t blocks;
+  uint32_t double_talk_blocks;
+} test_aec_phase_t;
+
+static double test_aec_cpu_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static float test_aec_db(double numerator, double denominator) {
+  return denominator > 0.0 ? 10.0f * log10f(numerator / denominator) : 0.0f;
+}
+
+// Runs `count` samples, aligned to blocks, through the canceller into
+// `output` if not NULL; energy is accumulated from sample `measure_from` on
+static void test_aec_run(aec_t *aec, const int16_t *reference,
+                         const int16_t *mic, int16_t *output, size_t count,
+                         size_t measure_from, test_aec_phase_t *phase,
+                         double *cpu_s) {
+  memset(phase, 0, sizeof(test_aec_phase_t));
+  int16_t block[TEST_AEC_BLOCK];
+  for (size_t offset = 0; offset + TEST_AEC_BLOCK <= count;
+       offset += TEST_AEC_BLOCK) {
+    memcpy(block, mic + offset, sizeof(block));
+    double start = test_aec_cpu_seconds();
+    aec_process(aec, block, reference + offset, TEST_AEC_BLOCK);
+    *cpu_s += test_aec_cpu_seconds() - start;
+    if (output != NULL) {
+      memcpy(output + offset, block, sizeof(block));
+    }
+
+    if (offset < measure_from) {
+      continue;
+    }
+    phase->blocks++;
+    phase->double_talk_blocks += aec->stats.double_talk;
+    for (int i = 0; i < TEST_AEC_BLOCK; i++) {
+      double d = mic[offset + i];
+      double e = block[i];
+      phase->mic_energy += d * d;
+      phase->output_energy += e * e;
+      phase->residual_energy += e * e / (aec->suppression * aec->suppression);
+    }
+  }
+}
+
+// The reference ring as media.cpp fills it, with playback started
+// TEST_AEC_BACKLOG_MS before capture and every stamp up to
+// TEST_AEC_STAMP_JITTER_US off. The blocks played before capture are
+// skipped and the canceller converges as it does on an aligned pair.
+// Playback starting after capture runs the first blocks against silence.
+#define TEST_AEC_BACKLOG_MS 60
+#define TEST_AEC_LATE_MS 30
+#define TEST_AEC_STAMP_JITTER_US 2000
+#define TEST_AEC_RING_BLOCKS 16
+#define TEST_AEC_FRAME_BLOCKS 2
+#define TEST_AEC_START_US 1000000
+#define TEST_AEC_BLOCK_US (AUDIO_BLOCK_MS * 1000)
+
+typedef struct {
+  uint32_t dropped;  // Skipped as played before their microphone block
+  uint32_t silent;   // Microphone blocks with no reference yet
+} test_aec_alignment_t;
+
+// Playback from `start_us` on of `reference`, capture from
+// TEST_AEC_START_US of its echo
+static void test_aec_aligned_run(aec_t *aec, const int16_t *reference,
+                                 size_t count, int64_t start_us,
+                                 size_t measure_from, test_aec_phase_t *phase,
+                                 test_aec_alignment_t *alignment) {
+  memset(phase, 0, sizeof(test_aec_phase_t));
+  memset(alignment, 0, sizeof(test_aec_alignment_t));
+  static pcm_ring_t ring;
+  if (ring.frames == NULL &&
+      !TEST_CHECK(pcm_ring_init(&ring, TEST_AEC_RING_BLOCKS, TEST_AEC_BLOCK,
+                                MEMORY_INTERNAL))) {
+    return;
+  }
+  while (pcm_ring_acquire_read(&ring, NULL) != NULL) {
+    pcm_ring_release_read(&ring);
+  }
+
+  // Echo of the reference at the microphone block's time
+  int64_t offset_samples =
+      (TEST_AEC_START_US - start_us) * TEST_AEC_RATE / 1000000;
+  uint32_t noise = 1;
+  uint32_t played = 0, consumed = 0;
+  int16_t mic[TEST_AEC_BLOCK], block[TEST_AEC_BLOCK];
+  size_t blocks = count / TEST_AEC_BLOCK - TEST_AEC_BACKLOG_MS / AUDIO_BLOCK_MS;
+  for (size_t b = 0; b < blocks; b++) {
+    int64_t mic_us = TEST_AEC_START_US + b * TEST_AEC_BLOCK_US;
+
+    // A frame's worth of playback is written ahead of its capture
+    int64_t frame_end_us =
+        mic_us + (TEST_AEC_FRAME_BLOCKS - b % TEST_AEC_FRAME_BLOCKS) *
+                     TEST_AEC_BLOCK_US;
+    if (b % TEST_AEC_FRAME_BLOCKS == 0) {
+      while (start_us + played * TEST_AEC_BLOCK_US < frame_end_us &&
+             (played + 1) * TEST_AEC_BLOCK <= count) {
+        int16_t *slot = pcm_ring_acquire_write(&ring);
+        if (!TEST_CHECK(slot != NULL)) {
+          return;
+        }
+        memcpy(slot, reference + played * TEST_AEC_BLOCK,
+               sizeof(int16_t) * TEST_AEC_BLOCK);
+        noise = noise * 1664525u + 1013904223u;
+        int64_t jitter_us =
+            (int64_t)(noise >> 16) % (2 * TEST_AEC_STAMP_JITTER_US + 1) -
+            TEST_AEC_STAMP_JITTER_US;
+        pcm_ring_commit_write(
+            &ring, start_us + played * TEST_AEC_BLOCK_US + jitter_us);
+        played++;
+      }
+    }
+
+    for (int i = 0; i < TEST_AEC_BLOCK; i++) {
+      int64_t t = offset_samples + (int64_t)(b * TEST_AEC_BLOCK + i);
+      float echo = 0.0f;
+      for (const test_aec_tap_t &tap : test_aec_path) {
+        if (t >= (int64_t)tap.delay && t - tap.delay < (int64_t)count) {
+          echo += tap.gain * reference[t - tap.delay];
+        }
+      }
+      noise = noise * 1664525u + 1013904223u;
+      echo += ((int32_t)(noise >> 16) - 32768) / 32768.0f * 33.0f;
+      mic[i] = (int16_t)fmaxf(-32768.0f, fminf(32767.0f, echo));
+    }
+
+    uint32_t before = pcm_ring_count(&ring);
+    const int16_t *aligned = aec_reference_acquire(&ring, mic_us);
+    alignment->dropped += before - pcm_ring_count(&ring);
+    alignment->silent += aligned == NULL;
+    memcpy(block, mic, sizeof(block));
+    aec_process(aec, block, aligned, TEST_AEC_BLOCK);
+    if (aligned != NULL) {
+      pcm_ring_release_read(&ring);
+      consumed++;
+    }
+
+    if (b * TEST_AEC_BLOCK < measure_from) {
+      continue;
+    }
+    phase->blocks++;
+    for (int i = 0; i < TEST_AEC_BLOCK; i++) {
+      double d = mic[i];
+      double e = block[i];
+      phase->mic_energy += d * d;
+      phase->residual_energy += e * e / (aec->suppression * aec->suppression);
+    }
+  }
+}
+
+static void test_aec_alignment(const int16_t *reference, size_t count) {
+  static aec_t aec;
+  test_aec_phase_t phase;
+  test_aec_alignment_t alignment;
+
+  aec_init(&aec);
+  test_aec_aligned_run(&aec, reference, count,
+                       TEST_AEC_START_US - TEST_AEC_BACKLOG_MS * 1000,
+                       count - TEST_AEC_RATE * 2, &phase, &alignment);
+  float linear_db = test_aec_db(phase.mic_energy, phase.residual_energy);
+  printf("  playback %ums ahead: %lu blocks skipped, ERLE %.1fdB before "
+         "suppression\n",
+         (unsigned)TEST_AEC_BACKLOG_MS, (unsigned long)alignment.dropped,
+         linear_db);
+  TEST_CHECK_EQ(alignment.dropped, TEST_AEC_BACKLOG_MS / AUDIO_BLOCK_MS);
+  TEST_CHECK_EQ(alignment.silent, 0);
+  TEST_CHECK(linear_db >= TEST_AEC_MIN_ERLE_DB);
+
+  aec_init(&aec);
+  test_aec_aligned_run(&aec, reference, count,
+                       TEST_AEC_START_US + TEST_AEC_LATE_MS * 1000,
+                       count - TEST_AEC_RATE * 2, &phase, &alignment);
+  linear_db = test_aec_db(phase.mic_energy, phase.residual_energy);
+  printf("  playback %ums late: %lu blocks against silence, ERLE %.1fdB "
+         "before suppression\n",
+         (unsigned)TEST_AEC_LATE_MS, (unsigned long)alignment.silent,
+         linear_db);
+  TEST_CHECK_EQ(alignment.dropped, 0);
+  TEST_CHECK_EQ(alignment.silent, TEST_AEC_LATE_MS / AUDIO_BLOCK_MS);
+  TEST_CHECK(linear_db >= TEST_AEC_MIN_ERLE_DB);
+}
+
+static void test_aec_wav_pair() {
+  const char *reference_path = getenv("PIPECAT_AEC_REFERENCE_WAV");
+  const char *mic_path = getenv("PIPECAT_AEC_MIC_WAV");
+  if (reference_path == NULL || mic_path == NULL) {
+    return;
+  }
+
+  size_t reference_count = 0, mic_count = 0;
+  int16_t *reference =
+      audio_wav_read_file(reference_path, TEST_AEC_RATE, &reference_count);
+  int16_t *mic = audio_wav_read_file(mic_path, TEST_AEC_RATE, &mic_count);
+  if (TEST_CHECK(reference != NULL && mic != NULL)) {
+    static aec_t aec;
+    aec_init(&aec);
+    size_t count = reference_count < mic_count ? reference_count : mic_count;
+    test_aec_phase_t phase;
+    double cpu_s = 0.0;
+    test_aec_run(&aec, reference, mic, NULL, count, 0, &phase, &cpu_s);
+    printf("  %s: ERLE %.1fdB (%.1fdB before suppression), %lu%% "
+           "double-talk\n",
+           mic_path, test_aec_db(phase.mic_energy, phase.output_energy),
+           test_aec_db(phase.mic_energy, phase.residual_energy),
+           (unsigned long)(phase.blocks > 0 ? phase.double_talk_blocks * 100 /
+                                                  phase.blocks
+                                            : 0));
+  }
+  free(reference);
+  free(mic);
+}
+
+void test_aec() {
+  size_t phase_samples = TEST_AEC_RATE * TEST_AEC_PHASE_S;
+  size_t double_talk_samples = TEST_AEC_RATE * TEST_AEC_DOUBLE_TALK_S;
+  size_t count = 2 * phase_samples + double_talk_samples;
+  int16_t *reference = (int16_t *)malloc(count * sizeof(int16_t));
+  int16_t *near = (int16_t *)malloc(count * sizeof(int16_t));
+  int16_t *mic = (int16_t *)malloc(count * sizeof(int16_t));
+  int16_t *output = (int16_t *)malloc(double_talk_samples * sizeof(int16_t));
+  if (!TEST_CHECK(reference != NULL && near != NULL && mic != NULL &&
+                  output != NULL)) {
+    free(reference);
+    free(near);
+    free(mic);
+    free(output);
+    return;
+  }
+
+  // A second, higher voice for the near end, only while both talk
+  audio_bench_signal(reference, count, TEST_AEC_RATE);
+  audio_bench_signal(near, count, TEST_AEC_RATE * 3 / 4);
+  uint32_t noise = 1;
+  for (size_t i = 0; i < count; i++) {
+    float echo = 0.0f;
+    for (const test_aec_tap_t &tap : test_aec_path) {
+      if (i >= tap.delay) {
+        echo += tap.gain * reference[i - tap.delay];
+      }
+    }
+    noise = noise * 1664525u + 1013904223u;
+    echo += ((int32_t)(noise >> 16) - 32768) / 32768.0f * 33.0f;
+    if (i >= phase_samples && i < phase_samples + double_talk_samples) {
+      echo += near[i];
+    }
+    mic[i] = (int16_t)fmaxf(-32768.0f, fminf(32767.0f, echo));
+  }
+
+  static aec_t aec;
+  aec_init(&aec);
+  double cpu_s = 0.0;
+  size_t last_second = TEST_AEC_RATE * (TEST_AEC_PHASE_S - 1);
+
+  // Far end only, converges
+  test_aec_phase_t phase;
+  test_aec_run(&aec, reference, mic, NULL, phase_samples, last_second, &phase,
+               &cpu_s);
+  float erle_db = test_aec_db(phase.mic_energy, phase.output_energy);
+  float linear_db = test_aec_db(phase.mic_energy, phase.residual_energy);
+  printf("  far end: ERLE %.1fdB (%.1fdB before suppression), filter says "
+         "%.1fdB\n",
+         erle_db, linear_db, aec.stats.erle_db);
+  TEST_CHECK(linear_db >= TEST_AEC_MIN_ERLE_DB);
+  TEST_CHECK(aec.stats.erle_db >= TEST_AEC_MIN_ERLE_DB);
+  TEST_CHECK_EQ(phase.double_talk_blocks, 0);
+
+  // Double-talk is detected and the near end gets through: what comes out
+  // is the near-end voice, neither cancelled along with the echo nor buried
+  // under echo from a filter that adapted to it
+  test_aec_run(&aec, reference + phase_samples, mic + phase_samples, output,
+               double_talk_samples, 0, &phase, &cpu_s);
+  double near_energy = 0.0, error_energy = 0.0;
+  for (size_t i = 0; i < double_talk_samples; i++) {
+    double d = near[phase_samples + i];
+    double e = output[i] - d;
+    near_energy += d * d;
+    error_energy += e * e;
+  }
+  float clarity_db = test_aec_db(near_energy, error_energy);
+  printf("  double-talk: detected in %lu of %lu blocks, near end %+.1fdB, "
+         "%.1fdB above echo left in it\n",
+         (unsigned long)phase.double_talk_blocks, (unsigned long)phase.blocks,
+         -test_aec_db(near_energy, phase.output_energy), clarity_db);
+  TEST_CHECK(phase.double_talk_blocks * 2 > phase.blocks);
+  TEST_CHECK(clarity_db >= TEST_AEC_MIN_NEAR_END_CLARITY_DB);
+
+  // Far end only again, the filter didn't diverge meanwhile
+  size_t offset = phase_samples + double_talk_samples;
+  test_aec_run(&aec, reference + offset, mic + offset, NULL, phase_samples,
+               last_second, &phase, &cpu_s);
+  linear_db = test_aec_db(phase.mic_energy, phase.residual_energy);
+  printf("  far end again: ERLE %.1fdB (%.1fdB before suppression)\n",
+         test_aec_db(phase.mic_energy, phase.output_energy), linear_db);
+  TEST_CHECK(linear_db >= TEST_AEC_MIN_ERLE_DB);
+
+  uint32_t blocks = aec.stats.frames;
+  printf("  CPU %.1fus per %ums block (%.2f%% of real time), max %luus\n",
+         cpu_s * 1e6 / blocks, (unsigned)AUDIO_BLOCK_MS,
+         cpu_s * 100.0 / ((double)count / TEST_AEC_RATE),
+         (unsigned long)aec.stats.max_frame_us);
+
+  test_aec_alignment(reference, phase_samples);
+
+  free(reference);
+  free(near);
+  free(mic);
+  free(output);
+
+  test_aec_wav_pair();
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+
+// audio_gain_meter() against the float path it replaced
+// (audio_bench_float_gain()): bit-exact for integer gains over every input
+// sample, within 1 LSB for fractional Q8 gains, and the same activity
+// decision. Peak and energy are checked against the output itself.
+#define TEST_GAIN_SAMPLES 65536
+
+static const float test_gain_integer[] = {0.0f, 1.0f,  2.0f,
+                                          3.0f, 10.0f, 127.0f};
+// Multiples of 1/256, so the Q8 gain is the same number
+static const float test_gain_fractional[] = {0.5f, 0.75f, 1.5f, 2.75f,
+                                             0.00390625f};
+
+static int16_t test_gain_input[TEST_GAIN_SAMPLES];
+static int16_t test_gain_expected[TEST_GAIN_SAMPLES];
+
+static void test_gain_fill() {
+  for (int32_t i = 0; i < TEST_GAIN_SAMPLES; i++) {
+    test_gain_input[i] = (int16_t)(i - 32768);
+  }
+}
+
+// Largest difference from the float path, and the level matching the
+// kernel's own output
+static int32_t test_gain_compare(float gain) {
+  memcpy(test_gain_expected, test_gain_input, sizeof(test_gain_input));
+  audio_bench_float_gain(test_gain_expected, TEST_GAIN_SAMPLES, gain);
+
+  int16_t output[TEST_GAIN_SAMPLES];
+  memcpy(output, test_gain_input, sizeof(test_gain_input));
+  audio_level_t level;
+  audio_gain_meter(output, TEST_GAIN_SAMPLES, AUDIO_GAIN_Q8(gain), &level);
+
+  int32_t max_difference = 0, peak = 0;
+  uint64_t sum_squares = 0;
+  for (size_t i = 0; i < TEST_GAIN_SAMPLES; i++) {
+    int32_t difference = output[i] - test_gain_expected[i];
+    difference = difference < 0 ? -difference : difference;
+    max_difference = difference > max_difference ? difference : max_difference;
+    int32_t magnitude = output[i] < 0 ? -output[i] : output[i];
+    peak = magnitude > peak ? magnitude : peak;
+    sum_squares += (uint64_t)((int64_t)output[i] * output[i]);
+  }
+  TEST_CHECK(level.active);
+  TEST_CHECK_EQ(level.peak, peak);
+  TEST_CHECK_EQ(level.sum_squares, sum_squares);
+  TEST_CHECK_EQ(level.samples, TEST_GAIN_SAMPLES);
+  return max_difference;
+}
+
+static void test_gain_activity(const int16_t *samples, size_t count) {
+  int16_t reference[8], kernel[8];
+  memcpy(reference, samples, count * sizeof(int16_t));
+  memcpy(kernel, samples, count * sizeof(int16_t));
+  audio_level_t level;
+  audio_gain_meter(kernel, count, AUDIO_GAIN_Q8(10), &level);
+  TEST_CHECK_EQ(level.active,
+                audio_bench_float_gain(reference, count, 10.0f));
+}
+
+void test_audio_gain_meter() {
+  test_gain_fill();
+  for (float gain : test_gain_integer) {
+    TEST_CHECK_EQ(test_gain_compare(gain), 0);
+  }
+  for (float gain : test_gain_fractional) {
+    TEST_CHECK(test_gain_compare(gain) <= 1);
+  }
+
+  // Silence and the {-1, 0, 1} dither floor are not activity, anything
+  // else is, on either side
+  static const int16_t silent[] = {0, 0, 0, 0};
+  static const int16_t dither[] = {-1, 0, 1, 1, -1, 0, 0, 1};
+  static const int16_t positive[] = {0, 1, 2, 0};
+  static const int16_t negative[] = {-1, -2, 0, 0};
+  static const int16_t extreme[] = {INT16_MIN, 0};
+  test_gain_activity(silent, 4);
+  test_gain_activity(dither, 8);
+  test_gain_activity(positive, 4);
+  test_gain_activity(negative, 4);
+  test_gain_activity(extreme, 2);
+
+  audio_level_t level;
+  audio_gain_meter(NULL, 0, AUDIO_GAIN_Q8(10), &level);
+  TEST_CHECK(!level.active);
+  TEST_CHECK_EQ(level.peak, 0);
+  TEST_CHECK_EQ(audio_level_rms(&level), 0);
+
+  // A full-scale square wave at unity gain has an RMS of full scale
+  int16_t square[8];
+  for (int i = 0; i < 8; i++) {
+    square[i] = i % 2 ? -32767 : 32767;
+  }
+  audio_gain_meter(square, 8, AUDIO_GAIN_Q8(1), &level);
+  TEST_CHECK_EQ(audio_level_rms(&level), 32767);
+}
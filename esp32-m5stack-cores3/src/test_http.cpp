@@ -0,0 +1,166 @@
+#include <esp_timer.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+
+// pipecat_http_request() against the stand-in's /api/echo, which answers
+// with the offer's own SDP: retries on 429, 5xx and dropped connections
+// with their backoff, none on other statuses, chunked answers, the body
+// buffer growing up to HTTP_MAX_RESPONSE_SIZE, cancellation, and nothing
+// left allocated on any error.
+#define TEST_HTTP_OFFER "v=0\r\no=- 1 1 IN IP4 0.0.0.0\r\na=\"quoted\"\r\n"
+#define TEST_HTTP_PAD 20000
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+typedef struct {
+  esp_err_t err;
+  uint32_t elapsed_ms;
+  int64_t leaked;
+} test_http_result_t;
+
+static uint16_t test_http_port;
+
+// Cancelled from this time on, never if 0
+static int64_t test_http_cancel_us;
+
+static bool test_http_cancelled(void *ctx) {
+  return test_http_cancel_us != 0 &&
+         esp_timer_get_time() >= test_http_cancel_us;
+}
+
+static test_http_result_t test_http_post(const char *query,
+                                         http_buffer_t *answer) {
+  char url[128];
+  snprintf(url, sizeof(url), "http://127.0.0.1:%u/api/echo%s",
+           test_http_port, query);
+  int64_t live = test_live_allocations();
+  int64_t start_us = esp_timer_get_time();
+  test_http_result_t result;
+  result.err = pipecat_http_request(url, TEST_HTTP_OFFER, answer,
+                                    test_http_cancelled, NULL);
+  result.elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+  // Only the answer outlives the request
+  result.leaked = test_live_allocations() - live - (answer->data != NULL);
+  return result;
+}
+
+// A failed request leaves nothing behind, in `answer` or on the heap
+static void test_http_check_failed(const test_http_result_t *result,
+                                   const http_buffer_t *answer) {
+  TEST_CHECK(result->err != ESP_OK);
+  TEST_CHECK(answer->data == NULL);
+  TEST_CHECK_EQ(answer->capacity, 0);
+  TEST_CHECK_EQ(result->leaked, 0);
+}
+
+static void test_http_check_answer(const test_http_result_t *result,
+                                   const http_buffer_t *answer) {
+  TEST_CHECK_EQ(result->err, ESP_OK);
+  TEST_CHECK(answer->data != NULL &&
+             strcmp(answer->data, TEST_HTTP_OFFER) == 0);
+  TEST_CHECK_EQ(answer->len, strlen(TEST_HTTP_OFFER));
+  TEST_CHECK_EQ(result->leaked, 0);
+}
+
+void test_http() {
+  test_http_port = pipecat_standin_start(0);
+  if (!TEST_CHECK(test_http_port != 0)) {
+    return;
+  }
+  http_buffer_t answer;
+  test_http_result_t result;
+
+  // Answered first time, in the initial buffer
+  result = test_http_post("", &answer);
+  test_http_check_answer(&result, &answer);
+  TEST_CHECK_EQ(answer.capacity, HTTP_INITIAL_RESPONSE_SIZE);
+  http_buffer_free(&answer);
+
+  result = test_http_post("?chunked=1", &answer);
+  test_http_check_answer(&result, &answer);
+  http_buffer_free(&answer);
+
+  // 429, 5xx and a dropped connection are retried after each backoff
+  uint32_t backoff_ms = 0;
+  uint32_t next_ms = HTTP_INITIAL_BACKOFF_MS;
+  for (int i = 1; i < HTTP_MAX_ATTEMPTS; i++) {
+    backoff_ms += next_ms;
+    next_ms = MIN(next_ms * 2, (uint32_t)HTTP_MAX_BACKOFF_MS);
+  }
+  const char *retried[] = {"?status=429&times=1", "?status=500&times=2",
+                           "?status=503&times=3",
+                           "?close=1&times=1"};
+  for (size_t i = 0; i < sizeof(retried) / sizeof(retried[0]); i++) {
+    result = test_http_post(retried[i], &answer);
+    test_http_check_answer(&result, &answer);
+    http_buffer_free(&answer);
+  }
+  TEST_CHECK(result.elapsed_ms >= HTTP_INITIAL_BACKOFF_MS);
+
+  // Given up after HTTP_MAX_ATTEMPTS
+  result = test_http_post("?status=503", &answer);
+  test_http_check_failed(&result, &answer);
+  TEST_CHECK_EQ(result.err, ESP_ERR_INVALID_RESPONSE);
+  TEST_CHECK(result.elapsed_ms >= backoff_ms);
+  printf("  %d attempts at 503 gave up after %lums\n", HTTP_MAX_ATTEMPTS,
+         (unsigned long)result.elapsed_ms);
+
+  // Other statuses aren't, or the next attempt would have succeeded
+  const char *refused[] = {"?status=400&times=1", "?status=404&times=1"};
+  for (size_t i = 0; i < sizeof(refused) / sizeof(refused[0]); i++) {
+    result = test_http_post(refused[i], &answer);
+    test_http_check_failed(&result, &answer);
+    TEST_CHECK_EQ(result.err, ESP_ERR_INVALID_RESPONSE);
+    TEST_CHECK(result.elapsed_ms < HTTP_INITIAL_BACKOFF_MS);
+  }
+
+  // The buffer doubles to fit, chunked or not
+  char query[64];
+  snprintf(query, sizeof(query), "?pad=%d", TEST_HTTP_PAD);
+  result = test_http_post(query, &answer);
+  test_http_check_answer(&result, &answer);
+  TEST_CHECK(answer.capacity > TEST_HTTP_PAD);
+  TEST_CHECK_EQ(answer.capacity & (answer.capacity - 1), 0);
+  http_buffer_free(&answer);
+  snprintf(query, sizeof(query), "?pad=%d&chunked=1", TEST_HTTP_PAD);
+  result = test_http_post(query, &answer);
+  test_http_check_answer(&result, &answer);
+  http_buffer_free(&answer);
+
+  // Past HTTP_MAX_RESPONSE_SIZE fails without a retry
+  snprintf(query, sizeof(query), "?pad=%d", HTTP_MAX_RESPONSE_SIZE);
+  result = test_http_post(query, &answer);
+  test_http_check_failed(&result, &answer);
+  TEST_CHECK_EQ(result.err, ESP_ERR_INVALID_SIZE);
+  snprintf(query, sizeof(query), "?pad=%d&chunked=1", HTTP_MAX_RESPONSE_SIZE);
+  result = test_http_post(query, &answer);
+  test_http_check_failed(&result, &answer);
+  TEST_CHECK_EQ(result.err, ESP_ERR_INVALID_SIZE);
+
+  // Cancelled before the first attempt, and in the middle of a backoff
+  test_http_cancel_us = esp_timer_get_time();
+  result = test_http_post("", &answer);
+  test_http_check_failed(&result, &answer);
+  TEST_CHECK_EQ(result.err, ESP_ERR_INVALID_STATE);
+  TEST_CHECK(result.elapsed_ms < HTTP_CANCEL_POLL_MS);
+  test_http_cancel_us =
+      esp_timer_get_time() + HTTP_INITIAL_BACKOFF_MS * 1000LL * 3 / 2;
+  result = test_http_post("?status=503", &answer);
+  test_http_check_failed(&result, &answer);
+  TEST_CHECK_EQ(result.err, ESP_ERR_INVALID_STATE);
+  TEST_CHECK(result.elapsed_ms <
+             HTTP_INITIAL_BACKOFF_MS * 3 / 2 + HTTP_CANCEL_POLL_MS * 2);
+  printf("  cancelled %lums into the backoff after 503s\n",
+         (unsigned long)result.elapsed_ms);
+  test_http_cancel_us = 0;
+
+  // Nothing listening: every attempt fails to connect
+  pipecat_standin_stop();
+  result = test_http_post("", &answer);
+  test_http_check_failed(&result, &answer);
+  TEST_CHECK(result.elapsed_ms >= backoff_ms);
+}
@@ -0,0 +1,264 @@
+#include <string.h>
+
+#include "main.h"
+
+// Each packet carries its own sequence number, so a frame shows which
+// packet it was made from
+#define TEST_JB_MAX_FRAMES 64
+#define TEST_JB_RTP_FRAME 960  // 20ms at 48kHz
+#define TEST_JB_FRAME_US (JITTER_BUFFER_FRAME_MS * 1000)
+
+typedef struct {
+  jitter_buffer_frame_kind_t kind[TEST_JB_MAX_FRAMES];
+  uint16_t seq[TEST_JB_MAX_FRAMES];
+  int32_t packet[TEST_JB_MAX_FRAMES];  // Sequence number in the data, or -1
+  uint32_t count;
+} test_jb_output_t;
+
+static jitter_buffer_t test_jb;
+
+static void test_jb_pop(bool drain, test_jb_output_t *out) {
+  jitter_buffer_frame_t frame;
+  while (jitter_buffer_pop(&test_jb, drain, &frame)) {
+    if (!TEST_CHECK(out->count < TEST_JB_MAX_FRAMES)) {
+      return;
+    }
+    out->kind[out->count] = frame.kind;
+    out->seq[out->count] = frame.seq;
+    out->packet[out->count] =
+        frame.data != NULL ? (frame.data[0] << 8) | frame.data[1] : -1;
+    out->count++;
+  }
+}
+
+static void test_jb_push(uint16_t seq, int64_t arrival_us,
+                         test_jb_output_t *out) {
+  uint8_t packet[4] = {(uint8_t)(seq >> 8), (uint8_t)seq, 0xfc, 0xff};
+  jitter_buffer_push(&test_jb, seq, (uint32_t)seq * TEST_JB_RTP_FRAME, packet,
+                     sizeof(packet), arrival_us);
+  test_jb_pop(false, out);
+}
+
+// Pushes `order` one frame period apart, then drains
+static void test_jb_run(const uint16_t *order, size_t count,
+                        test_jb_output_t *out) {
+  jitter_buffer_reset(&test_jb);
+  memset(&test_jb.stats, 0, sizeof(test_jb.stats));
+  memset(out, 0, sizeof(test_jb_output_t));
+  for (size_t i = 0; i < count; i++) {
+    test_jb_push(order[i], (int64_t)(i + 1) * TEST_JB_FRAME_US, out);
+  }
+  test_jb_pop(true, out);
+}
+
+// `expected` is one char per frame: P packet, F FEC, L PLC
+static void test_jb_expect(const test_jb_output_t *out, uint16_t first_seq,
+                           const char *expected) {
+  size_t count = strlen(expected);
+  if (!TEST_CHECK_EQ(out->count, count)) {
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    uint16_t seq = (uint16_t)(first_seq + i);
+    TEST_CHECK_EQ(out->seq[i], seq);
+    switch (expected[i]) {
+      case 'P':
+        TEST_CHECK_EQ(out->kind[i], JITTER_BUFFER_FRAME_PACKET);
+        TEST_CHECK_EQ(out->packet[i], seq);
+        break;
+      case 'F':
+        // Recovered from the packet that follows
+        TEST_CHECK_EQ(out->kind[i], JITTER_BUFFER_FRAME_FEC);
+        TEST_CHECK_EQ(out->packet[i], (uint16_t)(seq + 1));
+        break;
+      default:
+        TEST_CHECK_EQ(out->kind[i], JITTER_BUFFER_FRAME_PLC);
+        TEST_CHECK_EQ(out->packet[i], -1);
+        break;
+    }
+  }
+}
+
+void test_jitter_buffer() {
+  if (!TEST_CHECK(jitter_buffer_init(&test_jb, MEMORY_INTERNAL))) {
+    return;
+  }
+  test_jb_output_t out;
+
+  // In order
+  const uint16_t in_order[] = {100, 101, 102, 103, 104, 105, 106, 107};
+  test_jb_run(in_order, 8, &out);
+  test_jb_expect(&out, 100, "PPPPPPPP");
+  TEST_CHECK_EQ(test_jb.stats.played, 8);
+
+  // Reordered within the buffer's depth
+  const uint16_t reordered[] = {0, 2, 1, 3, 5, 4, 6, 7, 9, 8};
+  test_jb_run(reordered, 10, &out);
+  test_jb_expect(&out, 0, "PPPPPPPPPP");
+  TEST_CHECK_EQ(test_jb.stats.late, 0);
+
+  // A lone loss is recovered from the next packet's FEC, the first of two
+  // in a row has nothing to recover from
+  const uint16_t lossy[] = {0, 1, 2, 4, 5, 8, 9, 10};
+  test_jb_run(lossy, 8, &out);
+  test_jb_expect(&out, 0, "PPPFPPLFPPP");
+  TEST_CHECK_EQ(test_jb.stats.fec, 2);
+  TEST_CHECK_EQ(test_jb.stats.plc, 1);
+
+  // Duplicates, before and after the packet was played
+  const uint16_t duplicated[] = {0, 1, 1, 2, 3, 4, 0, 5, 5, 6};
+  test_jb_run(duplicated, 10, &out);
+  test_jb_expect(&out, 0, "PPPPPPP");
+  TEST_CHECK_EQ(test_jb.stats.duplicate, 2);
+  TEST_CHECK_EQ(test_jb.stats.late, 1);
+  TEST_CHECK_EQ(test_jb.stats.received, 7);
+
+  // Sequence numbers wrap
+  const uint16_t wrapping[] = {65533, 65534, 0, 65535, 1, 2};
+  test_jb_run(wrapping, 6, &out);
+  test_jb_expect(&out, 65533, "PPPPPP");
+  TEST_CHECK_EQ(test_jb.stats.resets, 0);
+
+  // A jump past the slots, or far behind, restarts at the new sequence
+  // number; what was still buffered is dropped
+  const uint16_t jump_ahead[] = {0, 1, 2, 3, 4, 5, 1000, 1001};
+  test_jb_run(jump_ahead, 8, &out);
+  TEST_CHECK_EQ(test_jb.stats.resets, 1);
+  TEST_CHECK(out.count >= 2);
+  if (out.count >= 2) {
+    TEST_CHECK_EQ(out.seq[out.count - 2], 1000);
+    TEST_CHECK_EQ(out.seq[out.count - 1], 1001);
+    TEST_CHECK_EQ(out.kind[out.count - 1], JITTER_BUFFER_FRAME_PACKET);
+  }
+  const uint16_t jump_behind[] = {5000, 5001, 5002, 5003, 5004, 100};
+  test_jb_run(jump_behind, 6, &out);
+  TEST_CHECK_EQ(test_jb.stats.resets, 1);
+  TEST_CHECK(out.count >= 1);
+  if (out.count >= 1) {
+    TEST_CHECK_EQ(out.seq[out.count - 1], 100);
+  }
+
+  // Frames are held for the target delay until drained
+  jitter_buffer_reset(&test_jb);
+  memset(&out, 0, sizeof(out));
+  TEST_CHECK_EQ(test_jb.target_frames,
+                JITTER_BUFFER_MIN_DELAY_MS / JITTER_BUFFER_FRAME_MS);
+  for (uint16_t seq = 0; seq < test_jb.target_frames; seq++) {
+    test_jb_push(seq, (seq + 1) * TEST_JB_FRAME_US, &out);
+  }
+  TEST_CHECK_EQ(out.count, 0);
+  test_jb_pop(true, &out);
+  TEST_CHECK_EQ(out.count, test_jb.target_frames);
+
+  // Reset forgets everything, the next packet starts over
+  test_jb_push(10, 0, &out);
+  jitter_buffer_reset(&test_jb);
+  jitter_buffer_frame_t frame;
+  TEST_CHECK(!jitter_buffer_pop(&test_jb, true, &frame));
+  memset(&out, 0, sizeof(out));
+  test_jb_push(500, 0, &out);
+  test_jb_pop(true, &out);
+  test_jb_expect(&out, 500, "P");
+
+  // Packets arriving 5 and 35ms apart, 15ms off the RTP clock either way,
+  // converge on a 15ms jitter estimate and a 20 + 3 * 15ms target
+  jitter_buffer_reset(&test_jb);
+  int64_t arrival_us = 0;
+  for (uint16_t seq = 0; seq < 400; seq++) {
+    arrival_us += seq % 2 == 0 ? 35000 : 5000;
+    out.count = 0;
+    test_jb_push(seq, arrival_us, &out);
+  }
+  TEST_CHECK(jitter_buffer_jitter_ms(&test_jb) >= 14 &&
+             jitter_buffer_jitter_ms(&test_jb) <= 15);
+  TEST_CHECK_EQ(test_jb.target_frames, 4);
+}
+
+static size_t test_rtp_header(uint8_t *packet, uint8_t first, uint16_t seq,
+                              uint32_t timestamp) {
+  memset(packet, 0, RTP_HEADER_SIZE);
+  packet[0] = first;
+  packet[1] = 111;
+  packet[2] = seq >> 8;
+  packet[3] = seq;
+  packet[4] = timestamp >> 24;
+  packet[5] = timestamp >> 16;
+  packet[6] = timestamp >> 8;
+  packet[7] = timestamp;
+  return RTP_HEADER_SIZE;
+}
+
+void test_rtp_parse() {
+  uint8_t packet[128];
+  rtp_packet_t rtp;
+  const uint8_t opus[3] = {0x78, 0x01, 0x02};
+
+  // Fixed header only
+  size_t len = test_rtp_header(packet, 0x80, 0xbeef, 0x01020304);
+  memcpy(packet + len, opus, sizeof(opus));
+  len += sizeof(opus);
+  TEST_CHECK(rtp_parse(packet, len, &rtp));
+  TEST_CHECK_EQ(rtp.seq, 0xbeef);
+  TEST_CHECK_EQ(rtp.timestamp, 0x01020304);
+  TEST_CHECK(rtp.payload == packet + RTP_HEADER_SIZE);
+  TEST_CHECK_EQ(rtp.size, sizeof(opus));
+
+  // Two CSRCs, a one-word extension and three bytes of padding
+  len = test_rtp_header(packet, 0x80 | 0x20 | 0x10 | 2, 7, 0xfffffff0);
+  memset(packet + len, 0x11, 8);
+  len += 8;
+  const uint8_t extension[8] = {0xbe, 0xde, 0x00, 0x01, 0x10, 0xaa, 0, 0};
+  memcpy(packet + len, extension, sizeof(extension));
+  len += sizeof(extension);
+  memcpy(packet + len, opus, sizeof(opus));
+  len += sizeof(opus);
+  const uint8_t padding[3] = {0, 0, 3};
+  memcpy(packet + len, padding, sizeof(padding));
+  len += sizeof(padding);
+  TEST_CHECK(rtp_parse(packet, len, &rtp));
+  TEST_CHECK_EQ(rtp.seq, 7);
+  TEST_CHECK_EQ(rtp.timestamp, 0xfffffff0);
+  TEST_CHECK(rtp.payload == packet + RTP_HEADER_SIZE + 8 + 8);
+  TEST_CHECK_EQ(rtp.size, sizeof(opus));
+  TEST_CHECK(memcmp(rtp.payload, opus, sizeof(opus)) == 0);
+
+  // Padding only
+  len = test_rtp_header(packet, 0x80 | 0x20, 8, 0);
+  packet[len++] = 0;
+  packet[len++] = 2;
+  TEST_CHECK(rtp_parse(packet, len, &rtp));
+  TEST_CHECK_EQ(rtp.size, 0);
+
+  // Not version 2
+  len = test_rtp_header(packet, 0x40, 1, 0);
+  packet[len++] = 0x78;
+  TEST_CHECK(!rtp_parse(packet, len, &rtp));
+
+  // Shorter than the fixed header
+  TEST_CHECK(!rtp_parse(packet, RTP_HEADER_SIZE - 1, &rtp));
+
+  // CSRC list past the end
+  len = test_rtp_header(packet, 0x80 | 15, 1, 0);
+  memset(packet + len, 0, 16);
+  len += 16;
+  TEST_CHECK(!rtp_parse(packet, len, &rtp));
+
+  // Extension header, then extension words, past the end
+  len = test_rtp_header(packet, 0x80 | 0x10, 1, 0);
+  packet[len++] = 0xbe;
+  packet[len++] = 0xde;
+  TEST_CHECK(!rtp_parse(packet, len, &rtp));
+  packet[len++] = 0x00;
+  packet[len++] = 0x04;
+  memset(packet + len, 0, 8);
+  len += 8;
+  TEST_CHECK(!rtp_parse(packet, len, &rtp));
+
+  // Padding longer than the payload, or a zero padding count
+  len = test_rtp_header(packet, 0x80 | 0x20, 1, 0);
+  packet[len++] = 0x78;
+  packet[len++] = 5;
+  TEST_CHECK(!rtp_parse(packet, len, &rtp));
+  packet[len - 1] = 0;
+  TEST_CHECK(!rtp_parse(packet, len, &rtp));
+}
@@ -0,0 +1,508 @@
+#include <esp_timer.h>
+#include <opus.h>
+#include <peer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+// The capture pipeline (AEC, VAD, encoder, packet scheduling) through
+// pipecat_send_audio() on a PeerConnection that never connects, so sends
+// fail the way they do before ICE completes. The microphone is a device
+// serving a buffer as fast as it is read: speech and room noise in turn,
+// then the same length of speech only to compare the encoder's CPU. With
+// PIPECAT_MIC_WAV (16-bit mono at the device rate) the same figures are
+// printed for that recording.
+#define TEST_CAPTURE_NOISE_AMPLITUDE 57  // About -60dBFS
+
+typedef struct {
+  const int16_t *samples;
+  size_t count;
+  size_t position;
+} test_capture_device_t;
+
+static esp_err_t test_capture_init(void *context, uint32_t sample_rate) {
+  return ESP_OK;
+}
+
+static esp_err_t test_capture_read(void *context, int16_t *samples,
+                                   size_t count) {
+  test_capture_device_t *device = (test_capture_device_t *)context;
+  if (device->position + count > device->count) {
+    return ESP_FAIL;
+  }
+  memcpy(samples, device->samples + device->position,
+         count * sizeof(int16_t));
+  device->position += count;
+  return ESP_OK;
+}
+
+static esp_err_t test_capture_write(void *context, const int16_t *samples,
+                                    size_t count) {
+  return ESP_OK;
+}
+
+static const audio_device_t test_capture_device = {
+    .init = test_capture_init,
+    .read = test_capture_read,
+    .write = test_capture_write,
+};
+
+// Speech and room noise, in that order, per segment
+typedef struct {
+  bool speech;
+  uint32_t ms;
+} test_capture_segment_t;
+
+static const test_capture_segment_t test_capture_script[] = {
+    {false, 1000}, {true, 2000}, {false, 4000}, {true, 1000}, {false, 6000},
+};
+
+typedef struct {
+  pipecat_session_t *session;
+  PeerConnection *peer_connection;
+  test_capture_device_t device;
+  double cpu_s;
+} test_capture_t;
+
+static double test_capture_cpu_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool test_capture_open(test_capture_t *capture, const int16_t *samples,
+                              size_t count) {
+  capture->device.samples = samples;
+  capture->device.count = count;
+  capture->device.position = 0;
+  capture->cpu_s = 0.0;
+  capture->session =
+      test_session_create(&test_capture_device, &capture->device);
+  if (capture->session == NULL) {
+    return false;
+  }
+  pipecat_init_audio_capture(capture->session);
+  pipecat_init_audio_encoder(capture->session);
+
+  PeerConfiguration config = {
+      .ice_servers = {},
+      .audio_codec = CODEC_OPUS,
+      .video_codec = CODEC_NONE,
+      .datachannel = DATA_CHANNEL_NONE,
+      .onaudiotrack = NULL,
+      .onvideotrack = NULL,
+      .on_request_keyframe = NULL,
+      .user_data = NULL,
+  };
+  capture->peer_connection = peer_connection_create(&config);
+  return capture->peer_connection != NULL;
+}
+
+// Capture periods until `frames` have been sent or the buffer runs out
+static void test_capture_run(test_capture_t *capture, uint32_t frames,
+                             audio_capture_stats_t *delta) {
+  audio_capture_stats_t before;
+  pipecat_audio_capture_stats(capture->session, &before);
+  size_t frame_samples = audio_frame_samples(
+      pipecat_audio_config.device_rate, pipecat_audio_config.frame_ms);
+  double start = test_capture_cpu_seconds();
+  for (uint32_t i = 0; i < frames && capture->device.position + frame_samples <=
+                                         capture->device.count;
+       i++) {
+    pipecat_send_audio(capture->session, capture->peer_connection);
+  }
+  capture->cpu_s += test_capture_cpu_seconds() - start;
+
+  pipecat_audio_capture_stats(capture->session, delta);
+  delta->frames -= before.frames;
+  delta->encoded -= before.encoded;
+  delta->sent -= before.sent;
+  delta->dtx -= before.dtx;
+  delta->fillers -= before.fillers;
+}
+
+static uint32_t test_capture_packets(const audio_capture_stats_t *stats) {
+  return stats->sent + stats->dtx + stats->fillers;
+}
+
+static void test_capture_print(const char *name, const test_capture_t *capture,
+                               const audio_capture_stats_t *total) {
+  double audio_s = (double)total->frames * pipecat_audio_config.frame_ms / 1000;
+  printf("  %s: %lu frames, %lu encoded (%.0f%%), %.1f packets/s, "
+         "%.2fms CPU per second of audio\n",
+         name, (unsigned long)total->frames, (unsigned long)total->encoded,
+         total->frames > 0 ? total->encoded * 100.0 / total->frames : 0.0,
+         test_capture_packets(total) / audio_s,
+         capture->cpu_s * 1000 / audio_s);
+}
+
+static void test_capture_close(test_capture_t *capture) {
+  if (capture->peer_connection != NULL) {
+    peer_connection_destroy(capture->peer_connection);
+    capture->peer_connection = NULL;
+  }
+}
+
+static void test_capture_wav() {
+  const char *path = getenv("PIPECAT_MIC_WAV");
+  if (path == NULL) {
+    return;
+  }
+  size_t count = 0;
+  int16_t *samples =
+      audio_wav_read_file(path, pipecat_audio_config.device_rate, &count);
+  static test_capture_t capture;
+  if (TEST_CHECK(samples != NULL) &&
+      TEST_CHECK(test_capture_open(&capture, samples, count))) {
+    audio_capture_stats_t total;
+    test_capture_run(&capture, UINT32_MAX, &total);
+    test_capture_print(path, &capture, &total);
+    TEST_CHECK_EQ(test_capture_packets(&total), total.frames);
+  }
+  test_capture_close(&capture);
+  free(samples);
+}
+
+void test_capture_vad() {
+  uint32_t rate = pipecat_audio_config.device_rate;
+  uint32_t frame_ms = pipecat_audio_config.frame_ms;
+  uint32_t total_ms = 0, speech_ms = 0;
+  for (const test_capture_segment_t &segment : test_capture_script) {
+    total_ms += segment.ms;
+    speech_ms += segment.speech ? segment.ms : 0;
+  }
+  size_t count = (size_t)rate / 1000 * total_ms;
+  int16_t *samples = (int16_t *)malloc(count * sizeof(int16_t));
+  int16_t *speech = (int16_t *)malloc(count * sizeof(int16_t));
+  if (!TEST_CHECK(samples != NULL && speech != NULL)) {
+    free(samples);
+    free(speech);
+    return;
+  }
+
+  audio_bench_signal(speech, count, rate);
+  uint32_t noise = 1;
+  size_t offset = 0;
+  for (const test_capture_segment_t &segment : test_capture_script) {
+    size_t end = offset + (size_t)rate / 1000 * segment.ms;
+    for (; offset < end; offset++) {
+      noise = noise * 1664525u + 1013904223u;
+      samples[offset] =
+          segment.speech ? speech[offset]
+                         : (int16_t)((int32_t)(noise >> 16) %
+                                     (2 * TEST_CAPTURE_NOISE_AMPLITUDE + 1) -
+                                     TEST_CAPTURE_NOISE_AMPLITUDE);
+    }
+  }
+
+  static test_capture_t mixed;
+  if (!TEST_CHECK(test_capture_open(&mixed, samples, count))) {
+    test_capture_close(&mixed);
+    free(samples);
+    free(speech);
+    return;
+  }
+
+  uint32_t hangover_frames = VAD_HANGOVER_MS / frame_ms;
+  uint32_t keepalive_frames = VAD_KEEPALIVE_MS / frame_ms;
+  audio_capture_stats_t total = {};
+  bool after_speech = false;
+  for (const test_capture_segment_t &segment : test_capture_script) {
+    uint32_t frames = segment.ms / frame_ms;
+    audio_capture_stats_t delta;
+    test_capture_run(&mixed, frames, &delta);
+    TEST_CHECK_EQ(delta.frames, frames);
+
+    // One packet per capture period whether or not it was encoded
+    TEST_CHECK_EQ(test_capture_packets(&delta), frames);
+
+    if (segment.speech) {
+      // Every frame of speech is encoded
+      TEST_CHECK_EQ(delta.encoded, frames);
+    } else {
+      // The hangover after speech, then one keepalive per interval
+      uint32_t hangover = after_speech ? hangover_frames : 0;
+      uint32_t expected =
+          hangover + (frames - hangover + keepalive_frames - 1) /
+                         keepalive_frames;
+      TEST_CHECK(delta.encoded + 1 >= expected &&
+                 delta.encoded <= expected + 1);
+    }
+    after_speech = segment.speech;
+
+    total.frames += delta.frames;
+    total.encoded += delta.encoded;
+    total.sent += delta.sent;
+    total.dtx += delta.dtx;
+    total.fillers += delta.fillers;
+  }
+  test_capture_print("speech and noise", &mixed, &total);
+  test_capture_close(&mixed);
+
+  // The same length of speech throughout, every frame encoded
+  static test_capture_t continuous;
+  if (TEST_CHECK(test_capture_open(&continuous, speech, count))) {
+    audio_capture_stats_t all;
+    test_capture_run(&continuous, total_ms / frame_ms, &all);
+    test_capture_print("speech only", &continuous, &all);
+    TEST_CHECK_EQ(all.encoded, all.frames);
+    TEST_CHECK(mixed.cpu_s < continuous.cpu_s);
+    printf("  %u%% speech: %.0f%% fewer encodes, %.0f%% less capture CPU, "
+           "same packet rate\n",
+           (unsigned)(speech_ms * 100 / total_ms),
+           100.0 - total.encoded * 100.0 / all.encoded,
+           100.0 - mixed.cpu_s * 100.0 / continuous.cpu_s);
+  }
+  test_capture_close(&continuous);
+
+  free(samples);
+  free(speech);
+
+  test_capture_wav();
+}
+
+// Downlink loss reaches the encoder controller as the loop task publishes
+// it: an interval with every tenth packet missing, then clean ones. The
+// downlink is driven on its own clock between capture intervals, which
+// starts at the real one so the latency traces never compare the two
+// across epochs.
+static void test_encoder_loss_downlink(pipecat_session_t *session,
+                                       uint16_t *seq, int64_t *now_us,
+                                       uint32_t frames, bool lossy) {
+  // A 20ms CELT frame of silence
+  const uint8_t packet[] = {0xf8, 0xff, 0xfe};
+  uint32_t samples =
+      JITTER_BUFFER_RTP_CLOCK_RATE / 1000 * JITTER_BUFFER_FRAME_MS;
+  for (uint32_t i = 0; i < frames; i++, (*seq)++) {
+    *now_us += JITTER_BUFFER_FRAME_MS * 1000;
+    if (!lossy || *seq % 10 != 5) {
+      pipecat_audio_receive(session, *seq, *seq * samples, packet,
+                            sizeof(packet), *now_us);
+    }
+  }
+}
+
+void test_encoder_loss() {
+  uint32_t frame_ms = pipecat_audio_config.frame_ms;
+  uint32_t interval_frames = OPUS_CONTROLLER_INTERVAL_MS / frame_ms;
+  size_t frame_samples =
+      audio_frame_samples(pipecat_audio_config.device_rate, frame_ms);
+  size_t count = frame_samples * interval_frames * 3;
+  int16_t *silence = (int16_t *)calloc(count, sizeof(int16_t));
+  static test_capture_t capture;
+  if (!TEST_CHECK(silence != NULL) ||
+      !TEST_CHECK(test_capture_open(&capture, silence, count))) {
+    test_capture_close(&capture);
+    free(silence);
+    return;
+  }
+  pipecat_init_audio_decoder(capture.session);
+
+  uint16_t seq = 0;
+  int64_t now_us = esp_timer_get_time();
+  float loss[3];
+  for (int interval = 0; interval < 3; interval++) {
+    test_encoder_loss_downlink(capture.session, &seq, &now_us,
+                               interval_frames * frame_ms /
+                                   JITTER_BUFFER_FRAME_MS,
+                               interval == 0);
+    audio_capture_stats_t delta;
+    test_capture_run(&capture, interval_frames, &delta);
+    loss[interval] = pipecat_audio_encoder_controller(capture.session)
+                         ->last_input.loss_percent;
+  }
+  printf("  controller saw %.1f%%, %.1f%% and %.1f%% downlink loss\n",
+         loss[0], loss[1], loss[2]);
+  TEST_CHECK(loss[0] >= 5.0f && loss[0] <= 15.0f);
+  TEST_CHECK(loss[1] <= 5.0f);
+  TEST_CHECK(loss[2] == 0.0f);
+  TEST_CHECK_EQ(pipecat_audio_encoder_controller(capture.session)
+                    ->last_input.rtt_ms,
+                0);
+
+  test_capture_close(&capture);
+  free(silence);
+}
+
+// Only libpeer's frame length and the AEC's rate, any Opus rate
+void test_audio_config() {
+  audio_config_t config = {.device_rate = AUDIO_DEVICE_SAMPLE_RATE,
+                           .codec_rate = AUDIO_CODEC_SAMPLE_RATE,
+                           .frame_ms = AUDIO_FRAME_MS};
+  TEST_CHECK(audio_config_valid(&config));
+
+  const uint32_t rates[] = {8000, 16000, 24000, 48000, 44100, 0};
+  for (uint32_t rate : rates) {
+    audio_config_t codec = config;
+    codec.codec_rate = rate;
+    TEST_CHECK_EQ(audio_config_valid(&codec), rate != 44100 && rate != 0);
+    audio_config_t device = config;
+    device.device_rate = rate;
+    TEST_CHECK_EQ(audio_config_valid(&device), rate == AEC_SAMPLE_RATE);
+  }
+
+  const uint32_t frames_ms[] = {0, 10, 20, 40, 60};
+  for (uint32_t frame_ms : frames_ms) {
+    audio_config_t frame = config;
+    frame.frame_ms = frame_ms;
+    TEST_CHECK_EQ(audio_config_valid(&frame),
+                  frame_ms == LIBPEER_AUDIO_LATENCY_MS);
+  }
+}
+
+// Every Opus packet duration, and packets of several frames, through
+// pipecat_audio_receive(): each run of packets adds up to 120ms and has to
+// come out of the decoder as that many samples and out of the speaker as
+// whole playback frames.
+#define TEST_RECEIVE_RUN_MS 120
+#define TEST_RECEIVE_BITRATE 30000
+#define TEST_RECEIVE_DRAIN_MS 1000
+
+typedef struct {
+  uint32_t duration;  // Of one frame, in tenths of a millisecond
+  uint32_t frames;    // Per packet, joined with the repacketizer
+} test_receive_case_t;
+
+static const test_receive_case_t test_receive_cases[] = {
+    {25, 1},  {50, 1},  {100, 1}, {200, 1}, {400, 1}, {600, 1},
+    {1200, 1}, {25, 4}, {100, 2}, {200, 3}, {200, 6},
+};
+
+typedef struct {
+  std::atomic<uint32_t> writes;
+  std::atomic<uint32_t> samples;
+  std::atomic<uint32_t> odd_writes;  // Not one playback frame
+  size_t frame_samples;
+} test_speaker_t;
+
+static esp_err_t test_speaker_write(void *context, const int16_t *samples,
+                                    size_t count) {
+  test_speaker_t *speaker = (test_speaker_t *)context;
+  speaker->writes++;
+  speaker->samples += count;
+  speaker->odd_writes += count != speaker->frame_samples;
+  return ESP_OK;
+}
+
+static const audio_device_t test_speaker_device = {
+    .init = test_capture_init,
+    .read = NULL,
+    .write = test_speaker_write,
+};
+
+// One packet of `frames` frames of `duration`
+static int test_receive_encode(OpusEncoder *encoder, OpusRepacketizer *rp,
+                               const test_receive_case_t *c,
+                               const int16_t *input, uint8_t *packet,
+                               size_t capacity) {
+  int samples = pipecat_audio_config.codec_rate / 400 * c->duration / 25;
+  if (c->frames == 1) {
+    return opus_encode(encoder, input, samples, packet, capacity);
+  }
+  uint8_t frames[6][400];
+  opus_repacketizer_init(rp);
+  for (uint32_t i = 0; i < c->frames; i++) {
+    int size = opus_encode(encoder, input + i * samples, samples, frames[i],
+                           sizeof(frames[i]));
+    if (size <= 0 || opus_repacketizer_cat(rp, frames[i], size) != OPUS_OK) {
+      return -1;
+    }
+  }
+  return opus_repacketizer_out(rp, packet, capacity);
+}
+
+// Until the playback task has written everything queued
+static void test_receive_drain(pipecat_session_t *session) {
+  audio_playback_stats_t stats;
+  for (int i = 0; i < TEST_RECEIVE_DRAIN_MS; i++) {
+    pipecat_audio_playback_stats(session, &stats);
+    if (stats.buffered_frames == 0) {
+      return;
+    }
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+}
+
+void test_audio_receive() {
+  uint32_t rate = pipecat_audio_config.codec_rate;
+  size_t run_samples = audio_frame_samples(rate, TEST_RECEIVE_RUN_MS);
+  size_t playback_samples = audio_frame_samples(
+      pipecat_audio_config.device_rate, JITTER_BUFFER_FRAME_MS);
+  static test_speaker_t speaker;
+  speaker.frame_samples = playback_samples;
+  pipecat_session_t *session =
+      test_session_create(&test_speaker_device, &speaker);
+  int16_t *input = (int16_t *)malloc(run_samples * sizeof(int16_t));
+  int error = 0;
+  OpusEncoder *encoder =
+      opus_encoder_create(rate, 1, OPUS_APPLICATION_VOIP, &error);
+  OpusRepacketizer *rp = opus_repacketizer_create();
+  if (!TEST_CHECK(session != NULL) || !TEST_CHECK(input != NULL) ||
+      !TEST_CHECK(encoder != NULL) || !TEST_CHECK(rp != NULL)) {
+    free(input);
+    return;
+  }
+  opus_encoder_ctl(encoder, OPUS_SET_BITRATE(TEST_RECEIVE_BITRATE));
+  audio_bench_signal(input, run_samples, rate);
+  pipecat_init_audio_decoder(session);
+
+  uint16_t seq = 0;
+  uint32_t timestamp = 0;
+  // Runs ahead of the real clock, from the same epoch
+  int64_t now_us = esp_timer_get_time();
+  uint8_t packet[1276 * 3];
+  for (const test_receive_case_t &c : test_receive_cases) {
+    uint32_t packet_tenths = c.duration * c.frames;
+    int packet_samples = rate / 400 * packet_tenths / 25;
+    uint32_t packets = TEST_RECEIVE_RUN_MS * 10 / packet_tenths;
+    audio_playback_stats_t before, after;
+    pipecat_audio_playback_stats(session, &before);
+    uint32_t writes = speaker.writes;
+
+    for (uint32_t i = 0; i < packets; i++, seq++) {
+      int size = test_receive_encode(encoder, rp, &c,
+                                     input + i * packet_samples, packet,
+                                     sizeof(packet));
+      if (!TEST_CHECK(size > 0) ||
+          !TEST_CHECK_EQ(opus_packet_get_nb_samples(packet, size, rate),
+                         packet_samples)) {
+        break;
+      }
+      pipecat_audio_receive(session, seq, timestamp, packet, size, now_us);
+      timestamp += JITTER_BUFFER_RTP_CLOCK_RATE / 400 * packet_tenths / 25;
+      now_us += packet_tenths * 100;
+      test_receive_drain(session);
+    }
+    // The end of the run waits in the jitter buffer for the playout tick
+    now_us += TEST_RECEIVE_DRAIN_MS * 1000;
+    pipecat_audio_playout_tick(session, now_us);
+    test_receive_drain(session);
+
+    pipecat_audio_playback_stats(session, &after);
+    uint32_t written = speaker.writes - writes;
+    printf("  %u x %u.%ums: %u samples decoded, %u playback frames\n",
+           (unsigned)c.frames, (unsigned)(c.duration / 10),
+           (unsigned)(c.duration % 10),
+           (unsigned)(after.decoded_samples - before.decoded_samples),
+           (unsigned)written);
+    TEST_CHECK_EQ(after.decoded_samples - before.decoded_samples,
+                  run_samples);
+    TEST_CHECK_EQ(written, TEST_RECEIVE_RUN_MS / JITTER_BUFFER_FRAME_MS);
+    TEST_CHECK_EQ(after.decode_errors, before.decode_errors);
+    TEST_CHECK_EQ(after.overruns, before.overruns);
+  }
+  TEST_CHECK_EQ(speaker.odd_writes, 0);
+  TEST_CHECK_EQ(speaker.samples, speaker.writes * playback_samples);
+
+  opus_repacketizer_destroy(rp);
+  opus_encoder_destroy(encoder);
+  free(input);
+}
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+
+// The controller against synthetic per-interval traces of loss, RTT and
+// encode time: a clean link, a loss burst and its recovery, loss sitting
+// in the FEC hysteresis band, bursty random loss, an encoder over budget,
+// and RTT swings. Each trace prints where the settings ended up and how
+// often they changed.
+#define TEST_OPUS_ENCODE_US 1000
+// Under bursty loss, changes per minute of each kind
+#define TEST_OPUS_MAX_BITRATE_CHANGES 12
+#define TEST_OPUS_MAX_FEC_CHANGES 6
+#define TEST_OPUS_MAX_LOSS_PERC_CHANGES 24
+
+static const opus_encoder_settings_t test_opus_initial = {
+    .bitrate = 30000,
+    .complexity = 0,
+    .inband_fec = false,
+    .packet_loss_perc = 0,
+};
+
+typedef struct {
+  uint32_t intervals;
+  uint32_t fec_intervals;
+  int32_t min_bitrate;
+  int32_t max_bitrate;
+  uint64_t bitrate_sum;
+  uint32_t bitrate_changes;
+  uint32_t fec_changes;
+  uint32_t loss_perc_changes;
+} test_opus_trace_t;
+
+static void test_opus_begin(opus_controller_t *ctl, test_opus_trace_t *trace) {
+  opus_controller_init(ctl, &test_opus_initial);
+  memset(trace, 0, sizeof(test_opus_trace_t));
+  trace->min_bitrate = INT32_MAX;
+}
+
+static void test_opus_step(opus_controller_t *ctl, test_opus_trace_t *trace,
+                           float loss_percent, uint32_t rtt_ms,
+                           uint32_t encode_us) {
+  opus_controller_input_t input = {
+      .loss_percent = loss_percent,
+      .rtt_ms = rtt_ms,
+      .encode_us = encode_us,
+  };
+  opus_encoder_settings_t before = ctl->settings;
+  opus_controller_update(ctl, &input);
+
+  const opus_encoder_settings_t *settings = &ctl->settings;
+  trace->bitrate_changes += settings->bitrate != before.bitrate;
+  trace->fec_changes += settings->inband_fec != before.inband_fec;
+  trace->loss_perc_changes +=
+      settings->packet_loss_perc != before.packet_loss_perc;
+  TEST_CHECK(settings->bitrate >= OPUS_CONTROLLER_MIN_BITRATE &&
+             settings->bitrate <= OPUS_CONTROLLER_MAX_BITRATE);
+  TEST_CHECK(!settings->inband_fec ||
+             settings->bitrate >= OPUS_CONTROLLER_FEC_MIN_BITRATE);
+  TEST_CHECK(settings->complexity >= 0 &&
+             settings->complexity <= OPUS_CONTROLLER_MAX_COMPLEXITY);
+  TEST_CHECK(settings->packet_loss_perc >= 0 &&
+             settings->packet_loss_perc <= 100);
+
+  trace->intervals++;
+  trace->fec_intervals += settings->inband_fec;
+  trace->bitrate_sum += settings->bitrate;
+  if (settings->bitrate < trace->min_bitrate) {
+    trace->min_bitrate = settings->bitrate;
+  }
+  if (settings->bitrate > trace->max_bitrate) {
+    trace->max_bitrate = settings->bitrate;
+  }
+}
+
+static void test_opus_print(const char *name, const opus_controller_t *ctl,
+                            const test_opus_trace_t *trace) {
+  printf("  %s: %lus, bitrate %ld..%ld (mean %llu), FEC %lu%% of the time, "
+         "changes: %lu bitrate %lu FEC %lu loss hint, ends at %ldbps "
+         "complexity %ld\n",
+         name, (unsigned long)trace->intervals, (long)trace->min_bitrate,
+         (long)trace->max_bitrate,
+         (unsigned long long)(trace->bitrate_sum / trace->intervals),
+         (unsigned long)(trace->fec_intervals * 100 / trace->intervals),
+         (unsigned long)trace->bitrate_changes,
+         (unsigned long)trace->fec_changes,
+         (unsigned long)trace->loss_perc_changes, (long)ctl->settings.bitrate,
+         (long)ctl->settings.complexity);
+}
+
+// Two-state Markov loss: long good runs, short bad bursts
+static float test_opus_bursty_loss(uint32_t *state, bool *bad) {
+  *state = *state * 1664525u + 1013904223u;
+  uint32_t roll = (*state >> 16) % 100;
+  if (*bad) {
+    *bad = roll >= 40;  // Bursts last 1.7 intervals on average
+  } else {
+    *bad = roll < 4;
+  }
+  return *bad ? 20.0f + (roll % 15) : (float)(roll % 2);
+}
+
+void test_opus_controller() {
+  static opus_controller_t ctl;
+  test_opus_trace_t trace;
+
+  // Clean link: bitrate probes up every OPUS_CONTROLLER_GOOD_INTERVALS to
+  // the ceiling, complexity climbs to the maximum, FEC stays off
+  test_opus_begin(&ctl, &trace);
+  for (int i = 0; i < 60; i++) {
+    test_opus_step(&ctl, &trace, 0.0f, 50, TEST_OPUS_ENCODE_US);
+  }
+  test_opus_print("clean", &ctl, &trace);
+  TEST_CHECK_EQ(ctl.settings.bitrate, OPUS_CONTROLLER_MAX_BITRATE);
+  TEST_CHECK_EQ(ctl.settings.complexity, OPUS_CONTROLLER_MAX_COMPLEXITY);
+  TEST_CHECK_EQ(trace.fec_intervals, 0);
+  TEST_CHECK_EQ(ctl.settings.packet_loss_perc, 0);
+
+  // 15% loss for 10s: FEC from the first interval, bitrate backs off once
+  // the smoothed loss passes 10%, never below the FEC floor
+  int32_t clean_bitrate = ctl.settings.bitrate;
+  test_opus_trace_t burst = {};
+  burst.min_bitrate = INT32_MAX;
+  test_opus_step(&ctl, &burst, 15.0f, 50, TEST_OPUS_ENCODE_US);
+  TEST_CHECK(ctl.settings.inband_fec);
+  TEST_CHECK_EQ(ctl.settings.bitrate, clean_bitrate);
+  for (int i = 1; i < 10; i++) {
+    test_opus_step(&ctl, &burst, 15.0f, 50, TEST_OPUS_ENCODE_US);
+  }
+  test_opus_print("15% loss", &ctl, &burst);
+  TEST_CHECK(ctl.settings.inband_fec);
+  TEST_CHECK(ctl.settings.bitrate < clean_bitrate);
+  TEST_CHECK(ctl.settings.packet_loss_perc >= 10);
+
+  // Loss gone: FEC holds while the smoothed loss is above 1%, then drops,
+  // and bitrate climbs back
+  uint32_t fec_off_after = 0;
+  for (int i = 0; i < 60; i++) {
+    test_opus_step(&ctl, &burst, 0.0f, 50, TEST_OPUS_ENCODE_US);
+    if (fec_off_after == 0 && !ctl.settings.inband_fec) {
+      fec_off_after = i + 1;
+    }
+  }
+  test_opus_print("recovery", &ctl, &burst);
+  TEST_CHECK(fec_off_after > 1 && fec_off_after < 15);
+  TEST_CHECK(!ctl.settings.inband_fec);
+  TEST_CHECK_EQ(ctl.settings.bitrate, OPUS_CONTROLLER_MAX_BITRATE);
+
+  // 1.5% loss sits between the FEC off and on thresholds: whatever state
+  // FEC is in stays, no flapping, and the loss hint holds still
+  test_opus_begin(&ctl, &trace);
+  for (int i = 0; i < 60; i++) {
+    test_opus_step(&ctl, &trace, 1.5f, 50, TEST_OPUS_ENCODE_US);
+  }
+  test_opus_print("1.5% loss", &ctl, &trace);
+  TEST_CHECK_EQ(trace.fec_intervals, 0);
+  TEST_CHECK_EQ(trace.loss_perc_changes, 0);
+  uint32_t changes = ctl.changes;
+  ctl.settings.inband_fec = true;
+  for (int i = 0; i < 60; i++) {
+    test_opus_step(&ctl, &trace, 1.5f, 50, TEST_OPUS_ENCODE_US);
+  }
+  TEST_CHECK(ctl.settings.inband_fec);
+  TEST_CHECK_EQ(ctl.changes, changes);
+
+  // Bursty random loss over 10 minutes: the settings follow it without
+  // changing every interval
+  test_opus_begin(&ctl, &trace);
+  uint32_t random = 7;
+  bool bad = false;
+  uint32_t minutes = 10;
+  for (uint32_t i = 0; i < minutes * 60; i++) {
+    test_opus_step(&ctl, &trace, test_opus_bursty_loss(&random, &bad), 50,
+                   TEST_OPUS_ENCODE_US);
+  }
+  test_opus_print("bursty loss", &ctl, &trace);
+  TEST_CHECK(trace.fec_intervals > 0 && trace.fec_intervals < trace.intervals);
+  TEST_CHECK(trace.bitrate_changes <= TEST_OPUS_MAX_BITRATE_CHANGES * minutes);
+  TEST_CHECK(trace.fec_changes <= TEST_OPUS_MAX_FEC_CHANGES * minutes);
+  TEST_CHECK(trace.loss_perc_changes <=
+             TEST_OPUS_MAX_LOSS_PERC_CHANGES * minutes);
+
+  // An encoder over 80% of its budget sheds complexity one step per
+  // interval down to 0, and only climbs again on a clean link
+  test_opus_begin(&ctl, &trace);
+  ctl.settings.complexity = OPUS_CONTROLLER_MAX_COMPLEXITY;
+  for (int i = 0; i < OPUS_CONTROLLER_MAX_COMPLEXITY + 2; i++) {
+    test_opus_step(&ctl, &trace, 0.0f, 50,
+                   OPUS_CONTROLLER_ENCODE_BUDGET_US * 9 / 10);
+  }
+  TEST_CHECK_EQ(ctl.settings.complexity, 0);
+  for (int i = 0; i < 10; i++) {
+    test_opus_step(&ctl, &trace, 5.0f, 50, TEST_OPUS_ENCODE_US);
+  }
+  TEST_CHECK_EQ(ctl.settings.complexity, 0);
+  for (int i = 0; i < 10; i++) {
+    test_opus_step(&ctl, &trace, 0.0f, 50, TEST_OPUS_ENCODE_US);
+  }
+  test_opus_print("slow encoder", &ctl, &trace);
+  TEST_CHECK(ctl.settings.complexity > 0);
+
+  // RTT swings with the same loss: the controller only logs RTT (libpeer
+  // doesn't surface RTCP, media.cpp passes 0), so decisions are identical
+  static opus_controller_t steady_rtt, swinging_rtt;
+  test_opus_trace_t steady_trace, swinging_trace;
+  test_opus_begin(&steady_rtt, &steady_trace);
+  test_opus_begin(&swinging_rtt, &swinging_trace);
+  random = 11;
+  bad = false;
+  for (int i = 0; i < 120; i++) {
+    float loss = test_opus_bursty_loss(&random, &bad);
+    test_opus_step(&steady_rtt, &steady_trace, loss, 50, TEST_OPUS_ENCODE_US);
+    test_opus_step(&swinging_rtt, &swinging_trace, loss, i % 10 < 5 ? 30 : 600,
+                   TEST_OPUS_ENCODE_US);
+  }
+  test_opus_print("RTT 30/600ms", &swinging_rtt, &swinging_trace);
+  TEST_CHECK_EQ(swinging_rtt.settings.bitrate, steady_rtt.settings.bitrate);
+  TEST_CHECK_EQ(swinging_rtt.settings.complexity,
+                steady_rtt.settings.complexity);
+  TEST_CHECK_EQ(swinging_rtt.settings.inband_fec,
+                steady_rtt.settings.inband_fec);
+  TEST_CHECK_EQ(steady_rtt.changes, swinging_rtt.changes);
+}
@@ -0,0 +1,186 @@
+#include <esp_timer.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+#define TEST_RING_CAPACITY 4
+#define TEST_RING_FRAME_SAMPLES 8
+#define TEST_RING_STRESS_FRAMES 100000
+#define TEST_RING_TASK_STACK_SIZE 4096
+#define TEST_RING_TASK_PRIORITY 5
+
+typedef struct {
+  pcm_ring_t *ring;
+  uint32_t frames;
+  uint32_t received;
+  uint32_t errors;  // Frames out of order or with the wrong samples
+  std::atomic<uint32_t> finished;
+} test_ring_stress_t;
+
+static int16_t test_ring_sample(uint32_t frame, size_t i) {
+  return (int16_t)(frame * 31 + i);
+}
+
+static void test_ring_fill(int16_t *samples, uint32_t frame) {
+  for (size_t i = 0; i < TEST_RING_FRAME_SAMPLES; i++) {
+    samples[i] = test_ring_sample(frame, i);
+  }
+}
+
+static bool test_ring_matches(const int16_t *samples, uint32_t frame) {
+  for (size_t i = 0; i < TEST_RING_FRAME_SAMPLES; i++) {
+    if (samples[i] != test_ring_sample(frame, i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Frame n carries origin_us n + 1
+static void test_ring_producer(void *user_data) {
+  test_ring_stress_t *stress = (test_ring_stress_t *)user_data;
+  for (uint32_t frame = 0; frame < stress->frames; frame++) {
+    int16_t *samples;
+    while ((samples = pcm_ring_acquire_write(stress->ring)) == NULL) {
+      sched_yield();
+    }
+    test_ring_fill(samples, frame);
+    pcm_ring_commit_write(stress->ring, frame + 1);
+  }
+  stress->finished.fetch_add(1);
+  vTaskDelete(NULL);
+}
+
+static void test_ring_consumer(void *user_data) {
+  test_ring_stress_t *stress = (test_ring_stress_t *)user_data;
+  while (stress->received < stress->frames) {
+    pcm_frame_meta_t meta;
+    const int16_t *samples = pcm_ring_acquire_read(stress->ring, &meta);
+    if (samples == NULL) {
+      sched_yield();
+      continue;
+    }
+    if (meta.origin_us != stress->received + 1 ||
+        !test_ring_matches(samples, stress->received)) {
+      stress->errors++;
+    }
+    pcm_ring_release_read(stress->ring);
+    stress->received++;
+  }
+  stress->finished.fetch_add(1);
+  vTaskDelete(NULL);
+}
+
+void test_pcm_ring() {
+  static pcm_ring_t ring;
+  TEST_CHECK(!pcm_ring_init(&ring, 3, TEST_RING_FRAME_SAMPLES,
+                            MEMORY_INTERNAL));
+  if (!TEST_CHECK(pcm_ring_init(&ring, TEST_RING_CAPACITY,
+                                TEST_RING_FRAME_SAMPLES, MEMORY_INTERNAL))) {
+    return;
+  }
+
+  // Empty
+  pcm_frame_meta_t meta;
+  TEST_CHECK(pcm_ring_acquire_read(&ring, &meta) == NULL);
+  TEST_CHECK_EQ(pcm_ring_count(&ring), 0);
+
+  // Full: the next write is refused and counted, nothing is overwritten
+  for (uint32_t frame = 0; frame < TEST_RING_CAPACITY; frame++) {
+    int16_t *samples = pcm_ring_acquire_write(&ring);
+    if (!TEST_CHECK(samples != NULL)) {
+      return;
+    }
+    test_ring_fill(samples, frame);
+    pcm_ring_commit_write(&ring, frame + 1);
+  }
+  TEST_CHECK_EQ(pcm_ring_count(&ring), TEST_RING_CAPACITY);
+  TEST_CHECK(pcm_ring_acquire_write(&ring) == NULL);
+  TEST_CHECK_EQ(ring.overruns.load(), 1);
+
+  // Drains in order, with each frame's metadata
+  for (uint32_t frame = 0; frame < TEST_RING_CAPACITY; frame++) {
+    const int16_t *samples = pcm_ring_acquire_read(&ring, &meta);
+    if (!TEST_CHECK(samples != NULL)) {
+      return;
+    }
+    TEST_CHECK(test_ring_matches(samples, frame));
+    TEST_CHECK_EQ(meta.origin_us, frame + 1);
+    TEST_CHECK(meta.queued_us > 0);
+    pcm_ring_release_read(&ring);
+  }
+  TEST_CHECK(pcm_ring_acquire_read(&ring, &meta) == NULL);
+
+  // An origin of 0 is the commit time
+  pcm_ring_acquire_write(&ring);
+  pcm_ring_commit_write(&ring, 0);
+  pcm_ring_acquire_read(&ring, &meta);
+  TEST_CHECK_EQ(meta.origin_us, meta.queued_us);
+  pcm_ring_release_read(&ring);
+
+  // Wraps around the slots, and the 32-bit counters, with two frames in
+  // flight
+  ring.head.store(UINT32_MAX - 5);
+  ring.tail.store(UINT32_MAX - 5);
+  uint32_t written = 0, read = 0;
+  while (read < 5 * TEST_RING_CAPACITY) {
+    while (pcm_ring_count(&ring) < 2) {
+      int16_t *samples = pcm_ring_acquire_write(&ring);
+      if (!TEST_CHECK(samples != NULL)) {
+        return;
+      }
+      test_ring_fill(samples, written);
+      pcm_ring_commit_write(&ring, ++written);
+    }
+    const int16_t *samples = pcm_ring_acquire_read(&ring, &meta);
+    if (!TEST_CHECK(samples != NULL)) {
+      return;
+    }
+    TEST_CHECK(test_ring_matches(samples, read));
+    TEST_CHECK_EQ(meta.origin_us, read + 1);
+    pcm_ring_release_read(&ring);
+    read++;
+  }
+
+  // Full across the counter wrap
+  ring.head.store(UINT32_MAX - 1);
+  ring.tail.store(UINT32_MAX - 1);
+  for (uint32_t frame = 0; frame < TEST_RING_CAPACITY; frame++) {
+    TEST_CHECK(pcm_ring_acquire_write(&ring) != NULL);
+    pcm_ring_commit_write(&ring, 0);
+  }
+  TEST_CHECK_EQ(pcm_ring_count(&ring), TEST_RING_CAPACITY);
+  TEST_CHECK(pcm_ring_acquire_write(&ring) == NULL);
+
+  // One producer and one consumer task at full speed, every frame arrives
+  // once, in order and intact
+  ring.head.store(0);
+  ring.tail.store(0);
+  ring.overruns.store(0);
+  static test_ring_stress_t stress;
+  stress.ring = &ring;
+  stress.frames = TEST_RING_STRESS_FRAMES;
+  stress.received = 0;
+  stress.errors = 0;
+  stress.finished.store(0);
+  int64_t start_us = esp_timer_get_time();
+  xTaskCreate(test_ring_consumer, "ring_consumer", TEST_RING_TASK_STACK_SIZE,
+              &stress, TEST_RING_TASK_PRIORITY, NULL);
+  xTaskCreate(test_ring_producer, "ring_producer", TEST_RING_TASK_STACK_SIZE,
+              &stress, TEST_RING_TASK_PRIORITY, NULL);
+  while (stress.finished.load() < 2) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  int64_t elapsed_us = esp_timer_get_time() - start_us;
+  TEST_CHECK_EQ(stress.received, TEST_RING_STRESS_FRAMES);
+  TEST_CHECK_EQ(stress.errors, 0);
+  TEST_CHECK_EQ(pcm_ring_count(&ring), 0);
+  printf("  %u frames across tasks in %.1fms, %lu full-ring retries\n",
+         (unsigned)TEST_RING_STRESS_FRAMES, elapsed_us / 1000.0,
+         (unsigned long)ring.overruns.load());
+}
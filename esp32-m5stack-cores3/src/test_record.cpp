@@ -0,0 +1,284 @@
+#include <esp_timer.h>
+#include <peer.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+// A recording of the default session read back record by record, with the
+// uplink of a capture session (every packet, fillers and keepalives too)
+// and a burst from a load generator sized session index that overflows the
+// ring. Then the recording is replayed, and the same recording with a
+// header this build can't play is refused rather than run with a frame
+// length of 0. Runs last, nothing stops the recorder once it has started.
+#define TEST_RECORD_PACKETS 25
+#define TEST_RECORD_PACKET_SIZE 40
+#define TEST_RECORD_MESSAGE \
+  "{\"label\":\"rtvi-ai\",\"type\":\"bot-started-speaking\"}"
+#define TEST_RECORD_CAPTURE_FRAMES 100
+#define TEST_RECORD_BURST_INDEX 300
+#define TEST_RECORD_BURST_SIZE 200
+#define TEST_RECORD_BURST_RECORDS \
+  (RECORD_RING_SIZE / TEST_RECORD_BURST_SIZE * 3)
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+typedef struct {
+  record_kind_t kind;
+  size_t length;
+} test_record_expected_t;
+
+// What a reading of the file found
+typedef struct {
+  int session0;  // Session 0's records, checked against the expected ones
+  int capture_tx;
+  int burst;
+  uint32_t dropped;
+  int dropped_records;
+  int unattributed;  // RECORD_DROPPED with a session index
+  int64_t session0_us;
+} test_record_read_t;
+
+static char test_record_path[64];
+
+static esp_err_t test_record_device_init(void *context, uint32_t sample_rate) {
+  return ESP_OK;
+}
+
+static esp_err_t test_record_device_read(void *context, int16_t *samples,
+                                         size_t count) {
+  memset(samples, 0, count * sizeof(int16_t));
+  return ESP_OK;
+}
+
+static esp_err_t test_record_device_write(void *context,
+                                          const int16_t *samples,
+                                          size_t count) {
+  return ESP_OK;
+}
+
+// A silent microphone, as fast as it is read
+static const audio_device_t test_record_device = {
+    .init = test_record_device_init,
+    .read = test_record_device_read,
+    .write = test_record_device_write,
+};
+
+// Writes the recording at `from` to `to` with another header
+static bool test_record_rewrite(const char *from, const char *to,
+                                uint32_t codec_rate, uint32_t frame_ms) {
+  FILE *in = fopen(from, "rb");
+  FILE *out = fopen(to, "wb");
+  bool ok = in != NULL && out != NULL;
+  record_file_header_t header;
+  if (ok && fread(&header, 1, sizeof(header), in) == sizeof(header)) {
+    header.codec_rate = codec_rate;
+    header.frame_ms = frame_ms;
+    fwrite(&header, 1, sizeof(header), out);
+    char data[1024];
+    size_t n;
+    while ((n = fread(data, 1, sizeof(data), in)) > 0) {
+      fwrite(data, 1, n, out);
+    }
+  }
+  if (in != NULL) {
+    fclose(in);
+  }
+  if (out != NULL) {
+    fclose(out);
+  }
+  return ok;
+}
+
+// Records what the WebRTC callbacks would for session 0
+static void test_record_session(test_record_expected_t *expected) {
+  pipecat_session_t *session = &pipecat_session;
+  uint8_t packet[TEST_RECORD_PACKET_SIZE];
+  uint32_t samples = pipecat_audio_config.codec_rate * JITTER_BUFFER_FRAME_MS /
+                     1000;
+  int count = 0;
+  for (int i = 0; i < TEST_RECORD_PACKETS; i++) {
+    memset(packet, i, sizeof(packet));
+    pipecat_record_audio_rx(session, i, i * samples, packet, sizeof(packet));
+    expected[count++] = {RECORD_AUDIO_RX, 6 + sizeof(packet)};
+    if (i == TEST_RECORD_PACKETS / 2) {
+      pipecat_record(session, RECORD_DATA_RX, TEST_RECORD_MESSAGE,
+                     strlen(TEST_RECORD_MESSAGE));
+      expected[count++] = {RECORD_DATA_RX, strlen(TEST_RECORD_MESSAGE)};
+    }
+    vTaskDelay(pdMS_TO_TICKS(JITTER_BUFFER_FRAME_MS));
+  }
+  pipecat_record(session, RECORD_RESET, NULL, 0);
+  expected[count++] = {RECORD_RESET, 0};
+}
+
+// Silence through the capture path: fillers and keepalives, one packet per
+// period, each of them recorded
+static pipecat_session_t *test_record_capture(audio_capture_stats_t *stats) {
+  pipecat_session_t *session =
+      test_session_create(&test_record_device, NULL);
+  if (!TEST_CHECK(session != NULL)) {
+    return NULL;
+  }
+  pipecat_init_audio_capture(session);
+  pipecat_init_audio_encoder(session);
+  PeerConfiguration config = {
+      .ice_servers = {},
+      .audio_codec = CODEC_OPUS,
+      .video_codec = CODEC_NONE,
+      .datachannel = DATA_CHANNEL_NONE,
+      .onaudiotrack = NULL,
+      .onvideotrack = NULL,
+      .on_request_keyframe = NULL,
+      .user_data = NULL,
+  };
+  PeerConnection *peer_connection = peer_connection_create(&config);
+  if (!TEST_CHECK(peer_connection != NULL)) {
+    return NULL;
+  }
+  for (int i = 0; i < TEST_RECORD_CAPTURE_FRAMES; i++) {
+    pipecat_send_audio(session, peer_connection);
+  }
+  peer_connection_destroy(peer_connection);
+  pipecat_audio_capture_stats(session, stats);
+  return session;
+}
+
+// More than the ring holds before the next flush, from a session index
+// past 255
+static void test_record_burst() {
+  static pipecat_session_t burst;
+  burst.config.index = TEST_RECORD_BURST_INDEX;
+  uint8_t data[TEST_RECORD_BURST_SIZE] = {};
+  for (int i = 0; i < TEST_RECORD_BURST_RECORDS; i++) {
+    pipecat_record(&burst, RECORD_DATA_TX, data, sizeof(data));
+  }
+  // The next record reports what was dropped, once there is room
+  vTaskDelay(pdMS_TO_TICKS(RECORD_FLUSH_INTERVAL_MS * 3));
+  pipecat_record(&burst, RECORD_DATA_TX, data, sizeof(data));
+}
+
+// The file holds the header and the records, in order and in full
+static void test_record_read(const test_record_expected_t *expected,
+                             int count, uint32_t capture_index,
+                             test_record_read_t *read) {
+  memset(read, 0, sizeof(*read));
+  FILE *file = fopen(test_record_path, "rb");
+  if (!TEST_CHECK(file != NULL)) {
+    return;
+  }
+  record_file_header_t file_header;
+  TEST_CHECK_EQ(fread(&file_header, 1, sizeof(file_header), file),
+                sizeof(file_header));
+  TEST_CHECK(memcmp(file_header.magic, "PCRC", 4) == 0);
+  TEST_CHECK_EQ(file_header.version, RECORD_VERSION);
+  TEST_CHECK_EQ(file_header.codec_rate, pipecat_audio_config.codec_rate);
+  TEST_CHECK_EQ(file_header.frame_ms, pipecat_audio_config.frame_ms);
+
+  record_header_t header;
+  static uint8_t payload[UINT16_MAX];
+  while (fread(&header, 1, sizeof(header), file) == sizeof(header) &&
+         fread(payload, 1, header.length, file) == header.length) {
+    if (header.kind == RECORD_DROPPED) {
+      uint32_t lost = 0;
+      memcpy(&lost, payload, MIN(sizeof(lost), (size_t)header.length));
+      read->dropped += lost;
+      read->dropped_records++;
+      read->unattributed += header.session != RECORD_SESSION_NONE;
+    } else if (header.session == 0) {
+      if (read->session0 < count) {
+        TEST_CHECK_EQ(header.kind, expected[read->session0].kind);
+        TEST_CHECK_EQ(header.length, expected[read->session0].length);
+      }
+      if (read->session0 > 0) {
+        read->session0_us += header.delta_us;
+      }
+      read->session0++;
+    } else if (header.session == capture_index) {
+      read->capture_tx += header.kind == RECORD_AUDIO_TX;
+    } else if (header.session == TEST_RECORD_BURST_INDEX) {
+      read->burst++;
+    }
+  }
+  fclose(file);
+}
+
+void test_record() {
+  snprintf(test_record_path, sizeof(test_record_path),
+           "/tmp/pipecat-test-%d.rec", (int)getpid());
+  if (!TEST_CHECK(pipecat_record_start(test_record_path))) {
+    return;
+  }
+  test_record_expected_t expected[TEST_RECORD_PACKETS + 2];
+  test_record_session(expected);
+  audio_capture_stats_t capture;
+  pipecat_session_t *capture_session = test_record_capture(&capture);
+  if (capture_session == NULL) {
+    return;
+  }
+  vTaskDelay(pdMS_TO_TICKS(RECORD_FLUSH_INTERVAL_MS * 3));
+  test_record_burst();
+  vTaskDelay(pdMS_TO_TICKS(RECORD_FLUSH_INTERVAL_MS * 3));
+
+  test_record_read_t read;
+  test_record_read(expected, TEST_RECORD_PACKETS + 2,
+                   capture_session->config.index, &read);
+  TEST_CHECK_EQ(read.session0, TEST_RECORD_PACKETS + 2);
+  TEST_CHECK(read.session0_us >=
+             (TEST_RECORD_PACKETS - 1) * JITTER_BUFFER_FRAME_MS * 1000LL);
+  printf("  %d records over %lldms\n", read.session0,
+         (long long)(read.session0_us / 1000));
+
+  // Every packet the uplink sent, not only the encoded ones
+  TEST_CHECK_EQ(capture.frames, TEST_RECORD_CAPTURE_FRAMES);
+  TEST_CHECK_EQ(read.capture_tx, capture.sent + capture.dtx + capture.fillers);
+  TEST_CHECK(capture.fillers > 0);
+  printf("  %d uplink packets recorded: %lu encoded, %lu DTX, %lu fillers\n",
+         read.capture_tx, (unsigned long)capture.sent,
+         (unsigned long)capture.dtx, (unsigned long)capture.fillers);
+
+  // Drops are reported as nobody's, and what was kept keeps its index
+  TEST_CHECK(read.dropped > 0);
+  TEST_CHECK(read.dropped_records > 0);
+  TEST_CHECK_EQ(read.unattributed, 0);
+  TEST_CHECK_EQ(read.burst + read.dropped, TEST_RECORD_BURST_RECORDS + 1);
+  printf("  burst of %d: %d recorded, %lu dropped\n",
+         TEST_RECORD_BURST_RECORDS + 1, read.burst,
+         (unsigned long)read.dropped);
+
+  // Unplayable headers are refused before anything runs, and leave the
+  // audio config as it was
+  char copy[80];
+  snprintf(copy, sizeof(copy), "%s.copy", test_record_path);
+  audio_config_t config = pipecat_audio_config;
+  const uint32_t bad[][2] = {{config.codec_rate, 0},
+                             {config.codec_rate, config.frame_ms / 2},
+                             {44100, config.frame_ms},
+                             {0, config.frame_ms}};
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    TEST_CHECK(test_record_rewrite(test_record_path, copy, bad[i][0],
+                                   bad[i][1]));
+    int64_t start_us = esp_timer_get_time();
+    TEST_CHECK_EQ(pipecat_replay(copy, true), 1);
+    TEST_CHECK(esp_timer_get_time() - start_us < 1000000);
+    TEST_CHECK_EQ(pipecat_audio_config.codec_rate, config.codec_rate);
+    TEST_CHECK_EQ(pipecat_audio_config.frame_ms, config.frame_ms);
+  }
+  unlink(copy);
+
+  // Replayed from a copy, replay's own RTVI sends are recorded too
+  TEST_CHECK(test_record_rewrite(test_record_path, copy,
+                                 config.codec_rate, config.frame_ms));
+  int64_t start_us = esp_timer_get_time();
+  TEST_CHECK_EQ(pipecat_replay(copy, true), 0);
+  printf("  replayed in %lldms\n",
+         (long long)((esp_timer_get_time() - start_us) / 1000));
+  unlink(copy);
+  unlink(test_record_path);
+}
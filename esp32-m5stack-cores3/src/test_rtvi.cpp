@@ -0,0 +1,194 @@
+#include <peer.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+
+// The outbound queue on a PeerConnection that never connects, so the data
+// channel refuses every message and the slots are all that holds a sender
+// back, as they are on a link slower than the sender: exact bytes
+// of compact messages, no allocations on the sending side, coalescing,
+// drops once every slot is busy, retries on refusal, and every slot back
+// after detach, attach or a message that doesn't fit.
+#define TEST_RTVI_DROPPED_SENDS 10000
+
+static char test_rtvi_oversized[RTVI_SEND_BUFFER_SIZE + 1];
+
+static void test_rtvi_write_string(json_writer_t *w, const void *ctx) {
+  json_writer_string(w, (const char *)ctx);
+}
+
+static double test_rtvi_cpu_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool test_rtvi_send_one(pipecat_session_t *session) {
+  return pipecat_rtvi_send(session, "client-ready", NULL, NULL,
+                           RTVI_COALESCE_NONE);
+}
+
+// Sends until a slot is refused, returns how many were taken
+static uint32_t test_rtvi_fill(pipecat_session_t *session) {
+  uint32_t sent = 0;
+  while (sent <= RTVI_SEND_SLOTS && test_rtvi_send_one(session)) {
+    sent++;
+  }
+  return sent;
+}
+
+static uint32_t test_rtvi_queued_bytes(pipecat_session_t *session) {
+  rtvi_send_stats_t stats;
+  pipecat_rtvi_send_stats(session, &stats);
+  return stats.queued_bytes;
+}
+
+void test_rtvi_send() {
+  pipecat_session_t *session = test_session_create(NULL, NULL);
+  if (!TEST_CHECK(session != NULL)) {
+    return;
+  }
+  pipecat_init_rtvi(session);
+
+  PeerConfiguration config = {
+      .ice_servers = {},
+      .audio_codec = CODEC_NONE,
+      .video_codec = CODEC_NONE,
+      .datachannel = DATA_CHANNEL_STRING,
+      .onaudiotrack = NULL,
+      .onvideotrack = NULL,
+      .on_request_keyframe = NULL,
+      .user_data = NULL,
+  };
+  PeerConnection *connection = peer_connection_create(&config);
+  if (!TEST_CHECK(connection != NULL)) {
+    return;
+  }
+
+  // Nothing is queued without a connection
+  rtvi_send_stats_t before, after;
+  pipecat_rtvi_send_stats(session, &before);
+  TEST_CHECK(!test_rtvi_send_one(session));
+  pipecat_rtvi_send_stats(session, &after);
+  TEST_CHECK_EQ(after.dropped - before.dropped, 1);
+  TEST_CHECK_EQ(after.queued, before.queued);
+
+  // Compact JSON, byte for byte, and no allocations per message
+  pipecat_rtvi_attach(session, connection);
+  uint64_t allocations = test_allocations();
+  uint32_t bytes = test_rtvi_queued_bytes(session);
+  pipecat_rtvi_send_client_ready(session);
+  uint32_t ready_bytes = test_rtvi_queued_bytes(session) - bytes;
+  TEST_CHECK_EQ(ready_bytes,
+                strlen("{\"label\":\"rtvi-ai\",\"type\":\"client-ready\","
+                       "\"id\":\"0\"}"));
+
+  bytes = test_rtvi_queued_bytes(session);
+  pipecat_rtvi_send_user_speaking(session, true);
+  uint32_t speaking_bytes = test_rtvi_queued_bytes(session) - bytes;
+  TEST_CHECK_EQ(speaking_bytes,
+                strlen("{\"label\":\"rtvi-ai\",\"type\":\"client-message\","
+                       "\"id\":\"1\",\"data\":{\"t\":\"user-started-"
+                       "speaking\"}}"));
+
+  bytes = test_rtvi_queued_bytes(session);
+  pipecat_rtvi_send_client_metrics(session);
+  uint32_t metrics_bytes = test_rtvi_queued_bytes(session) - bytes;
+  TEST_CHECK(metrics_bytes > 0 && metrics_bytes < RTVI_SEND_BUFFER_SIZE);
+  TEST_CHECK_EQ(test_allocations() - allocations, 0);
+  printf("  bytes per message: client-ready %lu, user-started-speaking %lu, "
+         "metrics %lu; no allocations\n",
+         (unsigned long)ready_bytes, (unsigned long)speaking_bytes,
+         (unsigned long)metrics_bytes);
+
+  // Metrics coalesce into the one slot they already hold
+  pipecat_rtvi_send_stats(session, &before);
+  for (int i = 0; i < 9; i++) {
+    pipecat_rtvi_send_client_metrics(session);
+  }
+  pipecat_rtvi_send_stats(session, &after);
+  TEST_CHECK_EQ(after.queued - before.queued, 9);
+  TEST_CHECK_EQ(after.coalesced - before.coalesced, 9);
+  TEST_CHECK_EQ(after.dropped, before.dropped);
+
+  // Three slots in use, the rest fill up and then sends are dropped,
+  // without blocking or allocating
+  TEST_CHECK_EQ(test_rtvi_fill(session), RTVI_SEND_SLOTS - 3);
+  pipecat_rtvi_send_stats(session, &before);
+  allocations = test_allocations();
+  double start = test_rtvi_cpu_seconds();
+  for (int i = 0; i < TEST_RTVI_DROPPED_SENDS; i++) {
+    test_rtvi_send_one(session);
+  }
+  double dropped_s = test_rtvi_cpu_seconds() - start;
+  TEST_CHECK_EQ(test_allocations() - allocations, 0);
+  pipecat_rtvi_send_stats(session, &after);
+  TEST_CHECK_EQ(after.dropped - before.dropped, TEST_RTVI_DROPPED_SENDS);
+  TEST_CHECK_EQ(after.queued, before.queued);
+  printf("  queue full: %.0fns per dropped send\n",
+         dropped_s * 1e9 / TEST_RTVI_DROPPED_SENDS);
+
+  // A refused message stays at the head and is retried on each flush
+  pipecat_rtvi_send_stats(session, &before);
+  pipecat_rtvi_flush(session);
+  pipecat_rtvi_flush(session);
+  pipecat_rtvi_send_stats(session, &after);
+  TEST_CHECK_EQ(after.retries - before.retries, 2);
+  TEST_CHECK_EQ(after.sent, before.sent);
+  TEST_CHECK(!test_rtvi_send_one(session));
+
+  // A sender that keeps up with each flush is still only held back by the
+  // slots, the refused head doesn't block or grow anything
+  pipecat_rtvi_send_stats(session, &before);
+  allocations = test_allocations();
+  for (int i = 0; i < TEST_RTVI_DROPPED_SENDS; i++) {
+    test_rtvi_send_one(session);
+    pipecat_rtvi_flush(session);
+  }
+  TEST_CHECK_EQ(test_allocations() - allocations, 0);
+  pipecat_rtvi_send_stats(session, &after);
+  TEST_CHECK_EQ(after.dropped - before.dropped, TEST_RTVI_DROPPED_SENDS);
+  TEST_CHECK_EQ(after.retries - before.retries, TEST_RTVI_DROPPED_SENDS);
+  TEST_CHECK_EQ(after.queued, before.queued);
+
+  // Detach gives every slot back, counted as dropped
+  pipecat_rtvi_send_stats(session, &before);
+  pipecat_rtvi_detach(session);
+  pipecat_rtvi_send_stats(session, &after);
+  TEST_CHECK_EQ(after.dropped - before.dropped, RTVI_SEND_SLOTS);
+  TEST_CHECK(!test_rtvi_send_one(session));
+  pipecat_rtvi_flush(session);
+
+  pipecat_rtvi_attach(session, connection);
+  TEST_CHECK_EQ(test_rtvi_fill(session), RTVI_SEND_SLOTS);
+  pipecat_rtvi_detach(session);
+
+  // A message that doesn't fit is refused and its slot comes back
+  memset(test_rtvi_oversized, 'a', RTVI_SEND_BUFFER_SIZE);
+  pipecat_rtvi_attach(session, connection);
+  pipecat_rtvi_send_stats(session, &before);
+  TEST_CHECK(!pipecat_rtvi_send_client_message(
+      session, "oversized", test_rtvi_write_string, test_rtvi_oversized,
+      RTVI_COALESCE_NONE));
+  pipecat_rtvi_send_stats(session, &after);
+  TEST_CHECK_EQ(after.overflow - before.overflow, 1);
+  TEST_CHECK_EQ(after.queued, before.queued);
+  TEST_CHECK_EQ(test_rtvi_fill(session), RTVI_SEND_SLOTS);
+  pipecat_rtvi_detach(session);
+
+  // Queued for the old connection as it was detached: the new one doesn't
+  // get it
+  pipecat_rtvi_attach(session, connection);
+  pipecat_rtvi_send_user_speaking(session, true);
+  pipecat_rtvi_send_client_metrics(session);
+  pipecat_rtvi_send_stats(session, &before);
+  pipecat_rtvi_attach(session, connection);
+  pipecat_rtvi_send_stats(session, &after);
+  TEST_CHECK_EQ(after.dropped - before.dropped, 2);
+  TEST_CHECK_EQ(test_rtvi_fill(session), RTVI_SEND_SLOTS);
+  pipecat_rtvi_detach(session);
+
+  peer_connection_destroy(connection);
+}
@@ -0,0 +1,346 @@
+#include <cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+
+// rtvi_parse_message() on well-formed, escaped, oversized, truncated and
+// malformed messages, then the same representative server messages through
+// it and through cJSON (parse, look up type, id and data.text, delete), as
+// rtvi.cpp did before the parser. cJSON's allocations are counted through
+// cJSON_InitHooks(); the parser makes none.
+#define TEST_RTVI_BENCH_ROUNDS 20000
+
+static rtvi_message_t test_rtvi_msg;
+
+static bool test_rtvi_parse(const char *json) {
+  return rtvi_parse_message(json, strlen(json), &test_rtvi_msg);
+}
+
+// `value` as data.v of an otherwise valid message
+static bool test_rtvi_parse_scalar(const char *value) {
+  char json[64];
+  snprintf(json, sizeof(json), "{\"type\":\"x\",\"data\":{\"v\":%s}}", value);
+  return test_rtvi_parse(json);
+}
+
+static void test_rtvi_valid() {
+  rtvi_message_t *msg = &test_rtvi_msg;
+
+  TEST_CHECK(test_rtvi_parse(
+      "{\"label\":\"rtvi-ai\",\"type\":\"bot-tts-text\",\"id\":\"a1\","
+      "\"data\":{\"text\":\"Hello there\","
+      "\"extra\":{\"n\":[1,{\"x\":null}]}}}"));
+  TEST_CHECK(strcmp(msg->type, "bot-tts-text") == 0);
+  TEST_CHECK_EQ(msg->event, RTVI_EVENT_BOT_TTS_TEXT);
+  TEST_CHECK(strcmp(msg->id, "a1") == 0);
+  TEST_CHECK(msg->has_text);
+  TEST_CHECK(strcmp(msg->text, "Hello there") == 0);
+  TEST_CHECK(strcmp(msg->data,
+                    "{\"text\":\"Hello there\","
+                    "\"extra\":{\"n\":[1,{\"x\":null}]}}") == 0);
+  TEST_CHECK_EQ(msg->data_len, strlen(msg->data));
+  TEST_CHECK(!msg->truncated);
+
+  // Whitespace anywhere, numeric id kept as written, final and data.type
+  TEST_CHECK(test_rtvi_parse(
+      " {\n\t\"type\" : \"server-message\" , \"id\" : -12.5e3 ,\r\n"
+      "\"data\" : { \"type\" : \"volume\" , \"final\" : true } } \n"));
+  TEST_CHECK_EQ(msg->event, RTVI_EVENT_SERVER_MESSAGE);
+  TEST_CHECK(strcmp(msg->id, "-12.5e3") == 0);
+  TEST_CHECK(strcmp(msg->data_type, "volume") == 0);
+  TEST_CHECK(msg->final);
+  TEST_CHECK(!msg->has_text);
+
+  TEST_CHECK(test_rtvi_parse("{\"type\":\"x\",\"data\":{\"final\":false}}"));
+  TEST_CHECK(!msg->final);
+  TEST_CHECK_EQ(msg->event, RTVI_EVENT_UNKNOWN);
+
+  // The trace request's flag, only when it is literally true
+  TEST_CHECK(test_rtvi_parse(
+      "{\"type\":\"server-message\",\"data\":{\"type\":\"pipecat-esp32-trace\","
+      "\"reset\":true}}"));
+  TEST_CHECK(msg->reset);
+  TEST_CHECK(!msg->final);
+  TEST_CHECK(test_rtvi_parse("{\"type\":\"x\",\"data\":{\"reset\":\"true\"}}"));
+  TEST_CHECK(!msg->reset);
+
+  // The data channel may hand over the terminator with the message
+  const char terminated[] = "{\"type\":\"bot-ready\"}";
+  TEST_CHECK(rtvi_parse_message(terminated, sizeof(terminated), msg));
+  TEST_CHECK_EQ(msg->event, RTVI_EVENT_BOT_READY);
+
+  // Known keys with values of another kind are skipped, not misread
+  TEST_CHECK(test_rtvi_parse(
+      "{\"type\":\"x\",\"data\":{\"text\":5,\"type\":[\"y\"]},\"id\":{}}"));
+  TEST_CHECK(!msg->has_text);
+  TEST_CHECK_EQ(msg->data_type[0], '\0');
+}
+
+static void test_rtvi_escapes() {
+  rtvi_message_t *msg = &test_rtvi_msg;
+
+  TEST_CHECK(test_rtvi_parse(
+      "{\"type\":\"x\",\"data\":{\"text\":"
+      "\"\\\"\\\\\\/\\b\\f\\n\\r\\t caf\\u00e9 \\u20AC \\ud83d\\ude00\"}}"));
+  TEST_CHECK(strcmp(msg->text, "\"\\/\b\f\n\r\t caf\xc3\xa9 \xe2\x82\xac "
+                               "\xf0\x9f\x98\x80") == 0);
+
+  // Escaped keys still match
+  TEST_CHECK(test_rtvi_parse("{\"\\u0074ype\":\"bot-ready\"}"));
+  TEST_CHECK_EQ(msg->event, RTVI_EVENT_BOT_READY);
+
+  // Raw UTF-8 passes through
+  TEST_CHECK(test_rtvi_parse(
+      "{\"type\":\"x\",\"data\":{\"text\":\"\xe6\x97\xa5\xe6\x9c\xac\"}}"));
+  TEST_CHECK(strcmp(msg->text, "\xe6\x97\xa5\xe6\x9c\xac") == 0);
+
+  const char *invalid[] = {
+      "\"\\x\"",           // Unknown escape
+      "\"\\u12G4\"",       // Bad hex
+      "\"\\u12\"",         // Short hex
+      "\"\\ud800\"",       // High surrogate alone
+      "\"\\ud800\\u0041\"",  // High surrogate, no low one
+      "\"\\udc00\"",       // Low surrogate alone
+      "\"a\x01z\"",        // Raw control character
+      "\"a\\\"",           // Escaped closing quote
+      "\"\xe2\x82\"",      // UTF-8 sequence cut by the closing quote
+  };
+  for (const char *text : invalid) {
+    char json[64];
+    snprintf(json, sizeof(json), "{\"type\":\"x\",\"data\":{\"text\":%s}}",
+             text);
+    if (!TEST_CHECK(!test_rtvi_parse(json))) {
+      printf("  accepted %s\n", json);
+    }
+  }
+}
+
+static void test_rtvi_truncation() {
+  rtvi_message_t *msg = &test_rtvi_msg;
+  static char json[4 * RTVI_MAX_TEXT_LEN];
+
+  // 2 and 3-byte characters past the end: cut on a character boundary
+  const char *characters[] = {"\xc3\xa9", "\xe2\x82\xac"};
+  for (const char *character : characters) {
+    size_t width = strlen(character);
+    size_t len = snprintf(json, sizeof(json),
+                          "{\"type\":\"x\",\"data\":{\"text\":\"");
+    for (size_t i = 0; i < RTVI_MAX_TEXT_LEN / width + 1; i++) {
+      memcpy(json + len, character, width);
+      len += width;
+    }
+    snprintf(json + len, sizeof(json) - len, "\"}}");
+    TEST_CHECK(test_rtvi_parse(json));
+    TEST_CHECK(msg->truncated);
+    size_t text_len = strlen(msg->text);
+    TEST_CHECK(text_len < RTVI_MAX_TEXT_LEN);
+    TEST_CHECK(text_len + width >= RTVI_MAX_TEXT_LEN);
+    TEST_CHECK_EQ(text_len % width, 0);
+    // data didn't fit either, so it is dropped rather than cut
+    TEST_CHECK_EQ(msg->data_len, 0);
+    TEST_CHECK_EQ(msg->data[0], '\0');
+  }
+
+  // A type that doesn't fit never matches an event
+  TEST_CHECK(test_rtvi_parse(
+      "{\"type\":\"bot-tts-text-but-much-longer-than-any-type\"}"));
+  TEST_CHECK(msg->truncated);
+  TEST_CHECK_EQ(msg->event, RTVI_EVENT_UNKNOWN);
+
+  const char *long_id =
+      "{\"type\":\"x\",\"id\":1234567890123456789012345678901234"
+      "567890123456789012345678901234567890}";
+  TEST_CHECK(test_rtvi_parse(long_id));
+  TEST_CHECK(msg->truncated);
+  TEST_CHECK_EQ(msg->id[0], '\0');
+
+  // Every strict prefix of a message is incomplete
+  const char *complete =
+      "{\"type\":\"user-transcription\",\"id\":7,\"data\":{\"text\":"
+      "\"caf\\u00e9\",\"final\":true,\"n\":[1.5,-2e3,null]}}";
+  size_t complete_len = strlen(complete);
+  for (size_t len = 0; len < complete_len; len++) {
+    if (!TEST_CHECK(!rtvi_parse_message(complete, len, msg))) {
+      printf("  accepted the first %lu bytes\n", (unsigned long)len);
+    }
+  }
+  TEST_CHECK(rtvi_parse_message(complete, complete_len, msg));
+}
+
+static void test_rtvi_malformed() {
+  const char *invalid[] = {
+      "",
+      "   ",
+      "[]",
+      "\"bot-ready\"",
+      "null",
+      "{}",                                    // No type
+      "{\"type\":5}",                          // Type isn't a string
+      "{\"type\":\"\"}",                       // Empty type
+      "{\"type\" \"x\"}",                      // Missing colon
+      "{\"type\":\"x\",}",                     // Trailing comma
+      "{,\"type\":\"x\"}",                     // Leading comma
+      "{\"type\":\"x\" \"id\":\"y\"}",         // Missing comma
+      "{type:\"x\"}",                          // Unquoted key
+      "{'type':'x'}",                          // Single quotes
+      "{\"type\":\"x\"",                       // Unterminated object
+      "{\"type\":\"x}",                        // Unterminated string
+      "{\"type\":\"x\",\"data\":{\"a\":[1,2}}",  // Mismatched bracket
+      "{\"type\":\"x\",\"data\":{\"a\":[1,]}}",  // Trailing comma in array
+      "{\"type\":\"x\"}}",                     // Trailing garbage
+      "{\"type\":\"x\"} {}",                   // Two messages
+      "{\"type\":\"x\"}x",
+  };
+  for (const char *json : invalid) {
+    if (!TEST_CHECK(!test_rtvi_parse(json))) {
+      printf("  accepted %s\n", json);
+    }
+  }
+
+  // Nesting up to RTVI_MAX_DEPTH, the message itself being the first level
+  char json[2 * RTVI_MAX_DEPTH + 32];
+  for (int levels = RTVI_MAX_DEPTH - 1; levels <= RTVI_MAX_DEPTH; levels++) {
+    size_t len = snprintf(json, sizeof(json), "{\"type\":\"x\",\"a\":");
+    memset(json + len, '[', levels);
+    memset(json + len + levels, ']', levels);
+    snprintf(json + len + 2 * levels, sizeof(json) - len - 2 * levels, "}");
+    TEST_CHECK_EQ(test_rtvi_parse(json), levels < RTVI_MAX_DEPTH);
+  }
+}
+
+static void test_rtvi_scalars() {
+  const char *valid[] = {
+      "0", "-0", "7", "1.5", "-2e10", "3E-2", "10e+3", "0.25",
+      "true", "false", "null",
+  };
+  for (const char *value : valid) {
+    if (!TEST_CHECK(test_rtvi_parse_scalar(value))) {
+      printf("  rejected %s\n", value);
+    }
+  }
+
+  const char *invalid[] = {
+      "1abc", "01", "-", "1.", ".5", "1e", "1e+", "+1", "1.2.3", "1-2",
+      "0x10", "tru", "nullx", "TRUE", "True", "nan", "-inf",
+  };
+  for (const char *value : invalid) {
+    if (!TEST_CHECK(!test_rtvi_parse_scalar(value))) {
+      printf("  accepted %s\n", value);
+    }
+  }
+
+  // Same rules for a numeric id
+  TEST_CHECK(!test_rtvi_parse("{\"type\":\"x\",\"id\":1abc}"));
+}
+
+static void test_rtvi_events() {
+  TEST_CHECK_EQ(rtvi_event_lookup("bot-ready"), RTVI_EVENT_BOT_READY);
+  TEST_CHECK_EQ(rtvi_event_lookup("metrics"), RTVI_EVENT_METRICS);
+  TEST_CHECK_EQ(rtvi_event_lookup("bot-ready "), RTVI_EVENT_UNKNOWN);
+  TEST_CHECK_EQ(rtvi_event_lookup("bot-read"), RTVI_EVENT_UNKNOWN);
+  TEST_CHECK_EQ(rtvi_event_lookup(""), RTVI_EVENT_UNKNOWN);
+  for (int event = 0; event < RTVI_EVENT_COUNT; event++) {
+    TEST_CHECK_EQ(rtvi_event_lookup(rtvi_event_name((rtvi_event_t)event)),
+                  event);
+  }
+}
+
+// What the bot sends most: streamed text, transcriptions and metrics
+static const char *test_rtvi_bench_messages[] = {
+    "{\"label\":\"rtvi-ai\",\"type\":\"bot-llm-text\",\"data\":{\"text\":"
+    "\" the\"}}",
+    "{\"label\":\"rtvi-ai\",\"type\":\"bot-tts-text\",\"data\":{\"text\":"
+    "\"Sure, I can help you with that.\"}}",
+    "{\"label\":\"rtvi-ai\",\"type\":\"user-transcription\",\"data\":{"
+    "\"text\":\"what's the weather like today\",\"user_id\":\"\","
+    "\"timestamp\":\"2025-01-01T12:00:00.000+00:00\",\"final\":true}}",
+    "{\"label\":\"rtvi-ai\",\"type\":\"metrics\",\"data\":{\"processing\":[{"
+    "\"processor\":\"OpenAILLMService#0\",\"value\":0.412,\"model\":"
+    "\"gpt-4o\"}],\"ttfb\":[{\"processor\":\"CartesiaTTSService#0\","
+    "\"value\":0.183}]}}",
+    "{\"label\":\"rtvi-ai\",\"type\":\"server-message\",\"id\":\"b1c2\","
+    "\"data\":{\"type\":\"set-volume\",\"volume\":0.8,\"note\":"
+    "\"caf\\u00e9 \\\"quoted\\\"\"}}",
+};
+
+static uint32_t test_rtvi_cjson_allocs = 0;
+static uint64_t test_rtvi_cjson_bytes = 0;
+
+static void *test_rtvi_cjson_malloc(size_t size) {
+  test_rtvi_cjson_allocs++;
+  test_rtvi_cjson_bytes += size;
+  return malloc(size);
+}
+
+static double test_rtvi_cpu_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void test_rtvi_bench() {
+  const size_t count =
+      sizeof(test_rtvi_bench_messages) / sizeof(test_rtvi_bench_messages[0]);
+  size_t lens[count];
+  size_t total_bytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    lens[i] = strlen(test_rtvi_bench_messages[i]);
+    total_bytes += lens[i];
+  }
+  uint32_t messages = TEST_RTVI_BENCH_ROUNDS * count;
+
+  uint32_t parsed = 0;
+  double start = test_rtvi_cpu_seconds();
+  for (uint32_t round = 0; round < TEST_RTVI_BENCH_ROUNDS; round++) {
+    for (size_t i = 0; i < count; i++) {
+      parsed += rtvi_parse_message(test_rtvi_bench_messages[i], lens[i],
+                                   &test_rtvi_msg);
+    }
+  }
+  double parser_s = test_rtvi_cpu_seconds() - start;
+  TEST_CHECK_EQ(parsed, messages);
+
+  cJSON_Hooks hooks = {.malloc_fn = test_rtvi_cjson_malloc, .free_fn = free};
+  cJSON_InitHooks(&hooks);
+  test_rtvi_cjson_allocs = 0;
+  test_rtvi_cjson_bytes = 0;
+  parsed = 0;
+  start = test_rtvi_cpu_seconds();
+  for (uint32_t round = 0; round < TEST_RTVI_BENCH_ROUNDS; round++) {
+    for (size_t i = 0; i < count; i++) {
+      cJSON *root = cJSON_Parse(test_rtvi_bench_messages[i]);
+      if (root == NULL) {
+        continue;
+      }
+      parsed++;
+      cJSON_GetObjectItem(root, "type");
+      cJSON_GetObjectItem(root, "id");
+      cJSON_GetObjectItem(cJSON_GetObjectItem(root, "data"), "text");
+      cJSON_Delete(root);
+    }
+  }
+  double cjson_s = test_rtvi_cpu_seconds() - start;
+  cJSON_InitHooks(NULL);
+  TEST_CHECK_EQ(parsed, messages);
+
+  printf("  %lu messages averaging %lu bytes: parser %.0fns each, no "
+         "allocations; cJSON %.0fns each, %.1f allocations totalling %.0f "
+         "bytes\n",
+         (unsigned long)messages, (unsigned long)(total_bytes / count),
+         parser_s * 1e9 / messages, cjson_s * 1e9 / messages,
+         (double)test_rtvi_cjson_allocs / messages,
+         (double)test_rtvi_cjson_bytes / messages);
+}
+
+void test_rtvi_parser() {
+  test_rtvi_valid();
+  test_rtvi_escapes();
+  test_rtvi_truncation();
+  test_rtvi_malformed();
+  test_rtvi_scalars();
+  test_rtvi_events();
+  test_rtvi_bench();
+}
@@ -0,0 +1,148 @@
+#include <esp_timer.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+// The signalling task against the stand-in's /api/echo, driven the way the
+// reconnect loop drives it: each connection starts an exchange with its
+// own id and cancels it when it is torn down. Answers only ever come back
+// for the connection still current, and a dead exchange doesn't keep the
+// next one waiting. Then the server goes down and comes back, and is too
+// slow for a connection that gives up on it.
+#define TEST_SIGNALLING_OFFER "v=0\r\no=- 1 1 IN IP4 0.0.0.0\r\n"
+#define TEST_SIGNALLING_SLOW_MS 300
+#define TEST_SIGNALLING_WAIT_MS 3000
+#define TEST_SIGNALLING_DOWN_MS 700
+#define TEST_SIGNALLING_STALLED_MS 2000
+
+static char test_signalling_url[128];
+
+static void test_signalling_set_url(pipecat_session_t *session, uint16_t port,
+                                    const char *query) {
+  snprintf(test_signalling_url, sizeof(test_signalling_url),
+           "http://127.0.0.1:%u/api/echo%s", port, query);
+  session->config.url = test_signalling_url;
+}
+
+// Polls like the WebRTC loop for up to `wait_ms`, false if nothing came
+static bool test_signalling_wait(pipecat_session_t *session,
+                                 signalling_result_t *result,
+                                 uint32_t wait_ms) {
+  int64_t deadline_us = esp_timer_get_time() + wait_ms * 1000LL;
+  while (esp_timer_get_time() < deadline_us) {
+    if (pipecat_signalling_poll(session, result)) {
+      return true;
+    }
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  return false;
+}
+
+// The one result that comes is `connection`'s answer
+static void test_signalling_check_answer(pipecat_session_t *session,
+                                         uint32_t connection,
+                                         uint32_t wait_ms) {
+  signalling_result_t result;
+  int64_t start_us = esp_timer_get_time();
+  if (!TEST_CHECK(test_signalling_wait(session, &result, wait_ms))) {
+    return;
+  }
+  TEST_CHECK_EQ(result.connection, connection);
+  TEST_CHECK_EQ(result.err, ESP_OK);
+  TEST_CHECK(result.answer.data != NULL &&
+             strcmp(result.answer.data, TEST_SIGNALLING_OFFER) == 0);
+  http_buffer_free(&result.answer);
+  printf("  connection %lu answered after %lldms\n", (unsigned long)connection,
+         (long long)((esp_timer_get_time() - start_us) / 1000));
+
+  TEST_CHECK(!test_signalling_wait(session, &result, TEST_SIGNALLING_SLOW_MS));
+}
+
+void test_signalling() {
+  pipecat_session_t *session = test_session_create(NULL, NULL);
+  if (!TEST_CHECK(session != NULL)) {
+    return;
+  }
+  uint16_t port = pipecat_standin_start(0);
+  if (!TEST_CHECK(port != 0)) {
+    return;
+  }
+  pipecat_init_signalling(session);
+  uint32_t connection = 0;
+  signalling_result_t result;
+
+  test_signalling_set_url(session, port, "");
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  test_signalling_check_answer(session, connection, TEST_SIGNALLING_WAIT_MS);
+
+  // Torn down while backing off from a 503: no result, and the next
+  // connection is answered without waiting out the backoff
+  test_signalling_set_url(session, port, "?status=503");
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  vTaskDelay(pdMS_TO_TICKS(HTTP_INITIAL_BACKOFF_MS / 2));
+  pipecat_signalling_cancel(session);
+  TEST_CHECK(!test_signalling_wait(session, &result, HTTP_INITIAL_BACKOFF_MS));
+  test_signalling_set_url(session, port, "");
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  test_signalling_check_answer(session, connection, HTTP_INITIAL_BACKOFF_MS);
+
+  // A new connection while a slow exchange runs: the old answer is
+  // dropped, a queued offer that never started is replaced
+  char slow[32];
+  snprintf(slow, sizeof(slow), "?delay_ms=%d", TEST_SIGNALLING_SLOW_MS);
+  test_signalling_set_url(session, port, slow);
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  vTaskDelay(pdMS_TO_TICKS(TEST_SIGNALLING_SLOW_MS / 3));
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  test_signalling_check_answer(session, connection, TEST_SIGNALLING_WAIT_MS);
+
+  // Cancelled with one running and one queued: nothing comes back
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  vTaskDelay(pdMS_TO_TICKS(TEST_SIGNALLING_SLOW_MS / 3));
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  pipecat_signalling_cancel(session);
+  TEST_CHECK(!test_signalling_wait(session, &result,
+                                   TEST_SIGNALLING_SLOW_MS * 2));
+
+  // Down, then back on the same port between two retries
+  pipecat_standin_stop();
+  test_signalling_set_url(session, port, "");
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  vTaskDelay(pdMS_TO_TICKS(TEST_SIGNALLING_DOWN_MS));
+  TEST_CHECK(!pipecat_signalling_poll(session, &result));
+  if (!TEST_CHECK_EQ(pipecat_standin_start(port), port)) {
+    return;
+  }
+  test_signalling_check_answer(session, connection, TEST_SIGNALLING_WAIT_MS);
+
+  // Too slow, so the connection gives up on it as the connect timeout does
+  // and the next one only waits for the attempt under way
+  char stalled[32];
+  snprintf(stalled, sizeof(stalled), "?delay_ms=%d",
+           TEST_SIGNALLING_STALLED_MS);
+  test_signalling_set_url(session, port, stalled);
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  vTaskDelay(pdMS_TO_TICKS(TEST_SIGNALLING_SLOW_MS));
+  pipecat_signalling_cancel(session);
+  test_signalling_set_url(session, port, "");
+  TEST_CHECK(pipecat_signalling_start(session, TEST_SIGNALLING_OFFER,
+                                      ++connection));
+  test_signalling_check_answer(session, connection, TEST_SIGNALLING_STALLED_MS);
+
+  pipecat_standin_stop();
+}
@@ -0,0 +1,245 @@
+#include <arpa/inet.h>
+#include <esp_timer.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+// The stand-in's HTTP side over plain sockets: /api/echo, every query
+// string fault, a client that never finishes its request holding up no one
+// else, and stop then start again. /api/offer only with a status fault,
+// test_webrtc.cpp connects a client to the rest of it.
+#define TEST_STANDIN_RESPONSE_SIZE (STANDIN_MAX_PAD + 64 * 1024)
+#define TEST_STANDIN_TIMEOUT_MS 5000
+#define TEST_STANDIN_PAD 100000
+#define TEST_STANDIN_DELAY_MS 300
+#define TEST_STANDIN_OFFER_BODY \
+  "{\"sdp\":\"v=0\\r\\no=- 1 1 IN IP4 0.0.0.0\\r\\n\",\"type\":\"offer\"}"
+
+typedef struct {
+  int status;  // 0 if the connection closed without a status line
+  bool chunked;
+  char *body;  // Into `data`, without chunk framing
+  size_t body_len;
+  uint32_t elapsed_ms;
+  char *data;
+  size_t len;
+} test_standin_response_t;
+
+static int test_standin_connect(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct timeval timeout = {.tv_sec = TEST_STANDIN_TIMEOUT_MS / 1000,
+                            .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Removes chunk framing in place, false if it is malformed
+static bool test_standin_dechunk(char *body, size_t *len) {
+  char *in = body;
+  char *end = body + *len;
+  char *out = body;
+  while (in < end) {
+    char *line_end = strstr(in, "\r\n");
+    if (line_end == NULL) {
+      return false;
+    }
+    size_t size = strtoul(in, NULL, 16);
+    in = line_end + 2;
+    if (size == 0) {
+      *len = out - body;
+      *out = '\0';
+      return true;
+    }
+    if (in + size + 2 > end) {
+      return false;
+    }
+    memmove(out, in, size);
+    out += size;
+    in += size + 2;
+  }
+  return false;
+}
+
+// Sends `method path` with `body` and reads until the server closes
+static bool test_standin_request(uint16_t port, const char *method,
+                                 const char *path, const char *body,
+                                 test_standin_response_t *response) {
+  response->status = 0;
+  response->chunked = false;
+  response->body = NULL;
+  response->body_len = 0;
+  response->len = 0;
+
+  int64_t start_us = esp_timer_get_time();
+  int fd = test_standin_connect(port);
+  if (fd < 0) {
+    return false;
+  }
+  char header[256];
+  int header_len = snprintf(header, sizeof(header),
+                            "%s %s HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                            "Content-Type: application/json\r\n"
+                            "Content-Length: %zu\r\n\r\n",
+                            method, path, strlen(body));
+  send(fd, header, header_len, MSG_NOSIGNAL);
+  send(fd, body, strlen(body), MSG_NOSIGNAL);
+
+  ssize_t n;
+  while (response->len < TEST_STANDIN_RESPONSE_SIZE - 1 &&
+         (n = recv(fd, response->data + response->len,
+                   TEST_STANDIN_RESPONSE_SIZE - 1 - response->len, 0)) > 0) {
+    response->len += n;
+  }
+  close(fd);
+  response->data[response->len] = '\0';
+  response->elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+
+  if (response->len == 0) {
+    return true;
+  }
+  char *header_end = strstr(response->data, "\r\n\r\n");
+  if (header_end == NULL ||
+      sscanf(response->data, "HTTP/1.1 %d", &response->status) != 1) {
+    return false;
+  }
+  *header_end = '\0';
+  response->chunked =
+      strstr(response->data, "Transfer-Encoding: chunked") != NULL;
+  response->body = header_end + 4;
+  response->body_len = response->data + response->len - response->body;
+  return !response->chunked ||
+         test_standin_dechunk(response->body, &response->body_len);
+}
+
+static void test_standin_faults(uint16_t port,
+                                test_standin_response_t *response) {
+  const char *offer = TEST_STANDIN_OFFER_BODY;
+
+  // The offer comes back as the answer
+  TEST_CHECK(test_standin_request(port, "POST", "/api/echo", offer, response));
+  TEST_CHECK_EQ(response->status, 200);
+  TEST_CHECK(!response->chunked);
+  TEST_CHECK(strstr(response->body, "\"type\":\"answer\"") != NULL);
+  TEST_CHECK(strstr(response->body, "\"pc_id\":\"echo-") != NULL);
+  char *sdp = response->body != NULL ? strstr(response->body, "v=0") : NULL;
+  TEST_CHECK(sdp != NULL &&
+             strncmp(sdp, "v=0\\r\\no=- 1 1 IN IP4 0.0.0.0\\r\\n", 33) == 0);
+  size_t plain_len = response->body_len;
+
+  TEST_CHECK(test_standin_request(port, "GET", "/api/echo", "", response));
+  TEST_CHECK_EQ(response->status, 404);
+  TEST_CHECK(test_standin_request(port, "POST", "/api/other", offer, response));
+  TEST_CHECK_EQ(response->status, 404);
+  TEST_CHECK(test_standin_request(port, "POST", "/api/echo", "{}", response));
+  TEST_CHECK_EQ(response->status, 400);
+
+  // A status for the first `times` requests with the same query only
+  const char *twice = "/api/echo?status=503&times=2";
+  for (int i = 0; i < 3; i++) {
+    TEST_CHECK(test_standin_request(port, "POST", twice, offer, response));
+    TEST_CHECK_EQ(response->status, i < 2 ? 503 : 200);
+  }
+  TEST_CHECK(test_standin_request(port, "POST",
+                                  "/api/echo?status=503&times=2&n=1", offer,
+                                  response));
+  TEST_CHECK_EQ(response->status, 503);
+  for (int i = 0; i < 3; i++) {
+    TEST_CHECK(test_standin_request(port, "POST", "/api/echo?status=429",
+                                    offer, response));
+    TEST_CHECK_EQ(response->status, 429);
+    TEST_CHECK_EQ(response->body_len, 0);
+  }
+  TEST_CHECK(test_standin_request(port, "POST", "/api/offer?status=500",
+                                  offer, response));
+  TEST_CHECK_EQ(response->status, 500);
+
+  // Chunked: the same body once the framing is removed
+  TEST_CHECK(test_standin_request(port, "POST", "/api/echo?chunked=1", offer,
+                                  response));
+  TEST_CHECK_EQ(response->status, 200);
+  TEST_CHECK(response->chunked);
+  TEST_CHECK_EQ(response->body_len, plain_len);
+
+  // Padding, in several chunks too
+  TEST_CHECK(test_standin_request(port, "POST", "/api/echo?pad=100000", offer,
+                                  response));
+  TEST_CHECK_EQ(response->status, 200);
+  TEST_CHECK_EQ(response->body_len, plain_len + TEST_STANDIN_PAD +
+                                        strlen(",\"pad\":\"\""));
+  TEST_CHECK(test_standin_request(port, "POST",
+                                  "/api/echo?pad=100000&chunked=1", offer,
+                                  response));
+  TEST_CHECK(response->chunked);
+  TEST_CHECK_EQ(response->body_len, plain_len + TEST_STANDIN_PAD +
+                                        strlen(",\"pad\":\"\""));
+
+  // Closed without a response, and `times` limits any fault
+  TEST_CHECK(test_standin_request(port, "POST", "/api/echo?close=1", offer,
+                                  response));
+  TEST_CHECK_EQ(response->len, 0);
+  for (int i = 0; i < 2; i++) {
+    TEST_CHECK(test_standin_request(port, "POST", "/api/echo?close=1&times=1",
+                                    offer, response));
+    TEST_CHECK_EQ(response->status, i < 1 ? 0 : 200);
+  }
+
+  TEST_CHECK(test_standin_request(port, "POST", "/api/echo?delay_ms=300",
+                                  offer, response));
+  TEST_CHECK_EQ(response->status, 200);
+  TEST_CHECK(response->elapsed_ms >= TEST_STANDIN_DELAY_MS);
+}
+
+void test_standin() {
+  test_standin_response_t response;
+  response.data = (char *)malloc(TEST_STANDIN_RESPONSE_SIZE);
+  if (!TEST_CHECK(response.data != NULL)) {
+    return;
+  }
+  uint16_t port = pipecat_standin_start(0);
+  if (!TEST_CHECK(port != 0)) {
+    free(response.data);
+    return;
+  }
+
+  test_standin_faults(port, &response);
+
+  // A client that never finishes its request doesn't hold up another
+  int stalled = test_standin_connect(port);
+  TEST_CHECK(stalled >= 0);
+  send(stalled, "POST /api/echo HTTP/1.1\r\n", 25, MSG_NOSIGNAL);
+  TEST_CHECK(test_standin_request(port, "POST", "/api/echo",
+                                  TEST_STANDIN_OFFER_BODY, &response));
+  TEST_CHECK_EQ(response.status, 200);
+  printf("  answered in %lums beside a stalled client\n",
+         (unsigned long)response.elapsed_ms);
+  TEST_CHECK(response.elapsed_ms < TEST_STANDIN_DELAY_MS);
+  if (stalled >= 0) {
+    close(stalled);
+  }
+
+  // Stopped means refused, and it starts again on the same port
+  pipecat_standin_stop();
+  TEST_CHECK_EQ(test_standin_connect(port), -1);
+  TEST_CHECK_EQ(pipecat_standin_start(port), port);
+  TEST_CHECK(test_standin_request(port, "POST", "/api/echo?status=503&times=2",
+                                  TEST_STANDIN_OFFER_BODY, &response));
+  TEST_CHECK_EQ(response.status, 503);
+  pipecat_standin_stop();
+  free(response.data);
+}
@@ -0,0 +1,237 @@
+#include <esp_timer.h>
+#include <peer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+
+// The file-backed store under a PIPECAT_CACHE_DIR of its own: the boot
+// counter across restarts, hits, misses on a tag, size or version that
+// doesn't match, expiry after max_boots, invalidation, and entries that are
+// truncated or larger than any value. Ends by timing
+// peer_connection_create(), the DTLS identity libpeer generates each time
+// and that the cache can't keep.
+#define TEST_WARM_CACHE_KEY "test"
+#define TEST_WARM_CACHE_MAX_BOOTS 3
+#define TEST_WARM_CACHE_CREATES 5
+
+typedef struct {
+  uint32_t magic;
+  uint8_t data[100];
+} test_warm_cache_value_t;
+
+static char test_warm_cache_dir[64];
+
+static void test_warm_cache_path(const char *key, char *path, size_t len) {
+  snprintf(path, len, "%s/%s", test_warm_cache_dir, key);
+}
+
+static long test_warm_cache_file_size(const char *key) {
+  char path[128];
+  test_warm_cache_path(key, path, sizeof(path));
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fclose(file);
+  return size;
+}
+
+// The entry's first `size` bytes, then `extra` bytes of padding
+static void test_warm_cache_rewrite(const char *key, long size, long extra) {
+  char path[128];
+  test_warm_cache_path(key, path, sizeof(path));
+  uint8_t entry[2 * WARM_CACHE_MAX_SIZE] = {};
+  FILE *file = fopen(path, "rb");
+  if (!TEST_CHECK(file != NULL)) {
+    return;
+  }
+  size_t read = fread(entry, 1, sizeof(entry), file);
+  fclose(file);
+  TEST_CHECK((size_t)(size + extra) <= sizeof(entry));
+  TEST_CHECK((size_t)size <= read);
+  file = fopen(path, "wb");
+  if (TEST_CHECK(file != NULL)) {
+    fwrite(entry, 1, size + extra, file);
+    fclose(file);
+  }
+}
+
+static bool test_warm_cache_load(uint32_t tag, test_warm_cache_value_t *value) {
+  memset(value, 0, sizeof(*value));
+  return warm_cache_load(TEST_WARM_CACHE_KEY, tag, TEST_WARM_CACHE_MAX_BOOTS,
+                         value, sizeof(*value));
+}
+
+static void test_warm_cache_store(uint32_t tag,
+                                  const test_warm_cache_value_t *value) {
+  warm_cache_store(TEST_WARM_CACHE_KEY, tag, value, sizeof(*value));
+}
+
+static void test_warm_cache_entries() {
+  uint32_t tag = warm_cache_tag("ssid\npassword");
+  TEST_CHECK(tag != warm_cache_tag("ssid\nother"));
+  test_warm_cache_value_t value, loaded;
+  memset(&value, 0xa5, sizeof(value));
+  value.magic = 0x12345678;
+
+  // Nothing stored yet, then a hit with the same bytes
+  TEST_CHECK(!test_warm_cache_load(tag, &loaded));
+  test_warm_cache_store(tag, &value);
+  long entry_size = test_warm_cache_file_size(TEST_WARM_CACHE_KEY);
+  TEST_CHECK(entry_size > (long)sizeof(value));
+  TEST_CHECK(test_warm_cache_load(tag, &loaded));
+  TEST_CHECK(memcmp(&loaded, &value, sizeof(value)) == 0);
+
+  // Another tag or size misses and leaves the entry alone
+  TEST_CHECK(!test_warm_cache_load(tag + 1, &loaded));
+  uint32_t magic;
+  TEST_CHECK(!warm_cache_load(TEST_WARM_CACHE_KEY, tag,
+                              TEST_WARM_CACHE_MAX_BOOTS, &magic,
+                              sizeof(magic)));
+  TEST_CHECK(test_warm_cache_load(tag, &loaded));
+
+  // Valid for max_boots boots after the one that wrote it, then erased
+  for (int boot = 0; boot < TEST_WARM_CACHE_MAX_BOOTS; boot++) {
+    pipecat_init_warm_cache();
+    TEST_CHECK(test_warm_cache_load(tag, &loaded));
+  }
+  pipecat_init_warm_cache();
+  TEST_CHECK(!test_warm_cache_load(tag, &loaded));
+  TEST_CHECK_EQ(test_warm_cache_file_size(TEST_WARM_CACHE_KEY), -1);
+
+  // Invalidated
+  test_warm_cache_store(tag, &value);
+  warm_cache_invalidate(TEST_WARM_CACHE_KEY);
+  TEST_CHECK(!test_warm_cache_load(tag, &loaded));
+  TEST_CHECK_EQ(test_warm_cache_file_size(TEST_WARM_CACHE_KEY), -1);
+
+  // Cut short anywhere, or with bytes after the value
+  const long cuts[] = {0, 1, entry_size - (long)sizeof(value), entry_size - 1};
+  for (long cut : cuts) {
+    test_warm_cache_store(tag, &value);
+    test_warm_cache_rewrite(TEST_WARM_CACHE_KEY, cut, 0);
+    TEST_CHECK(!test_warm_cache_load(tag, &loaded));
+  }
+  test_warm_cache_store(tag, &value);
+  test_warm_cache_rewrite(TEST_WARM_CACHE_KEY, entry_size, 1);
+  TEST_CHECK(!test_warm_cache_load(tag, &loaded));
+
+  // Another format version: the header starts with it
+  char path[128];
+  test_warm_cache_path(TEST_WARM_CACHE_KEY, path, sizeof(path));
+  test_warm_cache_store(tag, &value);
+  FILE *file = fopen(path, "r+b");
+  if (TEST_CHECK(file != NULL)) {
+    uint16_t version = WARM_CACHE_VERSION + 1;
+    fwrite(&version, 1, sizeof(version), file);
+    fclose(file);
+  }
+  TEST_CHECK(!test_warm_cache_load(tag, &loaded));
+
+  // The largest value, and a file longer than any entry whose first bytes
+  // are one
+  static uint8_t largest[WARM_CACHE_MAX_SIZE];
+  static uint8_t largest_loaded[WARM_CACHE_MAX_SIZE];
+  memset(largest, 0x3c, sizeof(largest));
+  warm_cache_store(TEST_WARM_CACHE_KEY, tag, largest, sizeof(largest));
+  TEST_CHECK(warm_cache_load(TEST_WARM_CACHE_KEY, tag,
+                             TEST_WARM_CACHE_MAX_BOOTS, largest_loaded,
+                             sizeof(largest_loaded)));
+  long largest_size = test_warm_cache_file_size(TEST_WARM_CACHE_KEY);
+  test_warm_cache_rewrite(TEST_WARM_CACHE_KEY, largest_size, 16);
+  TEST_CHECK(!warm_cache_load(TEST_WARM_CACHE_KEY, tag,
+                              TEST_WARM_CACHE_MAX_BOOTS, largest_loaded,
+                              sizeof(largest_loaded)));
+
+  // Too large to store at all
+  static uint8_t oversized[WARM_CACHE_MAX_SIZE + 1];
+  warm_cache_invalidate(TEST_WARM_CACHE_KEY);
+  warm_cache_store(TEST_WARM_CACHE_KEY, tag, oversized, sizeof(oversized));
+  TEST_CHECK_EQ(test_warm_cache_file_size(TEST_WARM_CACHE_KEY), -1);
+  warm_cache_invalidate(TEST_WARM_CACHE_KEY);
+}
+
+// A missing or damaged counter starts again from the first boot
+static void test_warm_cache_boots() {
+  uint32_t boots = 0;
+  FILE *file;
+  char path[128];
+  test_warm_cache_path("boots", path, sizeof(path));
+  remove(path);
+  for (uint32_t expected = 1; expected <= 3; expected++) {
+    pipecat_init_warm_cache();
+    file = fopen(path, "rb");
+    if (!TEST_CHECK(file != NULL)) {
+      return;
+    }
+    TEST_CHECK_EQ(fread(&boots, 1, sizeof(boots), file), sizeof(boots));
+    fclose(file);
+    TEST_CHECK_EQ(boots, expected);
+  }
+
+  test_warm_cache_rewrite("boots", 2, 0);
+  pipecat_init_warm_cache();
+  file = fopen(path, "rb");
+  if (TEST_CHECK(file != NULL)) {
+    TEST_CHECK_EQ(fread(&boots, 1, sizeof(boots), file), sizeof(boots));
+    fclose(file);
+    TEST_CHECK_EQ(boots, 1);
+  }
+}
+
+// What the cache would save if libpeer let it keep the identity
+static void test_warm_cache_peer_connection() {
+  PeerConfiguration config = {
+      .ice_servers = {},
+      .audio_codec = CODEC_OPUS,
+      .video_codec = CODEC_NONE,
+      .datachannel = DATA_CHANNEL_STRING,
+      .onaudiotrack = NULL,
+      .onvideotrack = NULL,
+      .on_request_keyframe = NULL,
+      .user_data = NULL,
+  };
+  int64_t total_us = 0, worst_us = 0;
+  for (int i = 0; i < TEST_WARM_CACHE_CREATES; i++) {
+    int64_t start_us = esp_timer_get_time();
+    PeerConnection *connection = peer_connection_create(&config);
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    if (!TEST_CHECK(connection != NULL)) {
+      return;
+    }
+    peer_connection_destroy(connection);
+    total_us += elapsed_us;
+    worst_us = elapsed_us > worst_us ? elapsed_us : worst_us;
+  }
+  printf("  peer_connection_create(): %.2fms average, %.2fms worst of %d\n",
+         total_us / 1000.0 / TEST_WARM_CACHE_CREATES, worst_us / 1000.0,
+         TEST_WARM_CACHE_CREATES);
+}
+
+void test_warm_cache() {
+  snprintf(test_warm_cache_dir, sizeof(test_warm_cache_dir),
+           "/tmp/pipecat-cache-%d", (int)getpid());
+  const char *previous = getenv("PIPECAT_CACHE_DIR");
+  char *saved = previous != NULL ? strdup(previous) : NULL;
+  setenv("PIPECAT_CACHE_DIR", test_warm_cache_dir, 1);
+
+  test_warm_cache_boots();
+  test_warm_cache_entries();
+  test_warm_cache_peer_connection();
+
+  char path[128];
+  test_warm_cache_path("boots", path, sizeof(path));
+  remove(path);
+  rmdir(test_warm_cache_dir);
+  if (saved != NULL) {
+    setenv("PIPECAT_CACHE_DIR", saved, 1);
+    free(saved);
+  } else {
+    unsetenv("PIPECAT_CACHE_DIR");
+  }
+}
@@ -0,0 +1,239 @@
+#include <esp_timer.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+// A client session against the stand-in over a real libpeer connection,
+// looped the way loadgen's tasks loop it. The stand-in drops
+// TEST_WEBRTC_LOSS_PERCENT of its RTP through its relay, after libpeer has
+// numbered it, and the client's jitter buffer should count about that much
+// lost. With audio flowing, the session is looped a turn cycle with the
+// fixed TICK_INTERVAL sleep the main loops used to take and one with
+// pipecat_webrtc_wait(), for wakeups and how long packets can have waited
+// for the loop. Then the stand-in is killed and restarted on the same port,
+// and the session reconnects in place once it notices; a second time with
+// PIPECAT_SIGNALLING_INLINE, to compare the time to connected with the
+// exchange blocking the loop. Last, the stand-in goes away for good and the
+// session has to notice again, so none of its tasks keeps publishing into
+// the tests that follow.
+#define TEST_WEBRTC_LOSS_PERCENT 10
+#define TEST_WEBRTC_LOSS_TOLERANCE 6  // Percentage points either way
+// A turn's worth at 20ms frames, about 2.1 points of binomial spread
+#define TEST_WEBRTC_FRAMES 200
+#define TEST_WEBRTC_SEED "7"
+#define TEST_WEBRTC_CONNECT_MS 15000
+// Past STANDIN_TURN_GAP_MS and a whole STANDIN_TURN_MS turn
+#define TEST_WEBRTC_AUDIO_MS 15000
+#define TEST_WEBRTC_DROP_MS 30000
+// Each loop variant gets the same mix of speech and gap
+#define TEST_WEBRTC_LOOP_MS (STANDIN_TURN_MS + STANDIN_TURN_GAP_MS)
+// From noticing the drop to connected again, RECONNECT_INITIAL_BACKOFF_MS
+// included
+#define TEST_WEBRTC_RECOVERY_MS 1000
+
+static char test_webrtc_url[64];
+static std::atomic<uint32_t> test_webrtc_bot_ready(0);
+static std::atomic<uint32_t> test_webrtc_tts_text(0);
+
+static void test_webrtc_on_rtvi(pipecat_session_t *session,
+                                const rtvi_message_t *msg, void *user_data) {
+  if (session != user_data) {
+    return;
+  }
+  if (msg->event == RTVI_EVENT_BOT_READY) {
+    test_webrtc_bot_ready++;
+  } else if (msg->event == RTVI_EVENT_BOT_TTS_TEXT) {
+    test_webrtc_tts_text++;
+  }
+}
+
+// Loops the session until `done` or `timeout_ms`, true for `done`
+static bool test_webrtc_run(pipecat_session_t *session, uint32_t timeout_ms,
+                            bool (*done)(pipecat_session_t *session)) {
+  int64_t deadline_us = esp_timer_get_time() + timeout_ms * 1000LL;
+  while (esp_timer_get_time() < deadline_us) {
+    pipecat_webrtc_loop(session);
+    if (done(session)) {
+      return true;
+    }
+    pipecat_webrtc_wait(session);
+  }
+  return false;
+}
+
+static bool test_webrtc_connected(pipecat_session_t *session) {
+  return pipecat_webrtc_state(session) == PIPECAT_SESSION_CONNECTED;
+}
+
+static bool test_webrtc_dropped(pipecat_session_t *session) {
+  return pipecat_webrtc_state(session) != PIPECAT_SESSION_CONNECTED;
+}
+
+static bool test_webrtc_ready(pipecat_session_t *session) {
+  return test_webrtc_bot_ready > 0;
+}
+
+static bool test_webrtc_audio_done(pipecat_session_t *session) {
+  audio_playback_stats_t stats;
+  pipecat_audio_playback_stats(session, &stats);
+  return stats.played + stats.lost >= TEST_WEBRTC_FRAMES;
+}
+
+typedef struct {
+  float wakeups_per_second;
+  uint32_t packets;
+  uint64_t rx_wait_us;  // Mean per packet
+} test_webrtc_loop_t;
+
+// Loops the session for TEST_WEBRTC_LOOP_MS, sleeping TICK_INTERVAL between
+// polls when `tick`, as the main loops did before pipecat_webrtc_wait()
+static void test_webrtc_measure_loop(pipecat_session_t *session, bool tick,
+                                     test_webrtc_loop_t *result) {
+  webrtc_loop_stats_t before, after;
+  pipecat_webrtc_loop_stats(session, &before);
+  int64_t end_us = esp_timer_get_time() + TEST_WEBRTC_LOOP_MS * 1000LL;
+  while (esp_timer_get_time() < end_us) {
+    pipecat_webrtc_loop(session);
+    if (tick) {
+      vTaskDelay(pdMS_TO_TICKS(TICK_INTERVAL));
+    } else {
+      pipecat_webrtc_wait(session);
+    }
+  }
+  pipecat_webrtc_loop_stats(session, &after);
+
+  result->wakeups_per_second =
+      (after.iterations - before.iterations) * 1000.0f / TEST_WEBRTC_LOOP_MS;
+  result->packets = after.packets - before.packets;
+  result->rx_wait_us = result->packets > 0
+                           ? (after.rx_wait_us - before.rx_wait_us) /
+                                 result->packets
+                           : 0;
+  printf("  %s: %.0f wakeups/s, %lu packets waited up to %lluus on average\n",
+         tick ? "15ms tick" : "pipecat_webrtc_wait()",
+         result->wakeups_per_second, (unsigned long)result->packets,
+         (unsigned long long)result->rx_wait_us);
+}
+
+// Kills the stand-in and brings it straight back; the session only finds
+// out from libpeer. Returns the time from noticing to connected with the
+// bot ready again, -1 if the session didn't get there.
+static int64_t test_webrtc_restart(pipecat_session_t *session, uint16_t port,
+                                   const char *label) {
+  test_webrtc_bot_ready = 0;
+  pipecat_standin_stop();
+  int64_t killed_us = esp_timer_get_time();
+  if (!TEST_CHECK_EQ(pipecat_standin_start(port), port) ||
+      !TEST_CHECK(test_webrtc_run(session, TEST_WEBRTC_DROP_MS,
+                                  test_webrtc_dropped))) {
+    return -1;
+  }
+  int64_t dropped_us = esp_timer_get_time();
+  if (!TEST_CHECK(test_webrtc_run(session, TEST_WEBRTC_CONNECT_MS,
+                                  test_webrtc_connected))) {
+    return -1;
+  }
+  int64_t recovered_us = esp_timer_get_time();
+  TEST_CHECK(
+      test_webrtc_run(session, TEST_WEBRTC_CONNECT_MS, test_webrtc_ready));
+  printf("  %s: dropped after %lldms, connected again %lldms later\n", label,
+         (long long)((dropped_us - killed_us) / 1000),
+         (long long)((recovered_us - dropped_us) / 1000));
+  return (recovered_us - dropped_us) / 1000;
+}
+
+void test_webrtc() {
+  void *device = audio_device_wav_create(NULL, NULL, true, false);
+  pipecat_session_t *session =
+      device != NULL ? test_session_create(&pipecat_audio_device, device)
+                     : NULL;
+  if (!TEST_CHECK(session != NULL)) {
+    return;
+  }
+
+  char loss[8];
+  snprintf(loss, sizeof(loss), "%d", TEST_WEBRTC_LOSS_PERCENT);
+  setenv("PIPECAT_STANDIN_LOSS", loss, 1);
+  setenv("PIPECAT_STANDIN_SEED", TEST_WEBRTC_SEED, 1);
+  uint16_t port = pipecat_standin_start(0);
+  unsetenv("PIPECAT_STANDIN_LOSS");
+  unsetenv("PIPECAT_STANDIN_SEED");
+  if (!TEST_CHECK(port != 0)) {
+    return;
+  }
+  snprintf(test_webrtc_url, sizeof(test_webrtc_url),
+           "http://127.0.0.1:%u/api/offer", (unsigned)port);
+  session->config.url = test_webrtc_url;
+
+  TEST_CHECK(pipecat_rtvi_subscribe(RTVI_EVENT_BOT_READY, test_webrtc_on_rtvi,
+                                    session));
+  TEST_CHECK(pipecat_rtvi_subscribe(RTVI_EVENT_BOT_TTS_TEXT,
+                                    test_webrtc_on_rtvi, session));
+  pipecat_init_audio_capture(session);
+  pipecat_init_audio_decoder(session);
+  pipecat_init_audio_encoder(session);
+  pipecat_init_webrtc(session);
+
+  int64_t start_us = esp_timer_get_time();
+  if (!TEST_CHECK(test_webrtc_run(session, TEST_WEBRTC_CONNECT_MS,
+                                  test_webrtc_connected))) {
+    pipecat_standin_stop();
+    return;
+  }
+  int64_t connected_us = esp_timer_get_time();
+  printf("  connected in %lldms\n",
+         (long long)((connected_us - start_us) / 1000));
+
+  // The first turn, through the relay
+  TEST_CHECK(test_webrtc_run(session, TEST_WEBRTC_AUDIO_MS,
+                             test_webrtc_audio_done));
+  audio_playback_stats_t stats;
+  pipecat_audio_playback_stats(session, &stats);
+  uint32_t frames = stats.played + stats.lost;
+  float lost_percent = frames > 0 ? 100.0f * stats.lost / frames : 0;
+  printf("  bot-ready %lu, bot-tts-text %lu, %lu of %lu frames lost "
+         "(%.1f%%, %d%% dropped at the stand-in)\n",
+         (unsigned long)test_webrtc_bot_ready.load(),
+         (unsigned long)test_webrtc_tts_text.load(),
+         (unsigned long)stats.lost, (unsigned long)frames, lost_percent,
+         TEST_WEBRTC_LOSS_PERCENT);
+  TEST_CHECK_EQ(test_webrtc_bot_ready.load(), 1);
+  TEST_CHECK(test_webrtc_tts_text.load() > 0);
+  TEST_CHECK(frames >= TEST_WEBRTC_FRAMES);
+  TEST_CHECK_EQ(stats.decode_errors, 0);
+  TEST_CHECK(fabsf(lost_percent - TEST_WEBRTC_LOSS_PERCENT) <=
+             TEST_WEBRTC_LOSS_TOLERANCE);
+
+  test_webrtc_loop_t tick, wait;
+  test_webrtc_measure_loop(session, true, &tick);
+  test_webrtc_measure_loop(session, false, &wait);
+  TEST_CHECK(tick.packets > 0 && wait.packets > 0);
+  TEST_CHECK(wait.rx_wait_us < tick.rx_wait_us);
+
+  int64_t task_ms = test_webrtc_restart(session, port, "killed and restarted");
+  TEST_CHECK(task_ms >= 0 && task_ms < TEST_WEBRTC_RECOVERY_MS);
+
+  // The same with the exchange blocking the loop, as it did before the
+  // signalling task
+  setenv("PIPECAT_SIGNALLING_INLINE", "1", 1);
+  int64_t inline_ms = test_webrtc_restart(session, port, "inline signalling");
+  unsetenv("PIPECAT_SIGNALLING_INLINE");
+  TEST_CHECK(inline_ms >= 0);
+  printf("  reconnected in %lldms with the signalling task, %lldms inline\n",
+         (long long)task_ms, (long long)inline_ms);
+
+  // Gone for good, the session stays idle once nothing loops it
+  pipecat_standin_stop();
+  int64_t stopped_us = esp_timer_get_time();
+  TEST_CHECK(
+      test_webrtc_run(session, TEST_WEBRTC_DROP_MS, test_webrtc_dropped));
+  printf("  dropped %lldms after the stand-in stopped\n",
+         (long long)((esp_timer_get_time() - stopped_us) / 1000));
+}
@@ -0,0 +1,178 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "main.h"
+
+static_assert((TLOG_RING_SIZE & (TLOG_RING_SIZE - 1)) == 0,
+              "TLOG_RING_SIZE must be a power of two");
+static_assert(sizeof(tlog_record_t) == 20, "tlog_record_t is a wire format");
+
+// A slot is free for the writer at position p when its sequence is p, and
+// holds a published record for the reader when its sequence is p + 1.
+// Sequences are stored minus the slot index, so the zeroed rings are ready
+// before pipecat_init_tlog() runs.
+typedef struct {
+  std::atomic<uint32_t> sequence;
+  tlog_record_t record;
+} tlog_slot_t;
+
+typedef struct {
+  std::atomic<uint32_t> head;  // Next position to reserve, any writer
+  uint32_t tail;               // Next position to drain, drain task only
+  std::atomic<uint32_t> dropped;
+  tlog_slot_t slots[TLOG_RING_SIZE];
+} tlog_ring_t;
+
+typedef struct {
+  esp_log_level_t level;
+  const char *format;
+} tlog_format_t;
+
+static const tlog_format_t tlog_formats[] = {
+#define TLOG_FORMAT_ENTRY(id, level, format) {level, format},
+    TLOG_FORMATS(TLOG_FORMAT_ENTRY)
+#undef TLOG_FORMAT_ENTRY
+};
+
+static_assert(sizeof(tlog_formats) / sizeof(tlog_formats[0]) == TLOG_ID_COUNT,
+              "tlog_formats out of sync with tlog_id_t");
+
+static tlog_ring_t tlog_rings[TLOG_CORES];
+static std::atomic<uint32_t> tlog_drained(0);
+static std::atomic<uint32_t> tlog_dropped(0);
+
+static uint8_t tlog_core() {
+#ifndef LINUX_BUILD
+  return xPortGetCoreID();
+#else
+  return 0;
+#endif
+}
+
+void pipecat_tlog(tlog_id_t id, int32_t arg0, int32_t arg1, int32_t arg2) {
+  uint8_t core = tlog_core();
+  tlog_ring_t *ring = &tlog_rings[core];
+
+  uint32_t position = ring->head.load(std::memory_order_relaxed);
+  tlog_slot_t *slot;
+  uint32_t index;
+  while (1) {
+    index = position & (TLOG_RING_SIZE - 1);
+    slot = &ring->slots[index];
+    int32_t diff = (int32_t)(slot->sequence.load(std::memory_order_acquire) +
+                             index - position);
+    if (diff == 0) {
+      // On failure `position` is reloaded with the current head
+      if (ring->head.compare_exchange_weak(position, position + 1,
+                                           std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Not drained yet
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      position = ring->head.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->record.timestamp_us = (uint32_t)esp_timer_get_time();
+  slot->record.id = id;
+  slot->record.core = core;
+  slot->record.reserved = 0;
+  slot->record.args[0] = arg0;
+  slot->record.args[1] = arg1;
+  slot->record.args[2] = arg2;
+  slot->sequence.store(position + 1 - index, std::memory_order_release);
+}
+
+static void tlog_emit(const tlog_record_t *record) {
+#if TLOG_OUTPUT_BINARY
+  const uint8_t *bytes = (const uint8_t *)record;
+  char line[sizeof(tlog_record_t) * 2 + 8];
+  int offset = snprintf(line, sizeof(line), "TLOG:");
+  for (size_t i = 0; i < sizeof(tlog_record_t); i++) {
+    offset += snprintf(line + offset, sizeof(line) - offset, "%02x", bytes[i]);
+  }
+  printf("%s\n", line);
+#else
+  if (record->id >= TLOG_ID_COUNT) {
+    return;
+  }
+  const tlog_format_t *format = &tlog_formats[record->id];
+  if (format->level > TLOG_TEXT_LEVEL) {
+    return;
+  }
+
+  char message[128];
+  snprintf(message, sizeof(message), format->format, (long)record->args[0],
+           (long)record->args[1], (long)record->args[2]);
+  ESP_LOG_LEVEL(format->level, LOG_TAG, "[%lu.%03lums core %u] %s",
+                (unsigned long)(record->timestamp_us / 1000),
+                (unsigned long)(record->timestamp_us % 1000),
+                (unsigned)record->core, message);
+#endif
+}
+
+static void tlog_drain(uint8_t core) {
+  tlog_ring_t *ring = &tlog_rings[core];
+
+  while (1) {
+    uint32_t index = ring->tail & (TLOG_RING_SIZE - 1);
+    tlog_slot_t *slot = &ring->slots[index];
+    if (slot->sequence.load(std::memory_order_acquire) + index !=
+        ring->tail + 1) {
+      // Empty, or the writer holding this slot hasn't published it yet
+      break;
+    }
+    tlog_record_t record = slot->record;
+    slot->sequence.store(ring->tail + TLOG_RING_SIZE - index,
+                         std::memory_order_release);
+    ring->tail++;
+    tlog_drained.fetch_add(1, std::memory_order_relaxed);
+    tlog_emit(&record);
+  }
+
+  uint32_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+  if (dropped > 0) {
+    tlog_dropped.fetch_add(dropped, std::memory_order_relaxed);
+    tlog_record_t record = {};
+    record.timestamp_us = (uint32_t)esp_timer_get_time();
+    record.id = TLOG_DROPPED;
+    record.core = core;
+    record.args[0] = dropped;
+    record.args[1] = core;
+    tlog_emit(&record);
+  }
+}
+
+static void pipecat_tlog_task(void *user_data) {
+  while (1) {
+    for (uint8_t core = 0; core < TLOG_CORES; core++) {
+      tlog_drain(core);
+    }
+    vTaskDelay(pdMS_TO_TICKS(TLOG_DRAIN_INTERVAL_MS));
+  }
+}
+
+void pipecat_init_tlog() {
+  TaskHandle_t task = NULL;
+  xTaskCreate(pipecat_tlog_task, "tlog", TLOG_TASK_STACK_SIZE, NULL,
+              TLOG_TASK_PRIORITY, &task);
+  pipecat_memory_track_task(task, "tlog", TLOG_TASK_STACK_SIZE);
+}
+
+tlog_stats_t pipecat_tlog_stats() {
+  tlog_stats_t stats;
+  stats.drained = tlog_drained.load(std::memory_order_relaxed);
+  // Includes drops the drain task hasn't collected yet
+  stats.dropped = tlog_dropped.load(std::memory_order_relaxed);
+  for (int core = 0; core < TLOG_CORES; core++) {
+    stats.dropped += tlog_rings[core].dropped.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
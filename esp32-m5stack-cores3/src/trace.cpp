@@ -0,0 +1,163 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <esp_log.h>
+
+#include "main.h"
+
+// Upper bucket edges in microseconds, the last bucket takes everything above
+static const uint32_t trace_bucket_edges_us[TRACE_BUCKETS - 1] = {
+    500,   1000,  2000,   5000,   10000,  20000,
+    40000, 80000, 160000, 320000, 640000,
+};
+
+static const char *trace_stage_names[] = {
+    "mic_read",      "encode",           "send",
+    "uplink",        "rx_wait",          "rtp_interarrival",
+    "jitter_buffer", "decode",           "playback_queue",
+    "speaker_write", "downlink",
+};
+
+static_assert(sizeof(trace_stage_names) / sizeof(trace_stage_names[0]) ==
+                  TRACE_STAGE_COUNT,
+              "trace_stage_names out of sync with trace_stage_t");
+
+typedef struct {
+  std::atomic<uint32_t> buckets[TRACE_BUCKETS];
+  std::atomic<uint64_t> sum_us;
+  std::atomic<uint32_t> max_us;
+} trace_histogram_t;
+
+static trace_histogram_t trace_histograms[TRACE_STAGE_COUNT];
+
+static int trace_bucket(uint32_t elapsed_us) {
+  int bucket = 0;
+  while (bucket < TRACE_BUCKETS - 1 &&
+         elapsed_us > trace_bucket_edges_us[bucket]) {
+    bucket++;
+  }
+  return bucket;
+}
+
+void pipecat_trace_record(trace_stage_t stage, int64_t start_us,
+                          int64_t end_us) {
+  if (stage >= TRACE_STAGE_COUNT || start_us <= 0 || end_us < start_us) {
+    return;
+  }
+
+  uint32_t elapsed_us = end_us - start_us > UINT32_MAX
+                            ? UINT32_MAX
+                            : (uint32_t)(end_us - start_us);
+  trace_histogram_t *histogram = &trace_histograms[stage];
+  histogram->buckets[trace_bucket(elapsed_us)].fetch_add(
+      1, std::memory_order_relaxed);
+  histogram->sum_us.fetch_add(elapsed_us, std::memory_order_relaxed);
+
+  // Each stage is only recorded from one task, so no CAS loop is needed
+  if (elapsed_us > histogram->max_us.load(std::memory_order_relaxed)) {
+    histogram->max_us.store(elapsed_us, std::memory_order_relaxed);
+  }
+}
+
+void pipecat_trace_reset() {
+  for (int stage = 0; stage < TRACE_STAGE_COUNT; stage++) {
+    trace_histogram_t *histogram = &trace_histograms[stage];
+    for (int bucket = 0; bucket < TRACE_BUCKETS; bucket++) {
+      histogram->buckets[bucket].store(0, std::memory_order_relaxed);
+    }
+    histogram->sum_us.store(0, std::memory_order_relaxed);
+    histogram->max_us.store(0, std::memory_order_relaxed);
+  }
+}
+
+static uint32_t trace_count(const trace_histogram_t *histogram) {
+  uint32_t count = 0;
+  for (int bucket = 0; bucket < TRACE_BUCKETS; bucket++) {
+    count += histogram->buckets[bucket].load(std::memory_order_relaxed);
+  }
+  return count;
+}
+
+// Appends to buffer[*offset], returns false once the buffer is full
+static bool trace_append(char *buffer, size_t len, size_t *offset,
+                         const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static bool trace_append(char *buffer, size_t len, size_t *offset,
+                         const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(buffer + *offset, len - *offset, format, args);
+  va_end(args);
+  if (written < 0 || (size_t)written >= len - *offset) {
+    return false;
+  }
+  *offset += written;
+  return true;
+}
+
+// {"edges_us":[...],"stages":{"mic_read":{"n":..,"sum_us":..,"max_us":..,
+// "buckets":[...]},...}}
+size_t pipecat_trace_to_json(char *buffer, size_t len) {
+  size_t offset = 0;
+  bool ok = len > 0 && trace_append(buffer, len, &offset, "{\"edges_us\":[");
+  for (int bucket = 0; ok && bucket < TRACE_BUCKETS - 1; bucket++) {
+    ok = trace_append(buffer, len, &offset, "%s%lu", bucket ? "," : "",
+                      (unsigned long)trace_bucket_edges_us[bucket]);
+  }
+  ok = ok && trace_append(buffer, len, &offset, "],\"stages\":{");
+
+  for (int stage = 0; ok && stage < TRACE_STAGE_COUNT; stage++) {
+    const trace_histogram_t *histogram = &trace_histograms[stage];
+    ok = trace_append(
+        buffer, len, &offset,
+        "%s\"%s\":{\"n\":%lu,\"sum_us\":%llu,\"max_us\":%lu,\"buckets\":[",
+        stage ? "," : "", trace_stage_names[stage],
+        (unsigned long)trace_count(histogram),
+        (unsigned long long)histogram->sum_us.load(std::memory_order_relaxed),
+        (unsigned long)histogram->max_us.load(std::memory_order_relaxed));
+    for (int bucket = 0; ok && bucket < TRACE_BUCKETS; bucket++) {
+      ok = trace_append(
+          buffer, len, &offset, "%s%lu", bucket ? "," : "",
+          (unsigned long)histogram->buckets[bucket].load(
+              std::memory_order_relaxed));
+    }
+    ok = ok && trace_append(buffer, len, &offset, "]}");
+  }
+
+  ok = ok && trace_append(buffer, len, &offset, "}}");
+  if (!ok) {
+    if (len > 0) {
+      buffer[0] = '\0';
+    }
+    return 0;
+  }
+  return offset;
+}
+
+void pipecat_trace_dump() {
+  ESP_LOGI(LOG_TAG, "Latency trace (bucket upper edges in ms: 0.5 1 2 5 10 "
+                    "20 40 80 160 320 640 inf)");
+  for (int stage = 0; stage < TRACE_STAGE_COUNT; stage++) {
+    const trace_histogram_t *histogram = &trace_histograms[stage];
+    uint32_t count = trace_count(histogram);
+    if (count == 0) {
+      continue;
+    }
+
+    char buckets[TRACE_BUCKETS * 11 + 1];
+    size_t offset = 0;
+    for (int bucket = 0; bucket < TRACE_BUCKETS; bucket++) {
+      trace_append(buckets, sizeof(buckets), &offset, " %lu",
+                   (unsigned long)histogram->buckets[bucket].load(
+                       std::memory_order_relaxed));
+    }
+
+    uint64_t sum_us = histogram->sum_us.load(std::memory_order_relaxed);
+    ESP_LOGI(LOG_TAG, "  %-16s n=%-7lu avg=%6.2fms max=%7.2fms |%s",
+             trace_stage_names[stage], (unsigned long)count,
+             sum_us / 1000.0 / count,
+             histogram->max_us.load(std::memory_order_relaxed) / 1000.0,
+             buckets);
+  }
+}
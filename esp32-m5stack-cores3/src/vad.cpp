@@ -0,0 +1,55 @@
+#include <math.h>
+
+#include "main.h"
+
+// The floor drops quickly to quieter frames and creeps up slowly, so speech
+// barely moves it within an utterance but a louder room is still picked up.
+#define VAD_NOISE_FLOOR_DOWN 0.5f
+#define VAD_NOISE_FLOOR_UP 0.0005f
+#define VAD_INITIAL_NOISE_FLOOR_DB -70.0f
+
+void vad_init(vad_t *vad, uint32_t frame_ms) {
+  vad->noise_floor_db = VAD_INITIAL_NOISE_FLOOR_DB;
+  vad->hangover_frames = 0;
+  vad->silent_frames = 0;
+  vad->hangover_limit = VAD_HANGOVER_MS / frame_ms;
+  vad->keepalive_interval = VAD_KEEPALIVE_MS / frame_ms;
+  vad->speech = false;
+}
+
+static float vad_frame_db(const int16_t *samples, size_t count) {
+  uint64_t sum_squares = 0;
+  for (size_t i = 0; i < count; i++) {
+    sum_squares += (uint32_t)(samples[i] * samples[i]);
+  }
+  float power = (float)sum_squares / (count * 32768.0f * 32768.0f);
+  return 10.0f * log10f(power + 1e-10f);
+}
+
+bool vad_process(vad_t *vad, const int16_t *samples, size_t count) {
+  float level_db = vad_frame_db(samples, count);
+
+  vad->speech = level_db > vad->noise_floor_db + VAD_THRESHOLD_DB &&
+                level_db > VAD_MIN_SPEECH_DB;
+
+  if (level_db < vad->noise_floor_db) {
+    vad->noise_floor_db +=
+        (level_db - vad->noise_floor_db) * VAD_NOISE_FLOOR_DOWN;
+  } else {
+    vad->noise_floor_db +=
+        (level_db - vad->noise_floor_db) * VAD_NOISE_FLOOR_UP;
+  }
+
+  if (vad->speech) {
+    vad->hangover_frames = vad->hangover_limit;
+    vad->silent_frames = 0;
+    return true;
+  }
+
+  if (vad->hangover_frames > 0) {
+    vad->hangover_frames--;
+    return true;
+  }
+
+  return vad->silent_frames++ % vad->keepalive_interval == 0;
+}
@@ -0,0 +1,172 @@
+#include <esp_log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef LINUX_BUILD
+#include <nvs.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "main.h"
+
+#define WARM_CACHE_BOOTS_KEY "boots"
+
+typedef struct {
+  uint16_t version;
+  uint16_t size;
+  uint32_t tag;
+  uint32_t boot;  // Boot counter when written
+} warm_cache_header_t;
+
+static uint32_t warm_cache_boot = 0;
+
+// Backend: a blob per key, NVS on the device, a file on Linux
+
+#ifndef LINUX_BUILD
+static bool warm_cache_read(const char *key, void *data, size_t *size) {
+  nvs_handle_t handle;
+  if (nvs_open(WARM_CACHE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return false;
+  }
+  esp_err_t err = nvs_get_blob(handle, key, data, size);
+  nvs_close(handle);
+  return err == ESP_OK;
+}
+
+static void warm_cache_write(const char *key, const void *data, size_t size) {
+  nvs_handle_t handle;
+  if (nvs_open(WARM_CACHE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Unable to open the warm cache");
+    return;
+  }
+  if (nvs_set_blob(handle, key, data, size) != ESP_OK ||
+      nvs_commit(handle) != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Unable to store %s in the warm cache", key);
+  }
+  nvs_close(handle);
+}
+
+static void warm_cache_erase(const char *key) {
+  nvs_handle_t handle;
+  if (nvs_open(WARM_CACHE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+  nvs_erase_key(handle, key);
+  nvs_commit(handle);
+  nvs_close(handle);
+}
+#else
+static void warm_cache_path(const char *key, char *path, size_t len) {
+  const char *dir = getenv("PIPECAT_CACHE_DIR");
+  snprintf(path, len, "%s/%s", dir != NULL ? dir : WARM_CACHE_DIR, key);
+}
+
+static bool warm_cache_read(const char *key, void *data, size_t *size) {
+  char path[256];
+  warm_cache_path(key, path, sizeof(path));
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return false;
+  }
+  // Larger than the buffer is refused, as nvs_get_blob() does
+  *size = fread(data, 1, *size, file);
+  bool whole = fgetc(file) == EOF;
+  fclose(file);
+  return whole;
+}
+
+// Written to a temporary file and renamed, so a crash never leaves half an
+// entry behind
+static void warm_cache_write(const char *key, const void *data, size_t size) {
+  char path[256];
+  char temporary[264];
+  warm_cache_path("", path, sizeof(path));
+  mkdir(path, 0755);
+  warm_cache_path(key, path, sizeof(path));
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+  FILE *file = fopen(temporary, "wb");
+  bool ok = file != NULL && fwrite(data, 1, size, file) == size;
+  if (file != NULL) {
+    ok = fclose(file) == 0 && ok;
+  }
+  if (!ok || rename(temporary, path) != 0) {
+    ESP_LOGW(LOG_TAG, "Unable to store %s in the warm cache", key);
+    remove(temporary);
+  }
+}
+
+static void warm_cache_erase(const char *key) {
+  char path[256];
+  warm_cache_path(key, path, sizeof(path));
+  remove(path);
+}
+#endif
+
+void pipecat_init_warm_cache() {
+  size_t size = sizeof(warm_cache_boot);
+  if (!warm_cache_read(WARM_CACHE_BOOTS_KEY, &warm_cache_boot, &size) ||
+      size != sizeof(warm_cache_boot)) {
+    warm_cache_boot = 0;
+  }
+  warm_cache_boot++;
+  warm_cache_write(WARM_CACHE_BOOTS_KEY, &warm_cache_boot,
+                   sizeof(warm_cache_boot));
+}
+
+bool warm_cache_load(const char *key, uint32_t tag, uint32_t max_boots,
+                     void *value, size_t size) {
+  uint8_t entry[sizeof(warm_cache_header_t) + WARM_CACHE_MAX_SIZE];
+  size_t entry_size = sizeof(entry);
+  if (size > WARM_CACHE_MAX_SIZE ||
+      !warm_cache_read(key, entry, &entry_size) ||
+      entry_size != sizeof(warm_cache_header_t) + size) {
+    return false;
+  }
+
+  warm_cache_header_t header;
+  memcpy(&header, entry, sizeof(header));
+  if (header.version != WARM_CACHE_VERSION || header.size != size ||
+      header.tag != tag) {
+    return false;
+  }
+  if (warm_cache_boot - header.boot > max_boots) {
+    ESP_LOGI(LOG_TAG, "Warm cache entry %s expired", key);
+    warm_cache_erase(key);
+    return false;
+  }
+
+  memcpy(value, entry + sizeof(header), size);
+  return true;
+}
+
+void warm_cache_store(const char *key, uint32_t tag, const void *value,
+                      size_t size) {
+  if (size > WARM_CACHE_MAX_SIZE) {
+    return;
+  }
+
+  uint8_t entry[sizeof(warm_cache_header_t) + WARM_CACHE_MAX_SIZE];
+  warm_cache_header_t header = {
+      .version = WARM_CACHE_VERSION,
+      .size = (uint16_t)size,
+      .tag = tag,
+      .boot = warm_cache_boot,
+  };
+  memcpy(entry, &header, sizeof(header));
+  memcpy(entry + sizeof(header), value, size);
+  warm_cache_write(key, entry, sizeof(header) + size);
+}
+
+void warm_cache_invalidate(const char *key) { warm_cache_erase(key); }
+
+// FNV-1a
+uint32_t warm_cache_tag(const char *text) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = text; *c != '\0'; c++) {
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+  }
+  return hash;
+}
@@ -5,37 +5,137 @@
 
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <new>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 #include "main.h"
 
-static PeerConnection *peer_connection = NULL;
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+// Bytes, Opus encode is the deepest user
+#define PUBLISHER_TASK_STACK_SIZE 30000
+#define PUBLISHER_TASK_PRIORITY 7
+
+// Placed with the rest of the session's hot state
+#define WEBRTC_STATE_REGION MEMORY_INTERNAL
+
+struct webrtc_state {
+  PeerConnection *peer_connection;
 
+  // Reconnect state machine, only driven from pipecat_webrtc_loop() and the
+  // libpeer callbacks it runs
+  pipecat_session_state_t state;
+  uint32_t connection_id;
+  // Next attempt while IDLE, give-up time while CONNECTING
+  int64_t deadline_us;
+  uint32_t reconnect_backoff_ms;
+  // Set from inside peer_connection_loop(), which can't destroy its own
+  // connection
+  bool failed;
+  int64_t disconnected_us;
+
+  // Event-driven loop, see pipecat_webrtc_wait()
+  TaskHandle_t loop_task_handle;
+  int64_t loop_polled_us;  // When the previous poll returned
+  int64_t last_audio_rx_us;
+  bool loop_rx_activity;
+  webrtc_loop_stats_t loop_stats;
+  int64_t last_metrics_us;
+
+  // Milestones towards CONNECTED, for the time-to-connected log
+  int64_t connect_started_us;
+  int64_t offer_ready_us;
+  int64_t answer_applied_us;
+
+  // The publisher is created once and parks while there is no connection.
+  // It runs back to back, paced by the blocking microphone read. A lock
+  // held across that read would starve the lower-priority loop, so the
+  // loop clears `publishing` and waits for `publisher_in_frame` to drop
+  // before it destroys the connection.
+  std::atomic<bool> publishing;
+  std::atomic<bool> publisher_in_frame;
+  TaskHandle_t publisher_task_handle;
 #ifndef LINUX_BUILD
-StaticTask_t task_buffer;
-void pipecat_send_audio_task(void *user_data) {
-  pipecat_init_audio_encoder();
+  StaticTask_t publisher_task_buffer;
+#endif
+};
 
+static void pipecat_send_audio_task(void *user_data) {
+  pipecat_session_t *session = (pipecat_session_t *)user_data;
+  webrtc_state_t *webrtc = session->webrtc;
   while (1) {
-    pipecat_send_audio(peer_connection);
-    vTaskDelay(pdMS_TO_TICKS(TICK_INTERVAL));
+    if (!webrtc->publishing) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+
+    webrtc->publisher_in_frame = true;
+    if (webrtc->publishing) {
+      pipecat_send_audio(session, webrtc->peer_connection);
+    }
+    webrtc->publisher_in_frame = false;
   }
 }
-#endif
+
+// Packets sat in the socket for at most the time since the previous poll
+static void pipecat_loop_received(webrtc_state_t *webrtc, int64_t now_us) {
+  pipecat_trace_record(TRACE_RX_WAIT, webrtc->loop_polled_us, now_us);
+  webrtc->loop_rx_activity = true;
+  webrtc->loop_stats.packets++;
+  webrtc->loop_stats.rx_wait_us += now_us - webrtc->loop_polled_us;
+}
+
+static void pipecat_onaudiotrack_task(uint8_t *data, size_t size,
+                                      void *userdata) {
+  pipecat_session_t *session = (pipecat_session_t *)userdata;
+  webrtc_state_t *webrtc = session->webrtc;
+  webrtc->last_audio_rx_us = esp_timer_get_time();
+  pipecat_loop_received(webrtc, webrtc->last_audio_rx_us);
+
+  // See rtp_parse() in main.h
+  rtp_packet_t rtp;
+  if (!rtp_parse(data - RTP_HEADER_SIZE, size + RTP_HEADER_SIZE, &rtp)) {
+    pipecat_tlog(TLOG_INVALID_RTP, size + RTP_HEADER_SIZE);
+    return;
+  }
+  if (rtp.size == 0) {
+    // Padding only, e.g. a bandwidth probe
+    return;
+  }
+
+  pipecat_record_audio_rx(session, rtp.seq, rtp.timestamp, rtp.payload,
+                          rtp.size);
+  pipecat_audio_receive(session, rtp.seq, rtp.timestamp, rtp.payload, rtp.size,
+                        webrtc->last_audio_rx_us);
+}
 
 static void pipecat_ondatachannel_onmessage_task(char *msg, size_t len,
                                                  void *userdata, uint16_t sid) {
 #ifdef LOG_DATACHANNEL_MESSAGES
   ESP_LOGI(LOG_TAG, "DataChannel Message: %s", msg);
 #endif
-  pipecat_rtvi_handle_message(msg);
+  pipecat_session_t *session = (pipecat_session_t *)userdata;
+  pipecat_loop_received(session->webrtc, esp_timer_get_time());
+  pipecat_record(session, RECORD_DATA_RX, msg, len);
+  pipecat_rtvi_handle_message(session, msg, len);
 }
 
 static void pipecat_ondatachannel_onopen_task(void *userdata) {
-  if (peer_connection_create_datachannel(peer_connection, DATA_CHANNEL_RELIABLE,
-                                         0, 0, (char *)"rtvi-ai",
-                                         (char *)"") != -1) {
+  pipecat_session_t *session = (pipecat_session_t *)userdata;
+  if (peer_connection_create_datachannel(session->webrtc->peer_connection,
+                                         DATA_CHANNEL_RELIABLE, 0, 0,
+                                         (char *)"rtvi-ai", (char *)"") != -1) {
     ESP_LOGI(LOG_TAG, "DataChannel created");
+    // The bot starts the conversation once it has this, on every connection
+    pipecat_rtvi_send_client_ready(session);
   } else {
     ESP_LOGE(LOG_TAG, "Failed to create DataChannel");
   }
@@ -43,58 +143,93 @@ static void pipecat_ondatachannel_onopen_task(void *userdata) {
 
 static void pipecat_onconnectionstatechange_task(PeerConnectionState state,
                                                  void *user_data) {
-  ESP_LOGI(LOG_TAG, "PeerConnectionState: %s",
+  pipecat_session_t *session = (pipecat_session_t *)user_data;
+  webrtc_state_t *webrtc = session->webrtc;
+  ESP_LOGI(LOG_TAG, "Session %u PeerConnectionState: %s",
+           (unsigned)session->config.index,
            peer_connection_state_to_string(state));
 
   if (state == PEER_CONNECTION_DISCONNECTED ||
-      state == PEER_CONNECTION_CLOSED) {
-#ifndef LINUX_BUILD
-    esp_restart();
-#endif
-  } else if (state == PEER_CONNECTION_CONNECTED) {
-#ifndef LINUX_BUILD
-    StackType_t *stack_memory = (StackType_t *)heap_caps_malloc(
-        30000 * sizeof(StackType_t), MALLOC_CAP_SPIRAM);
-    xTaskCreateStaticPinnedToCore(pipecat_send_audio_task, "audio_publisher",
-                                  30000, NULL, 7, stack_memory, &task_buffer,
-                                  0);
-    pipecat_init_rtvi(peer_connection, &pipecat_rtvi_callbacks);
-#endif
+      state == PEER_CONNECTION_CLOSED || state == PEER_CONNECTION_FAILED) {
+    webrtc->failed = true;
+  } else if (state == PEER_CONNECTION_CONNECTED &&
+             webrtc->state == PIPECAT_SESSION_CONNECTING) {
+    int64_t now_us = esp_timer_get_time();
+    ESP_LOGI(LOG_TAG,
+             "Connected in %lldms (gathering %lldms, signalling %lldms, "
+             "ICE/DTLS %lldms)",
+             (long long)((now_us - webrtc->connect_started_us) / 1000),
+             (long long)((webrtc->offer_ready_us - webrtc->connect_started_us) /
+                         1000),
+             (long long)((webrtc->answer_applied_us - webrtc->offer_ready_us) /
+                         1000),
+             (long long)((now_us - webrtc->answer_applied_us) / 1000));
+    if (webrtc->disconnected_us != 0) {
+      ESP_LOGI(LOG_TAG, "Recovered %lldms after the connection dropped",
+               (long long)((now_us - webrtc->disconnected_us) / 1000));
+      webrtc->disconnected_us = 0;
+    }
+    pipecat_boot_milestone(BOOT_MILESTONE_CONNECTED);
+
+    webrtc->state = PIPECAT_SESSION_CONNECTED;
+    webrtc->reconnect_backoff_ms = 0;
+    pipecat_rtvi_attach(session, webrtc->peer_connection);
+    webrtc->publishing = true;
+    xTaskNotifyGive(webrtc->publisher_task_handle);
   }
 }
 
+// Called from peer_connection_loop() once gathering is done. The POST runs
+// on the signalling task, the answer comes back through the loop.
 static void pipecat_on_icecandidate_task(char *description, void *user_data) {
-  char *local_buffer = (char *)malloc(MAX_HTTP_OUTPUT_BUFFER + 1);
-  memset(local_buffer, 0, MAX_HTTP_OUTPUT_BUFFER + 1);
-  pipecat_http_request(description, local_buffer);
-  peer_connection_set_remote_description(peer_connection, local_buffer,
-                                         SDP_TYPE_ANSWER);
-  free(local_buffer);
+  pipecat_session_t *session = (pipecat_session_t *)user_data;
+  webrtc_state_t *webrtc = session->webrtc;
+  webrtc->offer_ready_us = esp_timer_get_time();
+#ifdef LINUX_BUILD
+  // The exchange as it ran before the signalling task, blocking the loop
+  if (getenv("PIPECAT_SIGNALLING_INLINE") != NULL) {
+    http_buffer_t answer;
+    if (pipecat_http_request(session->config.url, description, &answer, NULL,
+                             NULL) != ESP_OK) {
+      webrtc->failed = true;
+      return;
+    }
+    peer_connection_set_remote_description(webrtc->peer_connection,
+                                           answer.data, SDP_TYPE_ANSWER);
+    webrtc->answer_applied_us = esp_timer_get_time();
+    http_buffer_free(&answer);
+    return;
+  }
+#endif
+  if (!pipecat_signalling_start(session, description, webrtc->connection_id)) {
+    webrtc->failed = true;
+  }
 }
 
-void pipecat_init_webrtc() {
+static bool pipecat_open_session(pipecat_session_t *session) {
+  webrtc_state_t *webrtc = session->webrtc;
   PeerConfiguration peer_connection_config = {
       .ice_servers = {},
       .audio_codec = CODEC_OPUS,
       .video_codec = CODEC_NONE,
       .datachannel = DATA_CHANNEL_STRING,
-      .onaudiotrack = [](uint8_t *data, size_t size, void *userdata) -> void {
-#ifndef LINUX_BUILD
-        pipecat_audio_decode(data, size);
-#endif
-      },
+      .onaudiotrack = pipecat_onaudiotrack_task,
       .onvideotrack = NULL,
       .on_request_keyframe = NULL,
-      .user_data = NULL,
+      .user_data = session,
   };
 
-  peer_connection = peer_connection_create(&peer_connection_config);
+  // Includes generating a fresh DTLS identity, libpeer can't reuse one
+  int64_t create_started_us = esp_timer_get_time();
+  PeerConnection *peer_connection =
+      peer_connection_create(&peer_connection_config);
   if (peer_connection == NULL) {
     ESP_LOGE(LOG_TAG, "Failed to create peer connection");
-#ifndef LINUX_BUILD
-    esp_restart();
-#endif
+    return false;
   }
+  ESP_LOGI(LOG_TAG, "Peer connection created in %lldms",
+           (long long)((esp_timer_get_time() - create_started_us) / 1000));
+  webrtc->peer_connection = peer_connection;
 
   peer_connection_oniceconnectionstatechange(
       peer_connection, pipecat_onconnectionstatechange_task);
@@ -103,9 +238,241 @@ void pipecat_init_webrtc() {
                                 pipecat_ondatachannel_onmessage_task,
                                 pipecat_ondatachannel_onopen_task, NULL);
 
+  webrtc->connection_id++;
+  webrtc->state = PIPECAT_SESSION_CONNECTING;
+  webrtc->failed = false;
+  webrtc->connect_started_us = esp_timer_get_time();
+  webrtc->loop_polled_us = webrtc->connect_started_us;
+  webrtc->deadline_us =
+      webrtc->connect_started_us + RECONNECT_CONNECT_TIMEOUT_MS * 1000LL;
   peer_connection_create_offer(peer_connection);
+  return true;
+}
+
+// Tears down the PeerConnection (if any) and schedules the next attempt
+static void pipecat_close_session(pipecat_session_t *session,
+                                  const char *reason) {
+  webrtc_state_t *webrtc = session->webrtc;
+  int64_t now_us = esp_timer_get_time();
+  if (webrtc->state == PIPECAT_SESSION_CONNECTED) {
+    webrtc->disconnected_us = now_us;
+  }
+
+  pipecat_signalling_cancel(session);
+  webrtc->publishing = false;
+  // At most one capture period. The publisher sends RTVI messages too, so
+  // it has to be done before the queue is drained.
+  while (webrtc->publisher_in_frame) {
+    vTaskDelay(1);
+  }
+  pipecat_rtvi_detach(session);
+  if (webrtc->peer_connection != NULL) {
+    peer_connection_destroy(webrtc->peer_connection);
+    webrtc->peer_connection = NULL;
+  }
+  pipecat_audio_reset_downlink(session);
+  pipecat_record(session, RECORD_RESET, NULL, 0);
+
+  webrtc->reconnect_backoff_ms =
+      webrtc->reconnect_backoff_ms == 0
+          ? RECONNECT_INITIAL_BACKOFF_MS
+          : MIN(webrtc->reconnect_backoff_ms * 2,
+                (uint32_t)RECONNECT_MAX_BACKOFF_MS);
+  // The first attempt after a working session goes out right away
+  uint32_t delay_ms = webrtc->state == PIPECAT_SESSION_CONNECTED
+                          ? 0
+                          : webrtc->reconnect_backoff_ms;
+  ESP_LOGW(LOG_TAG,
+           "Session %u connection %lu closed (%s), reconnecting in %lums",
+           (unsigned)session->config.index,
+           (unsigned long)webrtc->connection_id, reason,
+           (unsigned long)delay_ms);
+
+  webrtc->state = PIPECAT_SESSION_IDLE;
+  webrtc->failed = false;
+  webrtc->deadline_us = now_us + delay_ms * 1000LL;
+}
+
+static void pipecat_signalling_complete(pipecat_session_t *session,
+                                        signalling_result_t *result) {
+  webrtc_state_t *webrtc = session->webrtc;
+  if (result->connection != webrtc->connection_id ||
+      webrtc->state != PIPECAT_SESSION_CONNECTING) {
+    // Answer for a connection that is already gone
+    http_buffer_free(&result->answer);
+    return;
+  }
+
+  if (result->err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Signalling failed: %s", esp_err_to_name(result->err));
+    pipecat_close_session(session, "signalling failed");
+    return;
+  }
+
+  peer_connection_set_remote_description(
+      webrtc->peer_connection, result->answer.data, SDP_TYPE_ANSWER);
+  webrtc->answer_applied_us = esp_timer_get_time();
+  http_buffer_free(&result->answer);
+}
+
+void pipecat_webrtc_memory_plan(memory_plan_t *plan) {
+  pipecat_rtvi_memory_plan(plan);
+  pipecat_signalling_memory_plan(plan);
+  memory_plan_add(plan, WEBRTC_STATE_REGION, sizeof(webrtc_state_t));
+#ifndef LINUX_BUILD
+  // Runs deep in Opus but isn't touched often enough to be worth internal RAM
+  memory_plan_add(plan, MEMORY_PSRAM, PUBLISHER_TASK_STACK_SIZE);
+#endif
+}
+
+bool pipecat_webrtc_session_create(pipecat_session_t *session) {
+  void *state = pipecat_memory_alloc(WEBRTC_STATE_REGION,
+                                     sizeof(webrtc_state_t), "webrtc_state");
+  if (state == NULL) {
+    return false;
+  }
+  session->webrtc = new (state) webrtc_state_t();
+  return true;
+}
+
+void pipecat_init_webrtc(pipecat_session_t *session) {
+  webrtc_state_t *webrtc = session->webrtc;
+  pipecat_init_signalling(session);
+  pipecat_init_rtvi(session);
+
+#ifndef LINUX_BUILD
+  StackType_t *stack_memory = (StackType_t *)pipecat_memory_alloc(
+      MEMORY_PSRAM, PUBLISHER_TASK_STACK_SIZE, "audio_publisher stack");
+  if (stack_memory != NULL) {
+    webrtc->publisher_task_handle = xTaskCreateStaticPinnedToCore(
+        pipecat_send_audio_task, "audio_publisher", PUBLISHER_TASK_STACK_SIZE,
+        session, PUBLISHER_TASK_PRIORITY, stack_memory,
+        &webrtc->publisher_task_buffer, 0);
+  }
+#else
+  xTaskCreate(pipecat_send_audio_task, "audio_publisher",
+              PUBLISHER_TASK_STACK_SIZE, session, PUBLISHER_TASK_PRIORITY,
+              &webrtc->publisher_task_handle);
+#endif
+  pipecat_memory_track_task(webrtc->publisher_task_handle, "audio_publisher",
+                            PUBLISHER_TASK_STACK_SIZE);
+
+  // The first connection is opened by the next pipecat_webrtc_loop()
+  webrtc->state = PIPECAT_SESSION_IDLE;
+  webrtc->deadline_us = 0;
+}
+
+void pipecat_webrtc_loop(pipecat_session_t *session) {
+  webrtc_state_t *webrtc = session->webrtc;
+  int64_t now_us = esp_timer_get_time();
+  if (webrtc->state == PIPECAT_SESSION_IDLE && now_us >= webrtc->deadline_us &&
+      !pipecat_open_session(session)) {
+    pipecat_close_session(session, "create failed");
+  }
+
+  webrtc->loop_stats.iterations++;
+  if (webrtc->peer_connection != NULL) {
+    peer_connection_loop(webrtc->peer_connection);
+    webrtc->loop_polled_us = esp_timer_get_time();
+    if (webrtc->failed) {
+      pipecat_close_session(session, "connection lost");
+    } else if (webrtc->state == PIPECAT_SESSION_CONNECTING &&
+               esp_timer_get_time() >= webrtc->deadline_us) {
+      pipecat_close_session(session, "connect timeout");
+    }
+  }
+  pipecat_audio_playout_tick(session, esp_timer_get_time());
+
+  signalling_result_t signalling;
+  if (pipecat_signalling_poll(session, &signalling)) {
+    pipecat_signalling_complete(session, &signalling);
+  }
+
+  now_us = esp_timer_get_time();
+  if (webrtc->state == PIPECAT_SESSION_CONNECTED &&
+      now_us - webrtc->last_metrics_us >= RTVI_METRICS_INTERVAL_MS * 1000LL) {
+    webrtc->last_metrics_us = now_us;
+    pipecat_rtvi_send_client_metrics(session);
+  }
+  pipecat_rtvi_flush(session);
+
+#if TRACE_DUMP_INTERVAL_MS > 0
+  // The histograms are shared, one session dumps them
+  static int64_t last_trace_dump_us = 0;
+  if (session->config.index == 0 &&
+      now_us - last_trace_dump_us >= TRACE_DUMP_INTERVAL_MS * 1000LL) {
+    last_trace_dump_us = now_us;
+    pipecat_trace_dump();
+  }
+#endif
+}
+
+// Next time an RTP frame is due, 0 when the downlink is quiet
+static int64_t pipecat_next_audio_rx_us(webrtc_state_t *webrtc,
+                                        int64_t now_us) {
+  int64_t last_audio_rx_us = webrtc->last_audio_rx_us;
+  int64_t elapsed_us = now_us - last_audio_rx_us;
+  if (last_audio_rx_us == 0 || elapsed_us > LOOP_RX_ACTIVE_MS * 1000LL) {
+    return 0;
+  }
+  int64_t frame_us = JITTER_BUFFER_FRAME_MS * 1000LL;
+  return last_audio_rx_us + (elapsed_us / frame_us + 1) * frame_us;
+}
+
+void pipecat_webrtc_wait(pipecat_session_t *session) {
+  webrtc_state_t *webrtc = session->webrtc;
+  if (webrtc->loop_task_handle == NULL) {
+    webrtc->loop_task_handle = xTaskGetCurrentTaskHandle();
+  }
+
+  // More may be queued right behind what was just handled
+  if (webrtc->loop_rx_activity) {
+    webrtc->loop_rx_activity = false;
+    return;
+  }
+
+  int64_t now_us = esp_timer_get_time();
+  int64_t wake_us = now_us + TICK_INTERVAL * 1000LL;
+  if (webrtc->state == PIPECAT_SESSION_CONNECTING) {
+    wake_us = now_us + LOOP_CONNECTING_POLL_MS * 1000LL;
+  } else if (webrtc->state == PIPECAT_SESSION_IDLE) {
+    wake_us = MIN(wake_us, webrtc->deadline_us);
+  }
+
+  int64_t due_us = pipecat_next_audio_rx_us(webrtc, now_us);
+  if (due_us != 0) {
+    // The frame that was due last hasn't shown up yet and may still
+    int64_t last_due_us = due_us - JITTER_BUFFER_FRAME_MS * 1000LL;
+    if (webrtc->last_audio_rx_us < last_due_us - LOOP_RX_EARLY_MS * 1000LL &&
+        now_us - last_due_us < LOOP_RX_WINDOW_MS * 1000LL) {
+      return;
+    }
+    wake_us = MIN(wake_us, due_us - LOOP_RX_EARLY_MS * 1000LL);
+  }
+
+  TickType_t ticks = pdMS_TO_TICKS((wake_us - now_us + 999) / 1000);
+  if (ticks == 0) {
+    return;
+  }
+  webrtc->loop_stats.sleeps++;
+  if (ulTaskNotifyTake(pdTRUE, ticks)) {
+    webrtc->loop_stats.notified++;
+  }
+}
+
+// Safe from any task
+void pipecat_webrtc_wake(pipecat_session_t *session) {
+  TaskHandle_t handle = session->webrtc->loop_task_handle;
+  if (handle != NULL) {
+    xTaskNotifyGive(handle);
+  }
+}
+
+pipecat_session_state_t pipecat_webrtc_state(pipecat_session_t *session) {
+  return session->webrtc->state;
 }
 
-void pipecat_webrtc_loop() {
-  peer_connection_loop(peer_connection);
+void pipecat_webrtc_loop_stats(pipecat_session_t *session,
+                               webrtc_loop_stats_t *stats) {
+  *stats = session->webrtc->loop_stats;
 }
@@ -1,19 +1,65 @@
 #include <assert.h>
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
 #include "main.h"
 
-static bool g_wifi_connected = false;
+#define WIFI_CONNECTED_BIT (1u << 0)
+
+typedef struct {
+  uint8_t bssid[6];
+  uint8_t channel;
+} wifi_cache_entry_t;
+
+static EventGroupHandle_t wifi_events = NULL;
+static wifi_config_t wifi_config;
+static int64_t wifi_started_us = 0;
+
+// Set while connecting straight to the cached AP, which skips the scan
+static bool wifi_fast_path = false;
+static wifi_cache_entry_t wifi_cached_ap;
+static wifi_cache_entry_t wifi_connected_ap;
+
+// The cache is only valid for the credentials it was learned with
+static uint32_t wifi_cache_tag() {
+  return warm_cache_tag(WIFI_SSID "\n" WIFI_PASSWORD);
+}
+
+static void pipecat_wifi_full_scan() {
+  wifi_config.sta.bssid_set = false;
+  memset(wifi_config.sta.bssid, 0, sizeof(wifi_config.sta.bssid));
+  wifi_config.sta.channel = 0;
+  wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  esp_wifi_set_config(static_cast<wifi_interface_t>(ESP_IF_WIFI_STA),
+                      &wifi_config);
+}
 
 static void pipecat_event_handler(void *arg, esp_event_base_t event_base,
                                   int32_t event_id, void *event_data) {
   static int s_retry_num = 0;
-  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+    wifi_event_sta_connected_t *event =
+        (wifi_event_sta_connected_t *)event_data;
+    memcpy(wifi_connected_ap.bssid, event->bssid, sizeof(event->bssid));
+    wifi_connected_ap.channel = event->channel;
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_DISCONNECTED && wifi_fast_path) {
+    // The AP moved channel or is gone, forget it and do it the slow way
+    ESP_LOGW(LOG_TAG, "Cached AP unreachable, falling back to a full scan");
+    wifi_fast_path = false;
+    warm_cache_invalidate(WIFI_CACHE_KEY);
+    pipecat_wifi_full_scan();
+    esp_wifi_connect();
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_DISCONNECTED) {
     if (s_retry_num < 5) {
       esp_wifi_connect();
       s_retry_num++;
@@ -23,11 +69,21 @@ static void pipecat_event_handler(void *arg, esp_event_base_t event_base,
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
     ESP_LOGI(LOG_TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-    g_wifi_connected = true;
+    ESP_LOGI(LOG_TAG, "WiFi connected in %lldms (%s)",
+             (long long)((esp_timer_get_time() - wifi_started_us) / 1000),
+             wifi_fast_path ? "cached AP" : "full scan");
+    if (!wifi_fast_path ||
+        memcmp(&wifi_connected_ap, &wifi_cached_ap, sizeof(wifi_cached_ap))) {
+      warm_cache_store(WIFI_CACHE_KEY, wifi_cache_tag(), &wifi_connected_ap,
+                       sizeof(wifi_connected_ap));
+    }
+    wifi_fast_path = false;
+    xEventGroupSetBits(wifi_events, WIFI_CONNECTED_BIT);
   }
 }
 
 void pipecat_init_wifi() {
+  wifi_events = xEventGroupCreate();
   ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
                                              &pipecat_event_handler, NULL));
   ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
@@ -43,19 +99,32 @@ void pipecat_init_wifi() {
   ESP_ERROR_CHECK(esp_wifi_start());
 
   ESP_LOGI(LOG_TAG, "Connecting to WiFi SSID: %s", WIFI_SSID);
-  wifi_config_t wifi_config;
   memset(&wifi_config, 0, sizeof(wifi_config));
   strncpy((char *)wifi_config.sta.ssid, (char *)WIFI_SSID,
           sizeof(wifi_config.sta.ssid));
   strncpy((char *)wifi_config.sta.password, (char *)WIFI_PASSWORD,
           sizeof(wifi_config.sta.password));
 
+  // Straight to the AP and channel that worked last time
+  if (warm_cache_load(WIFI_CACHE_KEY, wifi_cache_tag(), WIFI_CACHE_MAX_BOOTS,
+                      &wifi_cached_ap, sizeof(wifi_cached_ap))) {
+    wifi_fast_path = true;
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, wifi_cached_ap.bssid,
+           sizeof(wifi_cached_ap.bssid));
+    wifi_config.sta.channel = wifi_cached_ap.channel;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    ESP_LOGI(LOG_TAG, "Using cached AP on channel %u",
+             (unsigned)wifi_cached_ap.channel);
+  }
+
   ESP_ERROR_CHECK(esp_wifi_set_config(
       static_cast<wifi_interface_t>(ESP_IF_WIFI_STA), &wifi_config));
+  wifi_started_us = esp_timer_get_time();
   ESP_ERROR_CHECK(esp_wifi_connect());
+}
 
-  // block until we get an IP address
-  while (!g_wifi_connected) {
-    vTaskDelay(pdMS_TO_TICKS(200));
-  }
+void pipecat_wifi_wait_connected() {
+  xEventGroupWaitBits(wifi_events, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE,
+                      portMAX_DELAY);
 }
@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+"""Formats `TLOG:<hex>` lines from a console capture.
+
+Build with -DTLOG_OUTPUT_BINARY=1 and the device prints tokenized log
+records raw instead of formatting them. Formats come from the TLOG_FORMATS
+list in src/main.h, so decode with the main.h of the build that was
+captured. Other lines are passed through unchanged.
+
+    idf.py monitor | tee capture.txt
+    tools/tlog_decode.py capture.txt
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+RECORD = struct.Struct("<IHBx3i")
+ENTRY = re.compile(r'X\(\s*(\w+)\s*,\s*ESP_LOG_(\w+)\s*,\s*((?:"(?:[^"\\]|\\.)*"\s*)+)\)')
+LEVELS = {"ERROR": "E", "WARN": "W", "INFO": "I", "DEBUG": "D", "VERBOSE": "V"}
+
+
+def load_formats(header):
+    with open(header) as f:
+        source = f.read()
+    start = source.index("#define TLOG_FORMATS(X)")
+    end = source.index("typedef enum", start)
+    # Join the macro's continuation lines before matching entries
+    body = source[start:end].replace("\\\n", " ")
+
+    formats = []
+    for name, level, literals in ENTRY.findall(body):
+        text = "".join(re.findall(r'"((?:[^"\\]|\\.)*)"', literals))
+        formats.append((name, LEVELS.get(level, "?"), text.encode().decode("unicode_escape")))
+    return formats
+
+
+def decode(line, formats):
+    record = bytes.fromhex(line[line.index("TLOG:") + 5:].strip())
+    timestamp_us, record_id, core, *args = RECORD.unpack(record)
+    if record_id >= len(formats):
+        return "? (%d.%03dms core %d) unknown id %d %s" % (
+            timestamp_us // 1000, timestamp_us % 1000, core, record_id, args)
+
+    name, level, text = formats[record_id]
+    # %lu and %lx print the 32-bit pattern, as on the device
+    values = [a & 0xFFFFFFFF if conversion in "ux" else a
+              for a, conversion in zip(args, re.findall(r"%l?([dux])", text))]
+    return "%s (%d.%03dms core %d) %s" % (
+        level, timestamp_us // 1000, timestamp_us % 1000, core,
+        text % tuple(values))
+
+
+def main():
+    default_header = os.path.join(os.path.dirname(__file__), "..", "src", "main.h")
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("capture", nargs="?", help="console capture, stdin if omitted")
+    parser.add_argument("--header", default=default_header, help="main.h with TLOG_FORMATS")
+    args = parser.parse_args()
+
+    formats = load_formats(args.header)
+    capture = open(args.capture, errors="replace") if args.capture else sys.stdin
+    for line in capture:
+        if "TLOG:" in line:
+            try:
+                print(decode(line, formats))
+                continue
+            except (ValueError, struct.error):
+                pass
+        sys.stdout.write(line)
+
+
+if __name__ == "__main__":
+    main()